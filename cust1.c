@@ -19,9 +19,21 @@
 #define HOST_IS_WINDOWS 0
 #endif
 
+#if !HOST_IS_WINDOWS
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+extern char **environ;
+#endif
+
 #define MAX_LINE 8192
 #define MAX_TOK 256
-#define MAX_HISTORY 1000
+#define DEFAULT_HISTORY 1000
+#define MAX_HISTORY_LIMIT 50000000UL
 
 #if defined(_WIN32) || defined(_WIN64)
     #define STRTOK(str, delim, saveptr) strtok((str), (delim))
@@ -29,24 +41,95 @@
     #define STRTOK(str, delim, saveptr) strtok_r((str), (delim), (saveptr))
 #endif
 
-static char *history[MAX_HISTORY];
-static int hist_count = 0;
+// History: a fixed-capacity ring of (offset, length) records whose text lives
+// in one append-only arena. The live text is always a contiguous tail of the
+// arena, so evicted entries are reclaimed in bulk by sliding that tail down
+// when the arena fills. Appends are O(1) amortized with no per-entry malloc.
+// Entries keep their absolute number (1 = first command of the session) after
+// the ring wraps, so !n stays stable.
+struct hist_rec { size_t off, len; };
+
+static struct {
+    struct hist_rec *ring;
+    size_t cap, head, count;    // head = ring index of the oldest live entry
+    unsigned long total;        // entries ever added; the newest is number `total`
+    char *arena;
+    size_t used, size;
+} hist;
+
+static int hist_init(size_t cap){
+    if(cap < 1) cap = 1;
+    if(cap > MAX_HISTORY_LIMIT) cap = MAX_HISTORY_LIMIT;
+    free(hist.ring); free(hist.arena);
+    memset(&hist, 0, sizeof(hist));
+    hist.ring = malloc(sizeof(struct hist_rec) * cap);
+    if(!hist.ring) return -1;
+    hist.cap = cap;
+    return 0;
+}
+
+// Capacity from $CUSTARD_HISTSIZE, else DEFAULT_HISTORY.
+static size_t hist_default_cap(void){
+    const char *e = getenv("CUSTARD_HISTSIZE");
+    long v = e ? atol(e) : 0;
+    return v > 0 ? (size_t)v : DEFAULT_HISTORY;
+}
+
+static void free_history(void){
+    free(hist.ring); free(hist.arena);
+    memset(&hist, 0, sizeof(hist));
+}
+
+// Text of entry number n, or NULL once it has been evicted. Valid until the next add.
+static const char *hist_get(unsigned long n){
+    unsigned long first = hist.total - hist.count + 1;
+    if(hist.count == 0 || n < first || n > hist.total) return NULL;
+    return hist.arena + hist.ring[(hist.head + (n - first)) % hist.cap].off;
+}
 
 static void add_history(const char *cmd){
     if(!cmd || strlen(cmd)==0) return;
-    if(hist_count < MAX_HISTORY){
-        history[hist_count++] = strdup(cmd);
-    } else {
-        free(history[0]);
-        memmove(history, history+1, sizeof(char*)*(MAX_HISTORY-1));
-        history[MAX_HISTORY-1] = strdup(cmd);
+    if(!hist.ring && hist_init(hist_default_cap()) != 0) return;
+    size_t len = strlen(cmd);
+    int full = hist.count == hist.cap, compact = hist.used + len + 1 > hist.size;
+    if(compact){
+        // grow before touching anything, so a failed allocation loses no entry;
+        // keep at least half the arena free after compacting so the next one is far off
+        size_t keep = full ? (hist.count > 1 ? hist.ring[(hist.head + 1) % hist.cap].off : hist.used)
+                           : (hist.count ? hist.ring[hist.head].off : hist.used);
+        size_t live = hist.used - keep;
+        if((live + len + 1) * 2 > hist.size){
+            size_t size = hist.size ? hist.size : 4096;
+            while((live + len + 1) * 2 > size) size *= 2;
+            char *a = realloc(hist.arena, size);
+            if(!a) return;
+            hist.arena = a; hist.size = size;
+        }
+    }
+    if(full){ // drop the oldest; its bytes go at the compaction below or a later one
+        hist.head = (hist.head + 1) % hist.cap;
+        hist.count--;
+    }
+    if(compact){
+        size_t start = hist.count ? hist.ring[hist.head].off : hist.used;
+        if(start){
+            memmove(hist.arena, hist.arena + start, hist.used - start);
+            for(size_t i=0;i<hist.count;i++) hist.ring[(hist.head + i) % hist.cap].off -= start;
+            hist.used -= start;
+        }
     }
+    struct hist_rec *r = &hist.ring[(hist.head + hist.count) % hist.cap];
+    r->off = hist.used; r->len = len;
+    memcpy(hist.arena + hist.used, cmd, len + 1);
+    hist.used += len + 1;
+    hist.count++;
+    hist.total++;
 }
 
 static void print_history(){
-    int start = hist_count>100? hist_count-100 : 0;
-    for(int i=start;i<hist_count;i++){
-        printf("%d  %s\n", i+1, history[i]);
+    unsigned long start = hist.count > 100 ? hist.total - 99 : hist.total - hist.count + 1;
+    for(unsigned long n=start; n<=hist.total; n++){
+        printf("%lu  %s\n", n, hist_get(n));
     }
 }
 
@@ -143,11 +226,10 @@ static char *map_command(const char *input, int source_is_windows, int host_is_w
 
 // Expand !! and !n
 static char *expand_bang(const char *cmd){
-    if(strcmp(cmd,"!!")==0){ if(hist_count==0) return strdup(""); return strdup(history[hist_count-1]); }
+    if(strcmp(cmd,"!!")==0){ if(hist.total==0) return strdup(""); return strdup(hist_get(hist.total)); }
     if(cmd[0]=='!' && isdigit((unsigned char)cmd[1])){
-        int n = atoi(cmd+1);
-        if(n <= 0 || n > hist_count) return strdup("");
-        return strdup(history[n-1]);
+        const char *h = hist_get(strtoul(cmd+1, NULL, 10));
+        return strdup(h ? h : "");
     }
     return strdup(cmd);
 }
@@ -195,6 +277,16 @@ static char *translate_pipeline(const char *line, int source_is_windows, int hos
     return strdup(buf);
 }
 
+#if !HOST_IS_WINDOWS
+#include "cust_exec.h"
+#endif
+
+// Gemini API fallback (mock)
+static void call_gemini_api(const char *cmd){
+    printf("[Gemini API] Command not recognized: %s\n", cmd);
+    printf("[Gemini API] Response: Placeholder response from Gemini API.\n");
+}
+
 int main(){
     printf("Universal Terminal + Gemini AI\n");
 #if HOST_IS_WINDOWS
@@ -233,14 +325,20 @@ int main(){
         printf("[Translated ->] %s\n", translated);
 
         if(strlen(translated)>0){
+#if HOST_IS_WINDOWS
             int rc = system(translated);
+#else
+            int rc = run_command(translated);
+#endif
             if(rc==-1) printf("Failed to run command.\n");
+            // -1: nothing could run; 127: the command was not found
+            if(rc==-1 || rc==127) call_gemini_api(line);
         }
 
         free(translated);
     }
 
-    for(int i=0;i<hist_count;i++) free(history[i]);
+    free_history();
     printf("Goodbye.\n");
     return 0;
 }
@@ -0,0 +1,243 @@
+// cust_exec.h: the direct execution engine shared by cust.c and cust1.c.
+// Include it once, on POSIX hosts only, after MAX_LINE is defined.
+#ifndef CUST_EXEC_H
+#define CUST_EXEC_H
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// ---- Direct execution engine ----
+// Simple commands and pipelines are started with posix_spawnp and wired with
+// pipes here instead of handing a string to system() for /bin/sh to re-parse.
+// Anything using shell syntax we do not interpret still goes to /bin/sh -c.
+
+#define MAX_STAGES 32
+
+// Builtins and keywords have no executable to spawn; leave them to the shell.
+static const char *shell_words[] = {
+    "cd", "export", "unset", "set", "alias", "unalias", "source", ".", "eval", "exec",
+    "exit", "read", "ulimit", "umask", "trap", "shift", "wait", "type", "command",
+    "hash", "local", "return", "readonly", "getopts", "break", "continue", "jobs",
+    "fg", "bg", "if", "for", "while", "until", "case", "function", "!", "[[", NULL
+};
+
+// Does this line use syntax (redirections, lists, expansions, globs...) we leave to sh?
+static int needs_shell(const char *s) {
+    char q = 0;
+    int word_start = 1;
+    for (const char *p = s; *p; p++) {
+        char c = *p;
+        if (q == '\'') { if (c == '\'') q = 0; continue; }
+        if (q == '"') {
+            if (c == '"') q = 0;
+            else if (c == '$' || c == '`' || c == '\\') return 1;
+            continue;
+        }
+        if (c == '\'' || c == '"') { q = c; word_start = 0; continue; }
+        if (strchr(";&<>()$`\\*?[]{}\n", c)) return 1;
+        if (c == '|' && p[1] == '|') return 1;
+        if (word_start && (c == '~' || c == '#')) return 1;
+        word_start = isspace((unsigned char)c) || c == '|';
+    }
+    return q != 0; // unbalanced quote: let sh report it
+}
+
+// Split one stage into argv in place, removing quotes. Returns argc.
+static int split_argv(char *s, char **argv) {
+    int n = 0;
+    char *r = s, *w = s;
+    while (*r) {
+        while (isspace((unsigned char)*r)) r++;
+        if (!*r) break;
+        argv[n++] = w;
+        char q = 0;
+        while (*r && (q || !isspace((unsigned char)*r))) {
+            if (q) { if (*r == q) q = 0; else *w++ = *r; r++; continue; }
+            if (*r == '\'' || *r == '"') { q = *r++; continue; }
+            *w++ = *r++;
+        }
+        if (*r) r++;
+        *w++ = 0;
+    }
+    argv[n] = NULL;
+    return n;
+}
+
+// Remembered PATH lookups (like the shell's hash table); dropped when PATH changes.
+#define CMD_CACHE_SIZE 128
+
+static struct { char *name, *path; } cmd_cache[CMD_CACHE_SIZE];
+static char *cmd_cache_pathvar;
+
+static unsigned cmd_hash(const char *s) {
+    unsigned h = 5381;
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h % CMD_CACHE_SIZE;
+}
+
+static void cmd_cache_clear(void) {
+    for (int i = 0; i < CMD_CACHE_SIZE; i++) {
+        free(cmd_cache[i].name);
+        free(cmd_cache[i].path);
+        cmd_cache[i].name = cmd_cache[i].path = NULL;
+    }
+}
+
+// Full path of an executable found on PATH, or NULL (then posix_spawnp decides).
+static const char *resolve_cmd(const char *name) {
+    if (strchr(name, '/')) return NULL;
+    const char *pathvar = getenv("PATH");
+    if (!pathvar) return NULL;
+    if (!cmd_cache_pathvar || strcmp(cmd_cache_pathvar, pathvar) != 0) {
+        cmd_cache_clear();
+        free(cmd_cache_pathvar);
+        cmd_cache_pathvar = strdup(pathvar);
+    }
+    unsigned h = cmd_hash(name);
+    if (cmd_cache[h].name && strcmp(cmd_cache[h].name, name) == 0) return cmd_cache[h].path;
+
+    char full[MAX_LINE];
+    for (const char *p = pathvar; ; ) {
+        const char *colon = strchr(p, ':');
+        size_t n = colon ? (size_t)(colon - p) : strlen(p);
+        snprintf(full, sizeof(full), "%.*s/%s", (int)n, n ? p : ".", name);
+        struct stat st;
+        if (stat(full, &st) == 0 && S_ISREG(st.st_mode) && access(full, X_OK) == 0) {
+            free(cmd_cache[h].name);
+            free(cmd_cache[h].path);
+            cmd_cache[h].name = strdup(name);
+            cmd_cache[h].path = strdup(full);
+            return cmd_cache[h].path;
+        }
+        if (!colon) break;
+        p = colon + 1;
+    }
+    return NULL;
+}
+
+static int decode_status(int st) {
+    if (WIFEXITED(st)) return WEXITSTATUS(st);
+    if (WIFSIGNALED(st)) return 128 + WTERMSIG(st);
+    return -1;
+}
+
+// Spawn every stage, connecting stdout of each to stdin of the next, then wait
+// for all of them. Returns the last stage's exit status (127 if not found).
+static int spawn_pipeline(char **argvs[], int nstages) {
+    pid_t pids[MAX_STAGES];
+    int npids = 0, in_fd = -1, last_rc = 0, last_pid = -1;
+
+    // Like system(): the terminal ignores ^C/^\ while a child runs; children get defaults.
+    struct sigaction ign, old_int, old_quit;
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigemptyset(&ign.sa_mask);
+    sigaction(SIGINT, &ign, &old_int);
+    sigaction(SIGQUIT, &ign, &old_quit);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t def;
+    sigemptyset(&def);
+    sigaddset(&def, SIGINT);
+    sigaddset(&def, SIGQUIT);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    for (int i = 0; i < nstages; i++) {
+        int fds[2] = { -1, -1 };
+        if (i < nstages - 1) {
+            if (pipe(fds) != 0) { perror("pipe"); last_rc = -1; break; }
+            fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+            fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        }
+        posix_spawn_file_actions_t fa;
+        posix_spawn_file_actions_init(&fa);
+        if (in_fd >= 0) posix_spawn_file_actions_adddup2(&fa, in_fd, 0);
+        if (fds[1] >= 0) posix_spawn_file_actions_adddup2(&fa, fds[1], 1);
+        pid_t pid;
+        const char *path = resolve_cmd(argvs[i][0]);
+        int err = path ? posix_spawn(&pid, path, &fa, &attr, argvs[i], environ) : ENOENT;
+        if (err == ENOENT) {
+            if (path) cmd_cache_clear(); // stale entry: binary moved or removed
+            err = posix_spawnp(&pid, argvs[i][0], &fa, &attr, argvs[i], environ);
+        }
+        posix_spawn_file_actions_destroy(&fa);
+        if (in_fd >= 0) close(in_fd);
+        if (fds[1] >= 0) close(fds[1]);
+        in_fd = fds[0];
+        if (err == 0) {
+            pids[npids++] = pid;
+            if (i == nstages - 1) last_pid = pid;
+        } else {
+            fprintf(stderr, "%s: %s\n", argvs[i][0], err == ENOENT ? "command not found" : strerror(err));
+            if (i == nstages - 1) last_rc = err == ENOENT ? 127 : 126;
+        }
+    }
+    if (in_fd >= 0) close(in_fd);
+    posix_spawnattr_destroy(&attr);
+
+    for (int i = 0; i < npids; i++) {
+        int st;
+        while (waitpid(pids[i], &st, 0) < 0 && errno == EINTR) {}
+        if (pids[i] == last_pid) last_rc = decode_status(st);
+    }
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGQUIT, &old_quit, NULL);
+    return last_rc;
+}
+
+static int run_shell(const char *cmd) {
+    char *argv[] = { "/bin/sh", "-c", (char *)cmd, NULL };
+    char **argvs[] = { argv };
+    return spawn_pipeline(argvs, 1);
+}
+
+// Execute a host command line. Returns its exit status, -1 if nothing could run.
+static int run_command(const char *cmd) {
+    if (needs_shell(cmd)) return run_shell(cmd);
+
+    char *buf = strdup(cmd);
+    if (!buf) return -1;
+    char *stage_start[MAX_STAGES];
+    int nstages = 0, too_many = 0;
+    char q = 0;
+    stage_start[nstages++] = buf;
+    for (char *p = buf; *p; p++) {
+        if (q) { if (*p == q) q = 0; continue; }
+        if (*p == '\'' || *p == '"') { q = *p; continue; }
+        if (*p == '|') {
+            *p = 0;
+            if (nstages == MAX_STAGES) { too_many = 1; break; }
+            stage_start[nstages++] = p + 1;
+        }
+    }
+
+    char **argvs[MAX_STAGES];
+    int ok = !too_many, built = 0;
+    for (int i = 0; i < nstages && ok; i++) {
+        argvs[i] = malloc(sizeof(char *) * (strlen(stage_start[i]) / 2 + 2));
+        if (!argvs[i]) { ok = 0; break; }
+        built++;
+        if (split_argv(stage_start[i], argvs[i]) == 0 || strchr(argvs[i][0], '=')) { ok = 0; break; }
+        for (const char **w = shell_words; *w; w++)
+            if (strcmp(argvs[i][0], *w) == 0) { ok = 0; break; }
+    }
+    int rc = ok ? spawn_pipeline(argvs, nstages) : run_shell(cmd);
+    for (int i = 0; i < built; i++) free(argvs[i]);
+    free(buf);
+    return rc;
+}
+
+#endif
@@ -4,56 +4,829 @@
   - Supports user dialect choice: Windows (cmd) or Linux (bash)
   - Detects host OS at compile time
   - Translates many common commands (with parameters) from source dialect to host dialect
-  - Keeps history and supports !! and !<num>
-  - Uses system() to execute translated commands
+  - Keeps history (ring buffer, --histsize / $CUSTARD_HISTSIZE) with bash-style ! expansion
+  - Line editing with Up/Down history and Ctrl-R reverse search on terminals
+  - Persists history to ~/.custard_history (--histfile / $CUSTARD_HISTFILE) with a line-offset index
+  - Runs translated lists and pipelines itself (posix_spawn, pipe2, splice/tee for cat and
+    tee stages, per-stage exit status via `pipestatus`), falling back to /bin/sh -c
+  - Job control: `cmd &`, Ctrl-Z, jobs/fg/bg/wait/kill %n; children reaped from a SIGCHLD
+    signalfd the prompt polls, so finished jobs are reported while you type
+  - `xargs` runs as a pipeline stage with -P workers (-P 0 = one per core), spreading
+    batched arguments over idle workers; unsupported options fall back to the host xargs
+  - cmd `for` loops (plain, /d, /l, /f with %~ modifiers) iterate in-process, each body
+    run natively or spawned directly rather than through a shell per iteration
+  - Runs cat/type, head, tail (with -f via inotify on Linux), ls/dir, cp/copy, mv/move,
+    and du / dir /s and rm -r / rmdir /s (parallel tree walk) in-process on POSIX hosts
+  - Commands that are not found (status 127) can go to a fallback suggestion provider
+    (--fallback http://... or exec:PROGRAM) asynchronously, under a hard timeout, with
+    answers cached on disk; --fallback-mock serves canned answers on loopback
+  - Before that, a local BK-tree over PATH executables and the commands the translator
+    knows prints "did you mean" hints; PATH directories are rescanned only when changed
+  - Optional coprocess mode (--coproc, `coproc on`) keeps one host shell for the session
+  - Caches translations of repeated lines (LRU, `cache` builtin shows hit/miss)
+  - Tokenizes each line once into views (quote/escape aware), parses it into pipelines,
+    ;/&/&&/|| lists and redirections, and dispatches each command on its first token
+    through perfect-hash tables
+  - Batch mode (--batch) translates whole scripts and streams them into one host shell
+  - --translate-only converts script libraries (.bat/.cmd <-> .sh) on all cores
+  - Optional rule files (--rules, ~/.custard.rules) add mappings without rebuilding
+  - `custard --bench <name>` runs the built-in micro-benchmarks
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
 #define HOST_IS_WINDOWS 1
+#include <direct.h>
 #else
 #define HOST_IS_WINDOWS 0
 #endif
 
+#if !HOST_IS_WINDOWS
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <grp.h>
+#include <pwd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <termios.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#endif
+extern char **environ;
+#endif
+
 #define MAX_LINE 8192
 #define MAX_TOK 256
-#define MAX_HISTORY 1000
-// Cross-platform strtok alias
-#if defined(_WIN32) || defined(_WIN64)
-    // On Windows, fallback to strtok (not thread-safe, but fine here)
-    #define STRTOK(str, delim, saveptr) strtok((str), (delim))
-#else
-    // On Linux/Unix, use thread-safe strtok_r
-    #define STRTOK(str, delim, saveptr) strtok_r((str), (delim), (saveptr))
-#endif
+#define DEFAULT_HISTORY 1000
+#define MAX_HISTORY_LIMIT 50000000UL
+
+
+// History: a fixed-capacity ring of (offset, length) records whose text lives
+// in one append-only arena. The live text is always a contiguous tail of the
+// arena, so evicted entries are reclaimed in bulk by sliding that tail down
+// when the arena fills. Appends are O(1) amortized with no per-entry malloc.
+// Entries keep their absolute number (1 = first command of the session) after
+// the ring wraps, so !n stays stable.
+struct hist_rec { size_t off, len; };
+
+static struct {
+    struct hist_rec *ring;
+    size_t cap, head, count;    // head = ring index of the oldest live entry
+    unsigned long total;        // entries ever added; the newest is number `total`
+    char *arena;
+    size_t used, size;
+} hist;
+
+static int hist_init(size_t cap){
+    if(cap < 1) cap = 1;
+    if(cap > MAX_HISTORY_LIMIT) cap = MAX_HISTORY_LIMIT;
+    free(hist.ring); free(hist.arena);
+    memset(&hist, 0, sizeof(hist));
+    hist.ring = malloc(sizeof(struct hist_rec) * cap);
+    if(!hist.ring) return -1;
+    hist.cap = cap;
+    return 0;
+}
+
+// Capacity from $CUSTARD_HISTSIZE, else DEFAULT_HISTORY.
+static size_t hist_default_cap(void){
+    const char *e = getenv("CUSTARD_HISTSIZE");
+    long v = e ? atol(e) : 0;
+    return v > 0 ? (size_t)v : DEFAULT_HISTORY;
+}
+
+// Text of entry number n, or NULL once it has been evicted. Valid until the next add.
+static const char *hist_get(unsigned long n){
+    unsigned long first = hist.total - hist.count + 1;
+    if(hist.count == 0 || n < first || n > hist.total) return NULL;
+    return hist.arena + hist.ring[(hist.head + (n - first)) % hist.cap].off;
+}
+
+// ---- History substring index ----
+// Posting lists of entry numbers per 3-byte substring (trigram), built on the
+// first search and then kept current by hist_push: new entries are appended,
+// and the evicted oldest entry is always at the front of its lists, so
+// dropping it is O(length). A search intersects nothing: it walks the shortest
+// posting list of the query's trigrams newest-first and confirms with strstr.
+// Single bytes and byte pairs get lists of their own (tagged in the key's top
+// byte), so 1- and 2-byte queries are one exact list lookup, not a scan.
+struct posting { uint32_t *ids; uint32_t start, len, cap; };
+struct tri_slot { uint32_t key; int used; struct posting p; };
+
+static struct {
+    struct tri_slot *slots;
+    size_t cap, n;
+    int active;
+} hidx;
+
+static inline uint32_t tri_key(const char *s){
+    return ((uint32_t)(unsigned char)s[0] << 16) | ((uint32_t)(unsigned char)s[1] << 8) | (unsigned char)s[2];
+}
+
+// Key of the g-byte gram at s (g = 1..3); shorter grams are tagged 1 or 2 above bit 24.
+static inline uint32_t gram_key(const char *s, size_t g){
+    if(g == 3) return tri_key(s);
+    if(g == 2) return 0x02000000u | ((uint32_t)(unsigned char)s[0] << 8) | (unsigned char)s[1];
+    return 0x01000000u | (unsigned char)s[0];
+}
+
+static struct posting *tri_get(uint32_t key, int create){
+    if(!hidx.slots){
+        if(!create) return NULL;
+        hidx.cap = 4096;
+        hidx.slots = calloc(hidx.cap, sizeof(struct tri_slot));
+        if(!hidx.slots) return NULL;
+    }
+    if(create && (hidx.n + 1) * 2 > hidx.cap){
+        size_t ncap = hidx.cap * 2;
+        struct tri_slot *ns = calloc(ncap, sizeof(struct tri_slot));
+        if(!ns) return NULL;
+        for(size_t i=0;i<hidx.cap;i++){
+            if(!hidx.slots[i].used) continue;
+            size_t j = (hidx.slots[i].key * 2654435761u) & (ncap - 1);
+            while(ns[j].used) j = (j + 1) & (ncap - 1);
+            ns[j] = hidx.slots[i];
+        }
+        free(hidx.slots);
+        hidx.slots = ns; hidx.cap = ncap;
+    }
+    size_t j = (key * 2654435761u) & (hidx.cap - 1);
+    while(hidx.slots[j].used){
+        if(hidx.slots[j].key == key) return &hidx.slots[j].p;
+        j = (j + 1) & (hidx.cap - 1);
+    }
+    if(!create) return NULL;
+    hidx.slots[j].used = 1;
+    hidx.slots[j].key = key;
+    hidx.n++;
+    return &hidx.slots[j].p;
+}
+
+static void hidx_add(unsigned long id, const char *s, size_t len){
+    for(size_t g=1; g<=3; g++)
+    for(size_t i=0; i+g<=len; i++){
+        struct posting *p = tri_get(gram_key(s + i, g), 1);
+        if(!p) return;
+        if(p->len > p->start && p->ids[p->len-1] == id) continue; // repeated gram
+        if(p->len == p->cap){
+            if(p->start >= 8 && p->start * 2 >= p->len){ // reclaim evicted prefix
+                memmove(p->ids, p->ids + p->start, (p->len - p->start) * sizeof(uint32_t));
+                p->len -= p->start; p->start = 0;
+            } else {
+                uint32_t ncap = p->cap ? p->cap * 2 : 4;
+                uint32_t *ni = realloc(p->ids, ncap * sizeof(uint32_t));
+                if(!ni) return;
+                p->ids = ni; p->cap = ncap;
+            }
+        }
+        p->ids[p->len++] = (uint32_t)id;
+    }
+}
+
+static void hidx_remove_oldest(unsigned long id, const char *s, size_t len){
+    for(size_t g=1; g<=3; g++)
+    for(size_t i=0; i+g<=len; i++){
+        struct posting *p = tri_get(gram_key(s + i, g), 0);
+        if(p && p->start < p->len && p->ids[p->start] == id) p->start++;
+        if(p && p->start == p->len) p->start = p->len = 0;
+    }
+}
+
+static void hidx_free(void){
+    for(size_t i=0; hidx.slots && i<hidx.cap; i++) free(hidx.slots[i].p.ids);
+    free(hidx.slots);
+    memset(&hidx, 0, sizeof(hidx));
+}
+
+// Index everything currently in the ring; later pushes keep it up to date.
+static void hidx_activate(void){
+    if(hidx.active) return;
+    hidx.active = 1;
+    for(unsigned long id = hist.total - hist.count + 1; id <= hist.total && hist.count; id++){
+        const char *s = hist_get(id);
+        hidx_add(id, s, strlen(s));
+    }
+}
+
+// Newest entry number below `before` whose text contains the qn bytes at q
+// (or, when anchored, starts with them), or 0. Unanchored queries must be
+// NUL-terminated.
+static unsigned long hidx_find(const char *q, size_t qn, unsigned long before, int anchored){
+    if(qn == 0 || hist.count == 0) return 0;
+    unsigned long first = hist.total - hist.count + 1;
+    if(before > hist.total + 1) before = hist.total + 1;
+    hidx_activate();
+    struct posting *best = NULL;
+    if(qn < 3){ // the query is a gram itself: every entry on its list matches
+        best = tri_get(gram_key(q, qn), 0);
+        if(!best || best->start == best->len) return 0;
+    }
+    for(size_t i=0; i+3<=qn; i++){
+        struct posting *p = tri_get(tri_key(q + i), 0);
+        if(!p || p->start == p->len) return 0;
+        if(!best || p->len - p->start < best->len - best->start) best = p;
+    }
+    uint32_t lo = best->start, hi = best->len; // first position with id >= before
+    while(lo < hi){
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(best->ids[mid] < before) lo = mid + 1; else hi = mid;
+    }
+    for(uint32_t k = lo; k > best->start; k--){
+        unsigned long id = best->ids[k-1];
+        if(id < first) break;
+        if(anchored ? strncmp(hist_get(id), q, qn) == 0 : strstr(hist_get(id), q) != NULL) return id;
+    }
+    return 0;
+}
+
+// Newest entry number below `before` whose text contains q, or 0.
+static unsigned long hist_search(const char *q, unsigned long before){
+    return hidx_find(q, strlen(q), before, 0);
+}
+
+// ---- History prefix index ----
+// Trie over the first HTRIE_DEPTH bytes of every entry; each node remembers
+// the newest entry passing through it, so !prefix is a single walk down. If a
+// node's newest entry has been evicted, so has everything below it, so nothing
+// is ever removed. Instead an eviction counts the nodes on its path that it
+// was the newest for (now dead), and the trie is rebuilt from the ring once
+// half its nodes are dead, which keeps it within twice its live size.
+// Prefixes longer than HTRIE_DEPTH go to the substring index, anchored.
+// Edges live in one open-addressed table keyed by (parent node, byte).
+#define HTRIE_DEPTH 64
+
+static struct {
+    uint64_t *keys;    // ((uint64_t)parent << 8 | byte) + 1; 0 marks a free slot
+    uint32_t *child;
+    size_t cap, nedges;
+    uint32_t *newest;  // per node; node 0 is the root
+    size_t nnodes, node_cap;
+    size_t dead;       // nodes whose newest entry has been evicted
+    int active;
+} htrie;
+
+static void htrie_free(void){
+    free(htrie.keys); free(htrie.child); free(htrie.newest);
+    memset(&htrie, 0, sizeof(htrie));
+}
+
+// Child of node along byte c, created when create is set; 0 if absent.
+static uint32_t htrie_step(uint32_t node, unsigned char c, int create){
+    if(create && (htrie.nedges + 1) * 2 > htrie.cap){
+        size_t ncap = htrie.cap ? htrie.cap * 2 : 4096;
+        uint64_t *nk = calloc(ncap, sizeof(uint64_t));
+        uint32_t *nc = malloc(ncap * sizeof(uint32_t));
+        if(!nk || !nc){ free(nk); free(nc); return 0; }
+        for(size_t i=0;i<htrie.cap;i++){
+            if(!htrie.keys[i]) continue;
+            size_t j = (size_t)((htrie.keys[i] * 0x9E3779B97F4A7C15ull) >> 32) & (ncap - 1);
+            while(nk[j]) j = (j + 1) & (ncap - 1);
+            nk[j] = htrie.keys[i]; nc[j] = htrie.child[i];
+        }
+        free(htrie.keys); free(htrie.child);
+        htrie.keys = nk; htrie.child = nc; htrie.cap = ncap;
+    }
+    if(!htrie.cap) return 0;
+    uint64_t key = ((uint64_t)node << 8 | c) + 1;
+    size_t j = (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (htrie.cap - 1);
+    while(htrie.keys[j]){
+        if(htrie.keys[j] == key) return htrie.child[j];
+        j = (j + 1) & (htrie.cap - 1);
+    }
+    if(!create || htrie.nnodes >= UINT32_MAX) return 0; // node ids are 32-bit
+    if(htrie.nnodes == htrie.node_cap){
+        size_t ncap = htrie.node_cap ? htrie.node_cap * 2 : 4096;
+        uint32_t *nn = realloc(htrie.newest, ncap * sizeof(uint32_t));
+        if(!nn) return 0;
+        htrie.newest = nn; htrie.node_cap = ncap;
+    }
+    uint32_t id = (uint32_t)htrie.nnodes++;
+    htrie.newest[id] = 0;
+    htrie.keys[j] = key; htrie.child[j] = id;
+    htrie.nedges++;
+    return id;
+}
+
+static void htrie_add(unsigned long id, const char *s, size_t len){
+    uint32_t node = 0;
+    if(len > HTRIE_DEPTH) len = HTRIE_DEPTH;
+    for(size_t i=0;i<len;i++){
+        node = htrie_step(node, (unsigned char)s[i], 1);
+        if(!node) return;
+        htrie.newest[node] = (uint32_t)id;
+    }
+}
+
+// Entry id, with text s, is being evicted: its path's nodes that it was the
+// newest entry for are dead now.
+static void htrie_evict(unsigned long id, const char *s, size_t len){
+    uint32_t node = 0;
+    if(len > HTRIE_DEPTH) len = HTRIE_DEPTH;
+    for(size_t i=0;i<len;i++){
+        if(!(node = htrie_step(node, (unsigned char)s[i], 0))) return;
+        if(htrie.newest[node] == (uint32_t)id) htrie.dead++;
+    }
+}
+
+static void htrie_build(void){
+    htrie_free();
+    htrie.active = 1;
+    htrie.nnodes = 1; // root
+    htrie.node_cap = 4096;
+    htrie.newest = calloc(htrie.node_cap, sizeof(uint32_t));
+    if(!htrie.newest){ htrie.nnodes = htrie.node_cap = 0; return; }
+    for(unsigned long id = hist.total - hist.count + 1; id <= hist.total && hist.count; id++){
+        const char *s = hist_get(id);
+        htrie_add(id, s, strlen(s));
+    }
+}
+
+// Newest entry starting with the len bytes at p, or 0.
+static unsigned long hist_prefix(const char *p, size_t len){
+    if(len == 0 || hist.count == 0) return 0;
+    if(!htrie.active) htrie_build();
+    unsigned long first = hist.total - hist.count + 1;
+    uint32_t node = 0;
+    for(size_t i=0; i<len && i<HTRIE_DEPTH; i++)
+        if(!(node = htrie_step(node, (unsigned char)p[i], 0))) return 0;
+    unsigned long id = htrie.newest[node];
+    if(id < first) return 0;
+    // longer than the indexed depth: no match is newer than the depth-prefix one
+    if(len > HTRIE_DEPTH) return hidx_find(p, len, id + 1, 1);
+    return id;
+}
+
+static void free_history(void){
+    hidx_free();
+    htrie_free();
+    free(hist.ring); free(hist.arena);
+    memset(&hist, 0, sizeof(hist));
+}
+
+// Append len bytes of s as the newest entry (memory only).
+static void hist_push(const char *s, size_t len){
+    if(!hist.ring && hist_init(hist_default_cap()) != 0) return;
+    int full = hist.count == hist.cap, compact = hist.used + len + 1 > hist.size;
+    if(compact){
+        // grow before touching anything, so a failed allocation loses no entry;
+        // keep at least half the arena free after compacting so the next one is far off
+        size_t keep = full ? (hist.count > 1 ? hist.ring[(hist.head + 1) % hist.cap].off : hist.used)
+                           : (hist.count ? hist.ring[hist.head].off : hist.used);
+        size_t live = hist.used - keep;
+        if((live + len + 1) * 2 > hist.size){
+            size_t size = hist.size ? hist.size : 4096;
+            while((live + len + 1) * 2 > size) size *= 2;
+            char *a = realloc(hist.arena, size);
+            if(!a) return;
+            hist.arena = a; hist.size = size;
+        }
+    }
+    if(full){ // drop the oldest; its bytes go at the compaction below or a later one
+        const struct hist_rec *old = &hist.ring[hist.head];
+        if(hidx.active) hidx_remove_oldest(hist.total - hist.count + 1, hist.arena + old->off, old->len);
+        if(htrie.active) htrie_evict(hist.total - hist.count + 1, hist.arena + old->off, old->len);
+        hist.head = (hist.head + 1) % hist.cap;
+        hist.count--;
+    }
+    if(compact){
+        size_t start = hist.count ? hist.ring[hist.head].off : hist.used;
+        if(start){
+            memmove(hist.arena, hist.arena + start, hist.used - start);
+            for(size_t i=0;i<hist.count;i++) hist.ring[(hist.head + i) % hist.cap].off -= start;
+            hist.used -= start;
+        }
+    }
+    struct hist_rec *r = &hist.ring[(hist.head + hist.count) % hist.cap];
+    r->off = hist.used; r->len = len;
+    memcpy(hist.arena + hist.used, s, len);
+    hist.arena[hist.used + len] = 0;
+    hist.used += len + 1;
+    hist.count++;
+    hist.total++;
+    if(hidx.active) hidx_add(hist.total, hist.arena + r->off, len);
+    if(htrie.active){
+        if(htrie.dead >= 4096 && htrie.dead * 2 >= htrie.nnodes) htrie_build();
+        else htrie_add(hist.total, hist.arena + r->off, len);
+    }
+}
+
+static void print_history(){
+    unsigned long start = hist.count > 100 ? hist.total - 99 : hist.total - hist.count + 1;
+    for(unsigned long n=start; n<=hist.total; n++){
+        printf("%lu  %s\n", n, hist_get(n));
+    }
+}
+
+#if !HOST_IS_WINDOWS
+// ---- Persistent history ----
+// Commands are appended to a plain text log, one per line, plus a sidecar
+// index of 64-bit line offsets (<file>.idx). Startup mmaps both and copies the
+// newest entries straight into the ring, so a long history costs no newline
+// scanning. Each append is one O_APPEND write per file under an flock on the
+// index, so concurrent sessions interleave whole records. Records written by a
+// session that died between the two writes are indexed at the next startup.
+static struct { int data_fd, idx_fd; } histfile = { -1, -1 };
+
+// End of the record starting at off (exclusive of its newline).
+static size_t hist_record_end(const char *data, size_t size, size_t off){
+    const char *nl = memchr(data + off, '\n', size - off);
+    return nl ? (size_t)(nl - data) : size;
+}
+
+static int hist_file_open(const char *path){
+    char ipath[MAX_LINE+8];
+    snprintf(ipath, sizeof(ipath), "%s.idx", path);
+    int dfd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    int ifd = dfd >= 0 ? open(ipath, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600) : -1;
+    if(dfd < 0 || ifd < 0){
+        fprintf(stderr, "history file %s: %s\n", dfd < 0 ? path : ipath, strerror(errno));
+        if(dfd >= 0) close(dfd);
+        return -1;
+    }
+    flock(ifd, LOCK_EX);
+    struct stat ds, is;
+    fstat(dfd, &ds);
+    fstat(ifd, &is);
+    size_t dsize = (size_t)ds.st_size, n = (size_t)is.st_size / sizeof(uint64_t);
+    const char *data = dsize ? mmap(NULL, dsize, PROT_READ, MAP_SHARED, dfd, 0) : NULL;
+    uint64_t *idx = n ? mmap(NULL, n * sizeof(uint64_t), PROT_READ, MAP_SHARED, ifd, 0) : NULL;
+    if(data == MAP_FAILED || idx == MAP_FAILED){
+        perror("history mmap");
+        if(data && data != MAP_FAILED) munmap((void*)data, dsize);
+        if(idx && idx != MAP_FAILED) munmap(idx, n * sizeof(uint64_t));
+        flock(ifd, LOCK_UN);
+        close(dfd); close(ifd);
+        return -1;
+    }
+
+    // Trust the index only if it is consistent with the log: it starts at 0,
+    // every offset increases and lies inside the log, and the last one starts
+    // a record. Otherwise rebuild it. (One pass over the index; the log itself
+    // is not scanned.)
+    int valid = is.st_size % sizeof(uint64_t) == 0;
+    if(valid && n){
+        valid = idx[0] == 0;
+        for(size_t i=1; valid && i<n; i++) valid = idx[i-1] < idx[i];
+        uint64_t last = idx[n-1];
+        valid = valid && last < dsize && (last == 0 || data[last-1] == '\n');
+    }
+    if(!valid){
+        if(idx) munmap(idx, n * sizeof(uint64_t));
+        idx = NULL; n = 0;
+        if(ftruncate(ifd, 0) != 0) perror("history index");
+    }
+    size_t covered = n ? hist_record_end(data, dsize, idx[n-1]) + 1 : 0;
+    if(covered < dsize){
+        size_t cap = 4096, k = 0;
+        uint64_t *add = malloc(cap * sizeof(uint64_t));
+        for(size_t off = covered; add && off < dsize; off = hist_record_end(data, dsize, off) + 1){
+            if(k == cap){
+                uint64_t *na = realloc(add, (cap *= 2) * sizeof(uint64_t));
+                if(!na){ free(add); add = NULL; break; }
+                add = na;
+            }
+            add[k++] = off;
+        }
+        if(add){
+            if(write(ifd, add, k * sizeof(uint64_t)) != (ssize_t)(k * sizeof(uint64_t))) perror("history index");
+            free(add);
+        }
+        if(idx) munmap(idx, n * sizeof(uint64_t));
+        fstat(ifd, &is);
+        n = (size_t)is.st_size / sizeof(uint64_t);
+        idx = n ? mmap(NULL, n * sizeof(uint64_t), PROT_READ, MAP_SHARED, ifd, 0) : NULL;
+        if(idx == MAP_FAILED){ idx = NULL; n = 0; }
+    }
+
+    size_t first = n > hist.cap ? n - hist.cap : 0;
+    for(size_t i=first;i<n;i++){
+        size_t end = i + 1 < n ? idx[i+1] - 1 : hist_record_end(data, dsize, idx[i]);
+        hist_push(data + idx[i], end - idx[i]);
+    }
+    hist.total = n; // numbering continues from the file
+
+    if(data) munmap((void*)data, dsize);
+    if(idx) munmap(idx, n * sizeof(uint64_t));
+    flock(ifd, LOCK_UN);
+    histfile.data_fd = dfd;
+    histfile.idx_fd = ifd;
+    return 0;
+}
+
+static void hist_file_append(const char *cmd, size_t len){
+    if(histfile.data_fd < 0) return;
+    char stackbuf[MAX_LINE+1];
+    char *rec = len < sizeof(stackbuf) ? stackbuf : malloc(len + 1);
+    if(!rec) return;
+    for(size_t i=0;i<len;i++) rec[i] = cmd[i] == '\n' ? ' ' : cmd[i];
+    rec[len] = '\n';
+    flock(histfile.idx_fd, LOCK_EX);
+    struct stat st;
+    if(fstat(histfile.data_fd, &st) == 0 && write(histfile.data_fd, rec, len + 1) == (ssize_t)(len + 1)){
+        uint64_t off = (uint64_t)st.st_size;
+        if(write(histfile.idx_fd, &off, sizeof(off)) != (ssize_t)sizeof(off)) perror("history index");
+    }
+    flock(histfile.idx_fd, LOCK_UN);
+    if(rec != stackbuf) free(rec);
+}
 
+static void hist_file_close(void){
+    if(histfile.data_fd >= 0){ close(histfile.data_fd); close(histfile.idx_fd); }
+    histfile.data_fd = histfile.idx_fd = -1;
+}
 
-// History buffer
-static char *history[MAX_HISTORY];
-static int hist_count = 0;
+// --histfile FILE, else $CUSTARD_HISTFILE (empty disables), else ~/.custard_history.
+static void init_histfile(const char *path){
+    char buf[MAX_LINE];
+    if(!path) path = getenv("CUSTARD_HISTFILE");
+    if(!path){
+        const char *home = getenv("HOME");
+        if(!home) return;
+        snprintf(buf, sizeof(buf), "%s/.custard_history", home);
+        path = buf;
+    }
+    if(*path) hist_file_open(path);
+}
+#endif
 
 static void add_history(const char *cmd){
     if(!cmd || strlen(cmd)==0) return;
-    if(hist_count < MAX_HISTORY){
-        history[hist_count++] = strdup(cmd);
-    } else {
-        // rotate: free oldest
-        free(history[0]);
-        memmove(history, history+1, sizeof(char*)*(MAX_HISTORY-1));
-        history[MAX_HISTORY-1] = strdup(cmd);
+    hist_push(cmd, strlen(cmd));
+#if !HOST_IS_WINDOWS
+    hist_file_append(cmd, strlen(cmd));
+#endif
+}
+
+#if !HOST_IS_WINDOWS
+// ---- Line input ----
+// Raw-mode line editor used when stdin is a terminal: cursor movement,
+// history browsing and incremental reverse search (Ctrl-R). Piped input keeps
+// the plain fgets path.
+
+#define CTRL_KEY(c) ((c) & 0x1f)
+enum { KEY_NONE = -2, KEY_EOF = -1, KEY_LEFT = 1000, KEY_RIGHT, KEY_UP, KEY_DOWN, KEY_HOME, KEY_END, KEY_DEL, KEY_WAKE };
+
+static struct termios orig_termios;
+static int raw_on;
+
+// Other fds to watch while waiting for a key (job control's SIGCHLD signalfd,
+// the fallback provider's completion pipe). When one fires, its callback runs
+// and read_key returns KEY_WAKE so the line is redrawn.
+#define INPUT_WAKE_MAX 4
+static struct input_wake { int fd; void (*fn)(void); } input_wakes[INPUT_WAKE_MAX];
+static int ninput_wakes;
+
+static void input_wake_add(int fd, void (*fn)(void)){
+    if(ninput_wakes < INPUT_WAKE_MAX) input_wakes[ninput_wakes++] = (struct input_wake){ fd, fn };
+}
+
+static void raw_disable(void){
+    if(raw_on){ tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios); raw_on = 0; }
+}
+
+static int raw_enable(void){
+    static int registered;
+    if(tcgetattr(STDIN_FILENO, &orig_termios) < 0) return -1;
+    if(!registered){ atexit(raw_disable); registered = 1; }
+    struct termios t = orig_termios;
+    t.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    t.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    t.c_cflag |= CS8;
+    t.c_cc[VMIN] = 1; t.c_cc[VTIME] = 0;
+    if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &t) < 0) return -1;
+    raw_on = 1;
+    return 0;
+}
+
+static int term_cols(void){
+    struct winsize ws;
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) return ws.ws_col;
+    return 80;
+}
+
+// Next key; escape sequences for arrows/Home/End/Delete are decoded.
+static int read_key(void){
+    unsigned char c;
+    ssize_t r;
+    if(ninput_wakes){
+        struct pollfd w[1 + INPUT_WAKE_MAX] = { { STDIN_FILENO, POLLIN, 0 } };
+        for(int i=0;i<ninput_wakes;i++) w[i + 1] = (struct pollfd){ input_wakes[i].fd, POLLIN, 0 };
+        while(poll(w, 1 + (nfds_t)ninput_wakes, -1) < 0 && errno == EINTR){}
+        if(!w[0].revents){
+            for(int i=0;i<ninput_wakes;i++) if(w[i + 1].revents) input_wakes[i].fn();
+            return KEY_WAKE;
+        }
+    }
+    while((r = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR){}
+    if(r <= 0) return KEY_EOF;
+    if(c != 27) return c;
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    unsigned char seq[3];
+    if(poll(&pfd, 1, 50) <= 0 || read(STDIN_FILENO, &seq[0], 1) != 1) return 27;
+    if(poll(&pfd, 1, 50) <= 0 || read(STDIN_FILENO, &seq[1], 1) != 1) return 27;
+    if(seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9'){
+        if(read(STDIN_FILENO, &seq[2], 1) != 1 || seq[2] != '~') return KEY_NONE;
+        switch(seq[1]){ case '1': case '7': return KEY_HOME; case '4': case '8': return KEY_END; case '3': return KEY_DEL; }
+        return KEY_NONE;
+    }
+    if(seq[0] == '[' || seq[0] == 'O'){
+        switch(seq[1]){
+        case 'A': return KEY_UP; case 'B': return KEY_DOWN; case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT; case 'H': return KEY_HOME; case 'F': return KEY_END;
+        }
     }
+    return KEY_NONE;
 }
 
-static void print_history(){
-    int start = hist_count>100? hist_count-100 : 0;
-    for(int i=start;i<hist_count;i++){
-        printf("%d  %s\n", i+1, history[i]);
+struct line_edit {
+    char *buf;
+    size_t size, len, pos;
+    const char *prompt;
+};
+
+static void edit_write(const char *s, size_t n){
+    while(n > 0){
+        ssize_t w = write(STDOUT_FILENO, s, n);
+        if(w < 0){ if(errno == EINTR) continue; return; }
+        s += w; n -= (size_t)w;
+    }
+}
+
+// Redraw prompt + text on one row, scrolling horizontally to keep the cursor visible.
+static void edit_refresh(const char *prompt, const char *text, size_t len, size_t pos){
+    size_t plen = strlen(prompt), cols = (size_t)term_cols(), start = 0;
+    if(plen + 1 >= cols) plen = 0, prompt = "";
+    while(plen + pos - start >= cols) start++;
+    size_t shown = len - start;
+    if(plen + shown > cols - 1) shown = cols - 1 - plen;
+    char out[MAX_LINE + 512];
+    int n = snprintf(out, sizeof(out), "\r%s%.*s\x1b[K\r", prompt, (int)shown, text + start);
+    if(n < 0) return;
+    if((size_t)n >= sizeof(out)) n = sizeof(out) - 1;
+    size_t col = plen + pos - start;
+    if(col) n += snprintf(out + n, sizeof(out) - n, "\x1b[%zuC", col);
+    edit_write(out, (size_t)n < sizeof(out) ? (size_t)n : sizeof(out) - 1);
+}
+
+static void edit_set(struct line_edit *e, const char *s){
+    size_t n = strlen(s);
+    if(n >= e->size) n = e->size - 1;
+    memcpy(e->buf, s, n);
+    e->buf[n] = 0;
+    e->len = e->pos = n;
+}
+
+// Ctrl-R: incremental reverse search. Returns the key that ended the search
+// (already applied to e when it accepts the match), or KEY_NONE on cancel.
+static int edit_reverse_search(struct line_edit *e){
+    char q[256] = "", saved[MAX_LINE];
+    size_t qn = 0;
+    unsigned long match = 0;
+    int failed = 0;
+    snprintf(saved, sizeof(saved), "%s", e->buf);
+    for(;;){
+        char prompt[sizeof(q) + 32];
+        snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%s': ", failed ? "failed " : "", q);
+        const char *m = match ? hist_get(match) : "";
+        if(!m) m = "";
+        edit_refresh(prompt, m, strlen(m), strlen(m));
+        int c = read_key();
+        if(c == KEY_WAKE) continue;
+        if(c == CTRL_KEY('R')){
+            unsigned long next = qn ? hist_search(q, match ? match : hist.total + 1) : 0;
+            if(next) match = next, failed = 0; else failed = 1;
+        } else if(c == 127 || c == CTRL_KEY('H')){
+            if(qn) q[--qn] = 0;
+            match = qn ? hist_search(q, hist.total + 1) : 0;
+            failed = qn && !match;
+        } else if(c >= 32 && c < 127 && qn + 1 < sizeof(q)){
+            q[qn++] = (char)c; q[qn] = 0;
+            unsigned long next = hist_search(q, match ? match + 1 : hist.total + 1);
+            if(next) match = next, failed = 0; else failed = 1;
+        } else if(c == CTRL_KEY('G') || c == 27){
+            edit_set(e, saved);
+            return KEY_NONE;
+        } else {
+            if(match && hist_get(match)) edit_set(e, hist_get(match));
+            return c;
+        }
+    }
+}
+
+// Read one line. Returns 1 with the line in buf (no newline), 0 at end of input.
+static int read_line(const char *prompt, char *buf, size_t size){
+    fflush(stdout);
+    if(!isatty(STDIN_FILENO) || raw_enable() != 0){
+        fputs(prompt, stdout);
+        fflush(stdout);
+        if(!fgets(buf, size, stdin)) return 0;
+        return 1;
+    }
+    struct line_edit e = { buf, size, 0, 0, prompt };
+    unsigned long nav = hist.total + 1; // history position for Up/Down
+    char pending[MAX_LINE] = "";        // the line being typed while browsing
+    buf[0] = 0;
+    int result = -1;
+    edit_refresh(prompt, buf, 0, 0);
+    while(result < 0){
+        int c = read_key();
+        if(c == CTRL_KEY('R')) c = edit_reverse_search(&e);
+        switch(c){
+        case KEY_EOF: result = 0; break;
+        case '\r': case '\n': result = 1; break;
+        case CTRL_KEY('C'):
+            edit_write("^C\r\n", 4);
+            e.len = e.pos = 0; buf[0] = 0; nav = hist.total + 1;
+            break;
+        case CTRL_KEY('D'):
+            if(e.len == 0){ result = 0; break; }
+            /* fall through */
+        case KEY_DEL:
+            if(e.pos < e.len){ memmove(buf + e.pos, buf + e.pos + 1, e.len - e.pos); e.len--; }
+            break;
+        case 127: case CTRL_KEY('H'):
+            if(e.pos > 0){ memmove(buf + e.pos - 1, buf + e.pos, e.len - e.pos + 1); e.pos--; e.len--; }
+            break;
+        case KEY_LEFT: case CTRL_KEY('B'): if(e.pos > 0) e.pos--; break;
+        case KEY_RIGHT: case CTRL_KEY('F'): if(e.pos < e.len) e.pos++; break;
+        case KEY_HOME: case CTRL_KEY('A'): e.pos = 0; break;
+        case KEY_END: case CTRL_KEY('E'): e.pos = e.len; break;
+        case CTRL_KEY('K'): e.len = e.pos; buf[e.len] = 0; break;
+        case CTRL_KEY('U'):
+            memmove(buf, buf + e.pos, e.len - e.pos + 1);
+            e.len -= e.pos; e.pos = 0;
+            break;
+        case CTRL_KEY('W'): {
+            size_t p = e.pos;
+            while(p > 0 && buf[p-1] == ' ') p--;
+            while(p > 0 && buf[p-1] != ' ') p--;
+            memmove(buf + p, buf + e.pos, e.len - e.pos + 1);
+            e.len -= e.pos - p; e.pos = p;
+            break;
+        }
+        case CTRL_KEY('L'): edit_write("\x1b[H\x1b[2J", 7); break;
+        case KEY_UP: case CTRL_KEY('P'):
+            if(nav > hist.total - hist.count + 1 && hist.count){
+                if(nav == hist.total + 1) snprintf(pending, sizeof(pending), "%s", buf);
+                edit_set(&e, hist_get(--nav));
+            }
+            break;
+        case KEY_DOWN: case CTRL_KEY('N'):
+            if(nav <= hist.total){
+                nav++;
+                edit_set(&e, nav == hist.total + 1 ? pending : hist_get(nav));
+            }
+            break;
+        default:
+            if(c >= 32 && c < 256 && c != 127 && e.len + 1 < size){
+                memmove(buf + e.pos + 1, buf + e.pos, e.len - e.pos + 1);
+                buf[e.pos++] = (char)c;
+                e.len++;
+            }
+            break;
+        }
+        if(result < 0) edit_refresh(prompt, buf, e.len, e.pos);
     }
+    edit_refresh(prompt, buf, e.len, e.len);
+    edit_write("\r\n", 2);
+    raw_disable();
+    return result;
+}
+#else
+static int read_line(const char *prompt, char *buf, size_t size){
+    fputs(prompt, stdout);
+    fflush(stdout);
+    return fgets(buf, (int)size, stdin) != NULL;
 }
+#endif
 
 // trim
 static void trim(char *s){
@@ -67,411 +840,8125 @@ static void trim(char *s){
     while(len>0 && isspace((unsigned char)s[len-1])) s[--len]=0;
 }
 
-// lowercase copy
-static void lc_copy(const char *in, char *out){
-    while(*in) { *out = tolower((unsigned char)*in); in++; out++; }
-    *out = 0;
-}
-
-// split first token and rest
-static void split_first(const char *in, char *first, char *rest){
-    first[0]=0; rest[0]=0;
-    const char *p = in;
-    while(*p && isspace((unsigned char)*p)) p++;
-    if(!*p) return;
-    // handle quoted token
-    if(*p=='\'' || *p=='"'){
-        char q = *p++;
-        const char *start = p;
-        while(*p && *p!=q) p++;
-        strncpy(first, start, p-start);
-        first[p-start]=0;
-        if(*p) p++;
-    } else {
-        const char *start = p;
-        while(*p && !isspace((unsigned char)*p)) p++;
-        strncpy(first, start, p-start);
-        first[p-start]=0;
+// Replace substring (first occurrence) in place; new may not be longer than old.
+// Returns 1 if replaced.
+static int replace_first(char *s, const char *old, const char *new){
+    char *pos = strstr(s, old);
+    size_t ol = strlen(old), nl = strlen(new);
+    if(!pos || nl > ol) return 0;
+    memcpy(pos, new, nl);
+    memmove(pos + nl, pos + ol, strlen(pos + ol) + 1);
+    return 1;
+}
+
+// ---- Arena and output builder ----
+// Translation output is assembled in a struct sbuf: tracked length, doubling
+// growth, no fixed cap. An sbuf may be backed by an arena, a bump allocator
+// for per-line scratch that is released all at once with arena_reset(), so a
+// caller translating many lines reuses the same memory instead of a malloc
+// and free per string. Without an arena the sbuf owns a malloc'd buffer.
+struct arena_blk { struct arena_blk *next; size_t used, cap; char data[]; };
+struct arena { struct arena_blk *head, *borrowed; }; // borrowed: caller memory, never freed
+
+#define ARENA_BLOCK 16384
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+static void *arena_alloc(struct arena *a, size_t n){
+    n = ARENA_ALIGN(n ? n : 1);
+    struct arena_blk *b = a->head;
+    if(!b || b->cap - b->used < n){
+        size_t cap = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        b = malloc(sizeof(*b) + cap);
+        if(!b) return NULL;
+        b->next = a->head; b->used = 0; b->cap = cap;
+        a->head = b;
+    }
+    void *p = b->data + b->used;
+    b->used += n;
+    return p;
+}
+
+// Start a on the caller's buffer (typically on the stack), so small jobs never
+// reach malloc; arena_free() leaves that block alone.
+static void arena_init_buf(struct arena *a, void *buf, size_t size){
+    struct arena_blk *b = buf;
+    b->next = NULL; b->used = 0; b->cap = size - sizeof(*b);
+    a->head = a->borrowed = b;
+}
+
+static char *arena_strndup(struct arena *a, const char *s, size_t n){
+    char *d = arena_alloc(a, n + 1);
+    if(!d) return NULL;
+    memcpy(d, s, n);
+    d[n] = 0;
+    return d;
+}
+
+// Release everything; the newest (usually largest) block is kept for reuse.
+static void arena_reset(struct arena *a){
+    struct arena_blk *b = a->head;
+    if(!b) return;
+    for(struct arena_blk *o = b->next, *next; o; o = next){ next = o->next; if(o != a->borrowed) free(o); }
+    b->next = NULL;
+    b->used = 0;
+    if(a->borrowed && a->borrowed != b) a->borrowed = NULL;
+}
+
+static void arena_free(struct arena *a){
+    for(struct arena_blk *b = a->head, *next; b; b = next){ next = b->next; if(b != a->borrowed) free(b); }
+    a->head = a->borrowed = NULL;
+}
+
+struct sbuf { char *p; size_t len, cap; struct arena *arena; };
+
+// Make room for need more bytes plus the terminator. Returns -1 on OOM.
+static int sb_grow(struct sbuf *sb, size_t need){
+    if(sb->len + need < sb->cap) return 0;
+    size_t cap = sb->cap ? sb->cap : 256;
+    while(sb->len + need >= cap) cap *= 2;
+    char *p;
+    if(sb->arena){
+        struct arena_blk *b = sb->arena->head;
+        // the newest allocation in the block can grow in place
+        if(b && sb->p && sb->p + ARENA_ALIGN(sb->cap) == b->data + b->used && (size_t)(b->data + b->cap - sb->p) >= ARENA_ALIGN(cap)){
+            b->used = (size_t)(sb->p - b->data) + ARENA_ALIGN(cap);
+            sb->cap = cap;
+            return 0;
+        }
+        p = arena_alloc(sb->arena, cap);
+        if(p && sb->len) memcpy(p, sb->p, sb->len);
+    } else p = realloc(sb->p, cap);
+    if(!p) return -1;
+    sb->p = p; sb->cap = cap;
+    return 0;
+}
+
+static void sb_put(struct sbuf *sb, const char *s, size_t n){
+    if(sb_grow(sb, n) != 0) return;
+    memcpy(sb->p + sb->len, s, n);
+    sb->len += n;
+    sb->p[sb->len] = 0;
+}
+
+static void sb_puts(struct sbuf *sb, const char *s){ sb_put(sb, s, strlen(s)); }
+
+static void sb_putc(struct sbuf *sb, char c){ sb_put(sb, &c, 1); }
+
+static void sb_printf(struct sbuf *sb, const char *fmt, ...){
+    va_list ap;
+    char tmp[256];
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if(n < 0) return;
+    if((size_t)n < sizeof(tmp)){ sb_put(sb, tmp, (size_t)n); return; }
+    if(sb_grow(sb, (size_t)n) != 0) return;
+    va_start(ap, fmt);
+    vsnprintf(sb->p + sb->len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    sb->len += (size_t)n;
+}
+
+// The built string (never NULL); malloc'd unless the sbuf is arena-backed.
+static char *sb_take(struct sbuf *sb){
+    char *p = sb->p;
+    if(!p) p = sb->arena ? arena_strndup(sb->arena, "", 0) : strdup("");
+    sb->p = NULL; sb->len = sb->cap = 0;
+    return p;
+}
+
+
+// ---- Tokenizer ----
+// One pass over a command line yields string views (offset, length) into it;
+// nothing is copied. Quotes group words and hide | and the other operators.
+// In the bash dialect a backslash escapes the next byte; in the cmd dialect ^
+// does, and backslashes are plain path separators. A word's span keeps its
+// quotes so text can be passed through untouched; tok_word() gives the
+// unquoted view of a word that is exactly one quoted span.
+enum tok_kind { TOK_WORD, TOK_PIPE, TOK_OP };
+enum tok_quote { TQ_NONE, TQ_SINGLE, TQ_DOUBLE, TQ_MIXED };
+struct tok { uint32_t off, len; uint8_t kind, quote; };
+
+#define TOK_INLINE 256 // tokens kept on the stack before falling back to malloc
+
+static inline int tok_is_blank(char c){ return c==' ' || c=='\t' || c=='\r' || c=='\n'; }
+static inline int tok_is_op(char c){ return c=='|' || c=='&' || c==';' || c=='<' || c=='>'; }
+
+// Tokenize n bytes of s into out (at most max entries). Returns the total
+// token count, which may exceed max; call again with room for that many.
+static size_t tokenize(const char *s, size_t n, int windows, struct tok *out, size_t max){
+    size_t count = 0, i = 0;
+    const char esc = windows ? '^' : '\\';
+    while(i < n){
+        if(tok_is_blank(s[i])){ i++; continue; }
+        struct tok t = { (uint32_t)i, 0, TOK_WORD, TQ_NONE };
+        if(tok_is_op(s[i])){
+            char c = s[i++];
+            while(i < n && s[i] == c) i++; // ||, &&, >>, ;;
+            t.kind = (c == '|' && i == t.off + 1) ? TOK_PIPE : TOK_OP;
+        } else {
+            char q = 0, first_q = 0;
+            int spans = 0, other = 0;
+            while(i < n){
+                char c = s[i];
+                if(q){
+                    if(c == q) q = 0;
+                    else if(c == '\\' && q == '"' && !windows && i + 1 < n) i++;
+                    i++;
+                    continue;
+                }
+                if(tok_is_blank(c) || tok_is_op(c)) break;
+                if(c == '"' || (c == '\'' && !windows)){
+                    q = c;
+                    if(!spans++) first_q = c;
+                } else if(c == esc && i + 1 < n){
+                    other = 2;
+                    i++;
+                } else other = 1;
+                i++;
+            }
+            size_t len = i - t.off;
+            if(spans == 0 && other < 2) t.quote = TQ_NONE;
+            else if(spans == 1 && !other && len >= 2 && s[i-1] == first_q) t.quote = first_q == '"' ? TQ_DOUBLE : TQ_SINGLE;
+            else t.quote = TQ_MIXED;
+        }
+        t.len = (uint32_t)(i - t.off);
+        if(count < max) out[count] = t;
+        count++;
+    }
+    return count;
+}
+
+// Text of a word with one enclosing pair of quotes removed.
+static inline const char *tok_word(const char *s, const struct tok *t, size_t *len){
+    if(t->quote == TQ_SINGLE || t->quote == TQ_DOUBLE){ *len = t->len - 2; return s + t->off + 1; }
+    *len = t->len;
+    return s + t->off;
+}
+
+// Case-insensitive compare of a view against a lowercase literal.
+static int view_ieq(const char *s, size_t n, const char *lit){
+    for(size_t i=0;i<n;i++, lit++)
+        if(!*lit || tolower((unsigned char)s[i]) != *lit) return 0;
+    return *lit == 0;
+}
+
+// First occurrence of lit inside the n bytes at s, or NULL.
+static const char *view_find(const char *s, size_t n, const char *lit){
+    size_t ln = strlen(lit);
+    if(ln == 0) return s;
+    for(const char *p = s; ln <= n - (size_t)(p - s); p++){
+        p = memchr(p, lit[0], n - (p - s) - ln + 1);
+        if(!p) return NULL;
+        if(memcmp(p, lit, ln) == 0) return p;
+    }
+    return NULL;
+}
+
+// Command dispatch: the lowercased first token is looked up in a static table
+// per dialect direction through a perfect hash, so dispatch costs one hash and
+// one strcmp no matter how many mappings the tables hold.
+enum map_id {
+    MAP_NONE = 0,
+    // Linux -> Windows
+    L2W_PWD, L2W_LS, L2W_MKDIR, L2W_RMDIR, L2W_RM, L2W_TOUCH, L2W_CP, L2W_MV,
+    L2W_CAT, L2W_LESS, L2W_HEAD, L2W_TAIL, L2W_CHMOD, L2W_CHOWN, L2W_WHOAMI,
+    L2W_UNAME, L2W_HOSTNAME, L2W_DATE, L2W_UPTIME, L2W_DF, L2W_DU, L2W_FREE,
+    L2W_TOP, L2W_PS, L2W_KILL, L2W_JOBS, L2W_PING, L2W_CURL, L2W_WGET,
+    L2W_IFCONFIG, L2W_IP, L2W_NETSTAT, L2W_SSH, L2W_SCP, L2W_SUDO, L2W_APT,
+    L2W_ADDUSER, L2W_WHO, L2W_TAR, L2W_ZIP, L2W_HISTORY, L2W_CLEAR, L2W_BANG,
+    // Windows -> Linux
+    W2L_DIR, W2L_TYPE, W2L_COPY, W2L_MOVE, W2L_DEL, W2L_RMDIR, W2L_MKDIR,
+    W2L_CLS, W2L_WHOAMI, W2L_SYSTEMINFO, W2L_HOSTNAME, W2L_DATE, W2L_NETSTAT,
+    W2L_TASKLIST, W2L_TASKKILL, W2L_IPCONFIG, W2L_PING, W2L_CURL, W2L_SSH,
+    W2L_SCP, W2L_POWERSHELL, W2L_WMIC, W2L_TAR, W2L_REM, W2L_HISTORY, W2L_START
+};
+
+struct map_entry {
+    const char *name; // lowercase source token
+    int id;
+};
+
+static const struct map_entry l2w_entries[] = {
+    {"pwd", L2W_PWD}, {"ls", L2W_LS}, {"mkdir", L2W_MKDIR}, {"rmdir", L2W_RMDIR},
+    {"rm", L2W_RM}, {"touch", L2W_TOUCH}, {"cp", L2W_CP}, {"mv", L2W_MV},
+    {"cat", L2W_CAT}, {"less", L2W_LESS}, {"more", L2W_LESS}, {"head", L2W_HEAD},
+    {"tail", L2W_TAIL}, {"chmod", L2W_CHMOD}, {"chown", L2W_CHOWN},
+    {"whoami", L2W_WHOAMI}, {"uname", L2W_UNAME}, {"hostname", L2W_HOSTNAME},
+    {"date", L2W_DATE}, {"uptime", L2W_UPTIME}, {"df", L2W_DF}, {"du", L2W_DU},
+    {"free", L2W_FREE}, {"top", L2W_TOP}, {"htop", L2W_TOP}, {"ps", L2W_PS},
+    {"kill", L2W_KILL}, {"jobs", L2W_JOBS}, {"fg", L2W_JOBS}, {"bg", L2W_JOBS},
+    {"ping", L2W_PING}, {"curl", L2W_CURL}, {"wget", L2W_WGET},
+    {"ifconfig", L2W_IFCONFIG}, {"ip", L2W_IP}, {"netstat", L2W_NETSTAT},
+    {"ssh", L2W_SSH}, {"scp", L2W_SCP}, {"sudo", L2W_SUDO}, {"apt", L2W_APT},
+    {"dnf", L2W_APT}, {"pacman", L2W_APT}, {"adduser", L2W_ADDUSER},
+    {"passwd", L2W_ADDUSER}, {"su", L2W_ADDUSER}, {"who", L2W_WHO},
+    {"id", L2W_WHO}, {"groups", L2W_WHO}, {"tar", L2W_TAR}, {"zip", L2W_ZIP},
+    {"unzip", L2W_ZIP}, {"history", L2W_HISTORY}, {"clear", L2W_CLEAR},
+    {"!!", L2W_BANG},
+};
+
+static const struct map_entry w2l_entries[] = {
+    {"dir", W2L_DIR}, {"type", W2L_TYPE}, {"copy", W2L_COPY}, {"move", W2L_MOVE},
+    {"del", W2L_DEL}, {"erase", W2L_DEL}, {"rmdir", W2L_RMDIR},
+    {"mkdir", W2L_MKDIR}, {"cls", W2L_CLS}, {"whoami", W2L_WHOAMI},
+    {"systeminfo", W2L_SYSTEMINFO}, {"hostname", W2L_HOSTNAME},
+    {"date", W2L_DATE}, {"netstat", W2L_NETSTAT}, {"tasklist", W2L_TASKLIST},
+    {"taskkill", W2L_TASKKILL}, {"ipconfig", W2L_IPCONFIG}, {"ping", W2L_PING},
+    {"curl", W2L_CURL}, {"ssh", W2L_SSH}, {"scp", W2L_SCP},
+    {"powershell", W2L_POWERSHELL}, {"wmic", W2L_WMIC}, {"tar", W2L_TAR},
+    {"compress-archive", W2L_TAR}, {"rem", W2L_REM}, {"history", W2L_HISTORY},
+    {"start", W2L_START},
+};
+
+#define ARRAY_LEN(a) (sizeof(a)/sizeof((a)[0]))
+
+// 64-bit FNV-1a with a final avalanche so both halves are usable.
+static uint64_t hash_bytes(const char *s, size_t n, uint64_t seed){
+    uint64_t h = 1469598103934665603ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+    for(size_t i=0;i<n;i++){ h ^= (unsigned char)s[i]; h *= 1099511628211ULL; }
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// hash_bytes of the ASCII-lowercased bytes, without making a lowercase copy.
+static uint64_t hash_bytes_lc(const char *s, size_t n, uint64_t seed){
+    uint64_t h = 1469598103934665603ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+    for(size_t i=0;i<n;i++){
+        unsigned char c = (unsigned char)s[i];
+        if(c >= 'A' && c <= 'Z') c |= 0x20;
+        h ^= c; h *= 1099511628211ULL;
+    }
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Perfect hash (hash-and-displace): keys are grouped into small buckets by one
+// half of the hash, then each bucket gets a displacement that drops all of its
+// keys into free slots. Lookup is a single hash plus one probe.
+struct phash {
+    uint32_t nbuckets;
+    uint32_t mask;      // slot count - 1 (power of two)
+    uint64_t seed;
+    uint32_t *disp;     // per-bucket displacement
+    int32_t *slots;     // slot -> key index, -1 when empty
+};
+
+static inline uint32_t phash_slot(const struct phash *ph, uint64_t h, uint32_t d){
+    uint32_t lo = (uint32_t)h, hi = (uint32_t)(h >> 32);
+    return (hi + d * (lo | 1)) & ph->mask;
+}
+
+static int cmp_u64_desc(const void *a, const void *b){
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+static void phash_free(struct phash *ph){
+    free(ph->disp); free(ph->slots);
+    ph->disp = NULL; ph->slots = NULL;
+}
+
+// Build over n distinct keys. Returns 0 on success, -1 on duplicates or OOM.
+static int phash_build(struct phash *ph, const char *const *keys, size_t n){
+    memset(ph, 0, sizeof(*ph));
+    size_t m = 8;
+    while(m < n + n/4 + 1) m <<= 1;
+    size_t nb = n/2 + 1;
+    uint64_t *hashes = malloc(sizeof(uint64_t) * (n ? n : 1));
+    uint64_t *order = malloc(sizeof(uint64_t) * nb);
+    uint32_t *start = calloc(nb + 1, sizeof(uint32_t));
+    uint32_t *members = malloc(sizeof(uint32_t) * (n ? n : 1));
+    uint32_t *fill = malloc(sizeof(uint32_t) * nb);
+    uint32_t *tmp = malloc(sizeof(uint32_t) * (n ? n : 1));
+    ph->disp = calloc(nb, sizeof(uint32_t));
+    ph->slots = malloc(sizeof(int32_t) * m);
+    int rc = -1;
+    if(!hashes || !order || !start || !members || !fill || !tmp || !ph->disp || !ph->slots) goto out;
+    ph->nbuckets = (uint32_t)nb;
+    ph->mask = (uint32_t)(m - 1);
+
+    for(uint64_t seed = 1; seed <= 64 && rc != 0; seed++){
+        ph->seed = seed;
+        memset(start, 0, sizeof(uint32_t) * (nb + 1));
+        for(size_t i=0;i<n;i++){
+            hashes[i] = hash_bytes(keys[i], strlen(keys[i]), seed);
+            start[(uint32_t)hashes[i] % nb + 1]++;
+        }
+        for(size_t b=0;b<nb;b++) start[b+1] += start[b];
+        memcpy(fill, start, sizeof(uint32_t) * nb);
+        for(size_t i=0;i<n;i++) members[fill[(uint32_t)hashes[i] % nb]++] = (uint32_t)i;
+        // place the largest buckets first while the table is still empty
+        for(size_t b=0;b<nb;b++) order[b] = ((uint64_t)(start[b+1]-start[b]) << 32) | b;
+        qsort(order, nb, sizeof(uint64_t), cmp_u64_desc);
+        for(size_t i=0;i<m;i++) ph->slots[i] = -1;
+
+        int ok = 1;
+        for(size_t oi=0; oi<nb && ok; oi++){
+            uint32_t b = (uint32_t)order[oi], cnt = (uint32_t)(order[oi] >> 32);
+            if(cnt == 0) break;
+            for(uint32_t i=0;i<cnt;i++)
+                for(uint32_t j=i+1;j<cnt;j++)
+                    if(strcmp(keys[members[start[b]+i]], keys[members[start[b]+j]])==0){
+                        fprintf(stderr, "phash: duplicate key '%s'\n", keys[members[start[b]+i]]);
+                        goto out;
+                    }
+            uint32_t d;
+            for(d=0; d < 4*m; d++){
+                uint32_t placed = 0;
+                for(; placed<cnt; placed++){
+                    uint32_t s = phash_slot(ph, hashes[members[start[b]+placed]], d);
+                    if(ph->slots[s] != -1) break;
+                    ph->slots[s] = (int32_t)members[start[b]+placed]; // tentatively claim
+                    tmp[placed] = s;
+                }
+                if(placed == cnt) break;
+                for(uint32_t k=0;k<placed;k++) ph->slots[tmp[k]] = -1;
+            }
+            if(d == 4*m) ok = 0; else ph->disp[b] = d;
+        }
+        if(ok) rc = 0;
+    }
+out:
+    free(hashes); free(order); free(start); free(members); free(fill); free(tmp);
+    if(rc != 0) phash_free(ph);
+    return rc;
+}
+
+// Candidate key index for a hash made with ph->seed, or -1.
+static inline int32_t phash_probe(const struct phash *ph, uint64_t h){
+    if(!ph->slots) return -1;
+    return ph->slots[phash_slot(ph, h, ph->disp[(uint32_t)h % ph->nbuckets])];
+}
+
+struct dispatch {
+    const struct map_entry *entries;
+    size_t n;
+    struct phash ph;
+};
+
+static struct dispatch l2w_dispatch = { l2w_entries, ARRAY_LEN(l2w_entries), {0} };
+static struct dispatch w2l_dispatch = { w2l_entries, ARRAY_LEN(w2l_entries), {0} };
+
+static int dispatch_init(struct dispatch *d){
+    const char **keys = malloc(sizeof(char*) * d->n);
+    if(!keys) return -1;
+    for(size_t i=0;i<d->n;i++) keys[i] = d->entries[i].name;
+    int rc = phash_build(&d->ph, keys, d->n);
+    free(keys);
+    return rc;
+}
+
+static void init_dispatch_tables(void){
+    if(dispatch_init(&l2w_dispatch) != 0 || dispatch_init(&w2l_dispatch) != 0){
+        fprintf(stderr, "Failed to build command dispatch tables.\n");
+        exit(1);
+    }
+}
+
+// Returns the map_id for the n-byte token (any case), MAP_NONE when unmapped.
+static int dispatch_lookup(const struct dispatch *d, const char *tok, size_t n){
+    int32_t i = d->ph.slots ? phash_probe(&d->ph, hash_bytes_lc(tok, n, d->ph.seed)) : -1;
+    if(i >= 0 && view_ieq(tok, n, d->entries[i].name)) return d->entries[i].id;
+    return MAP_NONE;
+}
+
+// Sequential scan in table order; what map_command used to do. Kept for --bench.
+static int dispatch_lookup_linear(const struct dispatch *d, const char *tok, size_t n){
+    for(size_t i=0;i<d->n;i++)
+        if(view_ieq(tok, n, d->entries[i].name)) return d->entries[i].id;
+    return MAP_NONE;
+}
+
+// ---- Translation rule files ----
+// Rules let new mappings be added without rebuilding. One rule per line:
+//
+//   <l2w|w2l> <token> [flag patterns...] => <output template>
+//
+// A flag pattern must appear among the arguments ("!pat" must not); a
+// trailing '=' ("-n=") also consumes the argument after it. Flags starting
+// with '/' match case-insensitively, and '*' in a flag matches any run of
+// bytes ("!*=*": no argument is an assignment). Template placeholders:
+//   $0       the source token as typed      $1..$9  remaining arguments
+//   $*       remaining arguments            $@      the argument string as typed
+//   ${last}  last remaining argument        ${-n}   value of flag pattern "-n="
+//   ${*:-x}  remaining arguments, or x when there are none
+//   $$       a literal '$'
+// Matched flags are removed from the remaining arguments. Rules override the
+// built-in table; for one token the rule with the most patterns wins, then
+// file order.
+//
+// At load time rules are compiled into a flat array grouped by token with a
+// perfect hash over the tokens, and the compiled form is written next to the
+// rule file as <file>.bin so later startups skip parsing.
+
+#define RULE_L2W 0
+#define RULE_W2L 1
+#define RULE_MAX_ARGS 64
+
+struct rule {
+    uint32_t token;     // offsets into the string pool
+    uint32_t flags;     // nflags NUL-terminated patterns, back to back
+    uint32_t tmpl;
+    uint32_t nflags;
+};
+
+struct rule_group {
+    uint64_t hash;      // token hash under the set's phash seed
+    uint32_t token;
+    uint32_t first;     // index of the first rule for this token
+    uint32_t count;
+    uint32_t pad;
+};
+
+struct ruleset {
+    struct rule *rules;
+    struct rule_group *groups;
+    uint32_t nrules, ngroups;
+    struct phash ph;
+};
+
+struct rule_db {
+    char *pool;
+    uint32_t pool_len;
+    struct ruleset set[2];
+    char *blob;         // backing block when loaded from the binary cache
+    int loaded;
+};
+
+static struct rule_db rules;
+
+#define RULE_CACHE_MAGIC "CUSTRUL\001"
+#define RULE_CACHE_VERSION 2
+#define RULE_CACHE_SEED 0x637573746172642eULL
+#define RULE_CACHE_MAX (1u << 24) // sanity bound on every count in the header
+
+struct rule_cache_hdr {
+    char magic[8];
+    uint32_t version, pool_len;
+    int64_t src_size;
+    uint64_t src_hash;  // hash_bytes of the rule text: edits invalidate the cache whatever the mtime
+    struct { uint32_t nrules, ngroups, nbuckets, mask; uint64_t seed; } set[2];
+};
+
+static size_t align8(size_t n){ return (n + 7) & ~(size_t)7; }
+
+static void rules_free(struct rule_db *db){
+    if(db->blob){
+        free(db->blob);
+    } else {
+        free(db->pool);
+        for(int d=0;d<2;d++){
+            free(db->set[d].rules); free(db->set[d].groups);
+            phash_free(&db->set[d].ph);
+        }
+    }
+    memset(db, 0, sizeof(*db));
+}
+
+struct pool_buf { char *p; uint32_t len, cap; };
+
+static uint32_t pool_add(struct pool_buf *pb, const char *s, size_t n){
+    if(pb->len + n + 1 > pb->cap){
+        uint32_t cap = pb->cap ? pb->cap : 4096;
+        while(pb->len + n + 1 > cap) cap *= 2;
+        char *np = realloc(pb->p, cap);
+        if(!np){ fprintf(stderr, "rules: out of memory\n"); exit(1); }
+        pb->p = np; pb->cap = cap;
+    }
+    uint32_t off = pb->len;
+    memcpy(pb->p + off, s, n);
+    pb->p[off + n] = 0;
+    pb->len += (uint32_t)n + 1;
+    return off;
+}
+
+struct parsed_rule { struct rule r; uint32_t dir, order; };
+
+static const char *sort_pool;
+
+static int cmp_parsed_rule(const void *a, const void *b){
+    const struct parsed_rule *x = a, *y = b;
+    int c = strcmp(sort_pool + x->r.token, sort_pool + y->r.token);
+    if(c) return c;
+    if(x->r.nflags != y->r.nflags) return x->r.nflags > y->r.nflags ? -1 : 1;
+    return x->order < y->order ? -1 : (x->order > y->order);
+}
+
+// Group sorted rules by token and build the token perfect hash.
+static int ruleset_build(struct ruleset *rs, const char *pool, struct parsed_rule *pr, uint32_t n){
+    memset(rs, 0, sizeof(*rs));
+    rs->rules = malloc(sizeof(struct rule) * (n ? n : 1));
+    rs->groups = malloc(sizeof(struct rule_group) * (n ? n : 1));
+    if(!rs->rules || !rs->groups) return -1;
+    for(uint32_t i=0;i<n;i++){
+        rs->rules[i] = pr[i].r;
+        if(i == 0 || strcmp(pool + pr[i].r.token, pool + pr[i-1].r.token) != 0){
+            struct rule_group *g = &rs->groups[rs->ngroups++];
+            memset(g, 0, sizeof(*g));
+            g->token = pr[i].r.token; g->first = i;
+        }
+        rs->groups[rs->ngroups-1].count++;
+    }
+    rs->nrules = n;
+    const char **keys = malloc(sizeof(char*) * (rs->ngroups ? rs->ngroups : 1));
+    if(!keys) return -1;
+    for(uint32_t g=0; g<rs->ngroups; g++) keys[g] = pool + rs->groups[g].token;
+    int rc = phash_build(&rs->ph, keys, rs->ngroups);
+    free(keys);
+    if(rc != 0) return -1;
+    for(uint32_t g=0; g<rs->ngroups; g++){
+        const char *t = pool + rs->groups[g].token;
+        rs->groups[g].hash = hash_bytes(t, strlen(t), rs->ph.seed);
+    }
+    return 0;
+}
+
+// Parse rule text into db. Bad lines are reported and skipped.
+static int rules_parse(struct rule_db *db, const char *text, size_t len, const char *path){
+    struct pool_buf pb = {0};
+    struct parsed_rule *pr = NULL;
+    uint32_t npr = 0, cap = 0;
+    int lineno = 0;
+    const char *p = text, *end = text + len;
+    pool_add(&pb, "", 0); // offset 0 is the empty string
+
+    while(p < end){
+        const char *eol = memchr(p, '\n', end - p);
+        if(!eol) eol = end;
+        lineno++;
+        const char *l = p, *le = eol;
+        p = eol < end ? eol + 1 : end;
+        while(l < le && isspace((unsigned char)*l)) l++;
+        while(le > l && isspace((unsigned char)le[-1])) le--;
+        if(l == le || *l == '#') continue;
+
+        const char *arrow = NULL;
+        for(const char *q=l; q+1<le; q++) if(q[0]=='=' && q[1]=='>'){ arrow = q; break; }
+        if(!arrow){ fprintf(stderr, "%s:%d: missing '=>'\n", path, lineno); continue; }
+
+        // left side: direction, token, flag patterns
+        const char *words[RULE_MAX_ARGS]; size_t wlen[RULE_MAX_ARGS]; int nw = 0;
+        for(const char *q=l; q<arrow && nw<RULE_MAX_ARGS; ){
+            while(q < arrow && isspace((unsigned char)*q)) q++;
+            if(q >= arrow) break;
+            words[nw] = q;
+            while(q < arrow && !isspace((unsigned char)*q)) q++;
+            wlen[nw] = q - words[nw]; nw++;
+        }
+        int dir;
+        if(nw >= 1 && wlen[0]==3 && strncmp(words[0],"l2w",3)==0) dir = RULE_L2W;
+        else if(nw >= 1 && wlen[0]==3 && strncmp(words[0],"w2l",3)==0) dir = RULE_W2L;
+        else { fprintf(stderr, "%s:%d: expected 'l2w' or 'w2l'\n", path, lineno); continue; }
+        if(nw < 2 || wlen[1] >= MAX_TOK){ fprintf(stderr, "%s:%d: missing source token\n", path, lineno); continue; }
+
+        const char *t = arrow + 2;
+        while(t < le && isspace((unsigned char)*t)) t++;
+
+        if(npr == cap){
+            cap = cap ? cap*2 : 64;
+            struct parsed_rule *np = realloc(pr, sizeof(*pr) * cap);
+            if(!np){ fprintf(stderr, "rules: out of memory\n"); exit(1); }
+            pr = np;
+        }
+        struct parsed_rule *r = &pr[npr];
+        char tok_lc[MAX_TOK];
+        for(size_t i=0;i<wlen[1];i++) tok_lc[i] = tolower((unsigned char)words[1][i]);
+        r->r.token = pool_add(&pb, tok_lc, wlen[1]);
+        r->r.nflags = nw - 2;
+        r->r.flags = pb.len;
+        for(int i=2;i<nw;i++) pool_add(&pb, words[i], wlen[i]);
+        if(nw == 2) r->r.flags = 0;
+        r->r.tmpl = pool_add(&pb, t, le - t);
+        r->dir = dir; r->order = npr;
+        npr++;
+    }
+
+    db->pool = pb.p; db->pool_len = pb.len;
+    sort_pool = db->pool;
+    qsort(pr, npr, sizeof(*pr), cmp_parsed_rule);
+    // stable partition by direction keeps the sort order inside each set
+    uint32_t nl2w = 0;
+    struct parsed_rule *tmp = malloc(sizeof(*pr) * (npr ? npr : 1));
+    if(!tmp){ fprintf(stderr, "rules: out of memory\n"); exit(1); }
+    for(uint32_t i=0;i<npr;i++) if(pr[i].dir == RULE_L2W) tmp[nl2w++] = pr[i];
+    uint32_t k = nl2w;
+    for(uint32_t i=0;i<npr;i++) if(pr[i].dir == RULE_W2L) tmp[k++] = pr[i];
+    int rc = 0;
+    if(ruleset_build(&db->set[RULE_L2W], db->pool, tmp, nl2w) != 0 ||
+       ruleset_build(&db->set[RULE_W2L], db->pool, tmp + nl2w, npr - nl2w) != 0) rc = -1;
+    free(tmp); free(pr);
+    return rc;
+}
+
+static void rules_cache_path(const char *path, char *out, size_t n){
+    snprintf(out, n, "%s.bin", path);
+}
+
+static void rules_write_cache(const struct rule_db *db, const char *path, int64_t src_size, uint64_t src_hash){
+    char cpath[MAX_LINE+8], tpath[MAX_LINE+16];
+    rules_cache_path(path, cpath, sizeof(cpath));
+    snprintf(tpath, sizeof(tpath), "%s.tmp", cpath);
+    FILE *f = fopen(tpath, "wb");
+    if(!f) return; // read-only location: just parse next time
+    struct rule_cache_hdr h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RULE_CACHE_MAGIC, 8);
+    h.version = RULE_CACHE_VERSION;
+    h.pool_len = db->pool_len;
+    h.src_size = src_size; h.src_hash = src_hash;
+    for(int d=0;d<2;d++){
+        const struct ruleset *rs = &db->set[d];
+        h.set[d].nrules = rs->nrules; h.set[d].ngroups = rs->ngroups;
+        h.set[d].nbuckets = rs->ph.nbuckets; h.set[d].mask = rs->ph.mask; h.set[d].seed = rs->ph.seed;
+    }
+    static const char zeros[8];
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && fwrite(db->pool, 1, db->pool_len, f) == db->pool_len;
+    ok = ok && fwrite(zeros, 1, align8(db->pool_len) - db->pool_len, f) == align8(db->pool_len) - db->pool_len;
+    for(int d=0; d<2 && ok; d++){
+        const struct ruleset *rs = &db->set[d];
+        size_t nd = sizeof(uint32_t) * rs->ph.nbuckets, ns = sizeof(int32_t) * (rs->ph.mask + 1);
+        ok = fwrite(rs->rules, sizeof(struct rule), rs->nrules, f) == rs->nrules;
+        ok = ok && fwrite(rs->groups, sizeof(struct rule_group), rs->ngroups, f) == rs->ngroups;
+        ok = ok && fwrite(rs->ph.disp, 1, nd, f) == nd;
+        ok = ok && fwrite(zeros, 1, align8(nd) - nd, f) == align8(nd) - nd;
+        ok = ok && fwrite(rs->ph.slots, 1, ns, f) == ns;
+        ok = ok && fwrite(zeros, 1, align8(ns) - ns, f) == align8(ns) - ns;
+    }
+    if(fclose(f) != 0) ok = 0;
+    if(!ok || rename(tpath, cpath) != 0) remove(tpath);
+}
+
+// Every offset and index in a mapped cache must stay inside it: the file may
+// be truncated, stale or simply not ours.
+static int rules_cache_valid(const struct rule_db *db){
+    if(db->pool_len == 0 || db->pool[db->pool_len - 1] != 0) return 0; // strings can't run off the end
+    for(int d=0;d<2;d++){
+        const struct ruleset *rs = &db->set[d];
+        for(uint32_t i=0;i<rs->nrules;i++){
+            const struct rule *r = &rs->rules[i];
+            if(r->token >= db->pool_len || r->tmpl >= db->pool_len || r->flags >= db->pool_len ||
+               r->nflags > RULE_MAX_ARGS) return 0;
+            uint32_t off = r->flags;
+            for(uint32_t k=0;k<r->nflags;k++, off += (uint32_t)strlen(db->pool + off) + 1)
+                if(off >= db->pool_len) return 0;
+        }
+        for(uint32_t g=0;g<rs->ngroups;g++){
+            const struct rule_group *gr = &rs->groups[g];
+            if(gr->token >= db->pool_len || gr->first > rs->nrules || gr->count > rs->nrules - gr->first) return 0;
+        }
+        for(size_t k=0;k<=rs->ph.mask;k++)
+            if(rs->ph.slots[k] < -1 || (rs->ph.slots[k] >= 0 && (uint32_t)rs->ph.slots[k] >= rs->ngroups)) return 0;
+    }
+    return 1;
+}
+
+// Map a compiled cache into db when it matches the rule text. Returns 0 on success.
+static int rules_read_cache(struct rule_db *db, const char *path, int64_t src_size, uint64_t src_hash){
+    char cpath[MAX_LINE+8];
+    rules_cache_path(path, cpath, sizeof(cpath));
+    FILE *f = fopen(cpath, "rb");
+    if(!f) return -1;
+    struct rule_cache_hdr h;
+    struct stat cst;
+    char *blob = NULL;
+    if(fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, RULE_CACHE_MAGIC, 8) != 0 ||
+       h.version != RULE_CACHE_VERSION || h.src_size != src_size || h.src_hash != src_hash ||
+       h.pool_len > RULE_CACHE_MAX || fstat(fileno(f), &cst) != 0) goto fail;
+    size_t total = align8(h.pool_len);
+    for(int d=0;d<2;d++){
+        if(h.set[d].nrules > RULE_CACHE_MAX || h.set[d].ngroups > RULE_CACHE_MAX || h.set[d].nbuckets == 0 ||
+           h.set[d].nbuckets > RULE_CACHE_MAX || h.set[d].mask >= RULE_CACHE_MAX || (h.set[d].mask & (h.set[d].mask + 1)))
+            goto fail;
+        total += sizeof(struct rule) * h.set[d].nrules + sizeof(struct rule_group) * h.set[d].ngroups;
+        total += align8(sizeof(uint32_t) * h.set[d].nbuckets) + align8(sizeof(int32_t) * ((size_t)h.set[d].mask + 1));
+    }
+    if((uint64_t)cst.st_size != sizeof(h) + total) goto fail; // truncated, or trailing bytes
+    blob = malloc(total ? total : 1);
+    if(!blob || fread(blob, 1, total, f) != total) goto fail;
+    fclose(f);
+
+    char *p = blob;
+    db->blob = blob;
+    db->pool = p; db->pool_len = h.pool_len; p += align8(h.pool_len);
+    for(int d=0;d<2;d++){
+        struct ruleset *rs = &db->set[d];
+        rs->nrules = h.set[d].nrules; rs->ngroups = h.set[d].ngroups;
+        rs->rules = (struct rule*)p; p += sizeof(struct rule) * rs->nrules;
+        rs->groups = (struct rule_group*)p; p += sizeof(struct rule_group) * rs->ngroups;
+        rs->ph.nbuckets = h.set[d].nbuckets; rs->ph.mask = h.set[d].mask; rs->ph.seed = h.set[d].seed;
+        rs->ph.disp = (uint32_t*)p; p += align8(sizeof(uint32_t) * rs->ph.nbuckets);
+        rs->ph.slots = (int32_t*)p; p += align8(sizeof(int32_t) * ((size_t)rs->ph.mask + 1));
+    }
+    if(!rules_cache_valid(db)){
+        memset(db, 0, sizeof(*db));
+        free(blob);
+        return -1;
+    }
+    return 0;
+fail:
+    free(blob);
+    fclose(f);
+    return -1;
+}
+
+// Load a rule file, preferring its compiled cache. Returns 0 on success.
+static int rules_load(struct rule_db *db, const char *path, int *from_cache){
+    struct stat st;
+    rules_free(db);
+    *from_cache = 0;
+    if(stat(path, &st) != 0) return -1;
+    // the text is read either way: hashing it is cheap next to parsing it
+    FILE *f = fopen(path, "rb");
+    if(!f) return -1;
+    char *text = malloc(st.st_size ? st.st_size : 1);
+    size_t got = text ? fread(text, 1, st.st_size, f) : 0;
+    fclose(f);
+    if(!text) return -1;
+    uint64_t hash = hash_bytes(text, got, RULE_CACHE_SEED);
+    if(rules_read_cache(db, path, (int64_t)got, hash) == 0){
+        free(text);
+        *from_cache = 1;
+        db->loaded = 1;
+        return 0;
+    }
+    int rc = rules_parse(db, text, got, path);
+    free(text);
+    if(rc != 0){ rules_free(db); return -1; }
+    db->loaded = 1;
+    rules_write_cache(db, path, (int64_t)got, hash);
+    return 0;
+}
+
+static const struct rule_group *rules_find(const struct rule_db *db, int dir, const char *tok, size_t n){
+    const struct ruleset *rs = &db->set[dir];
+    if(!rs->ph.slots) return NULL;
+    uint64_t h = hash_bytes_lc(tok, n, rs->ph.seed);
+    int32_t g = phash_probe(&rs->ph, h);
+    if(g < 0 || rs->groups[g].hash != h || !view_ieq(tok, n, db->pool + rs->groups[g].token)) return NULL;
+    return &rs->groups[g];
+}
+
+static int flag_eq(const char *pat, size_t n, const char *arg, size_t argn){
+    if(memchr(pat, '*', n)){ // wildcard: '*' matches any run of bytes
+        int fold = pat[0] == '/';
+        size_t pi = 0, ai = 0, star = (size_t)-1, mark = 0;
+        while(ai < argn){
+            if(pi < n && pat[pi] == '*'){ star = pi++; mark = ai; }
+            else if(pi < n && (fold ? tolower((unsigned char)pat[pi]) == tolower((unsigned char)arg[ai]) : pat[pi] == arg[ai])){ pi++; ai++; }
+            else if(star != (size_t)-1){ pi = star + 1; ai = ++mark; }
+            else return 0;
+        }
+        while(pi < n && pat[pi] == '*') pi++;
+        return pi == n;
+    }
+    if(argn != n) return 0;
+    if(pat[0] == '/'){
+        for(size_t i=0;i<n;i++) if(tolower((unsigned char)pat[i]) != tolower((unsigned char)arg[i])) return 0;
+        return 1;
+    }
+    return strncmp(pat, arg, n) == 0;
+}
+
+// Try the rules for the command tk[0] of line, with arguments tk[1..nt).
+// Appends the translation to out and returns 1, or returns 0 if no rule matched.
+// More than RULE_MAX_ARGS arguments are held in scratch (NULL: no rule applies).
+static int rules_apply(const struct rule_db *db, int dir, const char *line, const struct tok *tk, size_t nt, struct sbuf *out,
+                       struct arena *scratch){
+    if(!db->loaded) return 0;
+    size_t first_n;
+    const char *first = tok_word(line, &tk[0], &first_n);
+    const struct rule_group *g = rules_find(db, dir, first, first_n);
+    if(!g) return 0;
+
+    const char *rest = nt > 1 ? line + tk[1].off : "";
+    size_t rest_n = nt > 1 ? tk[nt-1].off + tk[nt-1].len - tk[1].off : 0;
+    const char *argv_buf[RULE_MAX_ARGS], *rem_buf[RULE_MAX_ARGS];
+    size_t argl_buf[RULE_MAX_ARGS], reml_buf[RULE_MAX_ARGS];
+    char used_buf[RULE_MAX_ARGS];
+    const char **argv = argv_buf, **remaining = rem_buf;
+    size_t *argl = argl_buf, *reml = reml_buf;
+    char *used = used_buf;
+    if(nt > RULE_MAX_ARGS + 1){ // every operand must reach the template
+        size_t na = nt - 1;
+        if(!scratch) return 0;
+        argv = arena_alloc(scratch, na * sizeof(*argv));
+        remaining = arena_alloc(scratch, na * sizeof(*remaining));
+        argl = arena_alloc(scratch, na * sizeof(*argl));
+        reml = arena_alloc(scratch, na * sizeof(*reml));
+        used = arena_alloc(scratch, na);
+        if(!argv || !remaining || !argl || !reml || !used) return 0;
+    }
+    int argc = 0;
+    for(size_t k=1; k<nt; k++, argc++){
+        argv[argc] = line + tk[k].off;
+        argl[argc] = tk[k].len;
+    }
+
+    for(uint32_t ri = g->first; ri < g->first + g->count; ri++){
+        const struct rule *r = &db->set[dir].rules[ri];
+        memset(used, 0, (size_t)argc);
+        const char *pat = db->pool + r->flags;
+        int ok = 1;
+        for(uint32_t fi=0; fi<r->nflags && ok; fi++, pat += strlen(pat) + 1){
+            int neg = pat[0] == '!';
+            const char *pp = pat + neg;
+            size_t pn = strlen(pp);
+            int takes_value = pn > 1 && pp[pn-1] == '=';
+            if(takes_value) pn--;
+            int found = -1;
+            for(int a=0;a<argc;a++) if(!used[a] && flag_eq(pp, pn, argv[a], argl[a])){ found = a; break; }
+            if(neg){ if(found >= 0) ok = 0; continue; }
+            if(found < 0 || (takes_value && found + 1 >= argc)){ ok = 0; continue; }
+            used[found] = 1;
+            if(takes_value) used[found+1] = 2;
+        }
+        if(!ok) continue;
+
+        int nrem = 0;
+        for(int a=0;a<argc;a++) if(!used[a]){ remaining[nrem] = argv[a]; reml[nrem++] = argl[a]; }
+
+        #define RULE_PUT(s, n) sb_put(out, (s), (n))
+        for(const char *t = db->pool + r->tmpl; *t; ){
+            if(*t != '$'){ const char *d = strchr(t, '$'); size_t n = d ? (size_t)(d - t) : strlen(t); RULE_PUT(t, n); t += n; continue; }
+            t++;
+            if(*t == '$'){ RULE_PUT("$", 1); t++; }
+            else if(*t == '0'){ RULE_PUT(first, first_n); t++; }
+            else if(*t >= '1' && *t <= '9'){ int k = *t - '1'; if(k < nrem) RULE_PUT(remaining[k], reml[k]); t++; }
+            else if(*t == '*'){ for(int k=0;k<nrem;k++){ if(k) RULE_PUT(" ", 1); RULE_PUT(remaining[k], reml[k]); } t++; }
+            else if(*t == '@'){ RULE_PUT(rest, rest_n); t++; }
+            else if(*t == '{'){
+                const char *close = strchr(t, '}');
+                if(!close){ RULE_PUT("${", 2); t++; continue; }
+                size_t n = close - t - 1;
+                if(n == 4 && strncmp(t+1, "last", 4)==0){
+                    if(nrem) RULE_PUT(remaining[nrem-1], reml[nrem-1]);
+                } else if(n >= 3 && strncmp(t+1, "*:-", 3)==0){
+                    if(!nrem) RULE_PUT(t + 4, n - 3);
+                    for(int k=0;k<nrem;k++){ if(k) RULE_PUT(" ", 1); RULE_PUT(remaining[k], reml[k]); }
+                } else {
+                    for(int a=0;a+1<argc;a++)
+                        if(used[a] == 1 && used[a+1] == 2 && flag_eq(t+1, n, argv[a], argl[a])){ RULE_PUT(argv[a+1], argl[a+1]); break; }
+                }
+                t = close + 1;
+            } else RULE_PUT("$", 1);
+        }
+        #undef RULE_PUT
+        return 1;
+    }
+    return 0;
+}
+
+// Rule file: --rules FILE, else $CUSTARD_RULES, else ~/.custard.rules when present.
+static void init_rules(const char *path, int quiet){
+    char buf[MAX_LINE];
+    int explicit_path = path != NULL;
+    if(!path) path = getenv("CUSTARD_RULES");
+    if(path) explicit_path = 1;
+    if(!path){
+        const char *home = getenv(HOST_IS_WINDOWS ? "USERPROFILE" : "HOME");
+        if(!home) return;
+        snprintf(buf, sizeof(buf), "%s/.custard.rules", home);
+        path = buf;
+    }
+    int from_cache;
+    if(rules_load(&rules, path, &from_cache) != 0){
+        if(explicit_path) fprintf(stderr, "Could not load rules from %s\n", path);
+        return;
+    }
+    if(!quiet)
+        printf("Loaded %u translation rules from %s%s\n", rules.set[0].nrules + rules.set[1].nrules,
+               path, from_cache ? " (compiled cache)" : "");
+}
+
+// Build command mapping for one pipeline stage: the nt tokens at t, viewed in line.
+// The translation is appended to out; scratch holds temporary argument copies.
+// source_is_windows: dialect user types. host_is_windows: current platform.
+static void map_command(const char *line, const struct tok *t, size_t nt, int source_is_windows, int host_is_windows,
+                        struct sbuf *out, struct arena *scratch){
+    const char *input = line + t[0].off;
+    size_t input_n = t[nt-1].off + t[nt-1].len - t[0].off;
+    // If same dialect as host, return copy
+    if(source_is_windows == host_is_windows){ sb_put(out, input, input_n); return; }
+
+    // We'll attempt best-effort map: change first token and common flags/subpatterns.
+    // first and rest are views into line; neither is NUL-terminated.
+    size_t first_n;
+    const char *first = tok_word(line, &t[0], &first_n);
+    const char *rest = nt > 1 ? line + t[1].off : "";
+    size_t rest_n = nt > 1 ? t[nt-1].off + t[nt-1].len - t[1].off : 0;
+
+    // Rule files take precedence over the built-in table
+    if(rules_apply(&rules, source_is_windows ? RULE_W2L : RULE_L2W, line, t, nt, out, scratch)) return;
+
+    size_t base = out->len; // this stage's output starts here
+
+    // Helper macros to set the mapped output easily
+    #define SETM(fmt,...) do{ out->len = base; sb_printf(out, fmt, ##__VA_ARGS__); } while(0)
+    #define APPREST() do{ if(rest_n){ if(out->len > base) sb_putc(out, ' '); sb_put(out, rest, rest_n); } } while(0)
+    #define HAS(lit) (view_find(rest, rest_n, (lit)) != NULL)
+    #define REST_DUP() arena_strndup(scratch, rest, rest_n)
+
+    // Linux -> Windows mappings
+    if(!source_is_windows && host_is_windows){
+        switch(dispatch_lookup(&l2w_dispatch, first, first_n)){
+        // Most common
+        case L2W_PWD: SETM("cd"); return;
+        case L2W_LS: {
+            // handle flags in rest: -l, -a
+            if(HAS("-l") && HAS("-a")){ SETM("dir /a /q"); APPREST(); return; }
+            if(HAS("-l")){ SETM("dir"); APPREST(); return; }
+            if(HAS("-a")){ SETM("dir /a"); APPREST(); return; }
+            SETM("dir"); APPREST(); return;
+        }
+        case L2W_MKDIR: SETM("mkdir"); APPREST(); return;
+        case L2W_RMDIR: SETM("rmdir"); APPREST(); return;
+        case L2W_RM: {
+            // rm -r <dir>
+            if(HAS("-r") || HAS("-rf")){ // rmdir /s /q
+                // remove -r from rest to get target
+                char *args = REST_DUP(); if(!args) return;
+                replace_first(args, "-r", ""); replace_first(args, "-rf", "");
+                SETM("rmdir /s /q"); if(*args){ sb_putc(out, ' '); sb_puts(out, args); } return;
+            } else {
+                SETM("del"); APPREST(); return;
+            }
+        }
+        case L2W_TOUCH: {
+            // type nul > file
+            if(rest_n){
+                char *args = REST_DUP(); if(!args) return;
+                SETM("type nul >"); sb_puts(out, " "); sb_puts(out, args); return;
+            } else { sb_puts(out, "rem touch: missing filename"); return; }
+        }
+        case L2W_CP: SETM("copy"); APPREST(); return;
+        case L2W_MV: SETM("move"); APPREST(); return;
+        case L2W_CAT: SETM("type"); APPREST(); return;
+        case L2W_LESS: SETM("more"); APPREST(); return;
+        case L2W_HEAD: {
+            // head -n N file -> powershell Get-Content file -TotalCount N
+            char *r = REST_DUP(); if(!r) return;
+            char *nptr = strstr(r, "-n");
+            if(nptr){
+                int N;
+                if(sscanf(nptr, "-n %d", &N)==1){
+                    // attempt to extract file: simple heuristic, last whitespace separated token
+                    char *last = strrchr(r, ' ');
+                    const char *file = last ? last+1 : r;
+                    SETM("powershell -Command \"Get-Content %s -TotalCount %d\"", file, N);
+                    return;
+                }
+            }
+            // fallback: more +N not reliable; use head via PowerShell reading first lines
+            if(rest_n){ SETM("powershell -Command \"Get-Content %s -TotalCount 10\"", r); return; }
+            SETM("more"); return;
+        }
+        case L2W_TAIL: {
+            // tail -f -> powershell Get-Content -Wait; tail -n -> Get-Content -Tail
+            if(HAS("-f") || HAS("-F")){
+                // extract filename
+                char *temp = REST_DUP(); if(!temp) return;
+                replace_first(temp, "-f", ""); replace_first(temp, "-F", "");
+                trim(temp);
+                SETM("powershell -Command \"Get-Content %s -Wait\"", temp);
+                return;
+            }
+            const char *nptr = view_find(rest, rest_n, "-n");
+            if(nptr){
+                int N;
+                char *temp = REST_DUP(); if(!temp) return;
+                if(sscanf(temp + (nptr - rest), "-n %d", &N)==1){
+                    // remove -n ... to get filename
+                    char *fn = NULL;
+                    for(char *p = temp; *p; p++) if(*p != ' ' && (p == temp || p[-1] == ' ')) fn = p;
+                    if(fn){ SETM("powershell -Command \"Get-Content %s -Tail %d\"", fn, N); return; }
+                }
+            }
+            SETM("powershell -Command \"Get-Content "); APPREST(); sb_puts(out, " -Tail 10\""); return;
+        }
+        case L2W_CHMOD: SETM("rem chmod not supported on Windows; use icacls or powershell Set-Acl"); APPREST(); return;
+        case L2W_CHOWN: SETM("rem chown not supported on Windows; use icacls"); APPREST(); return;
+        case L2W_WHOAMI: SETM("whoami"); return;
+        case L2W_UNAME: SETM("systeminfo"); APPREST(); return;
+        case L2W_HOSTNAME: SETM("hostname"); return;
+        case L2W_DATE: SETM("date /t"); return;
+        case L2W_UPTIME: SETM("net statistics workstation"); return;
+        case L2W_DF: {
+            // df -h -> wmic logicaldisk get size,freespace,caption (legacy)
+            SETM("wmic logicaldisk get caption,freespace,size"); return;
+        }
+        case L2W_DU: {
+            // du -sh dir -> powershell Get-ChildItem dir -Recurse | Measure-Object -Property Length -Sum
+            char *target = REST_DUP(); if(!target) return;
+            if(rest_n){
+                SETM("powershell -Command \"(Get-ChildItem -Recurse %s | Measure-Object -Property Length -Sum).Sum\"", target);
+                return;
+            } else { SETM("rem du needs directory"); return; }
+        }
+        case L2W_FREE: SETM("systeminfo | findstr /C:\"Total Physical Memory\" /C:\"Available\""); return;
+        case L2W_TOP: {
+            SETM("tasklist"); return;
+        }
+        case L2W_PS: {
+            if(HAS("aux")){ SETM("tasklist"); return; }
+            SETM("tasklist"); APPREST(); return;
+        }
+        case L2W_KILL: {
+            // kill -9 pid -> taskkill /PID pid /F
+            if(HAS("-9")){
+                char *args = REST_DUP(); if(!args) return;
+                replace_first(args,"-9","");
+                trim(args);
+                SETM("taskkill /PID %s /F", args);
+                return;
+            } else {
+                char *args = REST_DUP(); if(!args) return;
+                SETM("taskkill /PID %s", args);
+                return;
+            }
+        }
+        case L2W_JOBS: {
+            SETM("rem job control not supported on Windows; use powershell background jobs or task manager"); APPREST(); return;
+        }
+        case L2W_PING: SETM("ping"); APPREST(); return;
+        case L2W_CURL: SETM("curl"); APPREST(); return;
+        case L2W_WGET: {
+            SETM("curl -O"); APPREST(); return;
+        }
+        case L2W_IP:
+            if(!HAS("addr")) break;
+            // fall through
+        case L2W_IFCONFIG: {
+            SETM("ipconfig /all"); return;
+        }
+        case L2W_NETSTAT: {
+            // netstat -tulnp -> netstat -ano
+            SETM("netstat -ano"); APPREST(); return;
+        }
+        case L2W_SSH: { SETM("ssh"); APPREST(); return; } // Windows 10+ may have ssh
+        case L2W_SCP: { SETM("scp"); APPREST(); return; } // requires installed scp
+        // package managers: apt/dnf/pacman -> not supported
+        case L2W_SUDO: {
+            // remove sudo on Windows; try to run via powershell start-process -Verb runAs for elevation is complex; we'll strip it
+            if(rest_n) sb_put(out, rest, rest_n);
+            else sb_puts(out, "rem sudo with no command");
+            return;
+        }
+        case L2W_APT: {
+            SETM("rem Package manager commands are not supported on Windows; consider using WSL or equivalent"); APPREST(); return;
+        }
+        case L2W_ADDUSER: {
+            SETM("rem User management must be done via Control Panel or net user on Windows"); APPREST(); return;
+        }
+        case L2W_WHO: {
+            SETM("whoami"); APPREST(); return;
+        }
+        case L2W_TAR: {
+            // many forms: tar -czvf file.tar.gz dir/ -> use tar if Windows has tar.exe or use powershell Compress-Archive
+            if(HAS("-czvf") || HAS("-czf")){
+                // find archive name and dir
+                // fallback to using tar if available
+                SETM("tar"); APPREST(); return;
+            }
+            SETM("tar"); APPREST(); return;
+        }
+        case L2W_ZIP: {
+            // Windows: use powershell Compress-Archive or Expand-Archive
+            if(view_ieq(first, first_n, "zip")){
+                SETM("powershell -Command \"Compress-Archive -Path"); APPREST(); sb_puts(out, "\""); return;
+            } else {
+                SETM("powershell -Command \"Expand-Archive -Path"); APPREST(); sb_puts(out, "\""); return;
+            }
+        }
+        case L2W_HISTORY: SETM("rem history shown by this terminal"); return;
+        case L2W_CLEAR: SETM("cls"); return;
+        case L2W_BANG: { // handled outside
+            sb_puts(out, "!!"); return;
+        }
+        default:
+            break;
+        }
+        if(first[0]=='!'){ // !n handled outside
+            sb_put(out, input, input_n); return;
+        }
+
+        // default fallback: try to run via bash on Windows if available (WSL) else run raw
+        // We'll attempt to run original in PowerShell by wrapping: bash -lc "input"
+        // But since host_is_windows, we will try to run via bash -c if WSL present:
+        SETM("bash -lc \"%.*s\"", (int)input_n, input);
+        return;
+    }
+
+    // Windows -> Linux mappings
+    if(source_is_windows && !host_is_windows){
+        switch(dispatch_lookup(&w2l_dispatch, first, first_n)){
+        case W2L_DIR: {
+            // map flags /a etc roughly
+            SETM("ls"); APPREST(); return;
+        }
+        case W2L_TYPE: SETM("cat"); APPREST(); return;
+        case W2L_COPY: SETM("cp"); APPREST(); return;
+        case W2L_MOVE: SETM("mv"); APPREST(); return;
+        case W2L_DEL: SETM("rm"); APPREST(); return;
+        case W2L_RMDIR: SETM("rm -r"); APPREST(); return;
+        case W2L_MKDIR: SETM("mkdir"); APPREST(); return;
+        case W2L_CLS: SETM("clear"); return;
+        case W2L_WHOAMI: SETM("whoami"); return;
+        case W2L_SYSTEMINFO: SETM("uname -a"); APPREST(); return;
+        case W2L_HOSTNAME: SETM("hostname"); return;
+        case W2L_DATE: SETM("date"); return;
+        case W2L_NETSTAT: SETM("netstat -tulnp"); APPREST(); return;
+        case W2L_TASKLIST: SETM("ps aux"); APPREST(); return;
+        case W2L_TASKKILL: {
+            // taskkill /PID pid /F -> kill -9 pid
+            char *args = REST_DUP(); if(!args) return;
+            // try to find PID
+            char pid[MAX_TOK] = {0};
+            if(strstr(args,"/PID")){
+                char *p = strstr(args,"/PID")+4;
+                while(*p && isspace((unsigned char)*p)) p++;
+                int i=0;
+                while(*p && !isspace((unsigned char)*p) && i<MAX_TOK-1) pid[i++]=*p++;
+                pid[i]=0;
+                SETM("kill -9 %s", pid); return;
+            } else {
+                SETM("rem cannot map taskkill: check args"); APPREST(); return;
+            }
+        }
+        case W2L_IPCONFIG: SETM("ifconfig"); APPREST(); return;
+        case W2L_PING: SETM("ping"); APPREST(); return;
+        case W2L_CURL: SETM("curl"); APPREST(); return;
+        case W2L_SSH: SETM("ssh"); APPREST(); return;
+        case W2L_SCP: SETM("scp"); APPREST(); return;
+        case W2L_POWERSHELL: { // pass through but remove 'powershell -Command'
+            SETM("%.*s", (int)rest_n, rest); return;
+        }
+        case W2L_WMIC: {
+            SETM("df -h"); APPREST(); return;
+        }
+        case W2L_TAR: {
+            SETM("tar"); APPREST(); return;
+        }
+        case W2L_REM: {
+            // comment - do nothing
+            SETM("true"); return;
+        }
+        case W2L_HISTORY: { SETM("history"); return; } // history is handled in this terminal
+        case W2L_START: {
+            SETM("xdg-open"); APPREST(); return;
+        }
+        default:
+            break;
+        }
+        // fallback: return original
+        sb_put(out, input, input_n); return;
+    }
+
+    #undef SETM
+    #undef APPREST
+    #undef HAS
+    #undef REST_DUP
+
+    // default fallback
+    sb_put(out, input, input_n);
+}
+
+// ---- History expansion ----
+// Bash-style event designators (!! !n !-n !str !?str? !# and a leading
+// ^old^new^), word designators (:0 :n :^ :$ :% :x-y :x- :-y :* :x*, with the
+// colon optional before ^ $ * - %) and modifiers (:h :t :r :e :p :q
+// :s/old/new/ :gs/old/new/ :&), anywhere in the line outside single quotes.
+// !str goes through the prefix trie and !?str? through the substring index.
+
+static struct {
+    char old[MAX_TOK], repl[MAX_TOK]; // last :s substitution, for :&
+    int have_subst;
+    char match_word[MAX_LINE];        // word matched by the last !?str?, for %
+} hexp;
+
+#define HEXP_MAX_WORDS 256
+
+// Split into words as word designators see them: blanks separate, quotes
+// group, and runs of shell operator characters form words of their own.
+static int hist_words(const char *s, size_t *ws, size_t *we){
+    int n = 0;
+    size_t i = 0;
+    while(s[i] && n < HEXP_MAX_WORDS){
+        while(s[i] == ' ' || s[i] == '\t') i++;
+        if(!s[i]) break;
+        ws[n] = i;
+        if(strchr("|&;<>()", s[i])){
+            char op = s[i];
+            while(s[i] == op) i++;
+        } else {
+            char q = 0;
+            while(s[i] && (q || (s[i] != ' ' && s[i] != '\t' && !strchr("|&;<>()", s[i])))){
+                if(q){ if(s[i] == q) q = 0; }
+                else if(s[i] == '\'' || s[i] == '"') q = s[i];
+                else if(s[i] == '\\' && s[i+1]) i++;
+                i++;
+            }
+        }
+        we[n++] = i;
+    }
+    return n;
+}
+
+// Append len bytes to out; 0 when the result would not fit a command line.
+static int hexp_put(char *out, size_t *n, const char *s, size_t len){
+    if(*n + len >= MAX_LINE) return 0;
+    memcpy(out + *n, s, len);
+    *n += len;
+    out[*n] = 0;
+    return 1;
+}
+
+// Replace the first (or every, when global) occurrence of old in text;
+// 0 when old does not occur.
+static int hexp_subst(char *text, const char *old, const char *repl, int global){
+    size_t olen = strlen(old);
+    if(!olen || !strstr(text, old)) return 0;
+    char buf[MAX_LINE];
+    size_t n = 0;
+    const char *p = text, *m;
+    buf[0] = 0;
+    while((m = strstr(p, old))){
+        if(!hexp_put(buf, &n, p, m - p)) return 0;
+        for(const char *r = repl; *r; r++){ // & in the replacement stands for old
+            if(*r == '\\' && r[1] == '&'){ r++; if(!hexp_put(buf, &n, r, 1)) return 0; }
+            else if(*r == '&'){ if(!hexp_put(buf, &n, old, olen)) return 0; }
+            else if(!hexp_put(buf, &n, r, 1)) return 0;
+        }
+        p = m + olen;
+        if(!global) break;
+    }
+    if(!hexp_put(buf, &n, p, strlen(p))) return 0;
+    memcpy(text, buf, n + 1);
+    return 1;
+}
+
+// Parse a word designator at *pp (colon already consumed) and copy the chosen
+// words of ev into sel. Returns 0 on a bad specifier.
+static int hexp_words(const char **pp, const char *ev, char *sel){
+    size_t ws[HEXP_MAX_WORDS], we[HEXP_MAX_WORDS];
+    int nw = hist_words(ev, ws, we);
+    int last = nw - 1, from, to;
+    const char *p = *pp;
+    if(*p == '%'){
+        p++;
+        *pp = p;
+        if(!hexp.match_word[0]) return 0;
+        snprintf(sel, MAX_LINE, "%s", hexp.match_word);
+        return 1;
+    }
+    if(*p == '*'){ p++; from = 1; to = last; }
+    else {
+        if(*p == '^'){ p++; from = 1; }
+        else if(*p == '$'){ p++; from = last; }
+        else if(isdigit((unsigned char)*p)) from = (int)strtol(p, (char**)&p, 10);
+        else if(*p == '-') from = 0;
+        else return 0;
+        to = from;
+        if(*p == '*'){ p++; to = last; }
+        else if(*p == '-'){
+            p++;
+            if(*p == '$'){ p++; to = last; }
+            else if(isdigit((unsigned char)*p)) to = (int)strtol(p, (char**)&p, 10);
+            else to = last - 1;
+        }
+    }
+    *pp = p;
+    sel[0] = 0;
+    if(from > to) return from <= last + 1; // e.g. 1* on a one-word line is empty
+    if(from < 0 || to > last) return 0;
+    size_t n = we[to] - ws[from];
+    memcpy(sel, ev + ws[from], n);
+    sel[n] = 0;
+    return 1;
+}
+
+// Apply :h :t :r :e :p :q :s :gs :& modifiers at *pp to sel. Returns 1, 0 for
+// a malformed modifier, or -1 when a substitution found nothing to replace.
+static int hexp_modifiers(const char **pp, char *sel, int *print_only){
+    const char *p = *pp;
+    while(p[0] == ':' && p[1] && strchr("htrepqsg&", p[1])){
+        int global = 0;
+        p++;
+        if(*p == 'g' && (p[1] == 's' || p[1] == '&')){ global = 1; p++; }
+        char *slash, *dot;
+        switch(*p++){
+        case 'h':
+            if((slash = strrchr(sel, '/'))) *slash = 0;
+            break;
+        case 't':
+            if((slash = strrchr(sel, '/'))) memmove(sel, slash + 1, strlen(slash + 1) + 1);
+            break;
+        case 'r':
+            dot = strrchr(sel, '.');
+            if(dot && !strchr(dot, '/')) *dot = 0;
+            break;
+        case 'e':
+            dot = strrchr(sel, '.');
+            if(dot && !strchr(dot, '/')) memmove(sel, dot, strlen(dot) + 1);
+            else sel[0] = 0;
+            break;
+        case 'p':
+            *print_only = 1;
+            break;
+        case 'q': {
+            char buf[MAX_LINE];
+            size_t n = 0;
+            buf[0] = 0;
+            if(!hexp_put(buf, &n, "'", 1)) return 0;
+            for(const char *s = sel; *s; s++)
+                if(!(*s == '\'' ? hexp_put(buf, &n, "'\\''", 4) : hexp_put(buf, &n, s, 1))) return 0;
+            if(!hexp_put(buf, &n, "'", 1)) return 0;
+            memcpy(sel, buf, n + 1);
+            break;
+        }
+        case 's': {
+            char delim = *p;
+            if(!delim) return 0;
+            p++;
+            char *parts[2] = { hexp.old, hexp.repl };
+            for(int k=0;k<2;k++){
+                size_t n = 0;
+                while(*p && *p != delim){
+                    if(*p == '\\' && p[1] == delim) p++;
+                    if(n + 1 < MAX_TOK) parts[k][n++] = *p;
+                    p++;
+                }
+                parts[k][n] = 0;
+                if(*p == delim) p++;
+                else if(k == 0) return 0;
+            }
+            if(!hexp.old[0]) return 0;
+            hexp.have_subst = 1;
+            if(!hexp_subst(sel, hexp.old, hexp.repl, global)) return -1;
+            break;
+        }
+        case '&':
+            if(!hexp.have_subst) return 0;
+            if(!hexp_subst(sel, hexp.old, hexp.repl, global)) return -1;
+            break;
+        }
+    }
+    *pp = p;
+    return 1;
+}
+
+// Like bash_history_inhibit_expansion: a ! that is $! (last background pid),
+// ${!name} (indirection) or [!set] (a negated glob bracket) is not an event.
+static int hexp_inhibited(const char *cmd, const char *p){
+    if(p > cmd && p[-1] == '$') return 1;
+    if(p > cmd + 1 && p[-1] == '{' && p[-2] == '$') return 1;
+    if(p > cmd && p[-1] == '[' && strchr(p, ']')) return 1;
+    return 0;
+}
+
+// Expand history references in cmd. Returns a malloc'd line, or NULL after
+// printing an error; *print_only is set when a :p modifier was used. In the
+// cmd dialect ! is ordinary text (and delayed expansion, !var!), so only an
+// event at the very start of the line (!!, !n, !prefix) is expanded there.
+static char *expand_bang(const char *cmd, int windows, int *print_only){
+    char out[MAX_LINE], sel[MAX_LINE];
+    size_t n = 0;
+    int squote = 0, dquote = 0;
+    const char *p = cmd;
+    out[0] = 0;
+    *print_only = 0;
+
+    if(*p == '^' && !windows){ // ^old^new^ is !!:s^old^new^
+        if(hist.count == 0){ printf("!!: event not found\n"); return NULL; }
+        snprintf(sel, sizeof(sel), "%s", hist_get(hist.total));
+        char spec[MAX_LINE];
+        snprintf(spec, sizeof(spec), ":s%s", p);
+        const char *q = spec;
+        if(hexp_modifiers(&q, sel, print_only) != 1){ printf("%s: substitution failed\n", cmd); return NULL; }
+        p += strlen(p) - strlen(q);
+        if(!hexp_put(out, &n, sel, strlen(sel))) goto too_long;
+    }
+
+    while(*p){
+        char c = *p;
+        if(squote){
+            if(c == '\'') squote = 0;
+        } else if(c == '\\' && p[1]){
+            if(!hexp_put(out, &n, p, 2)) goto too_long;
+            p += 2;
+            continue;
+        } else if(c == '\'' && !dquote){
+            squote = 1;
+        } else if(c == '"'){
+            dquote = !dquote;
+        } else if(c == '!' && (!windows || p == cmd) && p[1] && !strchr(" \t\n=(", p[1]) && !(dquote && p[1] == '"')
+                  && !hexp_inhibited(cmd, p)){
+            const char *start = p++;
+            unsigned long id = 0;
+            const char *ev = NULL;
+            int shorthand = 1; // word designator may follow without ':'
+            if(*p == '!'){ p++; id = hist.total; }
+            else if(*p == '#'){ p++; ev = out; }
+            else if(isdigit((unsigned char)*p)) id = strtoul(p, (char**)&p, 10);
+            else if(*p == '-' && isdigit((unsigned char)p[1])){
+                unsigned long k = strtoul(p + 1, (char**)&p, 10);
+                id = k <= hist.total ? hist.total + 1 - k : 0;
+            }
+            else if(*p == '?'){
+                char q[MAX_LINE];
+                size_t qn = 0;
+                for(p++; *p && *p != '?' && *p != '\n' && qn + 1 < sizeof(q); p++) q[qn++] = *p;
+                q[qn] = 0;
+                if(*p == '?') p++;
+                id = hist_search(q, hist.total + 1);
+                hexp.match_word[0] = 0;
+                if(id){ // remember the word containing the match for %
+                    const char *h = hist_get(id), *m = strstr(h, q);
+                    size_t ws[HEXP_MAX_WORDS], we[HEXP_MAX_WORDS];
+                    int nw = hist_words(h, ws, we);
+                    for(int k=0;k<nw;k++){
+                        if((size_t)(m - h) >= ws[k] && (size_t)(m - h) < we[k]){
+                            snprintf(hexp.match_word, sizeof(hexp.match_word), "%.*s", (int)(we[k] - ws[k]), h + ws[k]);
+                            break;
+                        }
+                    }
+                }
+            }
+            else if(strchr("$^*%", *p)) id = hist.total; // !$ !^ !* !%
+            else {
+                const char *s = p;
+                while(*p && !strchr(" \t\n:;|&<>()\"'", *p)) p++;
+                id = hist_prefix(s, p - s);
+                shorthand = 0;
+            }
+            if(!ev) ev = id ? hist_get(id) : NULL;
+            if(!ev){
+                printf("%.*s: event not found\n", (int)(p - start), start);
+                return NULL;
+            }
+            snprintf(sel, sizeof(sel), "%s", ev);
+            if((*p == ':' && p[1] && strchr("0123456789^$*%-", p[1])) || (shorthand && *p && strchr("^$*%-", *p) && p > start + 1) || (*p && strchr("$^*%", *p) && p == start + 1)){
+                if(*p == ':') p++;
+                if(!hexp_words(&p, ev, sel)){
+                    printf("%.*s: bad word specifier\n", (int)(p - start), start);
+                    return NULL;
+                }
+            }
+            int mr = hexp_modifiers(&p, sel, print_only);
+            if(mr != 1){
+                printf("%.*s: %s\n", (int)(p - start), start, mr < 0 ? "substitution failed" : "bad modifier");
+                return NULL;
+            }
+            if(!hexp_put(out, &n, sel, strlen(sel))) goto too_long;
+            continue;
+        }
+        if(!hexp_put(out, &n, p, 1)) goto too_long;
+        p++;
+    }
+    return strdup(out);
+too_long:
+    printf("History expansion is too long.\n");
+    return NULL;
+}
+
+// New function: handle built-in commands that can appear in a pipeline
+static int handle_builtin_pipeline(const char *line, const struct tok *t){
+    size_t first_n;
+    const char *first = tok_word(line, &t[0], &first_n);
+
+    if(view_ieq(first, first_n, "help")){
+        printf("Universal Terminal — Help\n");
+        printf("-------------------------\n");
+        printf("Built-in commands:\n");
+        printf("  exit, quit       : Exit the terminal\n");
+        printf("  history          : Show last 100 commands\n");
+        printf("  clear            : Clear the screen\n");
+        printf("  !!               : Repeat last command\n");
+        printf("  !<num>           : Repeat command number <num> from history\n");
+        printf("  !str !?str? !$   : Bash history expansion (also !*, !-n, ^old^new, :s/a/b/, :p)\n");
+        printf("  Ctrl-R           : Reverse-search history as you type\n");
+        printf("  coproc on|off    : Run commands in one persistent host shell\n");
+        printf("  cache [clear]    : Show translation cache hit/miss counters (or empty it)\n");
+        printf("  fallback         : Show suggestion provider counters (answers, cache hits, latency)\n");
+        printf("  pipestatus       : Show the exit status of each stage of the last pipeline\n");
+        printf("  cmd &, jobs, fg, bg, wait, kill %%n : Job control (Ctrl-Z stops the foreground job)\n");
+        printf("  for [/d|/l|/f] %%v in (...) do ... : cmd loops run in-process, no shell per iteration\n");
+        printf("  help             : Show this help message\n");
+        printf("\nCommand translation:\n");
+        printf("  You can type commands in your chosen dialect (Windows CMD or Linux Bash)\n");
+        printf("  Common commands like ls, dir, cp, move, rm, del, cat, etc., are mapped to the host OS\n");
+        printf("  Piped commands (using |) are supported and translated\n");
+        return 1; // indicates it was handled
+    }
+    if(view_ieq(first, first_n, "exit") || view_ieq(first, first_n, "quit")){
+        exit(0);
+    }
+    if(view_ieq(first, first_n, "history")){
+        print_history();
+        return 1;
+    }
+    if(view_ieq(first, first_n, "clear")){
+        if(HOST_IS_WINDOWS) system("cls"); else system("clear");
+        return 1;
+    }
+
+    return 0; // not a handled built-in
+}
+
+// ---- Command line AST ----
+// A line is a list of pipelines joined by ;, &, && and ||; a pipeline is a
+// chain of simple commands joined by |; a simple command is its words plus
+// its redirections (<, >, >>, N>, N>&M, and bash's &>). The parser makes one
+// pass over the tokens and keeps token indices, not text, in nodes taken from
+// the per-line scratch arena. Quoted operators never reach it: the tokenizer
+// already folded them into words.
+
+enum ast_conn { AST_END, AST_SEQ, AST_AND, AST_OR, AST_BG };
+enum ast_redir_op { REDIR_IN, REDIR_OUT, REDIR_APPEND, REDIR_DUP, REDIR_BOTH, REDIR_BOTH_APPEND };
+
+struct ast_redir {
+    struct ast_redir *next;
+    int fd;              // explicit source fd, or -1
+    int op;              // enum ast_redir_op
+    uint32_t target;     // token of the file name; the fd itself for REDIR_DUP
+    uint32_t first, last; // its tokens
+};
+
+// The words are the tokens from wfirst to wlast that no redirection covers.
+struct ast_cmd {
+    struct ast_cmd *next;       // next stage of the pipeline
+    uint32_t first, last;       // token span, redirections included
+    uint32_t wfirst, wlast, nwords;
+    struct ast_redir *redirs;   // in source order
+};
+
+struct ast_pipeline {
+    struct ast_pipeline *next;
+    struct ast_cmd *cmds;
+    int conn;                   // enum ast_conn: how it joins the next one
+};
+
+static int tok_is(const char *line, const struct tok *t, const char *lit){
+    size_t n = strlen(lit);
+    return t->kind != TOK_WORD && t->len == n && memcmp(line + t->off, lit, n) == 0;
+}
+
+static int tok_is_fd(const char *line, const struct tok *t){
+    if(t->kind != TOK_WORD || t->quote != TQ_NONE || t->len == 0 || t->len > 2) return 0;
+    for(uint32_t i = 0; i < t->len; i++) if(!isdigit((unsigned char)line[t->off + i])) return 0;
+    return 1;
+}
+
+static inline int tok_touch(const struct tok *a, const struct tok *b){ return a->off + a->len == b->off; }
+
+// Connector at token i, or AST_END when it is not one. An & glued to a
+// redirection (2>&1, &>file) belongs to it.
+static int ast_conn_of(const char *line, const struct tok *t, size_t i, size_t nt, int windows){
+    if(t[i].kind != TOK_OP) return AST_END;
+    if(tok_is(line, &t[i], "&&")) return AST_AND;
+    if(tok_is(line, &t[i], "||")) return AST_OR;
+    if(tok_is(line, &t[i], ";")) return AST_SEQ;
+    if(!tok_is(line, &t[i], "&")) return AST_END;
+    if(i > 0 && tok_touch(&t[i - 1], &t[i]) && (tok_is(line, &t[i - 1], ">") || tok_is(line, &t[i - 1], "<")))
+        return AST_END;
+    if(!windows && i + 1 < nt && tok_touch(&t[i], &t[i + 1]) && (tok_is(line, &t[i + 1], ">") || tok_is(line, &t[i + 1], ">>")))
+        return AST_END;
+    return windows ? AST_SEQ : AST_BG;
+}
+
+// A redirection starting at token i, if there is one: fills r and returns
+// how many tokens it used, else 0.
+static size_t ast_redir_at(const char *line, const struct tok *t, size_t i, size_t nt, int windows,
+                           struct ast_redir *r){
+    size_t k = i;
+    r->fd = -1;
+    if(tok_is_fd(line, &t[k]) && k + 1 < nt && tok_touch(&t[k], &t[k + 1])){
+        r->fd = atoi(line + t[k].off); // parsing stops at the operator
+        k++;
+    }
+    if(r->fd < 0 && !windows && tok_is(line, &t[k], "&") && k + 1 < nt && tok_touch(&t[k], &t[k + 1]) &&
+       (tok_is(line, &t[k + 1], ">") || tok_is(line, &t[k + 1], ">>"))){
+        r->op = t[k + 1].len == 2 ? REDIR_BOTH_APPEND : REDIR_BOTH;
+        k += 2;
+    } else if(tok_is(line, &t[k], "<")){ r->op = REDIR_IN; k++; }
+    else if(tok_is(line, &t[k], ">")){ r->op = REDIR_OUT; k++; }
+    else if(tok_is(line, &t[k], ">>")){ r->op = REDIR_APPEND; k++; }
+    else return 0;
+    if(k >= nt) return 0;
+    if(r->op == REDIR_OUT && tok_is(line, &t[k], "&") && k + 1 < nt && tok_touch(&t[k - 1], &t[k]) &&
+       tok_touch(&t[k], &t[k + 1]) && tok_is_fd(line, &t[k + 1])){
+        r->op = REDIR_DUP;
+        r->target = (uint32_t)atoi(line + t[k + 1].off);
+        return k + 2 - i;
+    }
+    if(t[k].kind != TOK_WORD) return 0;
+    r->target = (uint32_t)k;
+    return k + 1 - i;
+}
+
+// Parse the nt tokens of line in one pass. Returns the first pipeline, or
+// NULL for an empty line (or no memory). Anything that is not a connector, a
+// pipe or a well-formed redirection is a word, so nothing typed is lost.
+static struct ast_pipeline *ast_parse(const char *line, const struct tok *t, size_t nt, int windows, struct arena *a){
+    struct ast_pipeline *head = NULL, **pl = &head, *p = NULL;
+    struct ast_cmd **cl = NULL, *c = NULL;
+    struct ast_redir **rl = NULL, r;
+    for(size_t i = 0; i < nt; ){
+        if(t[i].kind == TOK_PIPE){ c = NULL; i++; continue; }
+        int conn = t[i].kind == TOK_OP ? ast_conn_of(line, t, i, nt, windows) : AST_END;
+        if(conn != AST_END){
+            if(p) p->conn = conn;
+            p = NULL;
+            c = NULL;
+            i++;
+            continue;
+        }
+        if(!p){
+            if(!(p = arena_alloc(a, sizeof(*p)))) return NULL;
+            memset(p, 0, sizeof(*p));
+            *pl = p;
+            pl = &p->next;
+            cl = &p->cmds;
+        }
+        if(!c){
+            if(!(c = arena_alloc(a, sizeof(*c)))) return NULL;
+            memset(c, 0, sizeof(*c));
+            c->first = (uint32_t)i;
+            *cl = c;
+            cl = &c->next;
+            rl = &c->redirs;
+        }
+        // a word not followed by an operator is the common case, and no redirection
+        size_t used = t[i].kind == TOK_WORD && (i + 1 >= nt || t[i + 1].kind != TOK_OP) ? 0 :
+                      ast_redir_at(line, t, i, nt, windows, &r);
+        if(used){
+            struct ast_redir *nr = arena_alloc(a, sizeof(*nr));
+            if(!nr) return NULL;
+            *nr = r;
+            nr->next = NULL;
+            nr->first = (uint32_t)i;
+            nr->last = (uint32_t)(i + used - 1);
+            *rl = nr;
+            rl = &nr->next;
+            i += used;
+        } else {
+            if(!c->nwords++) c->wfirst = (uint32_t)i;
+            c->wlast = (uint32_t)i++;
+        }
+        c->last = (uint32_t)(i - 1);
+    }
+    return head;
+}
+
+// Variables a script uses through their other-dialect names.
+static const char *const ast_var_pairs[][2] = {
+    { "HOME", "USERPROFILE" }, { "USER", "USERNAME" }, { "PWD", "CD" }, { "?", "ERRORLEVEL" },
+    { "HOSTNAME", "COMPUTERNAME" }, { "TMPDIR", "TEMP" },
+};
+
+static int ast_name_char(char c){ return isalnum((unsigned char)c) || c == '_'; }
+
+// The n bytes at s with the source dialect's variable references rewritten:
+// $X / ${X} / $1 become %X% / %1 for cmd, %X% / %1 become ${X} / $1 for bash.
+// Bash text in single quotes stays literal; cmd's %% and %~ forms are left.
+static void ast_put_vars(struct sbuf *out, const char *s, size_t n, int source_is_windows){
+    for(size_t i = 0; i < n; ){
+        char c = s[i];
+        if(!source_is_windows){
+            if(c == '\\' && i + 1 < n){ sb_put(out, s + i, 2); i += 2; continue; }
+            if(c == '\''){
+                const char *q = memchr(s + i + 1, '\'', n - i - 1);
+                size_t e = q ? (size_t)(q - s) + 1 : n;
+                sb_put(out, s + i, e - i);
+                i = e;
+                continue;
+            }
+            if(c != '$' || i + 1 >= n){ sb_putc(out, c); i++; continue; }
+            size_t b = i + 1, e;
+            int braced = s[b] == '{';
+            if(braced) b++;
+            if(s[b] == '?' || isdigit((unsigned char)s[b])) e = b + 1;
+            else if(s[b] == '@' || s[b] == '*'){ e = b + 1; }
+            else for(e = b; e < n && ast_name_char(s[e]); e++){}
+            if(e == b || (braced && (e >= n || s[e] != '}'))){ sb_putc(out, c); i++; continue; }
+            size_t nl = e - b;
+            if(s[b] == '@' || s[b] == '*') sb_puts(out, "%*");
+            else if(isdigit((unsigned char)s[b])){ sb_putc(out, '%'); sb_putc(out, s[b]); }
+            else {
+                const char *name = NULL;
+                for(size_t k = 0; k < ARRAY_LEN(ast_var_pairs) && !name; k++)
+                    if(strlen(ast_var_pairs[k][0]) == nl && memcmp(ast_var_pairs[k][0], s + b, nl) == 0) name = ast_var_pairs[k][1];
+                sb_putc(out, '%');
+                if(name) sb_puts(out, name); else sb_put(out, s + b, nl);
+                sb_putc(out, '%');
+            }
+            i = e + braced;
+        } else {
+            if(c != '%' || i + 1 >= n){ sb_putc(out, c); i++; continue; }
+            if(isdigit((unsigned char)s[i + 1])){ sb_putc(out, '$'); sb_putc(out, s[i + 1]); i += 2; continue; }
+            if(s[i + 1] == '*'){ sb_puts(out, "\"$@\""); i += 2; continue; }
+            size_t e = i + 1;
+            while(e < n && ast_name_char(s[e])) e++;
+            if(e == i + 1 || e >= n || s[e] != '%'){ sb_putc(out, c); i++; continue; }
+            size_t nl = e - i - 1;
+            const char *name = NULL;
+            for(size_t k = 0; k < ARRAY_LEN(ast_var_pairs) && !name; k++)
+                if(strlen(ast_var_pairs[k][1]) == nl && strncasecmp(ast_var_pairs[k][1], s + i + 1, nl) == 0) name = ast_var_pairs[k][0];
+            if(name && name[0] == '?') sb_puts(out, "$?");
+            else {
+                sb_puts(out, "${");
+                if(name) sb_puts(out, name); else sb_put(out, s + i + 1, nl);
+                sb_putc(out, '}');
+            }
+            i = e + 1;
+        }
+    }
+}
+
+// One simple command, translated: the words through map_command (rebuilt
+// as text first when a redirection sits among them or a variable needs
+// renaming), then the redirections in the host's spelling.
+static void ast_emit_cmd(const char *line, const struct tok *t, const struct ast_cmd *c, int source_is_windows,
+                         int host_is_windows, struct sbuf *out, struct arena *scratch){
+    if(source_is_windows == host_is_windows){ // same dialect: as typed
+        sb_put(out, line + t[c->first].off, t[c->last].off + t[c->last].len - t[c->first].off);
+        return;
+    }
+    if(c->nwords){
+        const struct tok *w0 = &t[c->wfirst], *wn = &t[c->wlast];
+        size_t span = wn->off + wn->len - w0->off, n0;
+        int contiguous = c->wlast - c->wfirst + 1 == c->nwords;
+        // bash commands with no cmd mapping run under bash -lc: their variables stay
+        const char *first = tok_word(line, w0, &n0);
+        int vars = source_is_windows ? memchr(line + w0->off, '%', span) != NULL :
+                   memchr(line + w0->off, '$', span) && dispatch_lookup(&l2w_dispatch, first, n0) != MAP_NONE;
+        if(contiguous && !vars){
+            map_command(line, w0, c->nwords, source_is_windows, host_is_windows, out, scratch);
+        } else {
+            struct sbuf text = { NULL, 0, 0, scratch };
+            const struct ast_redir *r = c->redirs;
+            for(uint32_t k = c->wfirst; k <= c->wlast; k++){
+                while(r && r->last < k) r = r->next;
+                if(r && k >= r->first) continue; // a redirection among the words
+                const struct tok *w = &t[k];
+                if(text.len) sb_putc(&text, ' ');
+                if(vars) ast_put_vars(&text, line + w->off, w->len, source_is_windows);
+                else sb_put(&text, line + w->off, w->len);
+            }
+            struct tok inline_toks[TOK_INLINE], *toks = inline_toks;
+            size_t n = tokenize(text.p, text.len, source_is_windows, toks, TOK_INLINE);
+            if(n > TOK_INLINE && (toks = arena_alloc(scratch, n * sizeof(*toks))))
+                tokenize(text.p, text.len, source_is_windows, toks, n);
+            if(toks && n) map_command(text.p, toks, n, source_is_windows, host_is_windows, out, scratch);
+        }
+    }
+    for(const struct ast_redir *r = c->redirs; r; r = r->next){
+        if(out->len && out->p[out->len - 1] != ' ') sb_putc(out, ' ');
+        if(r->op == REDIR_DUP){ sb_printf(out, "%d>&%u", r->fd < 0 ? 1 : r->fd, r->target); continue; }
+        if(r->fd >= 0) sb_printf(out, "%d", r->fd);
+        static const char *const ops[] = { "<", ">", ">>", "", ">", ">>" };
+        sb_puts(out, ops[r->op]);
+        sb_putc(out, ' ');
+        size_t n;
+        const char *w = tok_word(line, &t[r->target], &n);
+        if(!source_is_windows && n == 9 && memcmp(w, "/dev/null", 9) == 0) sb_puts(out, "nul");
+        else if(source_is_windows && view_ieq(w, n, "nul")) sb_puts(out, "/dev/null");
+        else ast_put_vars(out, line + t[r->target].off, t[r->target].len, source_is_windows);
+        if(r->op == REDIR_BOTH || r->op == REDIR_BOTH_APPEND) sb_puts(out, " 2>&1");
+    }
+}
+
+// Translate line into out: tokenized once, parsed into pipelines, and each
+// simple command mapped from views into it. Connectors and redirections come
+// out in the host's dialect (; and & swap, &> spreads into > f 2>&1, a bash
+// background job becomes start /b). Scratch memory comes from out's arena when
+// it has one. With builtins unset (scripts), exit/history/clear/help are
+// mapped like any other command instead of acting on this terminal. Returns
+// the number of builtin commands it ran (only when builtins is set); they are
+// left out of the translation.
+static int translate_pipeline_into(const char *line, size_t len, int source_is_windows, int host_is_windows,
+                                   struct sbuf *out, int builtins){
+    struct arena local, *scratch = out->arena ? out->arena : &local;
+    _Alignas(16) char local_buf[4096];
+    arena_init_buf(&local, local_buf, sizeof(local_buf));
+    struct tok inline_toks[TOK_INLINE], *toks = inline_toks;
+    size_t nt = tokenize(line, len, source_is_windows, toks, TOK_INLINE);
+    if(nt > TOK_INLINE){
+        toks = arena_alloc(scratch, nt * sizeof(*toks));
+        if(!toks){ arena_free(&local); return 0; }
+        tokenize(line, len, source_is_windows, toks, nt);
+    }
+
+    int ran = 0, pending = AST_END;
+    for(struct ast_pipeline *p = ast_parse(line, toks, nt, source_is_windows, scratch); p; p = p->next){
+        size_t start = out->len;
+        int stages = 0;
+        for(const struct ast_cmd *c = p->cmds; c; c = c->next){
+            // builtins are handled here and left out of the mapped line
+            if(builtins && c->nwords && handle_builtin_pipeline(line, &toks[c->wfirst])){ ran++; continue; }
+            if(stages++) sb_puts(out, " | ");
+            else if(pending != AST_END){
+                static const char *const to_cmd[] = { "", " & ", " && ", " || ", " & " };
+                static const char *const to_sh[] = { "", "; ", " && ", " || ", " & " };
+                sb_puts(out, (host_is_windows ? to_cmd : to_sh)[pending]);
+                start = out->len;
+            }
+            ast_emit_cmd(line, toks, c, source_is_windows, host_is_windows, out, scratch);
+        }
+        if(!stages) continue;
+        if(p->conn == AST_BG && host_is_windows && !source_is_windows){
+            // cmd has no background jobs; start /b comes closest
+            size_t n = out->len - start;
+            char *job = arena_strndup(scratch, out->p + start, n);
+            if(job){ out->len = start; sb_puts(out, "start /b "); sb_puts(out, job); }
+            pending = AST_SEQ;
+        } else pending = p->conn;
+    }
+    if(pending == AST_BG) sb_puts(out, " &");
+    arena_free(&local);
+    return ran;
+}
+
+// ---- Translation cache ----
+// Scripts and sessions repeat the same command lines over and over. Finished
+// translations are kept in an LRU cache keyed by (source, host dialect) and the
+// line with blanks outside quotes collapsed, so a repeated line costs one
+// normalizing pass and one hash lookup. Entries hold key and value in one
+// allocation; the cache is bounded both in entries and in bytes, evicting from
+// the cold end. Lines that ran a builtin are never cached, since a hit would
+// skip the builtin. Single-threaded: the --translate-only workers bypass it.
+// So does batch mode: a script's lines are mostly distinct, and a miss costs
+// about twice a plain translation.
+
+#define TCACHE_MAX_ENTRIES 4096
+#define TCACHE_MAX_BYTES   (4u << 20)
+#define TCACHE_BUCKETS     (TCACHE_MAX_ENTRIES * 2) // power of two
+#define TCACHE_NIL         UINT32_MAX
+
+struct tcache_ent {
+    uint64_t hash;
+    char *data;               // key bytes followed by the value and a NUL
+    uint32_t klen, vlen;
+    uint32_t chain;           // next entry in the same bucket
+    uint32_t prev, next;      // LRU list, most recent at head
+};
+
+static struct {
+    struct tcache_ent ent[TCACHE_MAX_ENTRIES];
+    uint32_t bucket[TCACHE_BUCKETS];
+    uint32_t head, tail, count, free_top;
+    uint32_t free_list[TCACHE_MAX_ENTRIES];
+    size_t bytes;
+    unsigned long hits, misses, evictions;
+    int ready;
+} tcache;
+
+static void tcache_init(void){
+    for(uint32_t i=0;i<TCACHE_BUCKETS;i++) tcache.bucket[i] = TCACHE_NIL;
+    for(uint32_t i=0;i<TCACHE_MAX_ENTRIES;i++) tcache.free_list[i] = TCACHE_MAX_ENTRIES - 1 - i;
+    tcache.free_top = TCACHE_MAX_ENTRIES;
+    tcache.head = tcache.tail = TCACHE_NIL;
+    tcache.count = 0;
+    tcache.bytes = 0;
+    tcache.ready = 1;
+}
+
+static void tcache_unlink(uint32_t i){
+    struct tcache_ent *e = &tcache.ent[i];
+    if(e->prev != TCACHE_NIL) tcache.ent[e->prev].next = e->next; else tcache.head = e->next;
+    if(e->next != TCACHE_NIL) tcache.ent[e->next].prev = e->prev; else tcache.tail = e->prev;
+}
+
+static void tcache_link_head(uint32_t i){
+    struct tcache_ent *e = &tcache.ent[i];
+    e->prev = TCACHE_NIL;
+    e->next = tcache.head;
+    if(tcache.head != TCACHE_NIL) tcache.ent[tcache.head].prev = i; else tcache.tail = i;
+    tcache.head = i;
+}
+
+static void tcache_evict(uint32_t i){
+    struct tcache_ent *e = &tcache.ent[i];
+    uint32_t *pp = &tcache.bucket[e->hash & (TCACHE_BUCKETS - 1)];
+    while(*pp != i) pp = &tcache.ent[*pp].chain;
+    *pp = e->chain;
+    tcache_unlink(i);
+    tcache.bytes -= e->klen + e->vlen + 1;
+    free(e->data);
+    e->data = NULL;
+    tcache.free_list[tcache.free_top++] = i;
+    tcache.count--;
+}
+
+static void tcache_clear(void){
+    if(!tcache.ready) return;
+    while(tcache.tail != TCACHE_NIL){ tcache_evict(tcache.tail); }
+    tcache.hits = tcache.misses = tcache.evictions = 0;
+}
+
+static const char *tcache_get(uint64_t h, const char *key, size_t klen, size_t *vlen){
+    for(uint32_t i = tcache.bucket[h & (TCACHE_BUCKETS - 1)]; i != TCACHE_NIL; i = tcache.ent[i].chain){
+        struct tcache_ent *e = &tcache.ent[i];
+        if(e->hash == h && e->klen == klen && memcmp(e->data, key, klen) == 0){
+            if(tcache.head != i){ tcache_unlink(i); tcache_link_head(i); }
+            *vlen = e->vlen;
+            return e->data + klen;
+        }
+    }
+    return NULL;
+}
+
+static void tcache_put(uint64_t h, const char *key, size_t klen, const char *val, size_t vlen){
+    size_t need = klen + vlen + 1;
+    if(need > TCACHE_MAX_BYTES / 16) return; // huge lines would flush everything else
+    while(tcache.count && (tcache.free_top == 0 || tcache.bytes + need > TCACHE_MAX_BYTES)){
+        tcache_evict(tcache.tail);
+        tcache.evictions++;
+    }
+    char *data = malloc(need);
+    if(!data) return;
+    memcpy(data, key, klen);
+    memcpy(data + klen, val, vlen);
+    data[klen + vlen] = '\0';
+    uint32_t i = tcache.free_list[--tcache.free_top];
+    struct tcache_ent *e = &tcache.ent[i];
+    e->hash = h; e->data = data; e->klen = (uint32_t)klen; e->vlen = (uint32_t)vlen;
+    uint32_t *b = &tcache.bucket[h & (TCACHE_BUCKETS - 1)];
+    e->chain = *b;
+    *b = i;
+    tcache_link_head(i);
+    tcache.count++;
+    tcache.bytes += need;
+}
+
+// Key: dialect byte, then the line trimmed with blank runs outside quotes
+// collapsed to one space (escaped characters are kept as they are).
+static size_t tcache_key(const char *s, size_t n, int source_is_windows, int host_is_windows, char *key){
+    size_t k = 0;
+    key[k++] = (char)('0' + (source_is_windows << 1 | host_is_windows));
+    char q = 0, esc = source_is_windows ? '^' : '\\';
+    int blank = 0;
+    while(n && tok_is_blank(*s)){ s++; n--; }
+    while(n && tok_is_blank(s[n-1])) n--;
+    for(size_t i=0;i<n;i++){
+        char c = s[i];
+        if(!q && tok_is_blank(c)){ blank = 1; continue; }
+        if(blank){ key[k++] = ' '; blank = 0; }
+        key[k++] = c;
+        if(q){ if(c == q) q = 0; }
+        else if(c == esc && i + 1 < n) key[k++] = s[++i];
+        else if(c == '"' || (c == '\'' && !source_is_windows)) q = c;
+    }
+    return k;
+}
+
+// Keys are hashed a word at a time; hash_bytes' byte loop would cost about as
+// much as the lookup saves on short lines.
+static uint64_t tcache_hash(const char *s, size_t n){
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ n, w;
+    for(; n >= 8; s += 8, n -= 8){
+        memcpy(&w, s, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 29;
+    }
+    w = 0;
+    memcpy(&w, s, n);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 32);
+}
+
+// translate_pipeline_into through the cache.
+static void translate_cached(const char *line, size_t len, int source_is_windows, int host_is_windows,
+                             struct sbuf *out, int builtins){
+    if(!tcache.ready) tcache_init();
+    char stack_key[512], *key = len < sizeof(stack_key) ? stack_key : malloc(len + 1);
+    if(!key){ translate_pipeline_into(line, len, source_is_windows, host_is_windows, out, builtins); return; }
+    size_t klen = tcache_key(line, len, source_is_windows, host_is_windows, key);
+    uint64_t h = tcache_hash(key, klen);
+    size_t vlen;
+    const char *hit = tcache_get(h, key, klen, &vlen);
+    if(hit){
+        tcache.hits++;
+        sb_put(out, hit, vlen);
+    } else {
+        tcache.misses++;
+        size_t at = out->len;
+        // translate the normalized text so that a hit and a miss print the same
+        if(translate_pipeline_into(key + 1, klen - 1, source_is_windows, host_is_windows, out, builtins) == 0)
+            tcache_put(h, key, klen, out->p ? out->p + at : "", out->len - at);
+    }
+    if(key != stack_key) free(key);
+}
+
+static void tcache_stats(void){
+    unsigned long total = tcache.hits + tcache.misses;
+    printf("translation cache: %u/%u entries, %zu/%u bytes, %lu hits, %lu misses (%.1f%% hit rate), %lu evictions\n",
+           tcache.count, TCACHE_MAX_ENTRIES, tcache.bytes, TCACHE_MAX_BYTES, tcache.hits, tcache.misses,
+           total ? 100.0 * tcache.hits / total : 0.0, tcache.evictions);
+}
+
+// Translated line as a malloc'd string.
+static char *translate_pipeline(const char *line, int source_is_windows, int host_is_windows){
+    struct sbuf out = { NULL, 0, 0, NULL };
+    translate_cached(line, strlen(line), source_is_windows, host_is_windows, &out, 1);
+    return sb_take(&out);
+}
+
+
+#if !HOST_IS_WINDOWS
+// ---- Direct execution engine ----
+// The translated line is parsed into the same AST the translator uses and run
+// here: && / || / ; lists, pipelines joined with pipe2() fds, and redirections
+// opened by the terminal and dup'd into place by posix_spawn. Every stage is
+// started before any is waited for, so data streams through the kernel and
+// nothing is buffered here. cat and tee stages between other stages run as
+// threads of the terminal and move data with splice() and tee(), without it
+// ever reaching user space. Each stage's exit status is kept (the pipestatus
+// builtin shows them) and a failure hidden inside a pipeline is reported.
+// Pipelines ending in & start as background jobs (see Job control below).
+// Words needing expansion (variables, globs, ~, command substitution), shell
+// builtins, assignments, a backgrounded && / || list and syntax the AST does
+// not cover go to /bin/sh -c.
+
+#define MAX_STAGES 32
+#define EXEC_MAX_REDIRS 8
+
+// Builtins and keywords have no executable to spawn; leave them to the shell.
+static const char *shell_words[] = {
+    "cd", "export", "unset", "set", "alias", "unalias", "source", ".", "eval", "exec",
+    "exit", "read", "ulimit", "umask", "trap", "shift", "wait", "type", "command",
+    "hash", "local", "return", "readonly", "getopts", "break", "continue", "jobs",
+    "fg", "bg", "if", "for", "while", "until", "case", "function", "!", "[[", NULL
+};
+
+enum { STAGE_EXEC, STAGE_CAT, STAGE_TEE };
+
+static const char *self_exe; // this program, for the stages it runs itself (xargs)
+
+struct exec_stage {
+    char **argv;
+    const char *path; // the program to run, if not argv[0] looked up on PATH
+    int kind;
+    int nredirs;
+    struct { int fd, op, to; const char *path; } redirs[EXEC_MAX_REDIRS];
+};
+
+// An in-process stage. It owns a copy of its argv: a stopped job keeps its
+// threads after the line that started them is gone.
+struct exec_thread {
+    pthread_t tid;
+    int kind, in, out, status;
+    char *argv[];
+};
+
+static int pipe_status[MAX_STAGES], pipe_nstatus; // of the last pipeline
+
+static int write_all(int fd, const char *p, size_t n){
+    while(n > 0){
+        ssize_t w = write(fd, p, n);
+        if(w < 0){ if(errno == EINTR) continue; return -1; }
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+// Does the word at s (n bytes, quotes included) need the shell to expand it?
+// Also 1 for an unbalanced quote, which sh should report.
+static int word_needs_shell(const char *s, size_t n, int first){
+    char q = 0;
+    for(size_t i = 0; i < n; i++){
+        char c = s[i];
+        if(q == '\''){ if(c == '\'') q = 0; continue; }
+        if(q == '"'){
+            if(c == '"') q = 0;
+            else if(c == '$' || c == '`' || c == '\\') return 1;
+            continue;
+        }
+        if(c == '\'' || c == '"'){ q = c; continue; }
+        if(strchr("$`\\*?[]{}()", c)) return 1;
+        if(i == 0 && (c == '~' || c == '#')) return 1;
+        if(first && c == '=') return 1; // VAR=value cmd
+    }
+    return q != 0;
+}
+
+// Copy of a word without its quotes.
+static char *word_unquote(struct arena *a, const char *s, size_t n){
+    char *d = arena_alloc(a, n + 1), *w = d;
+    if(!d) return NULL;
+    char q = 0;
+    for(size_t i = 0; i < n; i++){
+        if(q){ if(s[i] == q) q = 0; else *w++ = s[i]; continue; }
+        if(s[i] == '\'' || s[i] == '"'){ q = s[i]; continue; }
+        *w++ = s[i];
+    }
+    *w = 0;
+    return d;
+}
+
+// Build the stages of pipeline p. Returns the stage count, or -1 when the
+// line has to go to the shell instead.
+static int exec_plan(const char *line, const struct tok *t, const struct ast_pipeline *p, struct exec_stage *st,
+                     struct arena *a){
+    int n = 0;
+    for(const struct ast_cmd *c = p->cmds; c; c = c->next){
+        if(n == MAX_STAGES || !c->nwords) return -1;
+        struct exec_stage *s = &st[n++];
+        memset(s, 0, sizeof(*s));
+        s->argv = arena_alloc(a, (c->nwords + 1) * sizeof(*s->argv));
+        if(!s->argv) return -1;
+        int argc = 0;
+        const struct ast_redir *r = c->redirs;
+        for(uint32_t k = c->wfirst; k <= c->wlast; k++){
+            while(r && r->last < k) r = r->next;
+            if(r && k >= r->first) continue;
+            if(t[k].kind != TOK_WORD || word_needs_shell(line + t[k].off, t[k].len, argc == 0)) return -1;
+            if(!(s->argv[argc++] = word_unquote(a, line + t[k].off, t[k].len))) return -1;
+        }
+        s->argv[argc] = NULL;
+        for(const char **w = shell_words; *w; w++)
+            if(strcmp(s->argv[0], *w) == 0) return -1;
+        if(self_exe && strcmp(s->argv[0], "xargs") == 0){ // custard --xargs (see Parallel xargs)
+            char **v = arena_alloc(a, ((size_t)argc + 2) * sizeof(*v));
+            if(!v) return -1;
+            v[0] = "xargs";
+            v[1] = "--xargs";
+            memcpy(v + 2, s->argv + 1, (size_t)argc * sizeof(*v));
+            s->argv = v;
+            s->path = self_exe;
+        }
+        for(r = c->redirs; r; r = r->next){
+            if(s->nredirs == EXEC_MAX_REDIRS) return -1;
+            int i = s->nredirs++;
+            s->redirs[i].fd = r->fd;
+            s->redirs[i].op = r->op;
+            if(r->op == REDIR_DUP){ s->redirs[i].to = (int)r->target; continue; }
+            const struct tok *w = &t[r->target];
+            if(word_needs_shell(line + w->off, w->len, 0)) return -1;
+            if(!(s->redirs[i].path = word_unquote(a, line + w->off, w->len))) return -1;
+        }
+    }
+    // cat FILE... and tee FILE between other stages run in-process; one that
+    // would read the terminal stays a process, so job control can stop it
+    for(int i = 0; n > 1 && i < n; i++){
+        char **v = st[i].argv;
+        int opts = 0, files = 0;
+        for(int k = 1; v[k]; k++){ if(v[k][0] == '-' && v[k][1]) opts = 1; files++; }
+        if(opts || st[i].nredirs) continue;
+        if(strcmp(v[0], "cat") == 0 && (i == 0) == (files > 0)) st[i].kind = STAGE_CAT;
+        else if(strcmp(v[0], "tee") == 0 && i > 0 && files <= 1) st[i].kind = STAGE_TEE;
+    }
+    return n;
+}
+
+#ifdef __linux__
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_MORE 4
+#endif
+#endif
+
+// Move everything readable on in to out: splice() when the kernel can (one end
+// a pipe), else through a buffer.
+static int exec_relay(int in, int out){
+#ifdef __linux__
+    for(;;){
+        long k = syscall(SYS_splice, in, NULL, out, NULL, (size_t)1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(k > 0) continue;
+        if(k == 0) return 0;
+        if(errno == EINTR) continue;
+        if(errno != EINVAL && errno != ENOSYS) return -1;
+        break;
+    }
+#endif
+    char buf[65536];
+    for(;;){
+        ssize_t k = read(in, buf, sizeof(buf));
+        if(k < 0 && errno == EINTR) continue;
+        if(k <= 0) return (int)k;
+        if(write_all(out, buf, (size_t)k) != 0) return -1;
+    }
+}
+
+// tee: a copy of in goes to out and the data itself to file. With both ends
+// pipes, tee() duplicates the pages and splice() drains them into the file.
+static int exec_tee(int in, int out, int file){
+#ifdef __linux__
+    for(;;){
+        long k = syscall(SYS_tee, in, out, (size_t)1 << 20, 0);
+        if(k < 0 && errno == EINTR) continue;
+        if(k < 0 && (errno == EINVAL || errno == ENOSYS)) break;
+        if(k <= 0) return (int)k;
+        if(file < 0){
+            char sink[65536];
+            for(long left = k; left > 0; ){
+                ssize_t r = read(in, sink, (size_t)left < sizeof(sink) ? (size_t)left : sizeof(sink));
+                if(r < 0 && errno == EINTR) continue;
+                if(r <= 0) return -1;
+                left -= r;
+            }
+            continue;
+        }
+        for(long left = k; left > 0; ){
+            long m = syscall(SYS_splice, in, NULL, file, NULL, (size_t)left, SPLICE_F_MOVE);
+            if(m < 0 && errno == EINTR) continue;
+            if(m < 0 && errno == EINVAL){ // e.g. an O_APPEND file: copy this batch
+                char buf[65536];
+                ssize_t r = read(in, buf, (size_t)left < sizeof(buf) ? (size_t)left : sizeof(buf));
+                if(r <= 0 || write_all(file, buf, (size_t)r) != 0) return -1;
+                m = r;
+            }
+            if(m <= 0) return -1;
+            left -= m;
+        }
+    }
+#endif
+    char buf[65536];
+    for(;;){
+        ssize_t k = read(in, buf, sizeof(buf));
+        if(k < 0 && errno == EINTR) continue;
+        if(k <= 0) return (int)k;
+        if(write_all(out, buf, (size_t)k) != 0) return -1;
+        if(file >= 0 && write_all(file, buf, (size_t)k) != 0) return -1;
+    }
+}
+
+static struct exec_thread *exec_thread_new(const struct exec_stage *s){
+    size_t n = 0, bytes = 0;
+    while(s->argv[n]) bytes += strlen(s->argv[n++]) + 1;
+    struct exec_thread *t = malloc(sizeof(*t) + (n + 1) * sizeof(char *) + bytes);
+    if(!t) return NULL;
+    char *p = (char *)&t->argv[n + 1];
+    for(size_t i = 0; i < n; i++){
+        size_t len = strlen(s->argv[i]) + 1;
+        t->argv[i] = memcpy(p, s->argv[i], len);
+        p += len;
+    }
+    t->argv[n] = NULL;
+    t->kind = s->kind;
+    t->status = 0;
+    return t;
+}
+
+static void *exec_builtin_stage(void *arg){
+    struct exec_thread *s = arg;
+    int rc = 0;
+    if(s->kind == STAGE_CAT && s->argv[1]){
+        for(int k = 1; s->argv[k] && rc == 0; k++){
+            int fd = open(s->argv[k], O_RDONLY | O_CLOEXEC);
+            if(fd < 0){ fprintf(stderr, "cat: %s: %s\n", s->argv[k], strerror(errno)); s->status = 1; continue; }
+            rc = exec_relay(fd, s->out);
+            close(fd);
+        }
+    } else if(s->kind == STAGE_CAT){
+        rc = exec_relay(s->in, s->out);
+    } else {
+        int file = -1;
+        if(s->argv[1] && (file = open(s->argv[1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0){
+            fprintf(stderr, "tee: %s: %s\n", s->argv[1], strerror(errno));
+            s->status = 1;
+        }
+        rc = exec_tee(s->in, s->out, file);
+        if(file >= 0) close(file);
+    }
+    if(rc != 0) s->status = errno == EPIPE ? 128 + SIGPIPE : 1;
+    if(s->in != STDIN_FILENO) close(s->in);
+    if(s->out != STDOUT_FILENO) close(s->out);
+    return NULL;
+}
+
+static int exec_pipe(int fds[2]){
+#ifdef __linux__
+    return (int)syscall(SYS_pipe2, fds, O_CLOEXEC);
+#else
+    if(pipe(fds) != 0) return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+// Remembered PATH lookups (like the shell's hash table); dropped when PATH changes.
+#define CMD_CACHE_SIZE 128
+
+static struct { char *name, *path; } cmd_cache[CMD_CACHE_SIZE];
+static char *cmd_cache_pathvar;
+
+static unsigned cmd_hash(const char *s){
+    unsigned h = 5381;
+    while(*s) h = h * 33 + (unsigned char)*s++;
+    return h % CMD_CACHE_SIZE;
+}
+
+static void cmd_cache_clear(void){
+    for(int i = 0; i < CMD_CACHE_SIZE; i++){
+        free(cmd_cache[i].name);
+        free(cmd_cache[i].path);
+        cmd_cache[i].name = cmd_cache[i].path = NULL;
+    }
+}
+
+// Full path of an executable found on PATH, or NULL (then posix_spawnp decides).
+static const char *resolve_cmd(const char *name){
+    if(strchr(name, '/')) return NULL;
+    const char *pathvar = getenv("PATH");
+    if(!pathvar) return NULL;
+    if(!cmd_cache_pathvar || strcmp(cmd_cache_pathvar, pathvar) != 0){
+        cmd_cache_clear();
+        free(cmd_cache_pathvar);
+        cmd_cache_pathvar = strdup(pathvar);
+    }
+    unsigned h = cmd_hash(name);
+    if(cmd_cache[h].name && strcmp(cmd_cache[h].name, name) == 0) return cmd_cache[h].path;
+
+    char full[MAX_LINE];
+    for(const char *p = pathvar; ; ){
+        const char *colon = strchr(p, ':');
+        size_t n = colon ? (size_t)(colon - p) : strlen(p);
+        snprintf(full, sizeof(full), "%.*s/%s", (int)n, n ? p : ".", name);
+        struct stat st;
+        if(stat(full, &st) == 0 && S_ISREG(st.st_mode) && access(full, X_OK) == 0){
+            free(cmd_cache[h].name);
+            free(cmd_cache[h].path);
+            cmd_cache[h].name = strdup(name);
+            cmd_cache[h].path = strdup(full);
+            return cmd_cache[h].path;
+        }
+        if(!colon) break;
+        p = colon + 1;
+    }
+    return NULL;
+}
+
+static int decode_status(int st){
+    if(WIFEXITED(st)) return WEXITSTATUS(st);
+    if(WIFSIGNALED(st)) return 128 + WTERMSIG(st);
+    return -1;
+}
+
+// Signal state for a spawned child: default dispositions for what the terminal
+// ignores, and nothing blocked (job control keeps SIGCHLD blocked here).
+static void exec_spawnattr_init(posix_spawnattr_t *attr){
+    static const int defaults[] = { SIGINT, SIGQUIT, SIGPIPE, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD };
+    sigset_t def, none;
+    sigemptyset(&def);
+    for(size_t i = 0; i < ARRAY_LEN(defaults); i++) sigaddset(&def, defaults[i]);
+    sigemptyset(&none);
+    posix_spawnattr_init(attr);
+    posix_spawnattr_setsigdefault(attr, &def);
+    posix_spawnattr_setsigmask(attr, &none);
+    posix_spawnattr_setflags(attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+}
+
+// ---- Job control ----
+// Every pipeline the engine starts is a job. On a terminal a foreground job
+// gets its own process group and the terminal until it exits or stops; Ctrl-Z
+// moves it into the job table, where `cmd &` puts a job directly. Children are
+// reaped from a signalfd for SIGCHLD that the line editor polls next to the
+// keyboard, so finished jobs are reported while the prompt waits.
+
+enum { JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+struct job {
+    int id;                    // %n; 0 while not in the table
+    pid_t pgid;                // 0 without a process group of its own
+    int nstages, nlive, state, reported;
+    pid_t pids[MAX_STAGES];    // -1: reaped, or an in-process stage
+    int status[MAX_STAGES];
+    struct exec_thread *threads[MAX_STAGES];
+    struct termios tmodes;     // the job's terminal modes when it stopped
+    int has_tmodes;
+    char *cmd;
+};
+
+static struct job **job_table;
+static int njobs, job_table_cap, job_current; // job_current: target of a bare fg/bg
+static int job_control;                       // foreground jobs get the terminal
+static int job_sfd = -1;                      // SIGCHLD, and SIGINT inside wait
+static int job_interrupted;
+static struct termios job_shell_tmodes;
+
+static void job_free(struct job *j){
+    free(j->cmd);
+    free(j);
+}
+
+// Room for one more table entry, so that job_add cannot fail later.
+static int job_reserve(void){
+    if(njobs < job_table_cap) return 0;
+    int cap = job_table_cap ? job_table_cap * 2 : 16;
+    struct job **t = realloc(job_table, (size_t)cap * sizeof(*t));
+    if(!t) return -1;
+    job_table = t;
+    job_table_cap = cap;
+    return 0;
+}
+
+static void job_add(struct job *j){
+    j->id = njobs ? job_table[njobs - 1]->id + 1 : 1;
+    job_table[njobs++] = j;
+    job_current = j->id;
+}
+
+static void job_remove(struct job *j){
+    for(int i = 0; i < njobs; i++)
+        if(job_table[i] == j){
+            memmove(&job_table[i], &job_table[i + 1], (size_t)(njobs - i - 1) * sizeof(*job_table));
+            njobs--;
+            break;
+        }
+    if(job_current == j->id) job_current = njobs ? job_table[njobs - 1]->id : 0;
+    job_free(j);
+}
+
+static void job_signal(struct job *j, int sig){
+    if(j->pgid){ kill(-j->pgid, sig); return; }
+    for(int i = 0; i < j->nstages; i++)
+        if(j->pids[i] > 0) kill(j->pids[i], sig);
+}
+
+// Every process has exited: collect the in-process stages too.
+static void job_finish(struct job *j){
+    for(int i = 0; i < j->nstages; i++){
+        struct exec_thread *t = j->threads[i];
+        if(!t) continue;
+        pthread_join(t->tid, NULL);
+        j->status[i] = t->status;
+        free(t);
+        j->threads[i] = NULL;
+    }
+    j->state = JOB_DONE;
+    j->reported = 0;
+}
+
+static void job_update(struct job *j, int i, int ws){
+    if(WIFSTOPPED(ws)){
+        if(j->state != JOB_STOPPED) j->reported = 0; // each stage reports the same stop
+        j->state = JOB_STOPPED;
+        return;
+    }
+    if(WIFCONTINUED(ws)){ j->state = JOB_RUNNING; return; }
+    j->status[i] = decode_status(ws);
+    j->pids[i] = -1;
+    j->nlive--;
+}
+
+// Collect every state change of the table's jobs without blocking.
+static void job_reap(void){
+#ifdef __linux__
+    struct signalfd_siginfo si[16];
+    ssize_t k;
+    while(job_sfd >= 0 && (k = read(job_sfd, si, sizeof(si))) > 0)
+        for(size_t i = 0; i < (size_t)k / sizeof(*si); i++)
+            if(si[i].ssi_signo == SIGINT) job_interrupted = 1;
+#endif
+    for(int k = 0; k < njobs; k++){
+        struct job *j = job_table[k];
+        for(int i = 0; i < j->nstages && j->nlive; i++){
+            while(j->pids[i] > 0){
+                int ws;
+                pid_t r = waitpid(j->pids[i], &ws, WNOHANG | WUNTRACED | WCONTINUED);
+                if(r < 0 && errno == EINTR) continue;
+                if(r == 0) break;
+                if(r < 0) ws = 0; // already reaped elsewhere
+                job_update(j, i, ws);
+            }
+        }
+        if(!j->nlive && j->state != JOB_DONE) job_finish(j);
+    }
+}
+
+static void job_print(const struct job *j, int pids){
+    char buf[64];
+    const char *state = j->state == JOB_RUNNING ? "Running" : j->state == JOB_STOPPED ? "Stopped" : buf;
+    int last = j->status[j->nstages - 1];
+    if(j->state == JOB_DONE){
+        if(last == 0) snprintf(buf, sizeof(buf), "Done");
+        else if(last > 128) snprintf(buf, sizeof(buf), "%s", strsignal(last - 128));
+        else snprintf(buf, sizeof(buf), "Exit %d", last);
+    }
+    printf("[%d]%c  ", j->id, j->id == job_current ? '+' : ' ');
+    if(pids) printf("%-7d ", (int)j->pgid);
+    printf("%-24s%s%s\n", state, j->cmd, j->state == JOB_RUNNING ? " &" : "");
+}
+
+// Report finished jobs (dropping them) and newly stopped ones.
+static void job_notify(int quiet){
+    for(int k = 0; k < njobs; k++){
+        struct job *j = job_table[k];
+        if(j->reported || j->state == JOB_RUNNING) continue;
+        if(!quiet) job_print(j, 0);
+        j->reported = 1;
+        if(j->state == JOB_DONE){ job_remove(j); k--; }
+    }
+    fflush(stdout);
+}
+
+// SIGCHLD while the prompt waits: report above the line being edited.
+static void job_wake(void){
+    job_reap();
+    for(int k = 0; k < njobs; k++)
+        if(!job_table[k]->reported && job_table[k]->state != JOB_RUNNING){
+            fputs("\r\x1b[K", stdout);
+            job_notify(0);
+            break;
+        }
+}
+
+// interactive: the line editor watches for finished jobs and, when we own the
+// terminal, foreground jobs get their own process group.
+static void job_init(int interactive){
+    static int done;
+    if(done) return;
+    done = 1;
+#ifdef __linux__
+    sigset_t m;
+    sigemptyset(&m);
+    sigaddset(&m, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &m, NULL);
+    job_sfd = signalfd(-1, &m, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(job_sfd < 0) sigprocmask(SIG_UNBLOCK, &m, NULL);
+#endif
+    if(!interactive) return;
+    if(isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp()){
+        // handing the terminal over and back must not stop us; in-process
+        // stages of a stopped job may find their reader gone
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        signal(SIGPIPE, SIG_IGN);
+        tcgetattr(STDIN_FILENO, &job_shell_tmodes);
+        job_control = 1;
+    }
+    if(job_sfd >= 0) input_wake_add(job_sfd, job_wake);
+}
+
+// Start the stages of a pipeline; text is its source, for the job table.
+// Background jobs run every stage as a process.
+static struct job *job_start(struct exec_stage *st, int nstages, const char *text, size_t len, int bg){
+    struct job *j = calloc(1, sizeof(*j));
+    char *cmd = malloc(len + 1);
+    if(!j || !cmd || job_reserve() != 0){
+        fprintf(stderr, "custard: out of memory\n");
+        free(j);
+        free(cmd);
+        return NULL;
+    }
+    memcpy(cmd, text, len);
+    cmd[len] = 0;
+    j->cmd = cmd;
+    j->nstages = nstages;
+    j->state = JOB_RUNNING;
+
+    posix_spawnattr_t attr;
+    exec_spawnattr_init(&attr);
+    int own_group = job_control || bg;
+    if(own_group) posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+    int in_fd = -1;
+    for(int i = 0; i < nstages; i++){
+        struct exec_stage *s = &st[i];
+        int fds[2] = { -1, -1 };
+        j->pids[i] = -1;
+        if(i < nstages - 1 && exec_pipe(fds) != 0){
+            perror("pipe");
+            for(int k = i; k < nstages; k++) j->pids[k] = -1, j->status[k] = 1;
+            break;
+        }
+        if(s->kind != STAGE_EXEC && !bg){
+            struct exec_thread *t = exec_thread_new(s);
+            if(t){
+                t->in = in_fd >= 0 ? in_fd : STDIN_FILENO;
+                t->out = fds[1] >= 0 ? fds[1] : STDOUT_FILENO;
+                if(pthread_create(&t->tid, NULL, exec_builtin_stage, t) == 0){
+                    j->threads[i] = t;
+                    in_fd = fds[0];
+                    continue;
+                }
+                free(t); // no thread: spawn the real one
+            }
+        }
+        posix_spawn_file_actions_t fa;
+        posix_spawn_file_actions_init(&fa);
+        if(in_fd >= 0) posix_spawn_file_actions_adddup2(&fa, in_fd, 0);
+        else if(bg && !job_control) posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+        if(fds[1] >= 0) posix_spawn_file_actions_adddup2(&fa, fds[1], 1);
+        // redirections after the pipes, as the shell does; files are opened
+        // here so a failure names the file
+        int opened[EXEC_MAX_REDIRS], nopened = 0, err = 0;
+        for(int k = 0; k < s->nredirs && !err; k++){
+            int op = s->redirs[k].op, fd = s->redirs[k].fd;
+            if(op == REDIR_DUP){ posix_spawn_file_actions_adddup2(&fa, s->redirs[k].to, fd < 0 ? 1 : fd); continue; }
+            int flags = op == REDIR_IN ? O_RDONLY : O_WRONLY | O_CREAT |
+                        (op == REDIR_APPEND || op == REDIR_BOTH_APPEND ? O_APPEND : O_TRUNC);
+            int f = open(s->redirs[k].path, flags | O_CLOEXEC, 0666);
+            if(f < 0){ fprintf(stderr, "%s: %s\n", s->redirs[k].path, strerror(errno)); err = -1; break; }
+            opened[nopened++] = f;
+            posix_spawn_file_actions_adddup2(&fa, f, fd >= 0 ? fd : op == REDIR_IN ? 0 : 1);
+            if(op == REDIR_BOTH || op == REDIR_BOTH_APPEND) posix_spawn_file_actions_adddup2(&fa, f, 2);
+        }
+        pid_t pid;
+        if(!err){
+            const char *path = s->path ? s->path : resolve_cmd(s->argv[0]);
+            if(own_group) posix_spawnattr_setpgroup(&attr, j->pgid);
+            err = path ? posix_spawn(&pid, path, &fa, &attr, s->argv, environ) : ENOENT;
+            if(err == ENOENT && !s->path){
+                if(path) cmd_cache_clear(); // stale entry: binary moved or removed
+                err = posix_spawnp(&pid, s->argv[0], &fa, &attr, s->argv, environ);
+            }
+            if(err) fprintf(stderr, "%s: %s\n", s->argv[0], err == ENOENT ? "command not found" : strerror(err));
+        }
+        posix_spawn_file_actions_destroy(&fa);
+        for(int k = 0; k < nopened; k++) close(opened[k]);
+        if(in_fd >= 0) close(in_fd);
+        if(fds[1] >= 0) close(fds[1]);
+        in_fd = fds[0];
+        if(err == 0){
+            j->pids[i] = pid;
+            j->nlive++;
+            if(own_group && !j->pgid){
+                j->pgid = pid;
+                if(job_control && !bg) tcsetpgrp(STDIN_FILENO, pid);
+            }
+        } else {
+            j->status[i] = err == ENOENT ? 127 : err < 0 ? 1 : 126;
+        }
+    }
+    if(in_fd >= 0) close(in_fd);
+    posix_spawnattr_destroy(&attr);
+    return j;
+}
+
+// Run j in the foreground until it exits or stops (cont: it was stopped or in
+// the background). Returns the last stage's status, or 128+SIGTSTP when it
+// stopped and went into the table.
+static int job_foreground(struct job *j, int cont){
+    // Like system(): the terminal ignores ^C/^\ while a child runs. SIGPIPE too:
+    // an in-process stage sees EPIPE instead of killing us.
+    struct sigaction ign, old_int, old_quit, old_pipe;
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigemptyset(&ign.sa_mask);
+    sigaction(SIGINT, &ign, &old_int);
+    sigaction(SIGQUIT, &ign, &old_quit);
+    sigaction(SIGPIPE, &ign, &old_pipe);
+
+    int tty = job_control && j->pgid;
+    if(tty){
+        if(cont && j->has_tmodes) tcsetattr(STDIN_FILENO, TCSADRAIN, &j->tmodes);
+        tcsetpgrp(STDIN_FILENO, j->pgid);
+    }
+    if(cont) job_signal(j, SIGCONT);
+    j->state = JOB_RUNNING;
+    for(int i = 0; i < j->nstages && j->state == JOB_RUNNING; i++){
+        while(j->pids[i] > 0 && j->state == JOB_RUNNING){
+            int ws;
+            pid_t r = waitpid(j->pids[i], &ws, WUNTRACED);
+            if(r < 0 && errno == EINTR) continue;
+            if(r < 0) ws = 0;
+            // read the terminal before job_start handed it over: it has it now
+            if(tty && r > 0 && WIFSTOPPED(ws) && (WSTOPSIG(ws) == SIGTTIN || WSTOPSIG(ws) == SIGTTOU)){
+                job_signal(j, SIGCONT);
+                continue;
+            }
+            job_update(j, i, ws);
+        }
+    }
+    if(tty){
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+        if(j->state == JOB_STOPPED) j->has_tmodes = tcgetattr(STDIN_FILENO, &j->tmodes) == 0;
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &job_shell_tmodes);
+    }
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGQUIT, &old_quit, NULL);
+    sigaction(SIGPIPE, &old_pipe, NULL);
+
+    if(j->state == JOB_STOPPED){
+        if(!j->id) job_add(j);
+        job_current = j->id;
+        j->reported = 1;
+        printf("\n");
+        job_print(j, 0);
+        return 128 + SIGTSTP;
+    }
+    job_finish(j);
+    pipe_nstatus = j->nstages;
+    memcpy(pipe_status, j->status, (size_t)j->nstages * sizeof(*pipe_status));
+    return j->status[j->nstages - 1];
+}
+
+// Until only (or every job) is no longer running, or Ctrl-C. Returns the exit
+// status of only, 0 for all jobs, 130 when interrupted.
+static int job_wait(struct job *only){
+    struct sigaction ign, old_int;
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigemptyset(&ign.sa_mask);
+    sigaction(SIGINT, &ign, &old_int);
+#ifdef __linux__
+    // blocked, an ignored SIGINT still reaches the signalfd
+    sigset_t m, old;
+    sigemptyset(&m);
+    sigaddset(&m, SIGINT);
+    sigprocmask(SIG_BLOCK, &m, &old);
+    sigaddset(&m, SIGCHLD);
+    if(job_sfd >= 0) signalfd(job_sfd, &m, 0);
+#endif
+    job_interrupted = 0;
+    for(;;){
+        job_reap();
+        int busy = 0;
+        for(int k = 0; k < njobs; k++)
+            if((!only || job_table[k] == only) && job_table[k]->state == JOB_RUNNING) busy = 1;
+        if(!busy || job_interrupted) break;
+        struct pollfd p = { job_sfd, POLLIN, 0 };
+        poll(&p, job_sfd >= 0, job_sfd >= 0 ? -1 : 10);
+    }
+#ifdef __linux__
+    sigdelset(&m, SIGINT);
+    if(job_sfd >= 0) signalfd(job_sfd, &m, 0);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+#endif
+    sigaction(SIGINT, &old_int, NULL);
+    if(job_interrupted) return 130;
+    return only && only->state == JOB_DONE ? only->status[only->nstages - 1] : 0;
+}
+
+// Run one pipeline in the foreground, returning the last stage's exit status
+// (127 if not found), or start it as a background job (returns 0).
+static int spawn_pipeline(struct exec_stage *st, int nstages, const char *text, size_t len, int bg){
+    struct job *j = job_start(st, nstages, text, len, bg);
+    if(!j) return 1;
+    if(bg){
+        job_add(j);
+        if(!j->nlive) job_finish(j);
+        pid_t last = 0;
+        for(int i = 0; i < nstages; i++) if(j->pids[i] > 0) last = j->pids[i];
+        if(job_control) printf("[%d] %d\n", j->id, (int)last);
+        return 0;
+    }
+    int rc = job_foreground(j, 0);
+    if(j->state != JOB_DONE) return rc;
+    for(int i = 0; i < nstages - 1; i++)
+        // the last stage's status is the pipeline's; earlier failures would go unseen
+        if(j->status[i] != 0 && j->status[i] != 128 + SIGPIPE)
+            fprintf(stderr, "[pipeline] stage %d (%s) exited with status %d\n", i + 1, st[i].argv[0], j->status[i]);
+    job_free(j);
+    return rc;
+}
+
+static int run_shell(const char *cmd){
+    char *argv[] = { "/bin/sh", "-c", (char *)cmd, NULL };
+    struct exec_stage s;
+    memset(&s, 0, sizeof(s));
+    s.argv = argv;
+    return spawn_pipeline(&s, 1, cmd, strlen(cmd), 0);
+}
+
+// Execute a host command line. Returns its exit status, -1 if nothing could run.
+static int run_command(const char *cmd){
+    struct arena a;
+    _Alignas(16) char abuf[8192];
+    arena_init_buf(&a, abuf, sizeof(abuf));
+    size_t len = strlen(cmd);
+    struct tok inline_toks[TOK_INLINE], *toks = inline_toks;
+    size_t nt = tokenize(cmd, len, 0, toks, TOK_INLINE);
+    if(nt > TOK_INLINE && (toks = arena_alloc(&a, nt * sizeof(*toks)))) tokenize(cmd, len, 0, toks, nt);
+    struct ast_pipeline *list = toks ? ast_parse(cmd, toks, nt, 0, &a) : NULL;
+
+    // plan every pipeline first: the line runs here entirely or goes to sh entirely.
+    // `a && b &` backgrounds the whole and-or list, which takes a subshell.
+    int nplans = 0, ok = list != NULL, prev = AST_END;
+    for(struct ast_pipeline *p = list; p && ok; prev = p->conn, p = p->next, nplans++)
+        ok = p->conn != AST_BG || (prev != AST_AND && prev != AST_OR);
+    struct exec_stage **plans = ok ? arena_alloc(&a, (size_t)nplans * sizeof(*plans)) : NULL;
+    int *counts = ok ? arena_alloc(&a, (size_t)nplans * sizeof(*counts)) : NULL;
+    int i = 0;
+    for(struct ast_pipeline *p = list; p && plans && counts; p = p->next, i++){
+        plans[i] = arena_alloc(&a, MAX_STAGES * sizeof(**plans));
+        if(!plans[i] || (counts[i] = exec_plan(cmd, toks, p, plans[i], &a)) < 0){ plans = NULL; break; }
+    }
+    int rc = 0;
+    if(!plans || !counts) rc = list || !nt ? run_shell(cmd) : 0;
+    else {
+        int conn = AST_END;
+        i = 0;
+        for(struct ast_pipeline *p = list; p; p = p->next, i++){
+            if((conn == AST_AND && rc != 0) || (conn == AST_OR && rc == 0)){ conn = p->conn; continue; }
+            const struct ast_cmd *last = p->cmds;
+            while(last->next) last = last->next;
+            const struct tok *t0 = &toks[p->cmds->first], *t1 = &toks[last->last];
+            rc = spawn_pipeline(plans[i], counts[i], cmd + t0->off, t1->off + t1->len - t0->off, p->conn == AST_BG);
+            conn = p->conn;
+        }
+    }
+    arena_free(&a);
+    return rc;
+}
+
+// Job lookup: %n, %%, %+, %prefix-of-command or a bare n; NULL (or empty) for the current job.
+static struct job *job_lookup(const char *spec){
+    if(!spec || !*spec || strcmp(spec, "%") == 0 || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0){
+        for(int k = 0; k < njobs; k++)
+            if(job_table[k]->id == job_current) return job_table[k];
+        return njobs ? job_table[njobs - 1] : NULL;
+    }
+    const char *p = spec[0] == '%' ? spec + 1 : spec;
+    char *end;
+    long id = strtol(p, &end, 10);
+    for(int k = njobs - 1; k >= 0; k--){
+        if(!*end && job_table[k]->id == id) return job_table[k];
+        if(*end && spec[0] == '%' && strncmp(job_table[k]->cmd, p, strlen(p)) == 0) return job_table[k];
+    }
+    return NULL;
+}
+
+static int job_signum(const char *name){
+    static const struct { const char *name; int sig; } sigs[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL }, { "USR1", SIGUSR1 },
+        { "USR2", SIGUSR2 }, { "TERM", SIGTERM }, { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+    };
+    if(isdigit((unsigned char)*name)) return atoi(name);
+    if(strncmp(name, "SIG", 3) == 0) name += 3;
+    for(size_t i = 0; i < ARRAY_LEN(sigs); i++)
+        if(strcmp(name, sigs[i].name) == 0) return sigs[i].sig;
+    return -1;
+}
+
+// jobs [-l], fg/bg [job], wait [job...], and kill [-SIG] when an operand is a
+// %job (other kills are left to the real kill). Returns the status, or -1 when
+// line is none of these.
+static int job_builtin(const char *line, int windows){
+    struct tok t[16];
+    size_t nt = tokenize(line, strlen(line), windows, t, ARRAY_LEN(t));
+    if(nt == 0 || nt > ARRAY_LEN(t)) return -1;
+    char words[MAX_LINE + ARRAY_LEN(t)], *w[ARRAY_LEN(t)];
+    size_t used = 0;
+    for(size_t i = 0; i < nt; i++){
+        size_t n;
+        const char *v = tok_word(line, &t[i], &n);
+        if(t[i].kind != TOK_WORD || used + n + 1 > sizeof(words)) return -1;
+        w[i] = memcpy(words + used, v, n);
+        w[i][n] = 0;
+        used += n + 1;
+    }
+    int argc = (int)nt, rc = 0;
+
+    if(strcmp(w[0], "jobs") == 0){
+        job_reap();
+        for(int k = 0; k < njobs; k++){
+            struct job *j = job_table[k];
+            job_print(j, argc > 1 && strcmp(w[1], "-l") == 0);
+            j->reported = 1;
+            if(j->state == JOB_DONE){ job_remove(j); k--; }
+        }
+        return 0;
+    }
+    if(strcmp(w[0], "fg") == 0 || strcmp(w[0], "bg") == 0){
+        job_reap();
+        struct job *j = job_lookup(argc > 1 ? w[1] : NULL);
+        if(!j){ fprintf(stderr, "%s: %s: no such job\n", w[0], argc > 1 ? w[1] : "current"); return 1; }
+        if(j->state == JOB_DONE){ fprintf(stderr, "%s: job %d has terminated\n", w[0], j->id); return 1; }
+        if(w[0][0] == 'f'){
+            printf("%s\n", j->cmd);
+            fflush(stdout);
+            rc = job_foreground(j, 1);
+            if(j->state == JOB_DONE) job_remove(j);
+            return rc;
+        }
+        if(j->state == JOB_RUNNING){ fprintf(stderr, "bg: job %d already in background\n", j->id); return 0; }
+        job_signal(j, SIGCONT);
+        j->state = JOB_RUNNING;
+        job_current = j->id;
+        printf("[%d]+ %s &\n", j->id, j->cmd);
+        return 0;
+    }
+    if(strcmp(w[0], "wait") == 0){
+        if(argc == 1) return job_wait(NULL);
+        for(int i = 1; i < argc; i++){
+            struct job *j = job_lookup(w[i]);
+            if(!j){ fprintf(stderr, "wait: %s: no such job\n", w[i]); rc = 127; continue; }
+            if((rc = job_wait(j)) == 130 && job_interrupted) break;
+        }
+        return rc;
+    }
+    if(strcmp(w[0], "kill") == 0){
+        int sig = SIGTERM, i = 1, any = 0;
+        if(i + 1 < argc && strcmp(w[i], "-s") == 0) sig = job_signum(w[i + 1]), i += 2;
+        else if(i < argc && w[i][0] == '-' && w[i][1]) sig = job_signum(w[i++] + 1);
+        for(int k = i; k < argc; k++) if(w[k][0] == '%') any = 1;
+        if(!any) return -1;
+        if(sig < 0){ fprintf(stderr, "kill: invalid signal specification\n"); return 1; }
+        for(; i < argc; i++){
+            if(w[i][0] != '%'){
+                if(kill((pid_t)atol(w[i]), sig) != 0){ fprintf(stderr, "kill: %s: %s\n", w[i], strerror(errno)); rc = 1; }
+                continue;
+            }
+            struct job *j = job_lookup(w[i]);
+            if(!j){ fprintf(stderr, "kill: %s: no such job\n", w[i]); rc = 1; continue; }
+            job_signal(j, sig);
+            // a stopped job only acts on the signal once it runs again
+            if(j->state == JOB_STOPPED && sig != SIGSTOP && sig != SIGTSTP && sig != SIGCONT) job_signal(j, SIGCONT);
+        }
+        return rc;
+    }
+    return -1;
+}
+
+// Leaving the terminal: refuse once while jobs are stopped (as bash does), then
+// hang them up. Returns 1 to stay.
+static int job_exit(void){
+    static int warned;
+    int stopped = 0;
+    job_reap();
+    for(int k = 0; k < njobs; k++) stopped |= job_table[k]->state == JOB_STOPPED;
+    if(stopped && !warned){
+        warned = 1;
+        printf("There are stopped jobs.\n");
+        return 1;
+    }
+    for(int k = 0; k < njobs; k++)
+        if(job_table[k]->state == JOB_STOPPED){
+            job_signal(job_table[k], SIGHUP);
+            job_signal(job_table[k], SIGCONT);
+        }
+    return 0;
+}
+#endif
+
+#if !HOST_IS_WINDOWS
+// ---- Coprocess mode ----
+// One long-lived host shell reads commands from fd 3 and reports each exit
+// status on fd 4 as "\036<seq> <status>", so a session pays shell startup once.
+// stdin/stdout/stderr stay the terminal's. Shell state (cd, export) persists
+// between commands, as in a normal shell session.
+
+static const char coproc_script[] =
+    "trap : INT QUIT\n"
+    "while IFS= read -r __cu_seq <&3 && IFS= read -r __cu_line <&3; do\n"
+    "  eval \"$__cu_line\" 3<&- 4>&-\n"
+    "  printf '\\036%s %d\\n' \"$__cu_seq\" \"$?\" >&4\n"
+    "done\n";
+
+static struct {
+    pid_t pid;
+    int cmd_fd, status_fd;
+    unsigned long seq;
+    char buf[256];
+    size_t len;
+} coproc = { -1, -1, -1, 0, {0}, 0 };
+
+static int coproc_active(void){ return coproc.pid > 0; }
+
+static void coproc_stop(void){
+    if(!coproc_active()) return;
+    close(coproc.cmd_fd);  // EOF ends the read loop
+    close(coproc.status_fd);
+    while(waitpid(coproc.pid, NULL, 0) < 0 && errno == EINTR){}
+    coproc.pid = -1;
+    coproc.cmd_fd = coproc.status_fd = -1;
+    coproc.len = 0;
+}
+
+static int coproc_start(void){
+    if(coproc_active()) return 0;
+    int cmdp[2], stp[2];
+    if(pipe(cmdp) != 0){ perror("pipe"); return -1; }
+    if(pipe(stp) != 0){ perror("pipe"); close(cmdp[0]); close(cmdp[1]); return -1; }
+    // keep every end above 4 and close-on-exec so the dup2s below always apply
+    int fds[4] = { cmdp[0], cmdp[1], stp[0], stp[1] };
+    for(int i = 0; i < 4; i++){
+        int nfd = fcntl(fds[i], F_DUPFD_CLOEXEC, 10);
+        close(fds[i]);
+        fds[i] = nfd;
+    }
+    const char *shell = getenv("CUSTARD_COPROC_SHELL");
+    if(!shell || !*shell) shell = "/bin/sh";
+    char *argv[] = { (char *)shell, "-c", (char *)coproc_script, "custard-coproc", NULL };
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, fds[0], 3);
+    posix_spawn_file_actions_adddup2(&fa, fds[3], 4);
+    posix_spawnattr_t attr;
+    exec_spawnattr_init(&attr);
+    pid_t pid;
+    int err = posix_spawnp(&pid, shell, &fa, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    close(fds[0]);
+    close(fds[3]);
+    if(err != 0){
+        fprintf(stderr, "coproc: cannot start %s: %s\n", shell, strerror(err));
+        close(fds[1]);
+        close(fds[2]);
+        return -1;
+    }
+    coproc.pid = pid;
+    coproc.cmd_fd = fds[1];
+    coproc.status_fd = fds[2];
+    coproc.len = 0;
+    return 0;
+}
+
+// Run one command line in the coprocess. Returns its exit status, -1 if the
+// coprocess went away (it is restarted on the next command).
+static int coproc_run(const char *cmd){
+    if(coproc_start() != 0) return -1;
+    unsigned long seq = ++coproc.seq;
+    size_t n = strlen(cmd);
+    char *msg = malloc(n + 32);
+    if(!msg) return -1;
+    int len = snprintf(msg, 32, "%lu\n", seq);
+    for(size_t i = 0; i < n; i++) msg[len++] = cmd[i] == '\n' ? ' ' : cmd[i];
+    msg[len++] = '\n';
+
+    struct sigaction ign, old_int, old_quit, old_pipe;
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigemptyset(&ign.sa_mask);
+    sigaction(SIGINT, &ign, &old_int);
+    sigaction(SIGQUIT, &ign, &old_quit);
+    sigaction(SIGPIPE, &ign, &old_pipe);
+
+    int rc = -1;
+    if(write_all(coproc.cmd_fd, msg, len) == 0){
+        for(;;){
+            char *nl = memchr(coproc.buf, '\n', coproc.len);
+            if(nl){
+                *nl = 0;
+                unsigned long got;
+                int st;
+                int match = coproc.buf[0] == '\036' && sscanf(coproc.buf + 1, "%lu %d", &got, &st) == 2 && got == seq;
+                size_t used = nl + 1 - coproc.buf;
+                memmove(coproc.buf, nl + 1, coproc.len - used);
+                coproc.len -= used;
+                if(match){ rc = st; break; }
+                continue;
+            }
+            if(coproc.len == sizeof(coproc.buf)) coproc.len = 0; // not ours; drop
+            ssize_t r = read(coproc.status_fd, coproc.buf + coproc.len, sizeof(coproc.buf) - coproc.len);
+            if(r < 0 && errno == EINTR) continue;
+            if(r <= 0) break;
+            coproc.len += (size_t)r;
+        }
+    }
+    free(msg);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGQUIT, &old_quit, NULL);
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    if(rc < 0){
+        fprintf(stderr, "[coproc] host shell exited; a new one starts with the next command\n");
+        coproc_stop();
+    }
+    return rc;
+}
+#endif
+
+// Execute a translated host command through the active execution mode.
+static int exec_host(const char *cmd){
+    fflush(stdout); // keep our banners ahead of the child's output
+#if HOST_IS_WINDOWS
+    return system(cmd);
+#else
+    if(coproc_active()) return coproc_run(cmd);
+    return run_command(cmd);
+#endif
+}
+
+static double now_sec(void){
+#if HOST_IS_WINDOWS
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static int cpu_count(void){
+#if HOST_IS_WINDOWS
+    return 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+#if !HOST_IS_WINDOWS
+// ---- Native file commands ----
+// The common read-only commands run inside custard instead of costing a
+// fork+exec each: cat/head/tail/ls/du typed in bash, type/dir typed in cmd, with
+// the output of the command the user typed. cat and type go out with
+// sendfile(); head and tail scan an mmap'd file (tail backwards from the end);
+// ls and dir read the directory with getdents64 and stat the entries relative
+// to the directory fd in one pass. rm -r and rmdir /s share the tree walker
+// below and refuse /, . and .., and anything holding the current directory.
+// cp/copy use reflinks or copy_file_range and copy trees on the walker too;
+// mv/move rename, or copy and delete across filesystems. Lines using options, globs, variables,
+// redirections or pipes we do not handle return -1 and go through translation
+// and the host as before.
+
+#define NATIVE_MAX_ARGS 64
+
+static int native_error(int cmd_style, const char *prog, const char *path, int err){
+    if(!cmd_style) fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(err));
+    else if(err == ENOENT || err == ENOTDIR) fprintf(stderr, "The system cannot find the file specified.\n");
+    else if(err == EACCES || err == EPERM) fprintf(stderr, "Access is denied.\n");
+    else fprintf(stderr, "%s\n", strerror(err));
+    return 1;
+}
+
+// Copy an open file to stdout, zero-copy where the kernel allows it.
+static int native_copy_fd(int fd){
+#ifdef __linux__
+    for(;;){
+        ssize_t k = sendfile(STDOUT_FILENO, fd, NULL, 1 << 30);
+        if(k > 0) continue;
+        if(k == 0) return 0;
+        if(errno == EINTR) continue;
+        if(errno != EINVAL && errno != ENOSYS) return -1;
+        break; // stdout or the file does not support it: plain copy
+    }
+#endif
+    char buf[65536];
+    for(;;){
+        ssize_t k = read(fd, buf, sizeof(buf));
+        if(k < 0){ if(errno == EINTR) continue; return -1; }
+        if(k == 0) return 0;
+        if(write_all(STDOUT_FILENO, buf, (size_t)k) != 0) return -1;
+    }
+}
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#define NATIVE_COPY_BUF (1 << 20)
+
+// Copy the contents of in to out: a reflink where the filesystem shares
+// extents, else copy_file_range (the kernel moves the data, server side on
+// NFS/SMB), else read/write through a large buffer.
+static int native_copy_data(int in, int out, off_t size){
+#ifdef __linux__
+    if(size > 0 && ioctl(out, FICLONE, in) == 0) return 0;
+#ifdef SYS_copy_file_range
+    off_t done = 0;
+    for(;;){
+        long k = syscall(SYS_copy_file_range, in, NULL, out, NULL, (size_t)1 << 30, 0);
+        if(k > 0){ done += k; continue; }
+        if(k == 0) return 0;
+        if(errno == EINTR) continue;
+        if(done || (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF)) return -1;
+        break;
+    }
+#endif
+#else
+    (void)size;
+#endif
+    char *buf = malloc(NATIVE_COPY_BUF);
+    if(!buf) return -1;
+    int rc = 0;
+    for(;;){
+        ssize_t k = read(in, buf, NATIVE_COPY_BUF);
+        if(k < 0 && errno == EINTR) continue;
+        if(k <= 0){ rc = k < 0 ? -1 : 0; break; }
+        if(write_all(out, buf, (size_t)k) != 0){ rc = -1; break; }
+    }
+    int err = errno;
+    free(buf);
+    errno = err;
+    return rc;
+}
+
+// Copy the file or symlink sname (under sdir, described by st) to dname under
+// ddir. preserve keeps mode, owner and times; force replaces a destination
+// that cannot be opened. Returns 0, or -1 with errno set.
+static int native_copy_file(int sdir, const char *sname, int ddir, const char *dname, const struct stat *st,
+                            int preserve, int force){
+    if(S_ISLNK(st->st_mode)){
+        char target[4096];
+        ssize_t k = readlinkat(sdir, sname, target, sizeof(target) - 1);
+        if(k < 0) return -1;
+        target[k] = 0;
+        if(symlinkat(target, ddir, dname) != 0){
+            if(errno != EEXIST || unlinkat(ddir, dname, 0) != 0 || symlinkat(target, ddir, dname) != 0) return -1;
+        }
+        if(preserve){
+            struct timespec ts[2] = { st->st_atim, st->st_mtim };
+            utimensat(ddir, dname, ts, AT_SYMLINK_NOFOLLOW);
+        }
+        return 0;
+    }
+    if(!S_ISREG(st->st_mode)){ errno = ENOTSUP; return -1; }
+    int in = openat(sdir, sname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(in < 0) return -1;
+    int out = openat(ddir, dname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st->st_mode & 0777);
+    if(out < 0 && force && errno != ENOENT && unlinkat(ddir, dname, 0) == 0)
+        out = openat(ddir, dname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st->st_mode & 0777);
+    if(out < 0){ int err = errno; close(in); errno = err; return -1; }
+    int rc = native_copy_data(in, out, st->st_size);
+    int err = errno;
+    if(rc == 0 && preserve){
+        struct timespec ts[2] = { st->st_atim, st->st_mtim };
+        if(fchown(out, st->st_uid, st->st_gid) != 0){} // not ours to give away: keep going, like cp -p
+        fchmod(out, st->st_mode & 07777);
+        futimens(out, ts);
+    }
+    if(close(out) != 0 && rc == 0){ rc = -1; err = errno; }
+    close(in);
+    errno = err;
+    return rc;
+}
+
+static int native_cat(int argc, char **argv, int cmd_style){
+    int rc = 0;
+    if(argc < 2) return -1; // cat from stdin: leave it to the host
+    for(int i = 1; i < argc; i++)
+        if(argv[i][0] == '-' && !cmd_style) return -1; // options
+    for(int i = 1; i < argc; i++){
+        int fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if(fd < 0){ rc = native_error(cmd_style, argv[0], argv[i], errno); continue; }
+        if(fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)){
+            rc = native_error(cmd_style, argv[0], argv[i], cmd_style ? EACCES : EISDIR);
+            close(fd);
+            continue;
+        }
+        if(cmd_style && argc > 2) fprintf(stderr, "\n%s\n\n\n", argv[i]); // type names each file
+        if(native_copy_fd(fd) != 0){
+            int err = errno;
+            close(fd);
+            if(err == EPIPE) return rc;
+            rc = native_error(cmd_style, argv[0], argv[i], err);
+            continue;
+        }
+        close(fd);
+    }
+    return rc;
+}
+
+#ifdef __linux__
+// tail -f/-F: each file, and the directory it lives in (to see it replaced or
+// recreated), is watched through one inotify descriptor that shares an epoll
+// loop with a signalfd for Ctrl-C. Wakeups are spaced at least 10 ms apart;
+// each drains the queued events and then reads every touched file once, in
+// 256 KB preads, so a busy log costs a few reads per batch rather than work
+// per write. Files are followed by name: a
+// truncated file is read again from the top, and one replaced by rotation is
+// finished before the new file at that path is picked up.
+
+#define FOLLOW_BUF (256 * 1024)
+#define FOLLOW_BATCH_NS 10000000 // read passes at most every 10 ms, whatever the write rate
+
+struct follow_file {
+    const char *path, *base;
+    int fd, wd, dir_wd;
+    int dirty, renamed;
+    off_t pos;
+    dev_t dev;
+    ino_t ino;
+};
+
+// The inotify descriptor and a wd -> file table, so an event finds its file
+// without a scan (wds are small integers handed out in increasing order).
+struct follow_watches {
+    int in;
+    struct follow_file **by_wd;
+    int cap;
+};
+
+static void follow_watch(struct follow_watches *w, struct follow_file *f){
+    if(f->wd >= 0){
+        inotify_rm_watch(w->in, f->wd);
+        if(f->wd < w->cap) w->by_wd[f->wd] = NULL;
+    }
+    f->wd = inotify_add_watch(w->in, f->path, IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+    if(f->wd < 0) return;
+    if(f->wd >= w->cap){
+        int cap = f->wd * 2 + 16;
+        struct follow_file **nb = realloc(w->by_wd, (size_t)cap * sizeof(*nb));
+        if(!nb) return;
+        memset(nb + w->cap, 0, (size_t)(cap - w->cap) * sizeof(*nb));
+        w->by_wd = nb;
+        w->cap = cap;
+    }
+    w->by_wd[f->wd] = f;
+}
+
+// Print whatever was appended to f since the last read.
+static int follow_read(struct follow_file *f, char *buf, const struct follow_file **last, int headers){
+    struct stat st;
+    if(f->fd < 0) return 0;
+    if(fstat(f->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < f->pos){
+        fprintf(stderr, "tail: %s: file truncated\n", f->path);
+        f->pos = 0;
+    }
+    for(;;){
+        ssize_t k = pread(f->fd, buf, FOLLOW_BUF, f->pos);
+        if(k < 0 && errno == EINTR) continue;
+        if(k <= 0) return k < 0 && errno != EAGAIN ? -1 : 0;
+        if(headers && *last != f){
+            char hdr[MAX_LINE];
+            int hl = snprintf(hdr, sizeof(hdr), "\n==> %s <==\n", f->path);
+            write_all(STDOUT_FILENO, hdr, (size_t)hl < sizeof(hdr) ? (size_t)hl : sizeof(hdr) - 1);
+        }
+        *last = f;
+        if(write_all(STDOUT_FILENO, buf, (size_t)k) != 0) return -1;
+        f->pos += k;
+    }
+}
+
+// The name may now refer to a different file: finish the old one and follow the new.
+static void follow_reopen(struct follow_watches *w, struct follow_file *f, char *buf, const struct follow_file **last, int headers){
+    struct stat st;
+    if(stat(f->path, &st) != 0 || !S_ISREG(st.st_mode)) return; // gone for now; wait for it to come back
+    if(f->fd >= 0 && st.st_dev == f->dev && st.st_ino == f->ino) return;
+    int fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return;
+    if(f->fd >= 0){
+        follow_read(f, buf, last, headers);
+        close(f->fd);
+        fprintf(stderr, "tail: '%s' has been replaced;  following new file\n", f->path);
+    } else {
+        fprintf(stderr, "tail: '%s' has appeared;  following new file\n", f->path);
+    }
+    fstat(fd, &st);
+    f->fd = fd;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->pos = 0;
+    follow_watch(w, f);
+    follow_read(f, buf, last, headers);
+}
+
+// Follow n files until Ctrl-C. Each entry comes with the descriptor and
+// offset the initial tail output stopped at (fd -1 if it could not be opened).
+static int native_follow(struct follow_file *ff, int n, int last_shown){
+    int in = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    char *buf = malloc(FOLLOW_BUF);
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct follow_watches w = { in, NULL, 0 };
+    int ok = in >= 0 && ep >= 0 && sfd >= 0 && buf;
+    ev.data.fd = in;
+    ok = ok && epoll_ctl(ep, EPOLL_CTL_ADD, in, &ev) == 0;
+    ev.data.fd = sfd;
+    ok = ok && epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev) == 0;
+    if(!ok) perror("tail: cannot follow");
+
+    const struct follow_file *last = last_shown >= 0 ? &ff[last_shown] : NULL;
+    int headers = n > 1;
+    for(int i = 0; ok && i < n; i++){
+        struct follow_file *f = &ff[i];
+        const char *slash = strrchr(f->path, '/');
+        f->base = slash ? slash + 1 : f->path;
+        char dir[MAX_LINE];
+        snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - f->path) + (slash == f->path) : 1,
+                 slash ? f->path : ".");
+        f->wd = -1;
+        f->dir_wd = inotify_add_watch(in, dir, IN_CREATE | IN_MOVED_TO);
+        f->dirty = f->renamed = 0;
+        if(f->fd >= 0){
+            struct stat st;
+            fstat(f->fd, &st);
+            f->dev = st.st_dev;
+            f->ino = st.st_ino;
+            follow_watch(&w, f);
+        }
+    }
+
+    char events[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct timespec last_pass = { 0, 0 };
+    while(ok){
+        struct epoll_event ready[2];
+        int nr = epoll_wait(ep, ready, 2, -1);
+        if(nr < 0){ if(errno == EINTR) continue; break; }
+        int stop = 0;
+        for(int r = 0; r < nr; r++) if(ready[r].data.fd == sfd) stop = 1;
+        if(stop){
+            struct signalfd_siginfo si;
+            if(read(sfd, &si, sizeof(si)) < 0){}
+            break;
+        }
+        // let writes pile up if the previous pass was recent
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long since = (now.tv_sec - last_pass.tv_sec) * 1000000000LL + (now.tv_nsec - last_pass.tv_nsec);
+        if(since < FOLLOW_BATCH_NS){
+            struct timespec pause = { 0, (long)(FOLLOW_BATCH_NS - since) };
+            nanosleep(&pause, NULL);
+        }
+        for(;;){
+            ssize_t len = read(in, events, sizeof(events));
+            if(len <= 0) break;
+            for(char *p = events; p < events + len; ){
+                const struct inotify_event *e = (const struct inotify_event *)p;
+                p += sizeof(*e) + e->len;
+                struct follow_file *f = e->wd >= 0 && e->wd < w.cap ? w.by_wd[e->wd] : NULL;
+                if(f && f->wd == e->wd){
+                    f->dirty = 1;
+                    if(e->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) f->renamed = 1;
+                    if(e->mask & IN_IGNORED){ w.by_wd[e->wd] = NULL; f->wd = -1; }
+                    continue;
+                }
+                // queue overflow, or a directory event: match by name
+                for(int i = 0; i < n; i++){
+                    if(e->mask & IN_Q_OVERFLOW) ff[i].dirty = ff[i].renamed = 1;
+                    else if(e->wd == ff[i].dir_wd && e->len && strcmp(e->name, ff[i].base) == 0) ff[i].renamed = 1;
+                }
+            }
+        }
+        for(int i = 0; i < n; i++){
+            struct follow_file *f = &ff[i];
+            if(f->dirty && follow_read(f, buf, &last, headers) != 0 && errno == EPIPE) ok = 0;
+            if(f->renamed) follow_reopen(&w, f, buf, &last, headers);
+            f->dirty = f->renamed = 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &last_pass);
+    }
+
+    for(int i = 0; i < n; i++) if(ff[i].fd >= 0) close(ff[i].fd);
+    if(sfd >= 0) close(sfd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    if(ep >= 0) close(ep);
+    if(in >= 0) close(in);
+    free(w.by_wd);
+    free(buf);
+    return 0;
+}
+#endif
+
+// head/tail [-n N | -N | -nN] [-n +N for tail] [-f | -F for tail] FILE...
+static int native_head_tail(int argc, char **argv, int tail){
+    long n = 10;
+    int from_start = 0, nfiles = 0, follow = 0, stopped = 0;
+    char *files[NATIVE_MAX_ARGS];
+#ifdef __linux__
+    struct follow_file ff[NATIVE_MAX_ARGS];
+#endif
+    for(int i = 1; i < argc; i++){
+        const char *a = argv[i], *num = NULL;
+        if(tail && (strcmp(a, "-f") == 0 || strcmp(a, "-F") == 0)){ follow = 1; continue; }
+        if(strcmp(a, "-n") == 0 && i + 1 < argc) num = argv[++i];
+        else if(strncmp(a, "-n", 2) == 0 && a[2]) num = a + 2;
+        else if(a[0] == '-' && isdigit((unsigned char)a[1])) num = a + 1;
+        else if(a[0] == '-') return -1;
+        else { files[nfiles++] = argv[i]; continue; }
+        if(tail && *num == '+'){ from_start = 1; num++; }
+        char *end;
+        n = strtol(num, &end, 10);
+        if(*end || n < 0 || *num == '-') return -1;
+    }
+    if(nfiles == 0) return -1;
+#ifndef __linux__
+    if(follow) return -1;
+#endif
+    // everything that is not a regular file (pipes, devices) goes to the host
+    for(int i = 0; i < nfiles; i++){
+        struct stat st;
+        if(stat(files[i], &st) == 0 && !S_ISREG(st.st_mode)) return -1;
+    }
+    int rc = 0;
+    for(int i = 0; i < nfiles; i++){
+        if(nfiles > 1){
+            char hdr[MAX_LINE];
+            int hl = snprintf(hdr, sizeof(hdr), "%s==> %s <==\n", i ? "\n" : "", files[i]);
+            write_all(STDOUT_FILENO, hdr, (size_t)hl < sizeof(hdr) ? (size_t)hl : sizeof(hdr) - 1);
+        }
+        int fd = open(files[i], O_RDONLY | O_CLOEXEC);
+        struct stat st;
+#ifdef __linux__
+        ff[i].path = files[i];
+        ff[i].fd = -1;
+#endif
+        if(fd < 0 || fstat(fd, &st) != 0){
+            fprintf(stderr, "%s: cannot open '%s' for reading: %s\n", argv[0], files[i], strerror(errno));
+            rc = 1;
+            if(fd >= 0) close(fd);
+            continue;
+        }
+        size_t size = (size_t)st.st_size;
+        const char *m = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+#ifdef __linux__
+        if(follow){ ff[i].fd = fd; ff[i].pos = (off_t)size; } // keep reading where the output stops
+        else
+#endif
+        close(fd);
+        if(m == MAP_FAILED){ rc = native_error(0, argv[0], files[i], errno); continue; }
+        size_t from = 0, to = size;
+        if(!tail || from_start){
+            // forward: the first n lines, or everything from line n on
+            long want = from_start ? (n > 0 ? n - 1 : 0) : n;
+            const char *p = m, *e = m + size;
+            while(want > 0 && p < e){
+                const char *nl = memchr(p, '\n', (size_t)(e - p));
+                p = nl ? nl + 1 : e;
+                want--;
+            }
+            if(from_start) from = (size_t)(p - m); else to = (size_t)(p - m);
+        } else {
+            // backward from the end; a final newline does not start a line
+            size_t end = size;
+            if(end && m[end - 1] == '\n') end--;
+            long want = n;
+            from = size;
+            if(want > 0){
+                from = 0;
+                while(end > 0){
+                    if(m[--end] != '\n') continue;
+                    if(--want == 0){ from = end + 1; break; }
+                }
+            }
+        }
+        int werr = to > from && write_all(STDOUT_FILENO, m + from, to - from) != 0;
+        if(size) munmap((void *)m, size);
+        if(werr){
+            if(errno != EPIPE) rc = native_error(0, argv[0], files[i], errno);
+            nfiles = i + 1;
+            stopped = 1;
+            break;
+        }
+    }
+#ifdef __linux__
+    if(follow && !stopped) return native_follow(ff, nfiles, nfiles - 1) || rc;
+    for(int i = 0; i < nfiles; i++) if(follow && ff[i].fd >= 0) close(ff[i].fd);
+#endif
+    return rc;
+}
+
+struct native_dent {
+    const char *name;
+    unsigned char type;   // DT_*
+    struct stat st;
+};
+
+#ifdef __linux__
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+static int native_dent_cmp(const void *a, const void *b){
+    return strcmp(((const struct native_dent *)a)->name, ((const struct native_dent *)b)->name);
+}
+
+struct native_dir_list { struct native_dent *d; size_t n, cap; int all; struct arena *a; };
+
+static int native_dir_add(struct native_dir_list *l, const char *name, unsigned char type){
+    if(name[0] == '.'){
+        int dots = name[1] == 0 || (name[1] == '.' && name[2] == 0);
+        if(!l->all || (l->all == 2 && dots)) return 0;
+    }
+    if(l->n == l->cap){
+        size_t cap = l->cap ? l->cap * 2 : 64;
+        struct native_dent *nd = realloc(l->d, cap * sizeof(*nd));
+        if(!nd) return -1;
+        l->d = nd;
+        l->cap = cap;
+    }
+    if(!(l->d[l->n].name = arena_strndup(l->a, name, strlen(name)))) return -1;
+    l->d[l->n++].type = type;
+    return 0;
+}
+
+// Read the directory open on dfd into *out (names in a), sorted by name,
+// stat'ing each entry when want_stat is set. Hidden entries only with all (1:
+// with . and .., 2: without them). Returns the count, or -1 with errno set.
+static long native_read_dirfd(int dfd, int all, int want_stat, struct arena *a, struct native_dent **out){
+    struct native_dir_list l = { NULL, 0, 0, all, a };
+    int err = 0;
+#ifdef __linux__
+    char buf[32768] __attribute__((aligned(8)));
+    for(;;){
+        long k = syscall(SYS_getdents64, dfd, buf, sizeof(buf));
+        if(k < 0 && errno == EINTR) continue;
+        if(k < 0) err = errno;
+        if(k <= 0) break;
+        for(long off = 0; off < k && !err; ){
+            struct linux_dirent64 *e = (struct linux_dirent64 *)(buf + off);
+            off += e->d_reclen;
+            if(native_dir_add(&l, e->d_name, e->d_type) != 0) err = ENOMEM;
+        }
+        if(err) break;
+    }
+#else
+    int dup_fd = dup(dfd);
+    DIR *dir = dup_fd >= 0 ? fdopendir(dup_fd) : NULL;
+    if(!dir){ err = errno; if(dup_fd >= 0) close(dup_fd); }
+    for(struct dirent *e; dir && !err && (e = readdir(dir)); )
+        if(native_dir_add(&l, e->d_name, e->d_type) != 0) err = ENOMEM;
+    if(dir) closedir(dir);
+#endif
+    if(err){ free(l.d); errno = err; return -1; }
+    struct native_dent *d = l.d;
+    size_t n = l.n;
+    qsort(d, n, sizeof(*d), native_dent_cmp);
+    for(size_t i = 0; i < n; i++){
+        if(!want_stat && d[i].type != DT_UNKNOWN) continue;
+        if(fstatat(dfd, d[i].name, &d[i].st, AT_SYMLINK_NOFOLLOW) != 0) memset(&d[i].st, 0, sizeof(d[i].st));
+        if(d[i].type == DT_UNKNOWN) d[i].type = S_ISDIR(d[i].st.st_mode) ? DT_DIR : S_ISLNK(d[i].st.st_mode) ? DT_LNK : DT_REG;
+    }
+    *out = d;
+    return (long)n;
+}
+
+static long native_read_dir(const char *path, int all, int want_stat, struct arena *a, struct native_dent **out){
+    int dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dfd < 0) return -1;
+    long n = native_read_dirfd(dfd, all, want_stat, a, out);
+    int err = errno;
+    close(dfd);
+    errno = err;
+    return n;
+}
+
+static const char *native_user(uid_t uid, char *buf, size_t n){
+    static uid_t last = (uid_t)-1;
+    static char name[64];
+    if(uid != last){
+        struct passwd *pw = getpwuid(uid);
+        if(pw) snprintf(name, sizeof(name), "%s", pw->pw_name); else snprintf(name, sizeof(name), "%u", (unsigned)uid);
+        last = uid;
+    }
+    snprintf(buf, n, "%s", name);
+    return buf;
+}
+
+static const char *native_group(gid_t gid, char *buf, size_t n){
+    static gid_t last = (gid_t)-1;
+    static char name[64];
+    if(gid != last){
+        struct group *gr = getgrgid(gid);
+        if(gr) snprintf(name, sizeof(name), "%s", gr->gr_name); else snprintf(name, sizeof(name), "%u", (unsigned)gid);
+        last = gid;
+    }
+    snprintf(buf, n, "%s", name);
+    return buf;
+}
+
+static void native_mode(mode_t m, char *s){
+    s[0] = S_ISDIR(m) ? 'd' : S_ISLNK(m) ? 'l' : S_ISCHR(m) ? 'c' : S_ISBLK(m) ? 'b' :
+           S_ISFIFO(m) ? 'p' : S_ISSOCK(m) ? 's' : '-';
+    const char *rwx = "rwxrwxrwx";
+    for(int i = 0; i < 9; i++) s[i + 1] = (m & (0400 >> i)) ? rwx[i] : '-';
+    if(m & S_ISUID) s[3] = (m & S_IXUSR) ? 's' : 'S';
+    if(m & S_ISGID) s[6] = (m & S_IXGRP) ? 's' : 'S';
+    if(m & S_ISVTX) s[9] = (m & S_IXOTH) ? 't' : 'T';
+    s[10] = 0;
+}
+
+// ls [-a] [-A] [-l] [-1] [DIR]
+static int native_ls(int argc, char **argv){
+    int all = 0, lng = 0, one = !isatty(STDOUT_FILENO);
+    const char *path = NULL;
+    for(int i = 1; i < argc; i++){
+        if(argv[i][0] == '-' && argv[i][1]){
+            for(const char *o = argv[i] + 1; *o; o++){
+                if(*o == 'a') all = 1;
+                else if(*o == 'A') all = all == 1 ? 1 : 2;
+                else if(*o == 'l') lng = 1;
+                else if(*o == '1') one = 1;
+                else return -1;
+            }
+        } else if(path) return -1; // several operands: leave the layout to ls
+        else path = argv[i];
+    }
+    if(!path) path = ".";
+    struct stat pst;
+    if(lstat(path, &pst) != 0){
+        fprintf(stderr, "ls: cannot access '%s': %s\n", path, strerror(errno));
+        return 2;
+    }
+    if(!S_ISDIR(pst.st_mode)) return -1; // single files, symlinks to dirs: host ls
+
+    struct arena a = { NULL };
+    struct native_dent *d;
+    long n = native_read_dir(path, all, lng, &a, &d);
+    if(n < 0){
+        fprintf(stderr, "ls: cannot open directory '%s': %s\n", path, strerror(errno));
+        arena_free(&a);
+        return 2;
+    }
+    struct sbuf out = { NULL, 0, 0, NULL };
+    if(lng){
+        int wl = 1, wu = 1, wg = 1, ws = 1;
+        long long blocks = 0;
+        char ub[64], gb[64];
+        for(long i = 0; i < n; i++){
+            char tmp[32];
+            int k;
+            if((k = snprintf(tmp, sizeof(tmp), "%lu", (unsigned long)d[i].st.st_nlink)) > wl) wl = k;
+            if((k = snprintf(tmp, sizeof(tmp), "%lld", (long long)d[i].st.st_size)) > ws) ws = k;
+            if((k = (int)strlen(native_user(d[i].st.st_uid, ub, sizeof(ub)))) > wu) wu = k;
+            if((k = (int)strlen(native_group(d[i].st.st_gid, gb, sizeof(gb)))) > wg) wg = k;
+            blocks += d[i].st.st_blocks;
+        }
+        sb_printf(&out, "total %lld\n", blocks / 2);
+        time_t now = time(NULL);
+        for(long i = 0; i < n; i++){
+            const struct stat *st = &d[i].st;
+            char mode[11], when[32];
+            native_mode(st->st_mode, mode);
+            struct tm tm;
+            localtime_r(&st->st_mtime, &tm);
+            int recent = st->st_mtime > now - 15778476 && st->st_mtime <= now + 3600; // six months
+            strftime(when, sizeof(when), recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+            sb_printf(&out, "%s %*lu %-*s %-*s %*lld %s %s", mode, wl, (unsigned long)st->st_nlink,
+                      wu, native_user(st->st_uid, ub, sizeof(ub)), wg, native_group(st->st_gid, gb, sizeof(gb)),
+                      ws, (long long)st->st_size, when, d[i].name);
+            if(S_ISLNK(st->st_mode)){
+                char target[4096];
+                int dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                ssize_t tl = dfd >= 0 ? readlinkat(dfd, d[i].name, target, sizeof(target)) : -1;
+                if(dfd >= 0) close(dfd);
+                if(tl > 0){ sb_puts(&out, " -> "); sb_put(&out, target, (size_t)tl); }
+            }
+            sb_putc(&out, '\n');
+        }
+    } else if(one){
+        for(long i = 0; i < n; i++){ sb_puts(&out, d[i].name); sb_putc(&out, '\n'); }
+    } else {
+        // columns, filled top to bottom like ls -C
+        size_t w = 1;
+        for(long i = 0; i < n; i++) if(strlen(d[i].name) > w) w = strlen(d[i].name);
+        size_t colw = w + 2, width = (size_t)term_cols();
+        long cols = width > colw ? (long)(width / colw) : 1;
+        long rows = n ? (n + cols - 1) / cols : 0;
+        for(long r = 0; r < rows; r++){
+            for(long c = 0; c < cols; c++){
+                long i = c * rows + r;
+                if(i >= n) break;
+                sb_puts(&out, d[i].name);
+                if(c < cols - 1 && i + rows < n) sb_printf(&out, "%*s", (int)(colw - strlen(d[i].name)), "");
+            }
+            sb_putc(&out, '\n');
+        }
+    }
+    int rc = out.len && write_all(STDOUT_FILENO, out.p, out.len) != 0 && errno != EPIPE;
+    free(out.p);
+    free(d);
+    arena_free(&a);
+    return rc;
+}
+
+// 1234567 -> "1,234,567"
+static const char *native_commas(unsigned long long v, char *buf){
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), "%llu", v), k = 0;
+    for(int i = 0; i < n; i++){
+        if(i && (n - i) % 3 == 0) buf[k++] = ',';
+        buf[k++] = tmp[i];
+    }
+    buf[k] = 0;
+    return buf;
+}
+
+// ---- Parallel tree walker (du, dir /s, rm -r, cp -r) ----
+// Directories are shared out to a pool of workers with one deque each: a
+// worker pushes the subdirectories it finds onto its own deque and pops from
+// that end (depth first, warm dentries), and an idle worker steals from the
+// other end of someone else's. Each directory is read with getdents64 and its
+// entries stat'ed relative to the directory fd (native_read_dir). The result
+// is a tree of directory nodes, children in name order, walked once the pool
+// has drained: du sums subtrees bottom-up, dir /s prints the listings the
+// workers already formatted. Files with several links are counted once,
+// through an inode set split into locked shards. rm -r deletes as it goes:
+// files are unlinked relative to the directory fd while it is read, and each
+// directory counts its unfinished children, so whichever worker finishes
+// the last one removes it and carries on up the tree. cp -r works the same
+// way round: small files are copied between the two directory fds by the
+// worker that read the directory, large ones are queued so several workers
+// share them, and a directory gets its final mode and times once its last
+// child is in.
+
+enum { WALK_DU, WALK_DIR, WALK_RM, WALK_CP };
+#define WALK_CP_SPLIT (1 << 20) // cp: files at least this big get a worker of their own
+#define WALK_SHARDS 64
+
+struct walk_node {
+    struct walk_node *child, *next;   // subdirectories, in name order
+    struct walk_node *parent;
+    char *path;
+    char *dst;                        // cp: where it goes
+    struct stat *st;                  // cp: the source, a directory or a large file
+    long remaining;                   // rm, cp: children not yet done, +1 until its files are (atomic)
+    int failed;                       // rm, cp: something below failed
+    unsigned long long blocks;        // du: 512-byte blocks of the directory and its files
+    char *text;                       // dir /s: this directory's listing
+    size_t text_len;
+    long files, dirs;
+    unsigned long long bytes;
+};
+
+struct walk_deque {
+    pthread_mutex_t mu;
+    struct walk_node **items;
+    size_t head, tail, cap;
+};
+
+struct walk_inodes {
+    pthread_mutex_t mu;
+    struct walk_ino { dev_t dev; ino_t ino; int used; } *slot;
+    size_t cap, count;
+};
+
+struct walk;
+
+struct walk_worker {
+    struct walk *w;
+    int id;
+    struct arena keep, scratch; // nodes and listings; per-directory names
+};
+
+struct walk {
+    int mode, all, bare, cmd_style;
+    int every_inode;    // du with several operands: directories are counted once too
+    int nworkers;
+    struct walk_deque *q;
+    struct walk_worker *workers;
+    struct walk_inodes ino[WALK_SHARDS];
+    long pending;   // directories queued or being read (atomic)
+    int errors;     // atomic
+    long removed_files, removed_dirs; // rm (atomic)
+    double started, next_report;      // rm progress, reported by worker 0
+    int reported;
+    int preserve, force;              // cp
+    mode_t umask;
+    long copied_files;                // cp (atomic)
+    unsigned long long copied_bytes;  // cp (atomic)
+};
+
+static void walk_push(struct walk_deque *q, struct walk_node *n){
+    pthread_mutex_lock(&q->mu);
+    if(q->tail == q->cap){
+        if(q->head > 0){
+            memmove(q->items, q->items + q->head, (q->tail - q->head) * sizeof(*q->items));
+            q->tail -= q->head;
+            q->head = 0;
+        }
+        if(q->tail == q->cap){
+            size_t cap = q->cap ? q->cap * 2 : 256;
+            struct walk_node **ni = realloc(q->items, cap * sizeof(*ni));
+            if(!ni){ pthread_mutex_unlock(&q->mu); abort(); }
+            q->items = ni;
+            q->cap = cap;
+        }
+    }
+    q->items[q->tail++] = n;
+    pthread_mutex_unlock(&q->mu);
+}
+
+// Owner end (newest first) or, when stealing, the other end (oldest first).
+static struct walk_node *walk_take(struct walk_deque *q, int steal){
+    struct walk_node *n = NULL;
+    pthread_mutex_lock(&q->mu);
+    if(q->head < q->tail) n = steal ? q->items[q->head++] : q->items[--q->tail];
+    if(q->head == q->tail) q->head = q->tail = 0;
+    pthread_mutex_unlock(&q->mu);
+    return n;
+}
+
+// 1 the first time an inode is seen.
+static int walk_first_link(struct walk *w, dev_t dev, ino_t ino){
+    uint64_t h = (uint64_t)ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)dev * 0xc2b2ae3d27d4eb4fULL;
+    h ^= h >> 29;
+    struct walk_inodes *s = &w->ino[h % WALK_SHARDS];
+    int fresh = 1;
+    pthread_mutex_lock(&s->mu);
+    if((s->count + 1) * 2 > s->cap){
+        size_t cap = s->cap ? s->cap * 2 : 1024;
+        struct walk_ino *ns = calloc(cap, sizeof(*ns));
+        if(ns){
+            for(size_t i = 0; i < s->cap; i++){
+                if(!s->slot[i].used) continue;
+                uint64_t oh = (uint64_t)s->slot[i].ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)s->slot[i].dev * 0xc2b2ae3d27d4eb4fULL;
+                oh ^= oh >> 29;
+                size_t j = (size_t)(oh / WALK_SHARDS) & (cap - 1);
+                while(ns[j].used) j = (j + 1) & (cap - 1);
+                ns[j] = s->slot[i];
+            }
+            free(s->slot);
+            s->slot = ns;
+            s->cap = cap;
+        }
+    }
+    if(s->cap && (s->count + 1) * 2 <= s->cap){
+        size_t j = (size_t)(h / WALK_SHARDS) & (s->cap - 1);
+        while(s->slot[j].used && !(s->slot[j].ino == ino && s->slot[j].dev == dev)) j = (j + 1) & (s->cap - 1);
+        if(s->slot[j].used) fresh = 0;
+        else { s->slot[j].dev = dev; s->slot[j].ino = ino; s->slot[j].used = 1; s->count++; }
+    }
+    pthread_mutex_unlock(&s->mu);
+    return fresh;
+}
+
+// dir's listing of one directory: header, entries and the File(s) line.
+// Hidden entries only with all; . and .. always.
+static void native_dir_listing(struct sbuf *out, const char *abs, const struct native_dent *d, long n, int all,
+                               long *files, long *dirs, unsigned long long *bytes){
+    char num[32];
+    sb_printf(out, " Directory of %s\n\n", abs);
+    long nf = 0;
+    unsigned long long nb = 0;
+    for(long i = 0; i < n; i++){
+        int dots = d[i].name[0] == '.' && (d[i].name[1] == 0 || (d[i].name[1] == '.' && d[i].name[2] == 0));
+        if(!all && !dots && d[i].name[0] == '.') continue;
+        char when[32];
+        struct tm tm;
+        localtime_r(&d[i].st.st_mtime, &tm);
+        strftime(when, sizeof(when), "%m/%d/%Y  %I:%M %p", &tm);
+        if(S_ISDIR(d[i].st.st_mode)){
+            sb_printf(out, "%s    <DIR>          %s\n", when, d[i].name);
+            (*dirs)++;
+        } else {
+            sb_printf(out, "%s %17s %s\n", when, native_commas((unsigned long long)d[i].st.st_size, num), d[i].name);
+            nf++;
+            nb += (unsigned long long)d[i].st.st_size;
+        }
+    }
+    sb_printf(out, "%16ld File(s) %14s bytes\n", nf, native_commas(nb, num));
+    *files += nf;
+    *bytes += nb;
+}
+
+static void walk_rm_error(struct walk *w, const char *path, const char *name, int err){
+    const char *what = w->mode == WALK_CP ? "copy" : "remove";
+    if(w->cmd_style) fprintf(stderr, "%s%s%s - %s\n", path, name ? "/" : "", name ? name : "",
+                             err == EACCES || err == EPERM ? "Access is denied." : strerror(err));
+    else fprintf(stderr, "%s: cannot %s '%s%s%s': %s\n", w->mode == WALK_CP ? "cp" : "rm", what,
+                 path, name ? "/" : "", name ? name : "", strerror(err));
+    __atomic_fetch_add(&w->errors, 1, __ATOMIC_RELAXED);
+}
+
+// One piece of node is finished; once nothing is left inside, remove it (rm)
+// or give it its final attributes (cp), and go on to its parent.
+static void walk_done(struct walk *w, struct walk_node *node){
+    while(node && __atomic_sub_fetch(&node->remaining, 1, __ATOMIC_ACQ_REL) == 0){
+        struct walk_node *p = node->parent;
+        int failed = __atomic_load_n(&node->failed, __ATOMIC_ACQUIRE);
+        if(w->mode == WALK_CP){
+            const struct stat *st = node->st;
+            if(S_ISDIR(st->st_mode) && w->preserve){
+                struct timespec ts[2] = { st->st_atim, st->st_mtim };
+                if(lchown(node->dst, st->st_uid, st->st_gid) != 0){}
+                chmod(node->dst, st->st_mode & 07777);
+                utimensat(AT_FDCWD, node->dst, ts, 0);
+            } else if(S_ISDIR(st->st_mode) && (st->st_mode & S_IRWXU) != S_IRWXU){
+                chmod(node->dst, st->st_mode & 0777 & ~w->umask); // it was made writable to fill it
+            }
+        } else if(!failed){
+            if(rmdir(node->path) == 0) __atomic_fetch_add(&w->removed_dirs, 1, __ATOMIC_RELAXED);
+            else { walk_rm_error(w, node->path, NULL, errno); failed = 1; }
+        }
+        if(failed && p) __atomic_store_n(&p->failed, 1, __ATOMIC_RELEASE);
+        node = p;
+    }
+}
+
+static char *walk_join(struct arena *a, const char *dir, const char *name){
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    char *p = arena_alloc(a, dlen + nlen + 2);
+    if(!p) return NULL;
+    memcpy(p, dir, dlen);
+    p[dlen] = '/';
+    memcpy(p + dlen + 1, name, nlen + 1);
+    return p;
+}
+
+// cp: copy one directory's files and queue its subdirectories and large
+// files; or copy one large file.
+static void walk_cp(struct walk_worker *ww, struct walk_node *node){
+    struct walk *w = ww->w;
+    if(!S_ISDIR(node->st->st_mode)){
+        if(native_copy_file(AT_FDCWD, node->path, AT_FDCWD, node->dst, node->st, w->preserve, w->force) == 0){
+            __atomic_fetch_add(&w->copied_files, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&w->copied_bytes, (unsigned long long)node->st->st_size, __ATOMIC_RELAXED);
+        } else {
+            walk_rm_error(w, node->path, NULL, errno);
+            __atomic_store_n(&node->failed, 1, __ATOMIC_RELEASE);
+        }
+        walk_done(w, node);
+        return;
+    }
+    struct native_dent *d;
+    int sfd = -1, dfd = -1;
+    long n = -1;
+    if(mkdir(node->dst, (node->st->st_mode & 0777) | S_IRWXU) != 0 && errno != EEXIST){
+        fprintf(stderr, w->cmd_style ? "%s - %s\n" : "cp: cannot create directory '%s': %s\n", node->dst, strerror(errno));
+        __atomic_fetch_add(&w->errors, 1, __ATOMIC_RELAXED);
+    } else if((dfd = open(node->dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+              (sfd = open(node->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0 ||
+              (n = native_read_dirfd(sfd, 2, 1, &ww->scratch, &d)) < 0){
+        walk_rm_error(w, dfd < 0 ? node->dst : node->path, NULL, errno);
+    }
+    if(n < 0){
+        __atomic_store_n(&node->failed, 1, __ATOMIC_RELEASE);
+        if(sfd >= 0) close(sfd);
+        if(dfd >= 0) close(dfd);
+        arena_reset(&ww->scratch);
+        walk_done(w, node);
+        return;
+    }
+    struct walk_node *queued = NULL;
+    long more = 0, files = 0;
+    unsigned long long bytes = 0;
+    for(long i = 0; i < n; i++){
+        const struct stat *st = &d[i].st;
+        const char *name = d[i].name;
+        if(S_ISDIR(st->st_mode) || (S_ISREG(st->st_mode) && st->st_size >= WALK_CP_SPLIT)){
+            struct walk_node *c = arena_alloc(&ww->keep, sizeof(*c));
+            struct stat *cst = arena_alloc(&ww->keep, sizeof(*cst));
+            char *p = walk_join(&ww->keep, node->path, name), *q = walk_join(&ww->keep, node->dst, name);
+            if(!c || !cst || !p || !q){ __atomic_store_n(&node->failed, 1, __ATOMIC_RELEASE); continue; }
+            memset(c, 0, sizeof(*c));
+            *cst = *st;
+            c->path = p;
+            c->dst = q;
+            c->st = cst;
+            c->parent = node;
+            c->remaining = 1;
+            c->next = queued;
+            queued = c;
+            more++;
+        } else if(native_copy_file(sfd, name, dfd, name, st, w->preserve, w->force) == 0){
+            files++;
+            bytes += S_ISREG(st->st_mode) ? (unsigned long long)st->st_size : 0;
+        } else {
+            walk_rm_error(w, node->path, name, errno);
+            __atomic_store_n(&node->failed, 1, __ATOMIC_RELEASE);
+        }
+    }
+    close(sfd);
+    close(dfd);
+    free(d);
+    arena_reset(&ww->scratch);
+    __atomic_fetch_add(&w->copied_files, files, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&w->copied_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&node->remaining, more, __ATOMIC_ACQ_REL);
+    for(struct walk_node *c = queued, *next; c; c = next){
+        next = c->next;
+        __atomic_fetch_add(&w->pending, 1, __ATOMIC_RELAXED);
+        walk_push(&w->q[ww->id], c);
+    }
+    walk_done(w, node);
+}
+
+static void walk_rm_dir(struct walk_worker *ww, struct walk_node *node){
+    struct walk *w = ww->w;
+    struct native_dent *d;
+    int dfd = open(node->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    long n = dfd < 0 ? -1 : native_read_dirfd(dfd, 2, 0, &ww->scratch, &d);
+    if(n < 0){
+        walk_rm_error(w, node->path, NULL, errno);
+        __atomic_store_n(&node->failed, 1, __ATOMIC_RELEASE);
+        if(dfd >= 0) close(dfd);
+        arena_reset(&ww->scratch);
+        walk_done(w, node);
+        return;
+    }
+    size_t plen = strlen(node->path);
+    struct walk_node **link = &node->child;
+    long subdirs = 0, files = 0;
+    for(long i = 0; i < n; i++){
+        const char *name = d[i].name;
+        if(d[i].type == DT_DIR){
+            size_t nlen = strlen(name);
+            struct walk_node *c = arena_alloc(&ww->keep, sizeof(*c));
+            char *p = arena_alloc(&ww->keep, plen + nlen + 2);
+            if(!c || !p){ __atomic_store_n(&node->failed, 1, __ATOMIC_RELEASE); continue; }
+            memset(c, 0, sizeof(*c));
+            memcpy(p, node->path, plen);
+            p[plen] = '/';
+            memcpy(p + plen + 1, name, nlen + 1);
+            c->path = p;
+            c->parent = node;
+            c->remaining = 1;
+            *link = c;
+            link = &c->next;
+            subdirs++;
+        } else if(unlinkat(dfd, name, 0) == 0) files++;
+        else {
+            walk_rm_error(w, node->path, name, errno);
+            __atomic_store_n(&node->failed, 1, __ATOMIC_RELEASE);
+        }
+    }
+    close(dfd);
+    free(d);
+    arena_reset(&ww->scratch);
+    __atomic_fetch_add(&w->removed_files, files, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&node->remaining, subdirs, __ATOMIC_ACQ_REL);
+    for(struct walk_node *c = node->child; c; c = c->next){
+        __atomic_fetch_add(&w->pending, 1, __ATOMIC_RELAXED);
+        walk_push(&w->q[ww->id], c);
+    }
+    walk_done(w, node); // its own files are done
+}
+
+static void walk_progress(struct walk *w){
+    double t = now_sec();
+    if(t < w->next_report) return;
+    w->next_report = t + 0.5;
+    w->reported = 1;
+    long f = __atomic_load_n(&w->removed_files, __ATOMIC_RELAXED), d = __atomic_load_n(&w->removed_dirs, __ATOMIC_RELAXED);
+    fprintf(stderr, "\r%ld files, %ld directories removed (%.0f files/s)  ", f, d, f / (t - w->started));
+}
+
+static void walk_dir(struct walk_worker *ww, struct walk_node *node){
+    struct walk *w = ww->w;
+    if(w->mode == WALK_RM){ walk_rm_dir(ww, node); return; }
+    if(w->mode == WALK_CP){ walk_cp(ww, node); return; }
+    struct native_dent *d;
+    // du counts hidden entries; dir only with /a, and shows . and .. unless bare
+    int list = w->mode == WALK_DU ? 2 : w->bare ? (w->all ? 2 : 0) : 1;
+    long n = native_read_dir(node->path, list, 1, &ww->scratch, &d);
+    if(n < 0){
+        if(w->cmd_style) fprintf(stderr, "%s: %s\n", node->path, errno == EACCES ? "Access is denied." : strerror(errno));
+        else fprintf(stderr, "du: cannot read directory '%s': %s\n", node->path, strerror(errno));
+        __atomic_fetch_add(&w->errors, 1, __ATOMIC_RELAXED);
+        arena_reset(&ww->scratch);
+        return;
+    }
+    size_t plen = strlen(node->path);
+    int slash = plen && node->path[plen - 1] == '/';
+    struct walk_node **link = &node->child, *first = NULL;
+    struct sbuf text = { NULL, 0, 0, &ww->keep };
+    for(long i = 0; i < n; i++){
+        const struct stat *st = &d[i].st;
+        const char *name = d[i].name;
+        size_t nlen = strlen(name);
+        int dots = name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0));
+        if(S_ISDIR(st->st_mode) && !dots && (w->mode == WALK_DU || w->all || name[0] != '.')){
+            if(w->every_inode && !walk_first_link(w, st->st_dev, st->st_ino)) continue;
+            struct walk_node *c = arena_alloc(&ww->keep, sizeof(*c));
+            char *p = arena_alloc(&ww->keep, plen + nlen + 2);
+            if(!c || !p) continue;
+            memset(c, 0, sizeof(*c));
+            memcpy(p, node->path, plen);
+            if(!slash) p[plen] = '/';
+            memcpy(p + plen + !slash, name, nlen + 1);
+            c->path = p;
+            c->blocks = (unsigned long long)st->st_blocks;
+            *link = c;
+            link = &c->next;
+            if(!first) first = c;
+        } else if(w->mode == WALK_DU && !dots){
+            if((st->st_nlink > 1 || w->every_inode) && !walk_first_link(w, st->st_dev, st->st_ino)) continue;
+            node->blocks += (unsigned long long)st->st_blocks;
+        }
+        if(w->mode == WALK_DIR && w->bare){
+            sb_put(&text, node->path, plen);
+            if(!slash) sb_putc(&text, '/');
+            sb_put(&text, name, nlen);
+            sb_putc(&text, '\n');
+        }
+    }
+    if(w->mode == WALK_DIR && !w->bare){
+        native_dir_listing(&text, node->path, d, n, w->all, &node->files, &node->dirs, &node->bytes);
+        sb_putc(&text, '\n');
+    }
+    node->text = text.p;
+    node->text_len = text.len;
+    free(d);
+    arena_reset(&ww->scratch);
+    for(struct walk_node *c = first; c; c = c->next){
+        __atomic_fetch_add(&w->pending, 1, __ATOMIC_RELAXED);
+        walk_push(&w->q[ww->id], c);
+    }
+}
+
+static void *walk_worker_main(void *arg){
+    struct walk_worker *ww = arg;
+    struct walk *w = ww->w;
+    for(;;){
+        struct walk_node *n = walk_take(&w->q[ww->id], 0);
+        for(int k = 1; !n && k < w->nworkers; k++) n = walk_take(&w->q[(ww->id + k) % w->nworkers], 1);
+        if(!n){
+            if(__atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) == 0) break;
+            sched_yield();
+            continue;
+        }
+        walk_dir(ww, n);
+        __atomic_fetch_sub(&w->pending, 1, __ATOMIC_ACQ_REL);
+        if(ww->id == 0 && w->next_report > 0) walk_progress(w);
+    }
+    return NULL;
+}
+
+static void walk_init(struct walk *w, int mode){
+    memset(w, 0, sizeof(*w));
+    w->mode = mode;
+    for(int i = 0; i < WALK_SHARDS; i++) pthread_mutex_init(&w->ino[i].mu, NULL);
+}
+
+// Walk the tree under root with one worker per core. Node memory lives in
+// the workers' arenas until walk_release().
+static void walk_run(struct walk *w, struct walk_node *root){
+    w->nworkers = cpu_count();
+    w->q = calloc((size_t)w->nworkers, sizeof(*w->q));
+    w->workers = calloc((size_t)w->nworkers, sizeof(*w->workers));
+    pthread_t *tids = calloc((size_t)w->nworkers, sizeof(*tids));
+    if(!w->q || !w->workers || !tids){ fprintf(stderr, "out of memory\n"); exit(1); }
+    for(int i = 0; i < w->nworkers; i++){
+        pthread_mutex_init(&w->q[i].mu, NULL);
+        w->workers[i].w = w;
+        w->workers[i].id = i;
+    }
+    w->pending = 1;
+    walk_push(&w->q[0], root);
+    int started = 1;
+    for(; started < w->nworkers; started++)
+        if(pthread_create(&tids[started], NULL, walk_worker_main, &w->workers[started]) != 0) break;
+    walk_worker_main(&w->workers[0]);
+    for(int i = 1; i < started; i++) pthread_join(tids[i], NULL);
+    free(tids);
+}
+
+// Drop the nodes of the last walk; the inode set is kept for the next one.
+static void walk_release(struct walk *w){
+    for(int i = 0; i < w->nworkers; i++){
+        pthread_mutex_destroy(&w->q[i].mu);
+        free(w->q[i].items);
+        arena_free(&w->workers[i].keep);
+        arena_free(&w->workers[i].scratch);
+    }
+    free(w->q);
+    free(w->workers);
+    w->q = NULL;
+    w->workers = NULL;
+    w->nworkers = 0;
+}
+
+static void walk_free(struct walk *w){
+    walk_release(w);
+    for(int i = 0; i < WALK_SHARDS; i++){
+        pthread_mutex_destroy(&w->ino[i].mu);
+        free(w->ino[i].slot);
+    }
+}
+
+// du -h sizes: 4.0K, 12M, 1.5G (rounded up, like du)
+static const char *du_human(unsigned long long bytes, char *buf){
+    if(bytes < 1024){ sprintf(buf, "%llu", bytes); return buf; }
+    unsigned long long unit = 1024;
+    int u = 0;
+    while(u < 5 && (bytes + unit - 1) / unit >= 1024){ unit *= 1024; u++; }
+    unsigned long long tenths = (bytes / unit) * 10 + ((bytes % unit) * 10 + unit - 1) / unit;
+    if(tenths < 100) sprintf(buf, "%llu.%llu%c", tenths / 10, tenths % 10, "KMGTPE"[u]);
+    else sprintf(buf, "%llu%c", (bytes + unit - 1) / unit, "KMGTPE"[u]);
+    return buf;
+}
+
+static void du_line(struct sbuf *out, unsigned long long blocks, const char *path, int human){
+    char num[32];
+    if(human) sb_printf(out, "%s\t%s\n", du_human(blocks * 512, num), path);
+    else sb_printf(out, "%llu\t%s\n", (blocks + 1) / 2, path);
+}
+
+// Subtree size, printing each directory after its children unless summarize.
+static unsigned long long du_total(const struct walk_node *n, int summarize, int human, struct sbuf *out){
+    unsigned long long b = n->blocks;
+    for(const struct walk_node *c = n->child; c; c = c->next) b += du_total(c, summarize, human, out);
+    if(!summarize){
+        du_line(out, b, n->path, human);
+        if(out->len >= 65536){ write_all(STDOUT_FILENO, out->p, out->len); out->len = 0; }
+    }
+    return b;
+}
+
+// du [-s] [-h | -k] [-c] [PATH...]
+static int native_du(int argc, char **argv){
+    int summarize = 0, human = 0, total = 0, npaths = 0;
+    char *paths[NATIVE_MAX_ARGS];
+    for(int i = 1; i < argc; i++){
+        if(argv[i][0] == '-' && argv[i][1]){
+            for(const char *o = argv[i] + 1; *o; o++){
+                if(*o == 's') summarize = 1;
+                else if(*o == 'h') human = 1;
+                else if(*o == 'k') human = 0;
+                else if(*o == 'c') total = 1;
+                else return -1;
+            }
+        } else paths[npaths++] = argv[i];
+    }
+    if(!npaths) paths[npaths++] = ".";
+    struct walk w;
+    walk_init(&w, WALK_DU);
+    w.every_inode = npaths > 1; // like du, an operand inside an earlier one adds nothing
+    struct sbuf out = { NULL, 0, 0, NULL };
+    unsigned long long grand = 0;
+    int rc = 0;
+    for(int i = 0; i < npaths; i++){
+        struct stat st;
+        if(lstat(paths[i], &st) != 0){
+            fprintf(stderr, "du: cannot access '%s': %s\n", paths[i], strerror(errno));
+            rc = 1;
+            continue;
+        }
+        if(w.every_inode && !walk_first_link(&w, st.st_dev, st.st_ino)) continue;
+        struct walk_node root;
+        memset(&root, 0, sizeof(root));
+        root.path = paths[i];
+        root.blocks = (unsigned long long)st.st_blocks;
+        unsigned long long b = root.blocks;
+        if(S_ISDIR(st.st_mode)){
+            walk_run(&w, &root);
+            b = du_total(&root, summarize, human, &out);
+            walk_release(&w);
+        }
+        if(summarize || !S_ISDIR(st.st_mode)) du_line(&out, b, paths[i], human);
+        grand += b;
+    }
+    if(w.errors) rc = 1;
+    if(total) du_line(&out, grand, "total", human);
+    if(out.len && write_all(STDOUT_FILENO, out.p, out.len) != 0 && errno != EPIPE) rc = 1;
+    free(out.p);
+    walk_free(&w);
+    return rc;
+}
+
+// Pre-order print of dir /s listings; sums the totals.
+static void dir_s_print(const struct walk_node *n, long *files, long *dirs, unsigned long long *bytes){
+    if(n->text_len) write_all(STDOUT_FILENO, n->text, n->text_len);
+    *files += n->files;
+    *dirs += n->dirs;
+    *bytes += n->bytes;
+    for(const struct walk_node *c = n->child; c; c = c->next) dir_s_print(c, files, dirs, bytes);
+}
+
+// dir /s [/a] [/b] [DIR]
+static int native_dir_s(const char *path, int all, int bare){
+    char abs[4096];
+    if(!realpath(path, abs)) snprintf(abs, sizeof(abs), "%s", path);
+    struct walk w;
+    walk_init(&w, WALK_DIR);
+    w.all = all;
+    w.bare = bare;
+    w.cmd_style = 1;
+    struct walk_node root;
+    memset(&root, 0, sizeof(root));
+    root.path = abs;
+    walk_run(&w, &root);
+    long files = 0, dirs = 0;
+    unsigned long long bytes = 0;
+    dir_s_print(&root, &files, &dirs, &bytes);
+    if(!bare){
+        char num[32], num2[32];
+        struct statvfs vfs;
+        unsigned long long free_bytes = statvfs(path, &vfs) == 0 ? (unsigned long long)vfs.f_bavail * vfs.f_frsize : 0;
+        printf("     Total Files Listed:\n%16ld File(s) %14s bytes\n%16ld Dir(s)  %14s bytes free\n",
+               files, native_commas(bytes, num), dirs, native_commas(free_bytes, num2));
+        fflush(stdout);
+    }
+    int rc = w.errors ? 1 : 0;
+    walk_free(&w);
+    return rc;
+}
+
+// Refuse to delete / or the directory we are in (or one above it); abs is
+// the resolved operand.
+static int native_rm_refused(const char *path, const char *abs, int cmd_style){
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    if(!cmd_style && (strcmp(base, ".") == 0 || strcmp(base, "..") == 0)){
+        fprintf(stderr, "rm: refusing to remove '.' or '..' directory: skipping '%s'\n", path);
+        return 1;
+    }
+    if(strcmp(abs, "/") == 0){
+        if(cmd_style) fprintf(stderr, "Access is denied.\n");
+        else fprintf(stderr, "rm: it is dangerous to operate recursively on '/'\nrm: use --no-preserve-root to override this failsafe\n");
+        return 1;
+    }
+    char cwd[4096];
+    size_t n = strlen(abs);
+    if(getcwd(cwd, sizeof(cwd)) && strncmp(cwd, abs, n) == 0 && (cwd[n] == '\0' || cwd[n] == '/')){
+        if(cmd_style) fprintf(stderr, "The process cannot access the file because it is being used by another process.\n");
+        else fprintf(stderr, "rm: refusing to remove '%s': it contains the current directory\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+// Remove path and everything under it. Progress goes to a terminal stderr
+// every half second, with a closing throughput line if it was shown at all.
+static int native_rm_tree(const char *path, int cmd_style){
+    struct stat st;
+    if(lstat(path, &st) != 0) return -1;
+    if(!S_ISDIR(st.st_mode)) return unlink(path);
+    char abs[4096];
+    if(!realpath(path, abs)) return -1;
+    if(native_rm_refused(path, abs, cmd_style)){ errno = 0; return -1; }
+    struct walk w;
+    walk_init(&w, WALK_RM);
+    w.cmd_style = cmd_style;
+    w.started = now_sec();
+    if(isatty(STDERR_FILENO)) w.next_report = w.started + 0.5;
+    struct walk_node root;
+    memset(&root, 0, sizeof(root));
+    root.path = (char *)path;
+    root.remaining = 1;
+    walk_run(&w, &root);
+    walk_release(&w);
+    if(w.reported){
+        double dt = now_sec() - w.started;
+        fprintf(stderr, "\r%ld files, %ld directories removed in %.1fs (%.0f files/s)\n",
+                w.removed_files, w.removed_dirs, dt, w.removed_files / dt);
+    }
+    int rc = w.errors ? -1 : 0;
+    walk_free(&w);
+    errno = 0; // already reported
+    return rc;
+}
+
+// rm -r [-f] PATH...   (plain rm and other options go to the host)
+static int native_rm(int argc, char **argv){
+    int recursive = 0, force = 0, npaths = 0;
+    char *paths[NATIVE_MAX_ARGS];
+    for(int i = 1; i < argc; i++){
+        if(argv[i][0] == '-' && argv[i][1]){
+            for(const char *o = argv[i] + 1; *o; o++){
+                if(*o == 'r' || *o == 'R') recursive = 1;
+                else if(*o == 'f') force = 1;
+                else return -1;
+            }
+        } else paths[npaths++] = argv[i];
+    }
+    if(!recursive) return -1;
+    if(!npaths){
+        if(force) return 0;
+        fprintf(stderr, "rm: missing operand\n");
+        return 1;
+    }
+    int rc = 0;
+    for(int i = 0; i < npaths; i++){
+        if(native_rm_tree(paths[i], 0) == 0) continue;
+        if(errno == ENOENT && force) continue;
+        if(errno) fprintf(stderr, "rm: cannot remove '%s': %s\n", paths[i], strerror(errno));
+        rc = 1;
+    }
+    return rc;
+}
+
+// rmdir /s [/q] DIR...   (without /s it only removes empty directories: host)
+static int native_rmdir(int argc, char **argv){
+    int sub = 0, quiet = 0, npaths = 0;
+    char *paths[NATIVE_MAX_ARGS];
+    for(int i = 1; i < argc; i++){
+        if(argv[i][0] == '/' && argv[i][1] && !argv[i][2]){
+            char o = (char)tolower((unsigned char)argv[i][1]);
+            if(o == 's') sub = 1;
+            else if(o == 'q') quiet = 1;
+            else return -1;
+        } else paths[npaths++] = argv[i];
+    }
+    if(!sub) return -1;
+    if(!npaths){ fprintf(stderr, "The syntax of the command is incorrect.\n"); return 1; }
+    int rc = 0;
+    for(int i = 0; i < npaths; i++){
+        struct stat st;
+        if(lstat(paths[i], &st) != 0){ fprintf(stderr, "The system cannot find the file specified.\n"); rc = 2; continue; }
+        if(!S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode)){ fprintf(stderr, "The directory name is invalid.\n"); rc = 267; continue; }
+        if(!quiet){
+            char ans[64];
+            fprintf(stderr, "%s, Are you sure (Y/N)? ", paths[i]);
+            if(!fgets(ans, sizeof(ans), stdin) || (ans[0] != 'y' && ans[0] != 'Y')) continue;
+        }
+        if(native_rm_tree(paths[i], 1) != 0){
+            if(errno) fprintf(stderr, "%s\n", errno == EACCES || errno == EPERM ? "Access is denied." : strerror(errno));
+            rc = 5;
+        }
+    }
+    return rc;
+}
+
+// Where src lands: inside dst when that is a directory, else dst itself.
+static const char *native_target(char *buf, size_t cap, const char *src, const char *dst, int dst_is_dir){
+    if(!dst_is_dir) return dst;
+    size_t n = strlen(src);
+    while(n > 1 && src[n - 1] == '/') n--;
+    size_t b = n;
+    while(b > 0 && src[b - 1] != '/') b--;
+    size_t dn = strlen(dst);
+    int slash = dn && dst[dn - 1] == '/';
+    snprintf(buf, cap, "%s%s%.*s", dst, slash ? "" : "/", (int)(n - b), src + b);
+    return buf;
+}
+
+// 1 when path is dir or somewhere below it (path need not exist yet).
+static int native_inside(const char *dir, const char *path){
+    char a[4096], b[4096], parent[4096];
+    if(!realpath(dir, a)) return 0;
+    if(!realpath(path, b)){
+        snprintf(parent, sizeof(parent), "%s", path);
+        char *slash = strrchr(parent, '/');
+        if(slash == parent) slash[1] = 0;
+        else if(slash) *slash = 0;
+        else snprintf(parent, sizeof(parent), ".");
+        if(!realpath(parent, b)) return 0;
+    }
+    size_t n = strlen(a);
+    return strncmp(a, b, n) == 0 && (b[n] == '\0' || b[n] == '/' || n == 1);
+}
+
+// Copy the directory src (described by st) to dst on the walker. Adds what
+// was copied to *files and *bytes; returns the number of errors.
+static int native_copy_tree(const char *src, const char *dst, const struct stat *st, int cmd_style, int preserve,
+                            int force, long *files, unsigned long long *bytes){
+    struct walk w;
+    walk_init(&w, WALK_CP);
+    w.cmd_style = cmd_style;
+    w.preserve = preserve;
+    w.force = force;
+    w.umask = umask(0);
+    umask(w.umask);
+    struct stat rst = *st;
+    struct walk_node root;
+    memset(&root, 0, sizeof(root));
+    root.path = (char *)src;
+    root.dst = (char *)dst;
+    root.st = &rst;
+    root.remaining = 1;
+    walk_run(&w, &root);
+    walk_release(&w);
+    *files += w.copied_files;
+    *bytes += w.copied_bytes;
+    int errors = w.errors;
+    walk_free(&w);
+    return errors;
+}
+
+// Ask before replacing dst, the way copy and move do without /y.
+static int native_overwrite_ok(const char *dst, int *all){
+    if(*all) return 1;
+    char ans[64];
+    fprintf(stderr, "Overwrite %s? (Yes/No/All): ", dst);
+    if(!fgets(ans, sizeof(ans), stdin)) return 0;
+    if(ans[0] == 'a' || ans[0] == 'A') *all = 1;
+    return ans[0] == 'y' || ans[0] == 'Y' || *all;
+}
+
+// cp [-rRapf] SRC... DST;  copy [/y | /-y] [/b] FILE [DST]
+static int native_cp(int argc, char **argv, int cmd_style){
+    int recursive = 0, preserve = 0, force = 0, confirm = cmd_style, all = 0, nops = 0;
+    char *ops[NATIVE_MAX_ARGS];
+    for(int i = 1; i < argc; i++){
+        const char *a = argv[i];
+        if(cmd_style && a[0] == '/'){
+            if(strcasecmp(a, "/y") == 0) confirm = 0;
+            else if(strcasecmp(a, "/-y") == 0) confirm = 1;
+            else if(strcasecmp(a, "/b") != 0) return -1;
+        } else if(!cmd_style && a[0] == '-' && a[1]){
+            for(const char *o = a + 1; *o; o++){
+                if(*o == 'r' || *o == 'R') recursive = 1;
+                else if(*o == 'p') preserve = 1;
+                else if(*o == 'a') recursive = preserve = 1;
+                else if(*o == 'f') force = 1;
+                else return -1;
+            }
+        } else {
+            if(cmd_style && strchr(a, '+')) return -1; // copy a+b c concatenates
+            ops[nops++] = argv[i];
+        }
+    }
+    if(cmd_style && nops == 1) ops[nops++] = ".";
+    if(nops < 2) return -1;
+    const char *dst = ops[--nops];
+    struct stat dst_st, st;
+    int dst_is_dir = stat(dst, &dst_st) == 0 && S_ISDIR(dst_st.st_mode);
+    if(cmd_style && (nops != 1 || (stat(ops[0], &st) == 0 && S_ISDIR(st.st_mode)))) return -1; // copy DIR copies its files
+    if(nops > 1 && !dst_is_dir){
+        fprintf(stderr, "cp: target '%s' is not a directory\n", dst);
+        return 1;
+    }
+    int rc = 0;
+    long files = 0;
+    unsigned long long bytes = 0;
+    for(int i = 0; i < nops; i++){
+        const char *src = ops[i];
+        char buf[4096];
+        const char *target = native_target(buf, sizeof(buf), src, dst, dst_is_dir);
+        if((recursive ? lstat(src, &st) : stat(src, &st)) != 0){
+            if(cmd_style) fprintf(stderr, "The system cannot find the file specified.\n");
+            else fprintf(stderr, "cp: cannot stat '%s': %s\n", src, strerror(errno));
+            rc = 1;
+            continue;
+        }
+        struct stat tst;
+        int exists = lstat(target, &tst) == 0;
+        if(exists && tst.st_dev == st.st_dev && tst.st_ino == st.st_ino){
+            if(cmd_style) fprintf(stderr, "The file cannot be copied onto itself.\n");
+            else fprintf(stderr, "cp: '%s' and '%s' are the same file\n", src, target);
+            rc = 1;
+            continue;
+        }
+        if(S_ISDIR(st.st_mode)){
+            if(!recursive){
+                fprintf(stderr, "cp: -r not specified; omitting directory '%s'\n", src);
+                rc = 1;
+            } else if(native_inside(src, target)){
+                fprintf(stderr, "cp: cannot copy a directory, '%s', into itself, '%s'\n", src, target);
+                rc = 1;
+            } else if(native_copy_tree(src, target, &st, 0, preserve, force, &files, &bytes)) rc = 1;
+            continue;
+        }
+        if(exists && confirm && !native_overwrite_ok(target, &all)) continue;
+        if(native_copy_file(AT_FDCWD, src, AT_FDCWD, target, &st, preserve, force) != 0){
+            if(cmd_style) fprintf(stderr, "%s\n", errno == EACCES || errno == EPERM ? "Access is denied." : strerror(errno));
+            else fprintf(stderr, "cp: cannot copy '%s' to '%s': %s\n", src, target, strerror(errno));
+            rc = 1;
+            continue;
+        }
+        files++;
+    }
+    if(cmd_style) printf("%9ld file(s) copied.\n", rc ? 0 : files);
+    return rc;
+}
+
+// mv [-f] SRC... DST;  move [/y | /-y] SRC... DST. A rename when it can be;
+// across filesystems, a copy that keeps attributes and then a delete.
+static int native_mv(int argc, char **argv, int cmd_style){
+    int confirm = cmd_style, all = 0, nops = 0;
+    char *ops[NATIVE_MAX_ARGS];
+    for(int i = 1; i < argc; i++){
+        const char *a = argv[i];
+        if(cmd_style && a[0] == '/'){
+            if(strcasecmp(a, "/y") == 0) confirm = 0;
+            else if(strcasecmp(a, "/-y") == 0) confirm = 1;
+            else return -1;
+        } else if(!cmd_style && a[0] == '-' && a[1]){
+            if(strcmp(a, "-f") != 0) return -1;
+        } else ops[nops++] = argv[i];
+    }
+    if(nops < 2) return -1;
+    const char *dst = ops[--nops];
+    struct stat dst_st, st;
+    int dst_is_dir = stat(dst, &dst_st) == 0 && S_ISDIR(dst_st.st_mode);
+    if(nops > 1 && !dst_is_dir){
+        if(cmd_style) fprintf(stderr, "The syntax of the command is incorrect.\n");
+        else fprintf(stderr, "mv: target '%s' is not a directory\n", dst);
+        return 1;
+    }
+    int rc = 0, dirs = 0;
+    long files = 0;
+    for(int i = 0; i < nops; i++){
+        const char *src = ops[i];
+        char buf[4096];
+        const char *target = native_target(buf, sizeof(buf), src, dst, dst_is_dir);
+        if(lstat(src, &st) != 0){
+            if(cmd_style) fprintf(stderr, "The system cannot find the file specified.\n");
+            else fprintf(stderr, "mv: cannot stat '%s': %s\n", src, strerror(errno));
+            rc = 1;
+            continue;
+        }
+        struct stat tst;
+        int exists = lstat(target, &tst) == 0;
+        if(exists && tst.st_dev == st.st_dev && tst.st_ino == st.st_ino){
+            if(!cmd_style){ fprintf(stderr, "mv: '%s' and '%s' are the same file\n", src, target); rc = 1; }
+            continue;
+        }
+        if(exists && confirm && !S_ISDIR(st.st_mode) && !native_overwrite_ok(target, &all)) continue;
+        if(S_ISDIR(st.st_mode) && native_inside(src, target)){
+            if(cmd_style) fprintf(stderr, "The process cannot access the file because it is being used by another process.\n");
+            else fprintf(stderr, "mv: cannot move '%s' to a subdirectory of itself, '%s'\n", src, target);
+            rc = 1;
+            continue;
+        }
+        int moved = rename(src, target) == 0;
+        if(!moved && errno == EXDEV){
+            unsigned long long bytes = 0;
+            long copied = 0;
+            if(S_ISDIR(st.st_mode)){
+                if(native_copy_tree(src, target, &st, cmd_style, 1, 1, &copied, &bytes) != 0){ rc = 1; continue; }
+                moved = native_rm_tree(src, cmd_style) == 0;
+                if(!moved && errno == 0){ rc = 1; continue; } // already reported
+            } else moved = native_copy_file(AT_FDCWD, src, AT_FDCWD, target, &st, 1, 1) == 0 && unlink(src) == 0;
+        }
+        if(!moved){
+            if(cmd_style) fprintf(stderr, "%s\n", errno == EACCES || errno == EPERM ? "Access is denied." : strerror(errno));
+            else fprintf(stderr, "mv: cannot move '%s' to '%s': %s\n", src, target, strerror(errno));
+            rc = 1;
+            continue;
+        }
+        if(S_ISDIR(st.st_mode)) dirs++; else files++;
+    }
+    if(cmd_style && dirs) printf("%9d dir(s) moved.\n", dirs);
+    else if(cmd_style) printf("%9ld file(s) moved.\n", files);
+    return rc;
+}
+
+// dir [/a] [/b] [/s] [DIR]
+static int native_dir(int argc, char **argv){
+    int all = 0, bare = 0, sub = 0;
+    const char *path = NULL;
+    for(int i = 1; i < argc; i++){
+        if(argv[i][0] == '/' && argv[i][1] && !argv[i][2]){
+            char o = (char)tolower((unsigned char)argv[i][1]);
+            if(o == 'a') all = 1;
+            else if(o == 'b') bare = 1;
+            else if(o == 's') sub = 1;
+            else return -1;
+        } else if(path) return -1;
+        else path = argv[i];
+    }
+    if(!path) path = ".";
+    struct stat pst;
+    if(stat(path, &pst) != 0){
+        if(errno == ENOENT){ fprintf(stderr, "File Not Found\n"); return 1; }
+        return native_error(1, "dir", path, errno);
+    }
+    if(!S_ISDIR(pst.st_mode)) return -1;
+    if(sub) return native_dir_s(path, all, bare);
+    struct arena a = { NULL };
+    struct native_dent *d;
+    // dir lists . and .. but hides dotfiles unless /a; bare listings never show . and ..
+    long n = native_read_dir(path, bare ? (all ? 2 : 0) : 1, !bare, &a, &d);
+    if(n < 0){ arena_free(&a); return native_error(1, "dir", path, errno); }
+    struct sbuf out = { NULL, 0, 0, NULL };
+    if(bare){
+        for(long i = 0; i < n; i++){ sb_puts(&out, d[i].name); sb_putc(&out, '\n'); }
+    } else {
+        char abs[4096], num[32];
+        if(!realpath(path, abs)) snprintf(abs, sizeof(abs), "%s", path);
+        long files = 0, dirs = 0;
+        unsigned long long bytes = 0;
+        native_dir_listing(&out, abs, d, n, all, &files, &dirs, &bytes);
+        struct statvfs vfs;
+        if(statvfs(path, &vfs) == 0)
+            sb_printf(&out, "%16ld Dir(s)  %14s bytes free\n", dirs,
+                      native_commas((unsigned long long)vfs.f_bavail * vfs.f_frsize, num));
+        else sb_printf(&out, "%16ld Dir(s)\n", dirs);
+    }
+    int rc = out.len && write_all(STDOUT_FILENO, out.p, out.len) != 0 && errno != EPIPE;
+    free(out.p);
+    free(d);
+    arena_free(&a);
+    return rc;
+}
+
+// Run line natively if it is one of the commands above in a form we handle.
+// Returns its exit status, or -1 to let the caller translate and spawn it.
+static int native_run(const char *line, int source_is_windows){
+    struct tok t[NATIVE_MAX_ARGS];
+    size_t nt = tokenize(line, strlen(line), source_is_windows, t, ARRAY_LEN(t));
+    if(nt == 0 || nt > ARRAY_LEN(t)) return -1;
+    size_t n0;
+    const char *w0 = tok_word(line, &t[0], &n0);
+    int which;
+    if(source_is_windows){
+        which = view_ieq(w0, n0, "type") ? 1 : view_ieq(w0, n0, "dir") ? 2 :
+                view_ieq(w0, n0, "rmdir") || view_ieq(w0, n0, "rd") ? 8 :
+                view_ieq(w0, n0, "copy") ? 9 : view_ieq(w0, n0, "move") ? 10 : 0;
+    } else {
+        which = n0 == 3 && memcmp(w0, "cat", 3) == 0 ? 1 : n0 == 2 && memcmp(w0, "ls", 2) == 0 ? 3 :
+                n0 == 4 && memcmp(w0, "head", 4) == 0 ? 4 : n0 == 4 && memcmp(w0, "tail", 4) == 0 ? 5 :
+                n0 == 2 && memcmp(w0, "du", 2) == 0 ? 6 : n0 == 2 && memcmp(w0, "rm", 2) == 0 ? 7 :
+                n0 == 2 && memcmp(w0, "cp", 2) == 0 ? 9 : n0 == 2 && memcmp(w0, "mv", 2) == 0 ? 10 : 0;
+    }
+    if(!which) return -1;
+
+    // plain words only: anything the shell would expand or reinterpret goes to the host
+    const char *special = source_is_windows ? "*?%^" : "*?[]{}$`\\~";
+    const char *quoted_special = source_is_windows ? "%" : "$`\\"; // still live inside double quotes
+    struct arena a = { NULL };
+    char *argv[NATIVE_MAX_ARGS];
+    int argc = 0;
+    for(size_t i = 0; i < nt; i++){
+        size_t n;
+        const char *w = tok_word(line, &t[i], &n);
+        if(t[i].kind != TOK_WORD || t[i].quote == TQ_MIXED || !n){ arena_free(&a); return -1; }
+        if(t[i].quote != TQ_SINGLE){
+            for(size_t k = 0; k < n; k++)
+                if(strchr(t[i].quote == TQ_NONE ? special : quoted_special, w[k])){ arena_free(&a); return -1; }
+        }
+        if(!(argv[argc] = arena_strndup(&a, w, n))){ arena_free(&a); return -1; }
+        if(source_is_windows){
+            if(n >= 2 && w[1] == ':'){ arena_free(&a); return -1; } // drive letters
+            for(char *p = argv[argc]; *p; p++) if(*p == '\\') *p = '/';
+        }
+        argc++;
+    }
+    fflush(stdout);
+    int rc;
+    switch(which){
+        case 1: rc = native_cat(argc, argv, source_is_windows); break;
+        case 2: rc = native_dir(argc, argv); break;
+        case 3: rc = native_ls(argc, argv); break;
+        case 6: rc = native_du(argc, argv); break;
+        case 7: rc = native_rm(argc, argv); break;
+        case 8: rc = native_rmdir(argc, argv); break;
+        case 9: rc = native_cp(argc, argv, source_is_windows); break;
+        case 10: rc = native_mv(argc, argv, source_is_windows); break;
+        default: rc = native_head_tail(argc, argv, which == 5); break;
+    }
+    arena_free(&a);
+    return rc;
+}
+#endif
+
+#if !HOST_IS_WINDOWS
+// ---- cmd for loops ----
+// for %v in (set) [/d], for /l %v in (start,step,end) and for /f ["options"] %v
+// in (files | "string" | 'command') run here rather than going to the host as
+// one opaque line. The set is expanded once: wildcards by reading the directory
+// (case-insensitively and sorted, like cmd on NTFS), /f sources by reading the
+// file or command output whole. Each iteration substitutes the loop variables,
+// %~ modifiers included, into the body and runs it the way the prompt runs a
+// line: in-process when native_run takes it, otherwise translated and spawned
+// by the exec engine, so no wrapper shell starts per iteration. Ctrl-C ends the
+// loop between iterations. for /r goes to the host as before.
+
+#define CMDFOR_MAX_TOKENS 31
+
+struct cmdfor {
+    int kind;                  // 0, 'd', 'l' or 'f'
+    unsigned char var;         // first loop variable
+    const char *set, *body;    // inside the parentheses; after do, outer ( ) removed
+    size_t nset, nbody;
+    // for /f
+    char eol;
+    int skip, usebackq, rest, ntok;
+    char delims[32];
+    int tok[CMDFOR_MAX_TOKENS];  // token numbers, ascending
+    const char *val[128];      // loop variable values; NULL: not a loop variable
+    int rc, stop;
+};
+
+static int cmdfor_run(const char *line);
+
+static const char *cmdfor_blank(const char *p){
+    while(*p == ' ' || *p == '\t') p++;
+    return p;
+}
+
+// Past keyword kw (lowercase) at p when a blank or end follows it, else NULL.
+static const char *cmdfor_kw(const char *p, const char *kw){
+    size_t n = strlen(kw);
+    if(!view_ieq(p, n, kw) || (p[n] && p[n] != ' ' && p[n] != '\t')) return NULL;
+    return cmdfor_blank(p + n);
+}
+
+// tokens=1,3-5* into f->tok (sorted, no duplicates) and f->rest.
+static int cmdfor_tokens(struct cmdfor *f, const char *s, size_t n){
+    unsigned long long want = 0;
+    size_t i = 0;
+    while(i < n){
+        if(s[i] == '*'){ f->rest = 1; i++; continue; }
+        if(s[i] == ','){ i++; continue; }
+        if(!isdigit((unsigned char)s[i])) return -1;
+        long a = 0, b;
+        while(i < n && isdigit((unsigned char)s[i])) a = a * 10 + (s[i++] - '0');
+        b = a;
+        if(i < n && s[i] == '-'){
+            b = 0;
+            for(i++; i < n && isdigit((unsigned char)s[i]); i++) b = b * 10 + (s[i] - '0');
+        }
+        if(a < 1 || b > CMDFOR_MAX_TOKENS || b < a) return -1;
+        for(long k = a; k <= b; k++) want |= 1ull << k;
+    }
+    f->ntok = 0;
+    for(int k = 1; k <= CMDFOR_MAX_TOKENS; k++) if(want >> k & 1) f->tok[f->ntok++] = k;
+    return 0;
+}
+
+// The /f options string: eol=c skip=n delims=xxx tokens=x,y,m-n* usebackq.
+// delims= runs to the next option or the end, so it can hold a space when last.
+static int cmdfor_options(struct cmdfor *f, const char *s, size_t n){
+    static const char *const opts[] = { "eol=", "skip=", "delims=", "tokens=", "usebackq" };
+    size_t i = 0;
+    while(i < n){
+        if(s[i] == ' ' || s[i] == '\t'){ i++; continue; }
+        int o = -1;
+        for(int k = 0; k < (int)ARRAY_LEN(opts); k++)
+            if(n - i >= strlen(opts[k]) && view_ieq(s + i, strlen(opts[k]), opts[k])) o = k;
+        if(o < 0) return -1;
+        i += strlen(opts[o]);
+        size_t v = i;
+        if(o == 0){ f->eol = i < n ? s[i++] : 0; continue; }
+        if(o == 4){ f->usebackq = 1; continue; }
+        if(o == 2){
+            for(; i < n; i++){
+                int next = 0;
+                for(int k = 0; k < (int)ARRAY_LEN(opts) && (s[i] == ' ' || s[i] == '\t'); k++){
+                    const char *q = cmdfor_blank(s + i);
+                    next |= (size_t)(q - s) < n && (size_t)(s + n - q) >= strlen(opts[k]) && view_ieq(q, strlen(opts[k]), opts[k]);
+                }
+                if(next) break;
+            }
+            if(i - v >= sizeof(f->delims)) return -1;
+            memcpy(f->delims, s + v, i - v);
+            f->delims[i - v] = 0;
+            continue;
+        }
+        while(i < n && s[i] != ' ' && s[i] != '\t') i++;
+        if(o == 1){
+            f->skip = atoi(s + v);
+        } else if(cmdfor_tokens(f, s + v, i - v) != 0) return -1;
+    }
+    return 0;
+}
+
+// Parse a for line. Returns 0, 1 when it is not one we run, -1 on bad syntax.
+static int cmdfor_parse(const char *line, struct cmdfor *f){
+    memset(f, 0, sizeof(*f));
+    f->eol = ';';
+    strcpy(f->delims, " \t");
+    f->tok[f->ntok++] = 1;
+    const char *p = cmdfor_kw(cmdfor_blank(line), "for");
+    if(!p) return 1;
+    while(*p == '/'){
+        int o = tolower((unsigned char)p[1]);
+        if((o != 'd' && o != 'l' && o != 'f') || !(p = cmdfor_kw(p + 2, ""))) return 1; // /r and friends
+        if(f->kind) return -1;
+        f->kind = o;
+        if(o == 'f' && *p == '"'){
+            const char *q = strchr(p + 1, '"');
+            if(!q || cmdfor_options(f, p + 1, (size_t)(q - p - 1)) != 0) return -1;
+            p = cmdfor_blank(q + 1);
+        }
+    }
+    if(*p++ != '%') return 1;
+    if(*p == '%') p++;
+    f->var = (unsigned char)*p;
+    if(f->var < '!' || f->var >= 128 || !(p = cmdfor_kw(p + 1, ""))) return -1;
+    if(!(p = cmdfor_kw(p, "in")) || *p != '(') return -1;
+    f->set = ++p;
+    // quotes hide ); ' and ` quote only in /f sets, where they mark strings and commands
+    for(char q = 0; *p && (q || *p != ')'); p++)
+        if(q ? *p == q : *p == '"' || (f->kind == 'f' && (*p == '\'' || *p == '`'))) q = q ? 0 : *p;
+    if(*p != ')') return -1;
+    f->nset = (size_t)(p - f->set);
+    if(!(p = cmdfor_kw(cmdfor_blank(p + 1), "do")) || !*p) return -1;
+    size_t n = strlen(p);
+    while(n && (p[n - 1] == ' ' || p[n - 1] == '\t')) n--;
+    if(n >= 2 && p[0] == '(' && p[n - 1] == ')'){ p++; n -= 2; }
+    f->body = p;
+    f->nbody = n;
+    return 0;
+}
+
+// Value v of a loop variable with %~ modifiers (f d p n x z) applied.
+static void cmdfor_modify(struct sbuf *out, const char *v, const char *mods, size_t nmods){
+    size_t n = strlen(v);
+    if(n >= 2 && v[0] == '"' && v[n - 1] == '"'){ v++; n -= 2; }
+    if(!nmods){ sb_put(out, v, n); return; }
+    char full[MAX_LINE * 2];
+    size_t len = 0;
+    if(n && v[0] != '/' && v[0] != '\\' && getcwd(full, MAX_LINE)){
+        len = strlen(full);
+        if(len > 1) full[len++] = '/';
+    }
+    if(len + n >= sizeof(full)) n = sizeof(full) - len - 1;
+    for(size_t i = 0; i < n; i++) full[len++] = v[i] == '\\' ? '/' : v[i];
+    full[len] = 0;
+    const char *base = strrchr(full, '/');
+    base = base ? base + 1 : full;
+    const char *dot = strrchr(base, '.');
+    if(!dot || dot == base) dot = full + len;
+    int want = 0;
+    for(size_t i = 0; i < nmods; i++) want |= 1 << (strchr("fdpnxz", mods[i]) - "fdpnxz");
+    if(want & 32){
+        struct stat st;
+        if(stat(full, &st) == 0) sb_printf(out, "%lld", (long long)st.st_size);
+        if(want & 31) sb_putc(out, ' ');
+    }
+    if((want & 31) == 1){ sb_put(out, full, len); return; }
+    if(want & 4) sb_put(out, full, (size_t)(base - full));
+    if(want & 8) sb_put(out, base, (size_t)(dot - base));
+    if(want & 16) sb_put(out, dot, (size_t)(full + len - dot));
+}
+
+static int cmdfor_isvar(const struct cmdfor *f, char c){
+    return (unsigned char)c < 128 && f->val[(unsigned char)c] != NULL;
+}
+
+// The body with %v, %%v and %~[mods]v replaced; other % text is left alone.
+static void cmdfor_subst(const struct cmdfor *f, struct sbuf *out){
+    const char *s = f->body, *end = s + f->nbody;
+    while(s < end){
+        const char *pct = memchr(s, '%', (size_t)(end - s));
+        if(!pct){ sb_put(out, s, (size_t)(end - s)); break; }
+        sb_put(out, s, (size_t)(pct - s));
+        const char *p = pct + 1;
+        if(p + 1 < end && *p == '%' && (p[1] == '~' || cmdfor_isvar(f, p[1]))) p++; // %%v, as in batch files
+        if(p < end && *p == '~'){
+            const char *m = ++p;
+            while(p < end && *p && strchr("fdpnxz", *p)) p++;
+            // the variable ends the modifiers, and may itself be a modifier letter
+            const char *v = p;
+            if(!(v < end && cmdfor_isvar(f, *v))){
+                while(v > m && !cmdfor_isvar(f, v[-1])) v--;
+                v = v > m ? v - 1 : NULL;
+            }
+            if(v){
+                cmdfor_modify(out, f->val[(unsigned char)*v], m, (size_t)(v - m));
+                s = v + 1;
+                continue;
+            }
+        } else if(p < end && cmdfor_isvar(f, *p)){
+            sb_puts(out, f->val[(unsigned char)*p]);
+            s = p + 1;
+            continue;
+        }
+        sb_putc(out, '%');
+        s = pct + 1;
+    }
+}
+
+static int cmdfor_interrupted(void){
+    sigset_t s;
+    return sigpending(&s) == 0 && sigismember(&s, SIGINT);
+}
+
+// One iteration: substitute the variables and run the body like a typed line.
+static void cmdfor_iterate(struct cmdfor *f){
+    if(f->stop || (f->stop = cmdfor_interrupted())) return;
+    struct sbuf sb = { NULL, 0, 0, NULL };
+    cmdfor_subst(f, &sb);
+    char *line = sb_take(&sb);
+    int rc = cmdfor_run(line);
+    if(rc == -1 && (rc = native_run(line, 1)) == -1){
+        char *t = translate_pipeline(line, 1, HOST_IS_WINDOWS);
+        rc = exec_host(t ? t : line);
+        free(t);
+    }
+    free(line);
+    f->rc = rc;
+    // stopped or interrupted: the loop ends with the command
+    if(rc == 128 + SIGINT || rc == 128 + SIGTSTP) f->stop = 1;
+}
+
+static int cmdfor_name_cmp(const void *a, const void *b){
+    return strcasecmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Iterate over the files (directories for /d) matching a wildcard pattern.
+// The value keeps the directory part as it was typed.
+static void cmdfor_glob(struct cmdfor *f, const char *pat, size_t n, struct arena *a){
+    size_t cut = n;
+    while(cut && pat[cut - 1] != '/' && pat[cut - 1] != '\\') cut--;
+    char dir[MAX_LINE], base[MAX_LINE], alt[MAX_LINE];
+    if(cut >= sizeof(dir) || n - cut >= sizeof(base) || memchr(pat, '*', cut) || memchr(pat, '?', cut)) return;
+    if(cut){
+        for(size_t i = 0; i < cut; i++) dir[i] = pat[i] == '\\' ? '/' : pat[i];
+        dir[cut > 1 ? cut - 1 : 1] = 0;
+    } else strcpy(dir, ".");
+    // cmd matches case-insensitively: compare lowercased pattern and names
+    for(size_t i = cut; i < n; i++) base[i - cut] = (char)tolower((unsigned char)pat[i]);
+    base[n - cut] = 0;
+    // *.* matches names without a dot too
+    size_t bl = n - cut;
+    snprintf(alt, sizeof(alt), "%.*s", bl >= 2 && strcmp(base + bl - 2, ".*") == 0 ? (int)bl - 2 : 0, base);
+    DIR *d = opendir(dir);
+    if(!d) return;
+    char **names = NULL;
+    size_t count = 0, cap = 0;
+    struct dirent *e;
+    char lower[256];
+    while((e = readdir(d))){
+        const char *nm = e->d_name;
+        if(nm[0] == '.' && (!nm[1] || (nm[1] == '.' && !nm[2]) || base[0] != '.')) continue; // hidden
+        size_t i = 0;
+        for(; nm[i] && i < sizeof(lower) - 1; i++) lower[i] = (char)tolower((unsigned char)nm[i]);
+        lower[i] = 0;
+        if(fnmatch(base, lower, 0) != 0 && (!*alt || fnmatch(alt, lower, 0) != 0)) continue;
+        int is_dir = e->d_type == DT_DIR;
+        struct stat st;
+        if(e->d_type == DT_UNKNOWN || e->d_type == DT_LNK) is_dir = fstatat(dirfd(d), nm, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        if(is_dir != (f->kind == 'd')) continue;
+        if(count == cap){
+            char **nn = realloc(names, (cap = cap ? cap * 2 : 256) * sizeof(*names));
+            if(!nn) break;
+            names = nn;
+        }
+        size_t l = strlen(nm);
+        char *v = arena_alloc(a, cut + l + 1);
+        if(!v) break;
+        memcpy(v, pat, cut);
+        memcpy(v + cut, nm, l + 1);
+        names[count++] = v;
+    }
+    closedir(d);
+    qsort(names, count, sizeof(*names), cmdfor_name_cmp);
+    for(size_t i = 0; i < count && !f->stop; i++){
+        f->val[f->var] = names[i];
+        cmdfor_iterate(f);
+    }
+    free(names);
+}
+
+// for and for /d: words of the set (blank, comma, semicolon or = separated,
+// quotes kept), wildcards expanded.
+static void cmdfor_words(struct cmdfor *f, struct arena *a){
+    const char *s = f->set, *end = s + f->nset;
+    while(s < end && !f->stop){
+        if(strchr(" \t,;=", *s)){ s++; continue; }
+        const char *w = s;
+        if(*s == '"'){
+            const char *q = memchr(s + 1, '"', (size_t)(end - s - 1));
+            s = q ? q + 1 : end;
+        } else while(s < end && !strchr(" \t,;=", *s)) s++;
+        size_t n = (size_t)(s - w);
+        if(memchr(w, '*', n) || memchr(w, '?', n)){
+            if(*w == '"' && n >= 2) cmdfor_glob(f, w + 1, n - 2, a);
+            else cmdfor_glob(f, w, n, a);
+            continue;
+        }
+        if(!(f->val[f->var] = arena_strndup(a, w, n))) return;
+        cmdfor_iterate(f);
+    }
+}
+
+// for /l: start, step, end; a missing number is 0, like cmd.
+static void cmdfor_range(struct cmdfor *f){
+    long long v[3] = { 0, 0, 0 };
+    const char *s = f->set, *end = s + f->nset;
+    for(int k = 0; k < 3 && s < end; k++){
+        while(s < end && strchr(" \t,;=", *s)) s++;
+        char *e;
+        v[k] = strtoll(s, &e, 10);
+        s = e > s ? e : end;
+    }
+    char num[24];
+    f->val[f->var] = num;
+    for(long long i = v[0]; !f->stop && (v[1] >= 0 ? i <= v[2] : i >= v[2]); i += v[1]){
+        snprintf(num, sizeof(num), "%lld", i);
+        cmdfor_iterate(f);
+    }
+}
+
+// Append everything readable from fd to sb.
+static int fd_slurp(int fd, struct sbuf *sb){
+    for(;;){
+        if(sb_grow(sb, 65536) != 0) return -1;
+        ssize_t k = read(fd, sb->p + sb->len, sb->cap - sb->len - 1);
+        if(k < 0 && errno == EINTR) continue;
+        if(k <= 0) return (int)k;
+        sb->len += (size_t)k;
+        sb->p[sb->len] = 0;
+    }
+}
+
+// for /f: each line of text split into tokens over the loop variables.
+static void cmdfor_lines(struct cmdfor *f, char *text, size_t len){
+    char *end = text + len;
+    unsigned char last = (unsigned char)(f->var + f->ntok + f->rest - 1);
+    if(last >= 128) return;
+    for(unsigned char v = f->var; v <= last; v++) f->val[v] = "";
+    for(char *line = text, *next; line < end && !f->stop; line = next){
+        char *nl = memchr(line, '\n', (size_t)(end - line));
+        next = nl ? nl + 1 : end;
+        char *le = nl ? nl : end;
+        if(le > line && le[-1] == '\r') le--;
+        *le = 0;
+        if(f->skip > 0){ f->skip--; continue; }
+        if(le == line || *line == f->eol) continue;
+        int k = 0, got = 0, t = 1;
+        char *p = line;
+        for(;;){
+            while(*p && strchr(f->delims, *p)) p++;
+            if(!*p) break;
+            if(k == f->ntok){ // everything after the last token
+                if(f->rest){ f->val[f->var + k] = p; got++; }
+                break;
+            }
+            char *w = p;
+            while(*p && !strchr(f->delims, *p)) p++;
+            if(t++ == f->tok[k]){ f->val[f->var + k++] = w; got++; }
+            if(*p) *p++ = 0;
+        }
+        if(got) cmdfor_iterate(f);
+        for(unsigned char v = f->var; v <= last; v++) f->val[v] = "";
+    }
+}
+
+// for /f sources: "string", 'command' and files (`command`, 'string' and
+// "file name" with usebackq). The command goes through translation and one
+// host shell, read to the end before the loop starts, as cmd does.
+static void cmdfor_file_set(struct cmdfor *f, struct arena *a){
+    const char *s = f->set, *end = s + f->nset;
+    while(s < end && (*s == ' ' || *s == '\t')) s++;
+    while(end > s && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    char str_q = f->usebackq ? '\'' : '"', cmd_q = f->usebackq ? '`' : '\'';
+    struct sbuf sb = { NULL, 0, 0, NULL };
+    if(end - s >= 2 && (*s == str_q || *s == cmd_q) && end[-1] == *s){
+        char *text = arena_strndup(a, s + 1, (size_t)(end - s - 2));
+        if(!text) return;
+        if(*s == str_q){ cmdfor_lines(f, text, strlen(text)); return; }
+        char *t = translate_pipeline(text, 1, HOST_IS_WINDOWS);
+        char *argv[] = { "/bin/sh", "-c", t ? t : text, NULL };
+        int fds[2], err = exec_pipe(fds) != 0 ? errno : 0;
+        pid_t pid = -1;
+        if(!err){
+            posix_spawn_file_actions_t fa;
+            posix_spawnattr_t attr;
+            posix_spawn_file_actions_init(&fa);
+            posix_spawn_file_actions_adddup2(&fa, fds[1], STDOUT_FILENO);
+            exec_spawnattr_init(&attr);
+            fflush(stdout);
+            err = posix_spawn(&pid, "/bin/sh", &fa, &attr, argv, environ);
+            posix_spawn_file_actions_destroy(&fa);
+            posix_spawnattr_destroy(&attr);
+            close(fds[1]);
+            if(!err) fd_slurp(fds[0], &sb);
+            close(fds[0]);
+        }
+        free(t);
+        int ws = 0;
+        if(err){ fprintf(stderr, "for /f: %s\n", strerror(err)); f->rc = 1; }
+        else while(waitpid(pid, &ws, 0) < 0 && errno == EINTR){}
+        if(err || decode_status(ws) == 128 + SIGINT) f->stop = 1;
+        if(sb.len) cmdfor_lines(f, sb.p, sb.len);
+        free(sb.p);
+        return;
+    }
+    while(s < end && !f->stop){
+        if(*s == ' ' || *s == '\t'){ s++; continue; }
+        const char *w = s;
+        size_t n;
+        if(*s == '"' && f->usebackq){
+            w++;
+            const char *q = memchr(w, '"', (size_t)(end - w));
+            n = (size_t)((q ? q : end) - w);
+            s = q ? q + 1 : end;
+        } else {
+            while(s < end && *s != ' ' && *s != '\t') s++;
+            n = (size_t)(s - w);
+        }
+        char path[MAX_LINE];
+        if(n >= sizeof(path)) continue;
+        for(size_t i = 0; i < n; i++) path[i] = w[i] == '\\' ? '/' : w[i];
+        path[n] = 0;
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0 || fd_slurp(fd, &sb) != 0){
+            fprintf(stderr, "The system cannot find the file %.*s.\n", (int)n, w);
+            f->rc = 1;
+        } else if(sb.len) cmdfor_lines(f, sb.p, sb.len);
+        if(fd >= 0) close(fd);
+        sb.len = 0;
+    }
+    free(sb.p);
+}
+
+// Run line if it is a cmd for loop we handle: its last body's exit status (1
+// on a syntax error), or -1 to let the caller translate and spawn it.
+static int cmdfor_run(const char *line){
+    struct cmdfor *f = malloc(sizeof(*f));
+    if(!f) return -1;
+    int r = cmdfor_parse(line, f);
+    if(r != 0){
+        free(f);
+        if(r > 0) return -1;
+        fprintf(stderr, "for: the syntax of the command is incorrect\n");
+        return 1;
+    }
+    // Ctrl-C in an in-process body stays pending until the next iteration checks
+    sigset_t m, old;
+    sigemptyset(&m);
+    sigaddset(&m, SIGINT);
+    sigprocmask(SIG_BLOCK, &m, &old);
+    struct arena a = { NULL, NULL };
+    if(f->kind == 'l') cmdfor_range(f);
+    else if(f->kind == 'f') cmdfor_file_set(f, &a);
+    else cmdfor_words(f, &a);
+    if(!sigismember(&old, SIGINT) && cmdfor_interrupted()){
+        struct timespec zero = { 0, 0 };
+        sigtimedwait(&m, NULL, &zero);
+        f->rc = 128 + SIGINT;
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    arena_free(&a);
+    r = f->rc;
+    free(f);
+    return r;
+}
+#endif
+
+#if !HOST_IS_WINDOWS
+// ---- Fallback provider ----
+// A command that is not found (exit status 127, what the exec engine and sh
+// both return for an unknown command) can be handed to a suggestion provider:
+// an HTTP endpoint (--fallback http://host[:port]/path, e.g. a local proxy in
+// front of an AI service) or a local program (--fallback exec:PROGRAM) that
+// reads the request on stdin. Either way the request is a small JSON object
+// and the answer its "suggestion" (or the plain text body). The request runs on
+// a worker thread under a hard timeout (--fallback-timeout MS) that covers the
+// name lookup too, so the prompt never waits for it: the answer is printed
+// when it arrives, through the line editor's wake-up, or before the next
+// prompt. Answers are cached in memory and appended to ~/.custard_fallback
+// ($CUSTARD_FALLBACK_CACHE) under the normalized command, so a repeated
+// mistake costs no request. Answers are only ever printed, never run.
+// `custard --fallback-mock` answers on loopback for testing, and the
+// `fallback` builtin shows the counters, including the time the prompt itself
+// spent on the provider.
+
+#define FB_TIMEOUT_MS 3000
+#define FB_SLOW_MS 1000          // answers slower than this report their cost to the prompt
+#define FB_MAX_ANSWER (64 << 10)
+#define FB_CACHE_BUCKETS 1024
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct fb_provider {
+    const char *name;
+    // On the worker thread: ask target about the JSON request and put the raw
+    // answer in out. Returns 0 or an errno value (ETIMEDOUT past deadline).
+    int (*ask)(const char *target, const char *request, struct sbuf *out, double deadline);
+};
+
+struct fb_entry { struct fb_entry *next; char *key, *val; };
+
+static struct {
+    const struct fb_provider *prov;
+    const char *target;          // URL or program
+    int timeout_ms;
+    int wake[2];                 // worker -> prompt: the request finished
+    pthread_mutex_t lock;
+    int busy, done, err;         // one request in flight
+    char *key, *request;
+    struct sbuf answer;
+    double t_start, t_done, start_cost;
+    long requests, answers, hits, timeouts, failures, skipped;
+    double lat_total, lat_max, prompt_total, prompt_max;
+    long prompt_n;
+    struct fb_entry *cache[FB_CACHE_BUCKETS];
+    int cache_loaded;
+    const char *cache_path;
+} fb = { .timeout_ms = FB_TIMEOUT_MS, .wake = { -1, -1 }, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Wait until fd is ready for events or the deadline passes.
+static int fb_wait(int fd, short events, double deadline){
+    for(;;){
+        double left = deadline - now_sec();
+        if(left <= 0) return ETIMEDOUT;
+        struct pollfd p = { fd, events, 0 };
+        int r = poll(&p, 1, (int)(left * 1e3) + 1);
+        if(r > 0) return 0;
+        if(r < 0 && errno != EINTR) return errno;
+    }
+}
+
+// Read fd to EOF (at most FB_MAX_ANSWER bytes) before the deadline.
+static int fb_read_all(int fd, struct sbuf *out, double deadline){
+    for(;;){
+        int err = fb_wait(fd, POLLIN, deadline);
+        if(err) return err;
+        char buf[4096];
+        ssize_t k = read(fd, buf, sizeof(buf));
+        if(k < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if(k < 0) return errno;
+        if(k == 0) return 0;
+        if(out->len + (size_t)k > FB_MAX_ANSWER) return EMSGSIZE;
+        sb_put(out, buf, (size_t)k);
+    }
+}
+
+// A name lookup handed to its own thread, so a stalled resolver cannot hold
+// the worker past its deadline. Whoever lets go last frees it: the worker on
+// an answer in time, the resolver when the worker has given up on it.
+struct fb_resolve {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs, done, rc;
+    struct addrinfo *ai;
+    char host[256], port[16];
+};
+
+static void fb_resolve_put(struct fb_resolve *r){
+    pthread_mutex_lock(&r->lock);
+    int last = --r->refs == 0;
+    pthread_mutex_unlock(&r->lock);
+    if(!last) return;
+    if(r->ai) freeaddrinfo(r->ai);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
+
+static void *fb_resolve_main(void *arg){
+    struct fb_resolve *r = arg;
+    struct addrinfo hints, *ai = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(r->host, r->port, &hints, &ai);
+    pthread_mutex_lock(&r->lock);
+    r->rc = rc;
+    r->ai = rc == 0 ? ai : NULL;
+    r->done = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    fb_resolve_put(r);
+    return NULL;
+}
+
+// Resolve host:port before the deadline. Numeric addresses skip the thread.
+static int fb_resolve(const char *host, const char *port, double deadline, struct addrinfo **out){
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    if(getaddrinfo(host, port, &hints, out) == 0) return 0;
+    struct fb_resolve *r = calloc(1, sizeof(*r));
+    if(!r) return ENOMEM;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    r->refs = 2;
+    snprintf(r->host, sizeof(r->host), "%s", host);
+    snprintf(r->port, sizeof(r->port), "%s", port);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t th;
+    int err = pthread_create(&th, &attr, fb_resolve_main, r);
+    pthread_attr_destroy(&attr);
+    if(err){
+        r->refs = 1;
+        fb_resolve_put(r);
+        return err;
+    }
+    // the condition waits on the realtime clock; the deadline is monotonic
+    double left = deadline - now_sec();
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if(left > 0){
+        ts.tv_sec += (time_t)left;
+        ts.tv_nsec += (long)((left - (double)(time_t)left) * 1e9);
+        if(ts.tv_nsec >= 1000000000L){ ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+    }
+    pthread_mutex_lock(&r->lock);
+    while(!r->done && left > 0)
+        if(pthread_cond_timedwait(&r->cond, &r->lock, &ts) == ETIMEDOUT) break;
+    err = !r->done ? ETIMEDOUT : r->rc != 0 ? EHOSTUNREACH : 0;
+    if(!err){
+        *out = r->ai;
+        r->ai = NULL;
+    }
+    pthread_mutex_unlock(&r->lock);
+    fb_resolve_put(r);
+    return err;
+}
+
+static int fb_http_ask(const char *url, const char *request, struct sbuf *out, double deadline){
+    if(strncmp(url, "http://", 7) != 0) return EINVAL;
+    const char *h = url + 7, *path = strchr(h, '/');
+    size_t hl = path ? (size_t)(path - h) : strlen(h);
+    const char *colon = memchr(h, ':', hl);
+    char host[256], port[16] = "80";
+    size_t nl = colon ? (size_t)(colon - h) : hl;
+    if(nl >= sizeof(host) || (colon && hl - nl - 1 >= sizeof(port))) return EINVAL;
+    memcpy(host, h, nl);
+    host[nl] = 0;
+    if(colon){
+        memcpy(port, colon + 1, hl - nl - 1);
+        port[hl - nl - 1] = 0;
+    }
+    struct addrinfo *ai;
+    int rerr = fb_resolve(host, port, deadline, &ai);
+    if(rerr) return rerr;
+    int fd = socket(ai->ai_family, SOCK_STREAM, 0), err = fd < 0 ? errno : 0;
+    if(!err){
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if(connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS) err = errno;
+        socklen_t el = sizeof(err);
+        if(!err && !(err = fb_wait(fd, POLLOUT, deadline))) getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &el);
+    }
+    freeaddrinfo(ai);
+    struct sbuf req = { NULL, 0, 0, NULL };
+    sb_printf(&req, "POST %s HTTP/1.0\r\nHost: %s\r\nContent-Type: application/json\r\n", path ? path : "/", host);
+    sb_printf(&req, "Content-Length: %zu\r\nConnection: close\r\n\r\n", strlen(request));
+    sb_puts(&req, request);
+    for(size_t off = 0; !err && off < req.len;){
+        if((err = fb_wait(fd, POLLOUT, deadline))) break;
+        ssize_t k = send(fd, req.p + off, req.len - off, MSG_NOSIGNAL);
+        if(k < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if(k < 0) err = errno;
+        else off += (size_t)k;
+    }
+    free(req.p);
+    struct sbuf resp = { NULL, 0, 0, NULL };
+    if(!err) err = fb_read_all(fd, &resp, deadline);
+    if(fd >= 0) close(fd);
+    // HTTP/1.x 200 ... \r\n\r\n body
+    const char *body = resp.p ? strstr(resp.p, "\r\n\r\n") : NULL;
+    if(!err && (!body || resp.len < 12 || strncmp(resp.p, "HTTP/1.", 7) != 0 || atoi(resp.p + 9) != 200)) err = EPROTO;
+    if(!err) sb_put(out, body + 4, resp.len - (size_t)(body + 4 - resp.p));
+    free(resp.p);
+    return err;
+}
+
+static int fb_exec_ask(const char *prog, const char *request, struct sbuf *out, double deadline){
+    int in[2], res[2];
+    if(exec_pipe(in) != 0) return errno;
+    if(exec_pipe(res) != 0){ int e = errno; close(in[0]); close(in[1]); return e; }
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, res[1], STDOUT_FILENO);
+    exec_spawnattr_init(&attr);
+    // its own process group: Ctrl-C meant for a command must not reach it
+    short flags;
+    posix_spawnattr_getflags(&attr, &flags);
+    posix_spawnattr_setflags(&attr, flags | POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    char *argv[] = { (char *)prog, NULL };
+    pid_t pid = -1;
+    int err = posix_spawnp(&pid, prog, &fa, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    close(in[0]);
+    close(res[1]);
+    if(!err){
+        fcntl(in[1], F_SETFL, fcntl(in[1], F_GETFL) | O_NONBLOCK);
+        size_t n = strlen(request);
+        for(size_t off = 0; !err && off < n;){
+            if((err = fb_wait(in[1], POLLOUT, deadline))) break;
+            ssize_t k = write(in[1], request + off, n - off);
+            if(k < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+            if(k < 0) err = errno;
+            else off += (size_t)k;
+        }
+    }
+    close(in[1]);
+    if(!err) err = fb_read_all(res[0], out, deadline);
+    close(res[0]);
+    if(pid > 0 && err) kill(-pid, SIGKILL); // the whole group, helpers included
+    int ws = 0;
+    if(pid > 0) while(waitpid(pid, &ws, 0) < 0 && errno == EINTR){}
+    if(!err && decode_status(ws) != 0) err = EPROTO;
+    return err;
+}
+
+static const struct fb_provider fb_providers[] = {
+    { "http", fb_http_ask },
+    { "exec", fb_exec_ask },
+};
+
+// --fallback http://... | exec:PROGRAM | off, with the timeout in ms (0: default).
+static int fb_configure(const char *spec, int timeout_ms){
+    if(timeout_ms > 0) fb.timeout_ms = timeout_ms;
+    if(!spec || !*spec || strcmp(spec, "off") == 0){ fb.prov = NULL; return 0; }
+    if(strncmp(spec, "http://", 7) == 0){ fb.prov = &fb_providers[0]; fb.target = spec; return 0; }
+    if(strncmp(spec, "exec:", 5) == 0 && spec[5]){ fb.prov = &fb_providers[1]; fb.target = spec + 5; return 0; }
+    fprintf(stderr, "custard: --fallback wants http://host[:port]/path, exec:PROGRAM or off\n");
+    return -1;
+}
+
+// The string value of "key" in a JSON object, unescaped into out; -1 if absent.
+static int fb_json_string(const char *s, size_t n, const char *key, struct sbuf *out){
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\"", key);
+    const char *p = view_find(s, n, pat), *end = s + n;
+    if(!p) return -1;
+    for(p += strlen(pat); p < end && (tok_is_blank(*p) || *p == ':'); p++){}
+    if(p >= end || *p++ != '"') return -1;
+    while(p < end && *p != '"'){
+        if(*p != '\\' || p + 1 >= end){ sb_putc(out, *p++); continue; }
+        char c = p[1];
+        p += 2;
+        if(c == 'n') sb_putc(out, '\n');
+        else if(c == 't') sb_putc(out, '\t');
+        else if(c == 'u' && end - p >= 4){
+            unsigned u = (unsigned)strtoul((char[5]){ p[0], p[1], p[2], p[3], 0 }, NULL, 16);
+            p += 4;
+            if(u < 0x80) sb_putc(out, (char)u);
+            else if(u < 0x800){ sb_putc(out, (char)(0xc0 | u >> 6)); sb_putc(out, (char)(0x80 | (u & 0x3f))); }
+            else { sb_putc(out, (char)(0xe0 | u >> 12)); sb_putc(out, (char)(0x80 | (u >> 6 & 0x3f))); sb_putc(out, (char)(0x80 | (u & 0x3f))); }
+        } else if(c != 'b' && c != 'f' && c != 'r') sb_putc(out, c);
+    }
+    return 0;
+}
+
+static void fb_json_put(struct sbuf *out, const char *s){
+    sb_putc(out, '"');
+    for(; *s; s++){
+        if(*s == '"' || *s == '\\'){ sb_putc(out, '\\'); sb_putc(out, *s); }
+        else if((unsigned char)*s < 32) sb_printf(out, "\\u%04x", (unsigned char)*s);
+        else sb_putc(out, *s);
+    }
+    sb_putc(out, '"');
+}
+
+// A provider's answer as printable text: "suggestion" (or "text") of a JSON
+// object, else the body itself; control characters (escape sequences) dropped.
+static void fb_answer_text(const char *s, size_t n, struct sbuf *out){
+    struct sbuf raw = { NULL, 0, 0, NULL };
+    while(n && tok_is_blank(*s)) s++, n--;
+    if(!(n && *s == '{' && (fb_json_string(s, n, "suggestion", &raw) == 0 || fb_json_string(s, n, "text", &raw) == 0)))
+        sb_put(&raw, s, n);
+    size_t len = raw.len;
+    while(len && tok_is_blank(raw.p[len - 1])) len--;
+    for(size_t i = 0; i < len; i++)
+        if((unsigned char)raw.p[i] >= 32 || raw.p[i] == '\n' || raw.p[i] == '\t') sb_putc(out, raw.p[i]);
+    free(raw.p);
+}
+
+// Cache key: dialect, blanks collapsed, command word lowercased.
+static char *fb_key(const char *line, int windows){
+    struct sbuf k = { NULL, 0, 0, NULL };
+    sb_puts(&k, windows ? "cmd:" : "bash:");
+    int word = 1;
+    for(const char *p = line; *p; p++){
+        if(tok_is_blank(*p)){
+            while(tok_is_blank(p[1])) p++;
+            if(p[1]) sb_putc(&k, ' ');
+            word = 0;
+            continue;
+        }
+        sb_putc(&k, word ? (char)tolower((unsigned char)*p) : *p);
+    }
+    return sb_take(&k);
+}
+
+static uint32_t fb_hash(const char *s){
+    uint32_t h = 2166136261u;
+    while(*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static const char *fb_cache_get(const char *key){
+    for(struct fb_entry *e = fb.cache[fb_hash(key) % FB_CACHE_BUCKETS]; e; e = e->next)
+        if(strcmp(e->key, key) == 0) return e->val;
+    return NULL;
+}
+
+static void fb_cache_set(const char *key, const char *val){
+    struct fb_entry **b = &fb.cache[fb_hash(key) % FB_CACHE_BUCKETS];
+    for(struct fb_entry *e = *b; e; e = e->next)
+        if(strcmp(e->key, key) == 0){
+            char *v = strdup(val);
+            if(v){ free(e->val); e->val = v; }
+            return;
+        }
+    struct fb_entry *e = malloc(sizeof(*e));
+    if(!e || !(e->key = strdup(key)) || !(e->val = strdup(val))){
+        if(e) free(e->key);
+        free(e);
+        return;
+    }
+    e->next = *b;
+    *b = e;
+}
+
+static const char *fb_cache_file(void){
+    static char buf[MAX_LINE];
+    if(fb.cache_path) return fb.cache_path;
+    const char *p = getenv("CUSTARD_FALLBACK_CACHE"), *home = getenv("HOME");
+    if(!p && home){
+        snprintf(buf, sizeof(buf), "%s/.custard_fallback", home);
+        p = buf;
+    }
+    return fb.cache_path = p ? p : "";
+}
+
+// Load the disk cache on first use: "key<TAB>answer" lines, the answer with
+// \n, \t and \\ escaped; later lines win.
+static void fb_cache_load(void){
+    if(fb.cache_loaded) return;
+    fb.cache_loaded = 1;
+    const char *path = fb_cache_file();
+    int fd = *path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if(fd < 0) return;
+    struct sbuf text = { NULL, 0, 0, NULL };
+    int rc = fd_slurp(fd, &text);
+    close(fd);
+    for(char *line = text.p, *next; rc == 0 && line && *line; line = next){
+        char *nl = strchr(line, '\n');
+        next = nl ? nl + 1 : line + strlen(line);
+        if(nl) *nl = 0;
+        char *tab = strchr(line, '\t');
+        if(!tab) continue;
+        *tab = 0;
+        char *w = tab + 1;
+        for(char *r = tab + 1; *r; r++){
+            if(*r == '\\' && r[1]){ r++; *w++ = *r == 'n' ? '\n' : *r == 't' ? '\t' : *r; }
+            else *w++ = *r;
+        }
+        *w = 0;
+        fb_cache_set(line, tab + 1);
+    }
+    free(text.p);
+}
+
+static void fb_cache_store(const char *key, const char *val){
+    fb_cache_set(key, val);
+    const char *path = fb_cache_file();
+    if(!*path) return;
+    struct sbuf line = { NULL, 0, 0, NULL };
+    sb_puts(&line, key);
+    sb_putc(&line, '\t');
+    for(const char *p = val; *p; p++){
+        if(*p == '\n') sb_put(&line, "\\n", 2);
+        else if(*p == '\t') sb_put(&line, "\\t", 2);
+        else if(*p == '\\') sb_put(&line, "\\\\", 2);
+        else sb_putc(&line, *p);
+    }
+    sb_putc(&line, '\n');
+    // one O_APPEND write per entry, so concurrent sessions interleave whole lines
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if(fd >= 0){
+        if(write_all(fd, line.p, line.len) != 0) perror(path);
+        close(fd);
+    }
+    free(line.p);
+}
+
+static void *fb_worker(void *arg){
+    (void)arg;
+    struct sbuf raw = { NULL, 0, 0, NULL }, ans = { NULL, 0, 0, NULL };
+    double deadline = fb.t_start + fb.timeout_ms / 1e3;
+    int err = fb.prov->ask(fb.target, fb.request, &raw, deadline);
+    if(!err && now_sec() > deadline) err = ETIMEDOUT;
+    if(!err) fb_answer_text(raw.p ? raw.p : "", raw.len, &ans);
+    free(raw.p);
+    pthread_mutex_lock(&fb.lock);
+    fb.answer = ans;
+    fb.err = err;
+    fb.t_done = now_sec();
+    fb.done = 1;
+    pthread_mutex_unlock(&fb.lock);
+    char c = 0;
+    if(write(fb.wake[1], &c, 1) < 0){} // the prompt also polls before each read
+    return NULL;
+}
+
+static void fb_prompt_cost(double t0){
+    double dt = now_sec() - t0;
+    fb.prompt_total += dt;
+    fb.prompt_n++;
+    if(dt > fb.prompt_max) fb.prompt_max = dt;
+}
+
+// Print what a finished request brought. redraw: the line editor is showing
+// a prompt, which is cleared first and redrawn by the caller. Returns 1 when
+// a suggestion was printed.
+static int fb_collect(int redraw){
+    if(!fb.busy) return 0;
+    double t0 = now_sec();
+    char c;
+    while(read(fb.wake[0], &c, 1) > 0){}
+    pthread_mutex_lock(&fb.lock);
+    int done = fb.done;
+    pthread_mutex_unlock(&fb.lock);
+    if(!done) return 0;
+    int shown = 0;
+    double lat = fb.t_done - fb.t_start;
+    fb.lat_total += lat;
+    if(lat > fb.lat_max) fb.lat_max = lat;
+    if(redraw) fputs("\r\x1b[K", stdout);
+    if(fb.err == ETIMEDOUT){
+        fb.timeouts++;
+        printf("[fallback] %s: no answer within %d ms\n", fb.prov->name, fb.timeout_ms);
+    } else if(fb.err){
+        fb.failures++;
+        printf("[fallback] %s: %s\n", fb.prov->name, strerror(fb.err));
+    } else if(!fb.answer.len){
+        fb.answers++;
+        printf("[fallback] no suggestion\n");
+    } else {
+        fb.answers++;
+        printf("[fallback] %s\n", fb.answer.p);
+        fb_cache_store(fb.key, fb.answer.p);
+        shown = 1;
+    }
+    fb_prompt_cost(t0);
+    double cost = now_sec() - t0 + fb.start_cost;
+    if(lat * 1e3 >= FB_SLOW_MS || fb.err == ETIMEDOUT)
+        printf("[fallback] slow provider: %.0f ms to answer, %.3f ms of it spent at the prompt\n", lat * 1e3, cost * 1e3);
+    fflush(stdout);
+    free(fb.key);
+    free(fb.request);
+    free(fb.answer.p);
+    fb.key = fb.request = NULL;
+    memset(&fb.answer, 0, sizeof(fb.answer));
+    fb.busy = fb.done = 0;
+    return shown;
+}
+
+static void fb_wake(void){ fb_collect(1); }
+
+// interactive: answers are printed while the user types.
+static int fb_init(int interactive){
+    if(fb.wake[0] >= 0) return 0;
+    if(exec_pipe(fb.wake) != 0){ fb.prov = NULL; return -1; }
+    fcntl(fb.wake[0], F_SETFL, fcntl(fb.wake[0], F_GETFL) | O_NONBLOCK);
+    if(interactive) input_wake_add(fb.wake[0], fb_wake);
+    return 0;
+}
+
+// line exited 127 (translated to host_cmd): answer from the cache, or start a
+// request unless one is still out.
+static void fb_request(const char *line, const char *host_cmd, int windows){
+    if(!fb.prov || fb.wake[0] < 0) return;
+    char *key = fb_key(line, windows);
+    int same = fb.busy && strcmp(fb.key, key) == 0;
+    // an answer that came in while the command ran; when it was for this very
+    // command it is now cached too, and the hit below would print it twice
+    if(fb_collect(0) && same){
+        free(key);
+        return;
+    }
+    double t0 = now_sec();
+    fb_cache_load();
+    const char *hit = fb_cache_get(key);
+    if(hit || fb.busy){
+        if(hit){
+            fb.hits++;
+            printf("[fallback] %s\n", hit);
+        } else fb.skipped++;
+        free(key);
+        fb_prompt_cost(t0);
+        return;
+    }
+    struct sbuf req = { NULL, 0, 0, NULL };
+    sb_puts(&req, "{\"command\":");
+    fb_json_put(&req, line);
+    sb_puts(&req, ",\"translated\":");
+    fb_json_put(&req, host_cmd);
+#if defined(__linux__)
+    const char *host = "linux";
+#elif defined(__APPLE__)
+    const char *host = "macos";
+#else
+    const char *host = "unix";
+#endif
+    sb_printf(&req, ",\"dialect\":\"%s\",\"host\":\"%s\",\"status\":127}", windows ? "cmd" : "bash", host);
+    fb.key = key;
+    fb.request = sb_take(&req);
+    fb.t_start = now_sec();
+    fb.done = 0;
+    // every signal stays with the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t t;
+    int err = pthread_create(&t, NULL, fb_worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(err){
+        fprintf(stderr, "[fallback] %s\n", strerror(err));
+        free(fb.key);
+        free(fb.request);
+        fb.key = fb.request = NULL;
+    } else {
+        pthread_detach(t);
+        fb.busy = 1;
+        fb.requests++;
+    }
+    fb_prompt_cost(t0);
+    fb.start_cost = now_sec() - t0;
+}
+
+static void fb_stats(void){
+    if(!fb.prov){ printf("fallback: off (--fallback http://host[:port]/path or exec:PROGRAM)\n"); return; }
+    fb_collect(0);
+    long n = fb.answers + fb.timeouts + fb.failures;
+    printf("fallback: %s %s, timeout %d ms, cache %s\n", fb.prov->name, fb.target, fb.timeout_ms, *fb_cache_file() ? fb_cache_file() : "(memory only)");
+    printf("  %ld requests (%ld answered, %ld timed out, %ld failed, %ld skipped while busy), %ld cache hits\n",
+           fb.requests, fb.answers, fb.timeouts, fb.failures, fb.skipped, fb.hits);
+    printf("  provider latency: avg %.1f ms, max %.1f ms; prompt delay: avg %.3f ms, max %.3f ms\n",
+           n ? fb.lat_total * 1e3 / n : 0.0, fb.lat_max * 1e3,
+           fb.prompt_n ? fb.prompt_total * 1e3 / fb.prompt_n : 0.0, fb.prompt_max * 1e3);
+}
+
+// ---- Loopback mock provider ----
+static int fb_mock_delay_ms;
+
+// Listen on 127.0.0.1:port (0: any free port, written back).
+static int fb_mock_listen(int *port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+    if(fd < 0) return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    a.sin_port = htons((uint16_t)*port);
+    socklen_t al = sizeof(a);
+    if(bind(fd, (struct sockaddr *)&a, sizeof(a)) != 0 || listen(fd, 64) != 0 ||
+       getsockname(fd, (struct sockaddr *)&a, &al) != 0){
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(a.sin_port);
+    return fd;
+}
+
+// Answer every request on lfd, one connection at a time, after fb_mock_delay_ms.
+static void *fb_mock_serve(void *arg){
+    int lfd = (int)(intptr_t)arg;
+    for(;;){
+        int c = accept(lfd, NULL, NULL);
+        if(c < 0){ if(errno == EINTR || errno == ECONNABORTED) continue; break; }
+        fcntl(c, F_SETFD, FD_CLOEXEC);
+        struct sbuf req = { NULL, 0, 0, NULL };
+        char buf[4096];
+        const char *body = NULL;
+        ssize_t k;
+        while((k = recv(c, buf, sizeof(buf), 0)) > 0 && req.len + (size_t)k <= FB_MAX_ANSWER){
+            sb_put(&req, buf, (size_t)k);
+            if(!body && (body = strstr(req.p, "\r\n\r\n"))) body += 4;
+            const char *cl = req.p ? strstr(req.p, "Content-Length:") : NULL;
+            if(body && (!cl || req.len - (size_t)(body - req.p) >= strtoul(cl + 15, NULL, 10))) break;
+            body = NULL;
+        }
+        struct sbuf cmd = { NULL, 0, 0, NULL }, ans = { NULL, 0, 0, NULL }, resp = { NULL, 0, 0, NULL };
+        if(body) fb_json_string(body, req.len - (size_t)(body - req.p), "command", &cmd);
+        if(fb_mock_delay_ms > 0) poll(NULL, 0, fb_mock_delay_ms);
+        char text[MAX_LINE];
+        snprintf(text, sizeof(text), "mock: '%s' is not a command on this host; check the spelling or install it", cmd.p ? cmd.p : "");
+        sb_puts(&ans, "{\"suggestion\":");
+        fb_json_put(&ans, text);
+        sb_puts(&ans, "}\n");
+        sb_printf(&resp, "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", ans.len);
+        sb_put(&resp, ans.p, ans.len);
+        for(size_t off = 0; off < resp.len && (k = send(c, resp.p + off, resp.len - off, MSG_NOSIGNAL)) > 0; off += (size_t)k){}
+        close(c);
+        free(req.p);
+        free(cmd.p);
+        free(ans.p);
+        free(resp.p);
+    }
+    return NULL;
+}
+
+// custard --fallback-mock [port [delay_ms]]
+static int fb_mock_main(int argc, char **argv){
+    int port = argc > 0 ? atoi(argv[0]) : 8765;
+    fb_mock_delay_ms = argc > 1 ? atoi(argv[1]) : 0;
+    signal(SIGPIPE, SIG_IGN);
+    int fd = fb_mock_listen(&port);
+    if(fd < 0){ perror("fallback mock"); return 1; }
+    printf("fallback mock: http://127.0.0.1:%d/suggest (answers after %d ms); Ctrl-C stops it\n", port, fb_mock_delay_ms);
+    fflush(stdout);
+    fb_mock_serve((void *)(intptr_t)fd);
+    return 1;
+}
+#endif
+
+#if !HOST_IS_WINDOWS
+// ---- Did you mean ----
+// A command word that is not found gets the nearest known commands, offline
+// and at once. The known words live in one BK-tree:
+// - every executable on PATH;
+// - the source-dialect commands the translator maps (its tables and rule files);
+// - shell, cmd and custard builtins.
+// Words are compared by optimal string alignment distance, case-insensitively
+// (insert, delete, substitute, or swap two adjacent letters). Each child hangs
+// off its parent by its distance to it, so a search of radius r only descends
+// into children whose distance is within r of its own. OSA is not quite a
+// metric, so a rare word at the edge of the radius can be pruned; fine for hints.
+// PATH directories are stat'ed before each search. One whose mtime changed, or
+// that entered or left $PATH, has only its own words added or released. A
+// released word stays in the tree as a dead node, and once dead nodes
+// outnumber live ones the tree is rebuilt.
+
+#define SPELL_MAX_WORD 64
+#define SPELL_SUGGEST 3
+
+struct spell_node {
+    uint32_t word;          // pool offset of the word, followed by its lowercase form
+    uint32_t child, next;   // first child, next sibling; 0 is none (node 0 is the root)
+    uint16_t refs;          // sources holding the word; 0: dead
+    uint8_t dist;           // distance to the parent
+    uint8_t dialects;       // 1 bash, 2 cmd
+    uint8_t len;
+};
+
+struct spell_dir {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    long mtime_ns;
+    uint32_t *nodes;        // words this directory holds
+    size_t n, cap;
+    int seen;
+};
+
+static struct {
+    struct spell_node *node;
+    uint32_t nnodes, cap, live, dead;
+    struct sbuf pool;
+    struct spell_dir *dirs;
+    size_t ndirs;
+    char *pathvar;
+    uint32_t *stack;
+} spell;
+
+static const char *const spell_bash_words[] = {
+    "exit", "quit", "history", "clear", "cache", "pipestatus", "coproc", "fallback", "help",
+    "jobs", "fg", "bg", "wait", "kill", "xargs", NULL
+};
+static const char *const spell_cmd_words[] = {
+    "cd", "chdir", "set", "echo", "for", "if", "call", "goto", "pause", "ver", "vol", "title",
+    "color", "pushd", "popd", "exit", "ren", "rename", "md", "rd", "where", "findstr", "more",
+    "sort", "find", "attrib", "xcopy", "robocopy", "tree", "timeout", "setlocal", "endlocal",
+    "shift", "path", "prompt", "quit", "clear", "cache", "pipestatus", "coproc", "fallback",
+    "help", "jobs", "fg", "bg", "wait", "kill", NULL
+};
+
+// A word prepared for comparisons: its lowercase (ASCII) form and, per byte
+// value, the mask of positions holding it.
+struct spell_pat {
+    char f[SPELL_MAX_WORD + 1];
+    size_t n;
+    uint64_t peq[256];
+};
+
+static void spell_pattern(struct spell_pat *pt, const char *w, size_t n){
+    memset(pt->peq, 0, sizeof(pt->peq));
+    for(size_t i = 0; i < n; i++){
+        pt->f[i] = (char)(w[i] >= 'A' && w[i] <= 'Z' ? w[i] | 0x20 : w[i]);
+        pt->peq[(unsigned char)pt->f[i]] |= 1ull << i;
+    }
+    pt->f[n] = 0;
+    pt->n = n;
+}
+
+// Optimal string alignment distance between the pattern and a folded word,
+// one column of the edit matrix per step as bit vectors (Hyyro's algorithm;
+// the pattern fits in 64 bits).
+static int spell_dist(const struct spell_pat *pt, const char *b, size_t bn){
+    size_t m = pt->n;
+    if(!m) return (int)bn;
+    uint64_t vp = m == 64 ? ~0ull : (1ull << m) - 1, vn = 0, d0 = 0, pm_prev = 0, top = 1ull << (m - 1);
+    int d = (int)m;
+    for(size_t j = 0; j < bn; j++){
+        uint64_t pm = pt->peq[(unsigned char)b[j]];
+        uint64_t tr = ((~d0 & pm) << 1) & pm_prev; // adjacent swap
+        d0 = (((pm & vp) + vp) ^ vp) | pm | vn | tr;
+        uint64_t hp = vn | ~(d0 | vp), hn = d0 & vp;
+        if(hp & top) d++;
+        else if(hn & top) d--;
+        hp = (hp << 1) | 1;
+        hn <<= 1;
+        vp = hn | ~(d0 | hp);
+        vn = hp & d0;
+        pm_prev = pm;
+    }
+    return d;
+}
+
+static inline const char *spell_folded(const struct spell_node *nd){
+    return spell.pool.p + nd->word + nd->len + 1;
+}
+
+// Add a reference to word (inserting it when new). Returns its node, or
+// UINT32_MAX for words too long to index or on OOM. Words differing only in
+// case share a node.
+static uint32_t spell_add(const char *w, size_t n, int dialects){
+    if(!n || n > SPELL_MAX_WORD) return UINT32_MAX;
+    struct spell_pat pt;
+    spell_pattern(&pt, w, n);
+    uint32_t cur = 0, parent = UINT32_MAX;
+    int d = 0;
+    while(cur < spell.nnodes){
+        const struct spell_node *nd = &spell.node[cur];
+        d = spell_dist(&pt, spell_folded(nd), nd->len);
+        if(d == 0){
+            struct spell_node *m = &spell.node[cur];
+            if(!m->refs++){ spell.live++; spell.dead--; }
+            m->dialects |= (uint8_t)dialects;
+            return cur;
+        }
+        parent = cur;
+        for(cur = nd->child; cur && spell.node[cur].dist != d; cur = spell.node[cur].next){}
+        if(!cur) break;
+    }
+    if(spell.nnodes == spell.cap){
+        uint32_t cap = spell.cap ? spell.cap * 2 : 1024;
+        struct spell_node *nn = realloc(spell.node, cap * sizeof(*nn));
+        uint32_t *ns = realloc(spell.stack, cap * sizeof(*ns));
+        if(nn) spell.node = nn;
+        if(ns) spell.stack = ns;
+        if(!nn || !ns) return UINT32_MAX;
+        spell.cap = cap;
+    }
+    uint32_t id = spell.nnodes++;
+    struct spell_node *m = &spell.node[id];
+    m->word = (uint32_t)spell.pool.len;
+    sb_put(&spell.pool, w, n);
+    sb_putc(&spell.pool, 0);
+    sb_put(&spell.pool, pt.f, n + 1);
+    m->len = (uint8_t)n;
+    m->child = 0;
+    m->refs = 1;
+    m->dist = (uint8_t)d;
+    m->dialects = (uint8_t)dialects;
+    m->next = 0;
+    if(parent != UINT32_MAX){
+        m->next = spell.node[parent].child;
+        spell.node[parent].child = id;
+    }
+    spell.live++;
+    return id;
+}
+
+static void spell_release(uint32_t id){
+    if(id < spell.nnodes && spell.node[id].refs && !--spell.node[id].refs){ spell.live--; spell.dead++; }
+}
+
+// (Re)read the executables of one PATH directory.
+static void spell_scan_dir(struct spell_dir *d){
+    for(size_t i = 0; i < d->n; i++) spell_release(d->nodes[i]);
+    d->n = 0;
+    DIR *dp = opendir(d->path);
+    if(!dp) return;
+    struct dirent *e;
+    while((e = readdir(dp))){
+        if(e->d_name[0] == '.' || e->d_type == DT_DIR) continue;
+        struct stat st;
+        if(fstatat(dirfd(dp), e->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode) || !(st.st_mode & 0111)) continue;
+        uint32_t id = spell_add(e->d_name, strlen(e->d_name), 3);
+        if(id == UINT32_MAX) continue;
+        if(d->n == d->cap){
+            size_t cap = d->cap ? d->cap * 2 : 64;
+            uint32_t *nn = realloc(d->nodes, cap * sizeof(*nn));
+            if(!nn){ spell_release(id); break; }
+            d->nodes = nn;
+            d->cap = cap;
+        }
+        d->nodes[d->n++] = id;
+    }
+    closedir(dp);
+}
+
+// Start over: the fixed words, then every PATH directory.
+static void spell_rebuild(void){
+    spell.nnodes = spell.live = spell.dead = 0;
+    spell.pool.len = 0;
+    for(size_t i = 0; i < ARRAY_LEN(l2w_entries); i++) spell_add(l2w_entries[i].name, strlen(l2w_entries[i].name), 1);
+    for(size_t i = 0; i < ARRAY_LEN(w2l_entries); i++) spell_add(w2l_entries[i].name, strlen(w2l_entries[i].name), 2);
+    for(const char **w = shell_words; *w; w++) spell_add(*w, strlen(*w), 1);
+    for(const char *const *w = spell_bash_words; *w; w++) spell_add(*w, strlen(*w), 1);
+    for(const char *const *w = spell_cmd_words; *w; w++) spell_add(*w, strlen(*w), 2);
+    for(int dir = 0; dir < 2; dir++)
+        for(uint32_t g = 0; rules.loaded && g < rules.set[dir].ngroups; g++){
+            const char *tok = rules.pool + rules.set[dir].groups[g].token;
+            spell_add(tok, strlen(tok), dir == RULE_L2W ? 1 : 2);
+        }
+    for(size_t i = 0; i < spell.ndirs; i++){
+        spell.dirs[i].n = 0; // their node ids went with the old tree
+        spell_scan_dir(&spell.dirs[i]);
+    }
+}
+
+// Bring the tree up to date with $PATH and its directories.
+static void spell_refresh(void){
+    const char *pv = getenv("PATH");
+    if(!pv) pv = "";
+    int full = spell.nnodes == 0;
+    if(!spell.pathvar || strcmp(spell.pathvar, pv) != 0){
+        for(size_t i = 0; i < spell.ndirs; i++) spell.dirs[i].seen = 0;
+        for(const char *p = pv; ; ){
+            const char *colon = strchr(p, ':');
+            size_t n = colon ? (size_t)(colon - p) : strlen(p);
+            const char *dir = n ? p : ".";
+            if(!n) n = 1;
+            size_t i = 0;
+            while(i < spell.ndirs && !(strlen(spell.dirs[i].path) == n && memcmp(spell.dirs[i].path, dir, n) == 0)) i++;
+            if(i < spell.ndirs) spell.dirs[i].seen = 1;
+            else {
+                struct spell_dir *nd = realloc(spell.dirs, (spell.ndirs + 1) * sizeof(*nd));
+                if(!nd) break;
+                spell.dirs = nd;
+                memset(&nd[spell.ndirs], 0, sizeof(*nd));
+                if(!(nd[spell.ndirs].path = strndup(dir, n))) break;
+                nd[spell.ndirs].seen = 1;
+                nd[spell.ndirs].ino = (ino_t)-1;
+                spell.ndirs++;
+            }
+            if(!colon) break;
+            p = colon + 1;
+        }
+        // directories that left $PATH give their words back
+        size_t k = 0;
+        for(size_t i = 0; i < spell.ndirs; i++){
+            struct spell_dir *d = &spell.dirs[i];
+            if(d->seen){ spell.dirs[k++] = *d; continue; }
+            for(size_t j = 0; j < d->n; j++) spell_release(d->nodes[j]);
+            free(d->path);
+            free(d->nodes);
+        }
+        spell.ndirs = k;
+        free(spell.pathvar);
+        spell.pathvar = strdup(pv);
+    }
+    for(size_t i = 0; i < spell.ndirs; i++){
+        struct spell_dir *d = &spell.dirs[i];
+        struct stat st;
+        if(stat(d->path, &st) != 0) memset(&st, 0, sizeof(st));
+        if(!full && st.st_dev == d->dev && st.st_ino == d->ino && st.st_mtim.tv_sec == d->mtime && st.st_mtim.tv_nsec == d->mtime_ns)
+            continue;
+        d->dev = st.st_dev;
+        d->ino = st.st_ino;
+        d->mtime = st.st_mtim.tv_sec;
+        d->mtime_ns = st.st_mtim.tv_nsec;
+        if(!full) spell_scan_dir(d);
+    }
+    if(full || (spell.dead > 256 && spell.dead > spell.live)) spell_rebuild();
+}
+
+// The live words within radius of w for the dialect, nearest first (ties:
+// closer length, then alphabetical); at most max of them. Returns the count,
+// and whether w itself is a known word (in either dialect) in *known.
+static int spell_search(const char *w, size_t n, int windows, int radius, const char **out, int max, int *known){
+    int dist[SPELL_SUGGEST];
+    int count = 0, mask = windows ? 2 : 1;
+    *known = 0;
+    if(max > SPELL_SUGGEST) max = SPELL_SUGGEST;
+    if(!spell.nnodes || n > SPELL_MAX_WORD) return 0;
+    struct spell_pat pt;
+    spell_pattern(&pt, w, n);
+    uint32_t top = 0;
+    spell.stack[top++] = 0;
+    while(top){
+        const struct spell_node *nd = &spell.node[spell.stack[--top]];
+        const char *s = spell.pool.p + nd->word;
+        size_t sl = nd->len;
+        int d = spell_dist(&pt, spell_folded(nd), sl);
+        if(d == 0 && nd->refs) *known = 1;
+        else if(d <= radius && nd->refs && (nd->dialects & mask)){
+            int k = count < max ? count++ : max;
+            // insertion sort into the best max
+            while(k > 0){
+                const char *o = out[k - 1];
+                long dl = labs((long)strlen(o) - (long)n) - labs((long)sl - (long)n);
+                if(dist[k - 1] < d || (dist[k - 1] == d && (dl < 0 || (dl == 0 && strcasecmp(o, s) <= 0)))) break;
+                if(k < max){ out[k] = out[k - 1]; dist[k] = dist[k - 1]; }
+                k--;
+            }
+            if(k < max){ out[k] = s; dist[k] = d; }
+        }
+        for(uint32_t c = nd->child; c; c = spell.node[c].next)
+            if(abs(spell.node[c].dist - d) <= radius) spell.stack[top++] = c;
+    }
+    return count;
+}
+
+// Search radius for a word of n letters: one edit for short words, two beyond.
+static int spell_radius(size_t n){
+    return n <= 4 ? 1 : 2;
+}
+
+// Suggestions for w: those one edit away, or when there are none, those
+// within the word's full radius. The narrow search visits far fewer nodes.
+static int spell_suggest(const char *w, size_t n, int windows, const char **out, int *known){
+    int k = spell_search(w, n, windows, 1, out, SPELL_SUGGEST, known);
+    if(!k && !*known && spell_radius(n) > 1) k = spell_search(w, n, windows, spell_radius(n), out, SPELL_SUGGEST, known);
+    return k;
+}
+
+// line failed with 127: for each command word that is no known command, print
+// the nearest ones. Words with paths, variables or assignments are left alone.
+static void spell_hint(const char *line, int windows){
+    struct tok t[64];
+    size_t nt = tokenize(line, strlen(line), windows, t, ARRAY_LEN(t));
+    if(nt > ARRAY_LEN(t)) nt = ARRAY_LEN(t);
+    int cmd_pos = 1;
+    spell_refresh();
+    for(size_t i = 0; i < nt; i++){
+        if(t[i].kind != TOK_WORD){
+            // redirections take a file name, not a command
+            cmd_pos = t[i].kind == TOK_PIPE || !strchr("<>", line[t[i].off]);
+            if(!cmd_pos) i++;
+            continue;
+        }
+        if(!cmd_pos) continue;
+        cmd_pos = 0;
+        size_t n;
+        const char *w = tok_word(line, &t[i], &n);
+        if(n < 2 || t[i].quote == TQ_MIXED || memchr(w, '/', n) || memchr(w, '\\', n) || memchr(w, '=', n) || memchr(w, '$', n) || memchr(w, '%', n))
+            continue;
+        const char *best[SPELL_SUGGEST];
+        int known, k = spell_suggest(w, n, windows, best, &known);
+        if(known || !k) continue;
+        printf("[did you mean] %.*s ->", (int)n, w);
+        for(int j = 0; j < k; j++) printf("%s %s", j ? "," : "", best[j]);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+#endif
+
+#if !HOST_IS_WINDOWS
+// ---- Parallel xargs ----
+// xargs in a command line runs as `custard --xargs ...`, a pipeline stage like
+// any other, so job control stops and resumes it together with its commands.
+// It reads arguments from stdin and runs the command over them on up to -P
+// workers at once (-P 0: one per core), packing each command line under
+// ARG_MAX. Without -n, a parallel run spreads the arguments evenly over the
+// idle workers instead of filling one command line first, so a large file set
+// keeps every core busy; arguments are also handed out when the producer
+// pauses. Options we do not implement hand the line to the system's xargs.
+// With -P on a terminal, totals and throughput go to stderr at the end.
+
+#define XARGS_MAX_CHARS (128 * 1024) // GNU xargs' default -s
+#define XARGS_STALL_MS 10
+
+struct xargs {
+    char **tmpl;              // the command and its initial arguments
+    int ntmpl;
+    const char *replace;      // -I: one input line per command, substituted into tmpl
+    const char *input_path;   // -a
+    int delim;                // -0 / -d: the byte ending an argument; -1: blanks, quotes
+    long max_args;            // -n; 0: as many as fit
+    size_t max_chars;         // -s
+    int procs, trace, no_empty, input;
+    struct sbuf cur;          // the argument being read
+    char quote;
+    int escape, have;
+    char **queue;             // read, not yet run: [qhead, qtail)
+    size_t qhead, qtail, qcap, qbytes;
+    long cmds, args;
+    int running, status, stop;
+};
+
+// GNU-style options. Returns the index of the command in argv, or -1 for an
+// option we do not implement.
+static int xargs_parse(struct xargs *x, int argc, char **argv){
+    int i = 0;
+    for(; i < argc && argv[i][0] == '-' && argv[i][1]; i++){
+        const char *a = argv[i];
+        if(strcmp(a, "--") == 0) return i + 1;
+        if(a[1] == '-'){
+            const char *v = strchr(a, '=');
+            if(strcmp(a, "--null") == 0) x->delim = 0;
+            else if(strcmp(a, "--no-run-if-empty") == 0) x->no_empty = 1;
+            else if(strcmp(a, "--verbose") == 0) x->trace = 1;
+            else if(v && strncmp(a, "--max-procs=", 12) == 0) x->procs = atoi(v + 1);
+            else if(v && strncmp(a, "--max-args=", 11) == 0 && (x->max_args = atol(v + 1)) > 0){}
+            else if(v && strncmp(a, "--max-chars=", 12) == 0) x->max_chars = strtoul(v + 1, NULL, 10);
+            else if(v && strncmp(a, "--arg-file=", 11) == 0) x->input_path = v + 1;
+            else return -1;
+            continue;
+        }
+        for(const char *p = a + 1; *p; p++){
+            if(*p == '0'){ x->delim = 0; continue; }
+            if(*p == 'r'){ x->no_empty = 1; continue; }
+            if(*p == 't'){ x->trace = 1; continue; }
+            if(!strchr("PnIsda", *p)) return -1;
+            const char *v = p[1] ? p + 1 : i + 1 < argc ? argv[++i] : NULL;
+            if(!v) return -1;
+            switch(*p){
+            case 'P': x->procs = atoi(v); break;
+            case 'n': if((x->max_args = atol(v)) <= 0) return -1; break;
+            case 'I': x->replace = v; break;
+            case 's': x->max_chars = strtoul(v, NULL, 10); break;
+            case 'a': x->input_path = v; break;
+            case 'd':
+                if(v[0] && !v[1]) x->delim = (unsigned char)v[0];
+                else if(strcmp(v, "\\n") == 0) x->delim = '\n';
+                else if(strcmp(v, "\\t") == 0) x->delim = '\t';
+                else if(strcmp(v, "\\0") == 0) x->delim = 0;
+                else if(strcmp(v, "\\\\") == 0) x->delim = '\\';
+                else return -1;
+                break;
+            }
+            break; // the value used the rest of this word
+        }
+    }
+    return i;
+}
+
+static void xargs_push(struct xargs *x){
+    if(x->qtail == x->qcap){
+        if(x->qhead){
+            memmove(x->queue, x->queue + x->qhead, (x->qtail - x->qhead) * sizeof(*x->queue));
+            x->qtail -= x->qhead;
+            x->qhead = 0;
+        } else {
+            size_t cap = x->qcap ? x->qcap * 2 : 1024;
+            char **q = realloc(x->queue, cap * sizeof(*q));
+            if(!q){ fprintf(stderr, "xargs: out of memory\n"); x->status = 1; x->stop = 1; return; }
+            x->queue = q;
+            x->qcap = cap;
+        }
+    }
+    char *arg = strdup(x->cur.p ? x->cur.p : "");
+    if(!arg){ fprintf(stderr, "xargs: out of memory\n"); x->status = 1; x->stop = 1; return; }
+    x->queue[x->qtail++] = arg;
+    x->qbytes += x->cur.len + 1;
+    x->cur.len = 0;
+    if(x->cur.p) x->cur.p[0] = 0;
+    x->have = 0;
+}
+
+// Split input into arguments: at the -0/-d byte, else at blanks and newlines
+// (newlines only, leading blanks dropped, with -I) honouring quotes and
+// backslashes. State carries over between reads.
+static void xargs_feed(struct xargs *x, const char *p, size_t n){
+    for(size_t i = 0; i < n; i++){
+        char c = p[i];
+        if(x->delim >= 0){
+            if((unsigned char)c == x->delim) xargs_push(x);
+            else sb_putc(&x->cur, c);
+            continue;
+        }
+        if(x->escape){ x->escape = 0; sb_putc(&x->cur, c); continue; }
+        if(x->quote){
+            if(c == x->quote) x->quote = 0;
+            else sb_putc(&x->cur, c);
+            continue;
+        }
+        if(c == '\\'){ x->escape = x->have = 1; continue; }
+        if(c == '\'' || c == '"'){ x->quote = c; x->have = 1; continue; }
+        if(c == '\n' || (!x->replace && (c == ' ' || c == '\t'))){
+            if(x->have || x->cur.len) xargs_push(x);
+            continue;
+        }
+        if(x->replace && !x->have && !x->cur.len && (c == ' ' || c == '\t')) continue;
+        sb_putc(&x->cur, c);
+    }
+}
+
+static void xargs_end(struct xargs *x){
+    if(x->quote){
+        fprintf(stderr, "xargs: unmatched %s quote; by default quotes are special to xargs unless you use the -0 option\n",
+                x->quote == '"' ? "double" : "single");
+        x->status = 1;
+        return;
+    }
+    if(x->have || x->cur.len) xargs_push(x);
+}
+
+// Characters of arguments (each counted with its terminator, as -s counts
+// them) one command line may add after the template. Half of what ARG_MAX
+// leaves after the environment, at most: the argv pointers count there too.
+static size_t xargs_budget(const struct xargs *x){
+    size_t env = 0, want = x->max_chars ? x->max_chars : XARGS_MAX_CHARS;
+    for(char **e = environ; *e; e++) env += strlen(*e) + 1 + sizeof(char *);
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if(arg_max > 0 && (size_t)arg_max > env + 4096 && want > ((size_t)arg_max - env - 2048) / 2)
+        want = ((size_t)arg_max - env - 2048) / 2;
+    for(int i = 0; i < x->ntmpl; i++){
+        size_t b = strlen(x->tmpl[i]) + 1;
+        want = want > b ? want - b : 0;
+    }
+    return want;
+}
+
+// How many queued arguments the next command takes; 0 to read more first.
+// flush: no more input is coming soon.
+static size_t xargs_batch(const struct xargs *x, size_t budget, int flush){
+    size_t queued = x->qtail - x->qhead, most = queued, idle = (size_t)(x->procs - x->running);
+    if(!queued) return 0;
+    int spread = !x->replace && !x->max_args && x->procs > 1;
+    if(x->replace) most = 1;
+    else if(x->max_args) most = (size_t)x->max_args;
+    else if(spread){
+        // hold out for enough to keep every idle worker busy, then share it out
+        if(!flush && x->qbytes < idle * budget) return 0;
+        most = (queued + idle - 1) / idle;
+    }
+    size_t n = 0, bytes = 0;
+    while(n < most && n < queued){
+        size_t b = strlen(x->queue[x->qhead + n]) + 1;
+        if(n && bytes + b > budget) break;
+        bytes += b;
+        n++;
+    }
+    // a full command line, or whatever there is when input pauses or ends
+    int full = n < queued || ((x->replace || x->max_args) && n == most);
+    return flush || spread || full ? n : 0;
+}
+
+static char *xargs_subst(const char *s, const char *from, const char *to){
+    size_t nf = strlen(from), nt = strlen(to), count = 0;
+    for(const char *p = s; (p = strstr(p, from)); p += nf) count++;
+    char *out = malloc(strlen(s) + count * nt + 1), *w = out;
+    if(!out) return NULL;
+    for(const char *p; (p = strstr(s, from)); s = p + nf){
+        memcpy(w, s, (size_t)(p - s));
+        w += p - s;
+        memcpy(w, to, nt);
+        w += nt;
+    }
+    strcpy(w, s);
+    return out;
+}
+
+// Start the command on the next n queued arguments.
+static void xargs_run(struct xargs *x, size_t n){
+    char **argv = malloc(((size_t)x->ntmpl + n + 1) * sizeof(*argv));
+    if(!argv){ fprintf(stderr, "xargs: out of memory\n"); x->status = 1; x->stop = 1; return; }
+    char **args = x->queue + x->qhead;
+    int argc = 0;
+    for(int i = 0; i < x->ntmpl; i++)
+        argv[argc++] = x->replace && strstr(x->tmpl[i], x->replace) ? xargs_subst(x->tmpl[i], x->replace, args[0]) : x->tmpl[i];
+    if(!x->replace)
+        for(size_t i = 0; i < n; i++) argv[argc++] = args[i];
+    argv[argc] = NULL;
+    if(x->trace){
+        for(int i = 0; i < argc; i++) fprintf(stderr, "%s%s", i ? " " : "", argv[i] ? argv[i] : "");
+        fputc('\n', stderr);
+    }
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0); // the input is ours
+    pid_t pid;
+    const char *path = resolve_cmd(argv[0]);
+    int err = path ? posix_spawn(&pid, path, &fa, NULL, argv, environ) : ENOENT;
+    if(err == ENOENT){
+        if(path) cmd_cache_clear();
+        err = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+    }
+    posix_spawn_file_actions_destroy(&fa);
+    if(err){
+        fprintf(stderr, "xargs: %s: %s\n", argv[0], strerror(err));
+        x->status = err == ENOENT ? 127 : 126;
+        x->stop = 1;
+    } else {
+        x->running++;
+        x->cmds++;
+    }
+
+    for(int i = 0; x->replace && i < x->ntmpl; i++)
+        if(argv[i] != x->tmpl[i]) free(argv[i]);
+    free(argv);
+    for(size_t i = 0; i < n; i++){
+        x->qbytes -= strlen(args[i]) + 1;
+        free(args[i]);
+    }
+    x->qhead += n;
+    x->args += (long)n;
+}
+
+// Collect finished commands; block: wait for at least one.
+static void xargs_reap(struct xargs *x, int block){
+    while(x->running){
+        int ws;
+        pid_t r = waitpid(-1, &ws, block ? 0 : WNOHANG);
+        if(r == 0) break;
+        if(r < 0){ if(errno == EINTR) continue; x->running = 0; break; }
+        x->running--;
+        block = 0;
+        if(WIFSIGNALED(ws)){
+            fprintf(stderr, "xargs: %s: terminated by signal %d\n", x->tmpl[0], WTERMSIG(ws));
+            x->status = 125;
+            x->stop = 1;
+        } else if(WEXITSTATUS(ws) == 255){
+            fprintf(stderr, "xargs: %s: exited with status 255; aborting\n", x->tmpl[0]);
+            x->status = 124;
+            x->stop = 1;
+        } else if(WEXITSTATUS(ws) && !x->status){
+            x->status = 123;
+        }
+    }
+}
+
+// custard --xargs [options] [command [initial-arguments]]: the xargs stage.
+static int xargs_main(int argc, char **argv){
+    struct xargs x;
+    memset(&x, 0, sizeof(x));
+    x.delim = -1;
+    x.procs = 1;
+    x.input = STDIN_FILENO;
+    int cmd = xargs_parse(&x, argc, argv);
+    if(cmd < 0){
+        argv[-1] = "xargs"; // our "--xargs" slot
+        execvp("xargs", argv - 1);
+        fprintf(stderr, "xargs: %s\n", strerror(errno));
+        return 127;
+    }
+    if(x.input_path && (x.input = open(x.input_path, O_RDONLY | O_CLOEXEC)) < 0){
+        fprintf(stderr, "xargs: %s: %s\n", x.input_path, strerror(errno));
+        return 1;
+    }
+    if(x.procs <= 0) x.procs = cpu_count();
+    static char *echo[] = { "echo", NULL };
+    x.tmpl = cmd < argc ? argv + cmd : echo;
+    x.ntmpl = cmd < argc ? argc - cmd : 1;
+    size_t budget = xargs_budget(&x);
+    double t0 = now_sec();
+
+    char buf[65536];
+    int eof = 0, stalled = 0;
+    while(!x.stop){
+        size_t n;
+        while(!x.stop && x.running < x.procs && (n = xargs_batch(&x, budget, eof || stalled)) > 0) xargs_run(&x, n);
+        stalled = 0;
+        if(x.stop || (eof && x.qhead == x.qtail)) break;
+        if(eof || x.running == x.procs){ xargs_reap(&x, 1); continue; }
+        // an idle worker with work queued waits only briefly for more input
+        struct pollfd p = { x.input, POLLIN, 0 };
+        int r = poll(&p, 1, x.qhead < x.qtail ? XARGS_STALL_MS : -1);
+        if(r == 0) stalled = 1;
+        else if(r > 0 || errno != EINTR){
+            ssize_t k = read(x.input, buf, sizeof(buf));
+            if(k < 0 && errno == EINTR) continue;
+            if(k > 0) xargs_feed(&x, buf, (size_t)k);
+            else {
+                if(k < 0){ fprintf(stderr, "xargs: read: %s\n", strerror(errno)); x.status = 1; }
+                eof = 1;
+                xargs_end(&x);
+            }
+        }
+        xargs_reap(&x, 0);
+    }
+    // GNU runs the command once on empty input unless -r (or -I)
+    if(!x.stop && !x.cmds && !x.args && !x.no_empty && !x.replace && !x.status) xargs_run(&x, 0);
+    while(x.running) xargs_reap(&x, 1);
+
+    double dt = now_sec() - t0;
+    if(x.procs > 1 && isatty(STDERR_FILENO))
+        fprintf(stderr, "[xargs] %ld args in %ld commands on %d workers: %.2f s (%.0f args/s, %.1f commands/s)\n",
+                x.args, x.cmds, x.procs, dt, dt > 0 ? x.args / dt : 0, dt > 0 ? x.cmds / dt : 0);
+    for(size_t i = x.qhead; i < x.qtail; i++) free(x.queue[i]);
+    free(x.queue);
+    free(x.cur.p);
+    return x.status;
+}
+#endif
+
+// ---- Batch mode ----
+// custard --batch [--dialect cmd|bash] [--input FILE] [--quiet] runs a whole
+// script: no prompts or banners, input read through one large buffer (mmap'd
+// when it is a regular file), and translated lines streamed in bulk to a
+// single host shell that executes them as one script, so shell state (cd,
+// variables) carries from line to line and nothing waits on a per-command
+// round trip. Without --quiet each translated line is traced to stderr as
+// "+ line". cmd-script noise (@ prefixes, echo off, ::/rem comments) is dropped.
+
+struct line_reader {
+    const char *data;  // mmap'd file, or buf
+    size_t len, pos;
+    int mapped;
+    FILE *f;
+    char *buf;
+    size_t cap;
+    int eof;
+};
+
+#define READER_CHUNK (1 << 20)
+
+static int reader_open(struct line_reader *r, const char *path){
+    memset(r, 0, sizeof(*r));
+    if(!path || strcmp(path, "-") == 0) r->f = stdin;
+    else if(!(r->f = fopen(path, "rb"))){ perror(path); return -1; }
+#if !HOST_IS_WINDOWS
+    struct stat st;
+    if(r->f != stdin && fstat(fileno(r->f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+        void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(r->f), 0);
+        if(m != MAP_FAILED){
+            madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+            r->data = m; r->len = (size_t)st.st_size; r->mapped = 1; r->eof = 1;
+            return 0;
+        }
+    }
+#endif
+    r->cap = READER_CHUNK;
+    r->buf = malloc(r->cap);
+    if(!r->buf){ if(r->f != stdin) fclose(r->f); return -1; }
+    r->data = r->buf;
+    return 0;
+}
+
+// Next line as a view (without its newline), or NULL at end of input. The
+// view stays valid until the next call.
+static const char *reader_next(struct line_reader *r, size_t *n){
+    for(;;){
+        const char *start = r->data + r->pos;
+        const char *nl = memchr(start, '\n', r->len - r->pos);
+        if(nl || (r->eof && r->pos < r->len)){
+            size_t l = nl ? (size_t)(nl - start) : r->len - r->pos;
+            r->pos += l + (nl != NULL);
+            *n = l;
+            return start;
+        }
+        if(r->eof) return NULL;
+        // refill: keep the partial line, growing the buffer if it fills it
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos; r->pos = 0;
+        if(r->len == r->cap){
+            char *nb = realloc(r->buf, r->cap * 2);
+            if(!nb){ r->eof = 1; continue; }
+            r->buf = nb; r->cap *= 2;
+        }
+        r->data = r->buf;
+#if HOST_IS_WINDOWS
+        size_t got = fread(r->buf + r->len, 1, r->cap - r->len, r->f);
+#else
+        ssize_t got; // read(), not fread(): take what a pipe has instead of waiting for a full buffer
+        while((got = read(fileno(r->f), r->buf + r->len, r->cap - r->len)) < 0 && errno == EINTR){}
+        if(got < 0) got = 0;
+#endif
+        if(got == 0) r->eof = 1;
+        r->len += (size_t)got;
+    }
+}
+
+static void reader_close(struct line_reader *r){
+#if !HOST_IS_WINDOWS
+    if(r->mapped) munmap((void*)r->data, r->len);
+#endif
+    free(r->buf);
+    if(r->f && r->f != stdin) fclose(r->f);
+}
+
+// Trim a line view and drop cmd-script noise. Returns 0 if nothing is left.
+static int batch_clean(const char **p, size_t *n, int source_is_windows){
+    const char *s = *p;
+    size_t l = *n;
+    while(l && isspace((unsigned char)*s)){ s++; l--; }
+    while(l && isspace((unsigned char)s[l-1])) l--; // also strips the \r of CRLF scripts
+    if(source_is_windows){
+        while(l && *s == '@'){ s++; l--; }
+        if(l >= 2 && s[0] == ':' && s[1] == ':') return 0;
+        if(view_ieq(s, l, "echo off") || view_ieq(s, l, "echo on") || view_ieq(s, l, "rem")) return 0;
+        if(l > 4 && (s[3] == ' ' || s[3] == '\t') && view_ieq(s, 3, "rem")) return 0;
+    }
+    *p = s; *n = l;
+    return l > 0;
+}
+
+// Translate every line of r and write the result, one command per line, to
+// out in 64 KB chunks. Returns the number of lines written, or -1 if out
+// went away (the script exited early).
+static long batch_stream(struct line_reader *r, int source_is_windows, int quiet, FILE *out_f){
+    struct arena arena = { NULL };
+    struct sbuf chunk = { NULL, 0, 0, NULL };
+    struct sbuf trace = { NULL, 0, 0, NULL };
+    const char *p;
+    size_t n;
+    long lines = 0;
+    int failed = 0;
+    while(!failed && (p = reader_next(r, &n))){
+        if(!batch_clean(&p, &n, source_is_windows)) continue;
+        size_t at = chunk.len;
+        struct sbuf out = { NULL, 0, 0, &arena };
+        translate_pipeline_into(p, n, source_is_windows, HOST_IS_WINDOWS, &out, 0);
+        sb_put(&chunk, out.p ? out.p : "", out.len);
+        sb_putc(&chunk, '\n');
+        arena_reset(&arena);
+        if(!quiet){ sb_puts(&trace, "+ "); sb_put(&trace, chunk.p + at, chunk.len - at); }
+        lines++;
+        // hand lines over in 64 KB chunks, or as soon as a pipe has nothing more buffered
+        if(chunk.len >= 65536 || (!r->mapped && r->pos == r->len)){
+            if(trace.len){ fwrite(trace.p, 1, trace.len, stderr); fflush(stderr); trace.len = 0; }
+            failed = fwrite(chunk.p, 1, chunk.len, out_f) != chunk.len || fflush(out_f) != 0;
+            chunk.len = 0;
+        }
+    }
+    if(!failed && chunk.len){
+        if(trace.len){ fwrite(trace.p, 1, trace.len, stderr); fflush(stderr); }
+        failed = fwrite(chunk.p, 1, chunk.len, out_f) != chunk.len || fflush(out_f) != 0;
+    }
+    free(chunk.p); free(trace.p);
+    arena_free(&arena);
+    return failed ? -1 : lines;
+}
+
+#if !HOST_IS_WINDOWS
+// Execute the translated script in one host shell reading it from fd 3, so
+// the script's commands keep our stdin. Returns the shell's exit status.
+static int run_batch(const char *path, int source_is_windows, int quiet){
+    struct line_reader r;
+    if(reader_open(&r, path) != 0) return 1;
+    int p[2];
+    if(pipe(p) != 0){ perror("pipe"); reader_close(&r); return 1; }
+    int rd = fcntl(p[0], F_DUPFD_CLOEXEC, 10), wr = fcntl(p[1], F_DUPFD_CLOEXEC, 10);
+    close(p[0]); close(p[1]);
+    char *argv[] = { "/bin/sh", "/dev/fd/3", NULL };
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, rd, 3);
+    pid_t pid;
+    int err = posix_spawn(&pid, "/bin/sh", &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(rd);
+    if(err != 0){
+        fprintf(stderr, "batch: cannot start /bin/sh: %s\n", strerror(err));
+        close(wr); reader_close(&r);
+        return 1;
+    }
+    struct sigaction ign, old_pipe;
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigemptyset(&ign.sa_mask);
+    sigaction(SIGPIPE, &ign, &old_pipe); // the script may exit before we finish writing
+    FILE *script = fdopen(wr, "w");
+    if(script){
+        batch_stream(&r, source_is_windows, quiet, script);
+        fclose(script);
+    } else close(wr);
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    reader_close(&r);
+    int st;
+    while(waitpid(pid, &st, 0) < 0){
+        if(errno != EINTR){ perror("waitpid"); return 1; }
+    }
+    return decode_status(st);
+}
+#else
+// Windows: no script-on-a-descriptor trick for cmd, so run line by line.
+static int run_batch(const char *path, int source_is_windows, int quiet){
+    struct line_reader r;
+    if(reader_open(&r, path) != 0) return 1;
+    struct sbuf out = { NULL, 0, 0, NULL };
+    const char *p;
+    size_t n;
+    int rc = 0;
+    while((p = reader_next(&r, &n))){
+        if(!batch_clean(&p, &n, source_is_windows)) continue;
+        out.len = 0;
+        translate_pipeline_into(p, n, source_is_windows, HOST_IS_WINDOWS, &out, 0);
+        if(!out.p) continue;
+        if(!quiet) fprintf(stderr, "+ %s\n", out.p);
+        rc = system(out.p);
+    }
+    free(out.p);
+    reader_close(&r);
+    return rc;
+}
+#endif
+
+// ---- Translate-only mode ----
+// custard --translate-only [--dialect cmd|bash] [--jobs N] [--out DIR] FILE...
+// converts whole script libraries offline: each .bat/.cmd becomes a .sh and
+// each .sh a .cmd (next to the input, or in DIR), nothing is executed. Files
+// are shared out to a pool of worker threads that pull the next file from an
+// atomic counter; the translation path (tokenizer, dispatch tables, rules,
+// map_command) keeps no mutable globals, so each worker only needs its own
+// arena and output buffers. Comments and blank lines are carried over.
+
+struct tr_job {
+    char *const *files;
+    size_t nfiles;
+    int dialect;         // 1 cmd, 0 bash, -1 infer from the extension
+    const char *out_dir; // NULL: write next to the input
+    size_t next;         // next file to claim (atomic)
+    long lines, failed;  // totals (atomic)
+};
+
+static int tr_dialect_of(const char *path){
+    const char *ext = strrchr(path, '.');
+    if(!ext || strpbrk(ext, "/\\")) return -1;
+    size_t n = strlen(ext);
+    if(view_ieq(ext, n, ".bat") || view_ieq(ext, n, ".cmd")) return 1;
+    if(view_ieq(ext, n, ".sh") || view_ieq(ext, n, ".bash")) return 0;
+    return -1;
+}
+
+// Output path: input name with its script extension swapped for the target's.
+static void tr_out_path(const char *in, const char *out_dir, int source_is_windows, struct sbuf *path){
+    const char *base = in;
+    if(out_dir){
+        for(const char *s = in; *s; s++) if(*s == '/' || *s == '\\') base = s + 1;
+        sb_puts(path, out_dir);
+        if(path->len && path->p[path->len-1] != '/' && path->p[path->len-1] != '\\') sb_putc(path, '/');
+    }
+    size_t n = strlen(base);
+    if(tr_dialect_of(base) >= 0) n = (size_t)(strrchr(base, '.') - base);
+    sb_put(path, base, n);
+    sb_puts(path, source_is_windows ? ".sh" : ".cmd");
+}
+
+// Create the --out directory and any missing parents (mkdir -p). Reports and
+// returns -1 when it cannot, so the run fails once rather than per file.
+static int tr_make_out_dir(const char *dir){
+    char path[MAX_LINE];
+    size_t n = strlen(dir);
+    if(n == 0 || n >= sizeof(path)){ fprintf(stderr, "custard: --out: bad directory name\n"); return -1; }
+    memcpy(path, dir, n + 1);
+    for(size_t i=1; i<=n; i++){
+        if(i < n && path[i] != '/' && path[i] != '\\') continue;
+        char c = path[i];
+        path[i] = 0;
+        struct stat st;
+#if HOST_IS_WINDOWS
+        int rc = _mkdir(path);
+#else
+        int rc = mkdir(path, 0777);
+#endif
+        int err = errno;
+        if(rc != 0 && stat(path, &st) != 0){
+            fprintf(stderr, "custard: --out %s: cannot create %s: %s\n", dir, path, strerror(err));
+            return -1;
+        }
+        if(rc != 0 && !S_ISDIR(st.st_mode)){
+            fprintf(stderr, "custard: --out %s: %s is not a directory\n", dir, path);
+            return -1;
+        }
+        path[i] = c;
+    }
+    return 0;
+}
+
+// Translate one script into out. Returns the number of lines.
+static long tr_script(struct line_reader *r, int source_is_windows, struct sbuf *out, struct arena *scratch){
+    const char *eol = source_is_windows ? "\n" : "\r\n";
+    long lines = 0;
+    const char *p;
+    size_t n;
+    sb_puts(out, source_is_windows ? "#!/bin/sh\n" : "@echo off\r\n");
+    while((p = reader_next(r, &n))){
+        lines++;
+        while(n && isspace((unsigned char)*p)){ p++; n--; }
+        while(n && isspace((unsigned char)p[n-1])) n--;
+        if(source_is_windows){
+            while(n && *p == '@'){ p++; n--; }
+            if(view_ieq(p, n, "echo off") || view_ieq(p, n, "echo on")) continue;
+            if(n >= 2 && p[0] == ':' && p[1] == ':'){ sb_puts(out, "#"); sb_put(out, p + 2, n - 2); sb_puts(out, eol); continue; }
+            if(n >= 3 && view_ieq(p, 3, "rem") && (n == 3 || p[3] == ' ' || p[3] == '\t')){
+                sb_puts(out, "#"); sb_put(out, p + 3, n - 3); sb_puts(out, eol); continue;
+            }
+        } else if(n && *p == '#'){
+            if(lines == 1 && n >= 2 && p[1] == '!') continue; // shebang
+            sb_puts(out, n > 1 && p[1] != ' ' ? "rem " : "rem"); sb_put(out, p + 1, n - 1); sb_puts(out, eol); continue;
+        }
+        if(n){
+            struct sbuf line = { NULL, 0, 0, scratch };
+            translate_pipeline_into(p, n, source_is_windows, !source_is_windows, &line, 0);
+            sb_put(out, line.p ? line.p : "", line.len);
+            arena_reset(scratch);
+        }
+        sb_puts(out, eol);
+    }
+    return lines;
+}
+
+// Translate and write one file. Returns its line count, or -1.
+static long tr_file(const struct tr_job *job, const char *in, struct sbuf *out, struct sbuf *path, struct arena *scratch){
+    int source_is_windows = job->dialect >= 0 ? job->dialect : tr_dialect_of(in);
+    if(source_is_windows < 0){
+        fprintf(stderr, "%s: unknown dialect (use --dialect cmd|bash)\n", in);
+        return -1;
+    }
+    struct line_reader r;
+    if(reader_open(&r, in) != 0) return -1;
+    out->len = 0;
+    long lines = tr_script(&r, source_is_windows, out, scratch);
+    reader_close(&r);
+    path->len = 0;
+    tr_out_path(in, job->out_dir, source_is_windows, path);
+    sb_putc(path, '\0');
+    FILE *f = fopen(path->p, "wb");
+    if(!f){ perror(path->p); return -1; }
+    int bad = fwrite(out->p, 1, out->len, f) != out->len;
+    if(fclose(f) != 0 || bad){ perror(path->p); return -1; }
+#if !HOST_IS_WINDOWS
+    if(source_is_windows) chmod(path->p, 0755);
+#endif
+    return lines;
+}
+
+static void *tr_worker(void *arg){
+    struct tr_job *job = arg;
+    struct arena scratch = { NULL };
+    struct sbuf out = { NULL, 0, 0, NULL }, path = { NULL, 0, 0, NULL };
+    long lines = 0, failed = 0;
+    for(;;){
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if(i >= job->nfiles) break;
+        long n = tr_file(job, job->files[i], &out, &path, &scratch);
+        if(n < 0) failed++;
+        else lines += n;
+    }
+    __atomic_fetch_add(&job->lines, lines, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->failed, failed, __ATOMIC_RELAXED);
+    free(out.p); free(path.p);
+    arena_free(&scratch);
+    return NULL;
+}
+
+// Translate files with jobs workers (0: one per core). Returns the number of
+// files that failed; *lines gets the number of lines read.
+static long translate_files(char *const *files, size_t nfiles, int dialect, const char *out_dir, int jobs, long *lines){
+    struct tr_job job = { files, nfiles, dialect, out_dir, 0, 0, 0 };
+    if(jobs <= 0) jobs = cpu_count();
+    if((size_t)jobs > nfiles) jobs = nfiles ? (int)nfiles : 1;
+#if HOST_IS_WINDOWS
+    (void)jobs; // Windows builds translate on the calling thread
+    tr_worker(&job);
+#else
+    pthread_t *tids = malloc(sizeof(*tids) * (size_t)jobs);
+    int started = 0;
+    for(; tids && started < jobs - 1; started++)
+        if(pthread_create(&tids[started], NULL, tr_worker, &job) != 0) break;
+    tr_worker(&job); // the calling thread is a worker too
+    for(int i=0;i<started;i++) pthread_join(tids[i], NULL);
+    free(tids);
+#endif
+    if(lines) *lines = job.lines;
+    return job.failed;
+}
+
+// ---- Benchmarks (custard --bench <name> [n]) ----
+
+// Mixed corpus: mapped commands plus the unmapped tools that dominate real use
+// (those were the worst case for the old strcmp chain).
+static const char *bench_linux_corpus[] = {
+    "ls -la", "git status", "make -j8", "cat README.md", "grep -rn foo src",
+    "gcc -O2 -o app main.c", "cd ..", "python3 build.py", "rm -rf build",
+    "cp a.txt b.txt", "tail -n 20 log.txt", "ps aux", "echo hello", "git log --oneline",
+    "sed -i s/a/b/ f", "find . -name '*.c'", "clear", "npm run build", "history", "zip -r out.zip dir",
+};
+static const char *bench_windows_corpus[] = {
+    "dir /a", "git status", "msbuild app.sln", "type README.md", "findstr foo *.c",
+    "cl /O2 main.c", "cd ..", "python build.py", "rmdir /s /q build", "copy a.txt b.txt",
+    "tasklist", "echo hello", "set PATH", "start notepad", "cls", "xcopy src dst /e",
+    "del *.obj", "robocopy a b", "rem comment", "ipconfig /all",
+};
+
+static int bench_dispatch(long iters){
+    if(iters <= 0) iters = 200000;
+    volatile int sink = 0;
+    struct { const char *name; const char **lines; size_t n; const struct dispatch *d; } sets[] = {
+        { "bash->cmd", bench_linux_corpus, ARRAY_LEN(bench_linux_corpus), &l2w_dispatch },
+        { "cmd->bash", bench_windows_corpus, ARRAY_LEN(bench_windows_corpus), &w2l_dispatch },
+    };
+    printf("dispatch: %ld passes over each corpus\n", iters);
+    for(size_t s=0;s<ARRAY_LEN(sets);s++){
+        struct tok t[8];
+        double t_lin = 0, t_ph = 0;
+        for(int mode=0; mode<2; mode++){
+            double t0 = now_sec();
+            for(long it=0; it<iters; it++){
+                for(size_t i=0;i<sets[s].n;i++){
+                    const char *l = sets[s].lines[i];
+                    tokenize(l, strlen(l), s == 1, t, ARRAY_LEN(t));
+                    sink += mode ? dispatch_lookup(sets[s].d, l + t[0].off, t[0].len) : dispatch_lookup_linear(sets[s].d, l + t[0].off, t[0].len);
+                }
+            }
+            double dt = now_sec() - t0;
+            if(mode) t_ph = dt; else t_lin = dt;
+        }
+        double lines = (double)iters * sets[s].n;
+        printf("  %-10s linear scan %7.1f ns/line   perfect hash %7.1f ns/line   (%.2fx)\n",
+               sets[s].name, t_lin * 1e9 / lines, t_ph * 1e9 / lines, t_ph > 0 ? t_lin / t_ph : 0);
+    }
+    (void)sink;
+    return 0;
+}
+
+// Rule lookup cost as the rule count grows; also parse vs compiled-cache startup.
+static int bench_rules(long iters){
+    if(iters <= 0) iters = 100000;
+    const char *tmpdir = getenv("TMPDIR");
+    if(!tmpdir) tmpdir = HOST_IS_WINDOWS ? "." : "/tmp";
+    static const long sizes[] = { 16, 256, 4096, 16384 };
+    volatile size_t sink = 0;
+    printf("rules: %ld translations per size\n", iters);
+    for(size_t si=0; si<ARRAY_LEN(sizes); si++){
+        long n = sizes[si];
+        char path[MAX_LINE], cpath[MAX_LINE+8];
+        snprintf(path, sizeof(path), "%s/custard-bench-%ld.rules", tmpdir, n);
+        rules_cache_path(path, cpath, sizeof(cpath));
+        remove(cpath);
+        FILE *f = fopen(path, "w");
+        if(!f){ perror(path); return 1; }
+        for(long i=0;i<n;i++){
+            if(i % 4 == 0) fprintf(f, "w2l tool%05ld /s /q => tool%05ld -rf $*\n", i, i);
+            fprintf(f, "w2l tool%05ld => tool%05ld $*\n", i, i);
+        }
+        fclose(f);
+
+        struct rule_db db = {0};
+        int cached;
+        double t0 = now_sec();
+        rules_load(&db, path, &cached);
+        double t_parse = now_sec() - t0;
+        t0 = now_sec();
+        rules_load(&db, path, &cached);
+        double t_cache = now_sec() - t0;
+
+        char line[64];
+        struct tok t[8];
+        struct sbuf out = { NULL, 0, 0, NULL };
+        t0 = now_sec();
+        for(long it=0; it<iters; it++){
+            long k = (it * 2654435761u) % n;
+            int len = snprintf(line, sizeof(line), "tool%05ld %s", k, (it & 1) ? "/s /q build" : "a.txt b.txt");
+            size_t nt = tokenize(line, (size_t)len, 1, t, ARRAY_LEN(t));
+            out.len = 0;
+            if(rules_apply(&db, RULE_W2L, line, t, nt, &out, NULL)) sink += out.len;
+        }
+        double t_apply = now_sec() - t0;
+        free(out.p);
+        printf("  %6ld tokens: parse+compile %8.2f ms  cache load %6.2f ms%s  translate %6.1f ns/line\n",
+               n, t_parse * 1e3, t_cache * 1e3, cached ? "" : " (cache miss!)", t_apply * 1e9 / iters);
+        rules_free(&db);
+        remove(path); remove(cpath);
     }
-    while(*p && isspace((unsigned char)*p)) p++;
-    strncpy(rest, p, MAX_LINE-1);
-    rest[MAX_LINE-1]=0;
+    (void)sink;
+    return 0;
 }
 
-// Replace substring (first occurrence). Returns 1 if replaced.
-static int replace_first(char *s, const char *old, const char *new){
-    char *pos = strstr(s, old);
-    if(!pos) return 0;
-    char buf[MAX_LINE];
-    int prefix_len = pos - s;
-    snprintf(buf, sizeof(buf), "%.*s%s%s", prefix_len, s, new, pos + strlen(old));
-    strncpy(s, buf, MAX_LINE-1);
-    s[MAX_LINE-1]=0;
-    return 1;
+// Translation throughput on long lines: pipelines of corpus commands with
+// quoted arguments, up to xargs-sized lines far beyond MAX_LINE. Timed for the
+// tokenizer alone, a malloc'd result per line, and an arena reset per line.
+static int bench_translate(long iters){
+    if(iters <= 0) iters = 20000;
+    static const size_t sizes[] = { 128, 1024, 8192, 65536, 262144 };
+    volatile size_t sink = 0;
+    struct arena arena = { NULL };
+    printf("translate: %ld lines per size and direction (scaled down for long lines)\n", iters);
+    for(int dir=0; dir<2; dir++){
+        const char **corpus = dir ? bench_windows_corpus : bench_linux_corpus;
+        size_t ncorpus = dir ? ARRAY_LEN(bench_windows_corpus) : ARRAY_LEN(bench_linux_corpus);
+        for(size_t si=0; si<ARRAY_LEN(sizes); si++){
+            struct sbuf line = { NULL, 0, 0, NULL };
+            for(size_t k=0; line.len + 64 < sizes[si]; k++){
+                const char *c = corpus[k % ncorpus];
+                sb_printf(&line, "%s%s \"arg %zu | quoted\"", line.len ? " | " : "", c, k);
+            }
+            long reps = iters * 1024 / (long)(sizes[si] > 1024 ? sizes[si] : 1024);
+            if(reps < 20) reps = 20;
+            size_t nt = tokenize(line.p, line.len, dir, NULL, 0);
+            struct tok *t = malloc(nt * sizeof(*t));
+            if(!t){ free(line.p); return 1; }
+            double t0 = now_sec();
+            for(long it=0; it<reps; it++) sink += tokenize(line.p, line.len, dir, t, nt);
+            double t_tok = now_sec() - t0;
+            size_t out_len = 0;
+            t0 = now_sec();
+            for(long it=0; it<reps; it++){
+                struct sbuf out = { NULL, 0, 0, NULL };
+                translate_pipeline_into(line.p, line.len, dir, !dir, &out, 0);
+                out_len = out.len;
+                free(sb_take(&out));
+            }
+            double t_tr = now_sec() - t0;
+            t0 = now_sec();
+            for(long it=0; it<reps; it++){
+                struct sbuf out = { NULL, 0, 0, &arena };
+                translate_pipeline_into(line.p, line.len, dir, !dir, &out, 0);
+                sink += out.len;
+                arena_reset(&arena);
+            }
+            double t_ar = now_sec() - t0;
+            double mb = (double)line.len * reps / 1e6;
+            printf("  %s %7zu -> %7zu bytes: tokenize %6.1f MB/s  translate %6.1f MB/s  arena %6.1f MB/s\n",
+                   dir ? "cmd->bash" : "bash->cmd", line.len, out_len, mb / t_tok, mb / t_tr, mb / t_ar);
+            free(t);
+            free(line.p);
+        }
+    }
+    arena_free(&arena);
+    (void)sink;
+    return 0;
 }
 
-// Build command mapping. source_is_windows: dialect user types. host_is_windows: current platform.
-static char *map_command(const char *input, int source_is_windows, int host_is_windows){
-    // If same dialect as host, return copy
-    if(source_is_windows == host_is_windows) return strdup(input);
+// Script throughput: the interactive path (fgets, banner, malloc'd translation
+// per line) against the batch reader and bulk writer, translation only; then
+// end to end with execution, per-line exec_host against one batch shell.
+static int bench_batch(long n){
+    if(n <= 0) n = 50000;
+    const char *tmpdir = getenv("TMPDIR");
+    if(!tmpdir) tmpdir = HOST_IS_WINDOWS ? "." : "/tmp";
+    const char *devnull = HOST_IS_WINDOWS ? "NUL" : "/dev/null";
+    char path[MAX_LINE];
+    snprintf(path, sizeof(path), "%s/custard-bench-batch.cmd", tmpdir);
+    FILE *f = fopen(path, "wb");
+    if(!f){ perror(path); return 1; }
+    fprintf(f, "@echo off\r\n");
+    for(long i=0;i<n;i++){
+        if(i % 50 == 0) fprintf(f, "rem step %ld\r\n", i);
+        fprintf(f, "%s \"arg %ld\"\r\n", bench_windows_corpus[i % ARRAY_LEN(bench_windows_corpus)], i);
+    }
+    fclose(f);
+    FILE *sink = fopen(devnull, "w");
+    if(!sink){ perror(devnull); return 1; }
 
-    // We'll attempt best-effort map: change first token and common flags/subpatterns.
-    char first[MAX_TOK], rest[MAX_LINE];
-    split_first(input, first, rest);
-    char first_lc[MAX_TOK];
-    lc_copy(first, first_lc);
+    printf("batch: %ld-line cmd script, translate only\n", n);
+    double t0 = now_sec();
+    long lines = 0;
+    f = fopen(path, "r");
+    char line[MAX_LINE];
+    while(f && fgets(line, sizeof(line), f)){
+        trim(line);
+        if(!*line) continue;
+        char *tr = translate_pipeline(line, 1, 0);
+        fprintf(sink, "[Translated ->] %s\n", tr);
+        free(tr);
+        lines++;
+    }
+    if(f) fclose(f);
+    double t_int = now_sec() - t0;
+    struct line_reader r;
+    t0 = now_sec();
+    if(reader_open(&r, path) != 0) return 1;
+    long blines = batch_stream(&r, 1, 1, sink);
+    reader_close(&r);
+    double t_batch = now_sec() - t0;
+    printf("  interactive path %10.0f lines/s   batch %10.0f lines/s   (%.1fx)\n",
+           lines / t_int, blines / t_batch, (blines / t_batch) / (lines / t_int));
+    fclose(sink);
 
-    char mapped[MAX_LINE*2];
-    mapped[0]=0;
+#if !HOST_IS_WINDOWS
+    long m = n / 25 > 100 ? n / 25 : 100;
+    f = fopen(path, "wb");
+    if(!f){ perror(path); return 1; }
+    for(long i=0;i<m;i++) fprintf(f, "cd .\r\n");
+    fclose(f);
+    printf("batch: %ld-line script, executed\n", m);
+    t0 = now_sec();
+    for(long i=0;i<m;i++){
+        char *tr = translate_pipeline("cd .", 1, 0);
+        exec_host(tr);
+        free(tr);
+    }
+    double t_exec = now_sec() - t0;
+    t0 = now_sec();
+    int rc = run_batch(path, 1, 1);
+    double t_bexec = now_sec() - t0;
+    printf("  per-line exec    %10.0f lines/s   batch %10.0f lines/s   (%.1fx)%s\n",
+           m / t_exec, m / t_bexec, t_exec / t_bexec, rc ? "  (batch shell failed!)" : "");
+#endif
+    remove(path);
+    return 0;
+}
 
-    // Helper macros to set mapped easily
-    #define SETM(fmt,...) do{ snprintf(mapped, sizeof(mapped), fmt, ##__VA_ARGS__); } while(0)
-    #define APPREST() do{ if(strlen(rest)) { if(strlen(mapped)) strncat(mapped, " ", sizeof(mapped)-strlen(mapped)-1); strncat(mapped, rest, sizeof(mapped)-strlen(mapped)-1); } } while(0)
+// Offline conversion of a script library (n files of 200 lines) with 1, 2,
+// 4, ... workers up to the core count.
+static int bench_translate_only(long n){
+    if(n <= 0) n = 2000;
+#if HOST_IS_WINDOWS
+    char dir[] = "custard-bench-tr";
+    if(_mkdir(dir) != 0){ perror(dir); return 1; }
+#else
+    char dir[] = "/tmp/custard-bench-trXXXXXX";
+    if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+#endif
+    char **files = calloc((size_t)n, sizeof(*files));
+    if(!files) return 1;
+    struct sbuf body = { NULL, 0, 0, NULL };
+    sb_puts(&body, "@echo off\r\nrem generated\r\n");
+    for(int i=0;i<200;i++) sb_printf(&body, "%s \"arg %d\"\r\n", bench_windows_corpus[i % ARRAY_LEN(bench_windows_corpus)], i);
+    for(long i=0;i<n;i++){
+        struct sbuf p = { NULL, 0, 0, NULL };
+        sb_printf(&p, "%s/s%ld.cmd", dir, i);
+        files[i] = sb_take(&p);
+        FILE *f = fopen(files[i], "wb");
+        if(!f){ perror(files[i]); return 1; }
+        fwrite(body.p, 1, body.len, f);
+        fclose(f);
+    }
+    int cpus = cpu_count();
+    printf("translate-only: %ld files x 200 lines, %d cores\n", n, cpus);
+    double base = 0;
+    for(int jobs = 1; ; jobs = jobs * 2 > cpus && jobs < cpus ? cpus : jobs * 2){
+        long lines = 0;
+        double t0 = now_sec();
+        long failed = translate_files(files, (size_t)n, -1, NULL, jobs, &lines);
+        double dt = now_sec() - t0;
+        if(jobs == 1) base = dt;
+        printf("  %3d jobs %9.0f files/s %11.0f lines/s   speedup %5.2fx%s\n",
+               jobs, n / dt, lines / dt, base / dt, failed ? "  (failures!)" : "");
+        if(jobs >= cpus) break;
+    }
+    struct sbuf p = { NULL, 0, 0, NULL };
+    for(long i=0;i<n;i++){
+        remove(files[i]);
+        p.len = 0;
+        tr_out_path(files[i], NULL, 1, &p);
+        sb_putc(&p, '\0');
+        remove(p.p);
+        free(files[i]);
+    }
+    free(p.p); free(body.p); free(files);
+#if HOST_IS_WINDOWS
+    _rmdir(dir);
+#else
+    rmdir(dir);
+#endif
+    return 0;
+}
 
-    // Linux -> Windows mappings
-    if(!source_is_windows && host_is_windows){
-        // Most common
-        if(strcmp(first_lc,"pwd")==0){ SETM("cd"); return strdup(mapped); }
-        if(strcmp(first_lc,"ls")==0){
-            // handle flags in rest: -l, -a
-            if(strstr(rest,"-l") && strstr(rest,"-a")) { SETM("dir /a /q"); APPREST(); return strdup(mapped); }
-            if(strstr(rest,"-l")) { SETM("dir"); APPREST(); return strdup(mapped); }
-            if(strstr(rest,"-a")) { SETM("dir /a"); APPREST(); return strdup(mapped); }
-            SETM("dir"); APPREST(); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"mkdir")==0){ SETM("mkdir"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"rmdir")==0){ SETM("rmdir"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"rm")==0){
-            // rm -r <dir>
-            if(strstr(rest,"-r") || strstr(rest,"-rf")){ // rmdir /s /q
-                // remove -r from rest to get target
-                char t[MAX_LINE]; strncpy(t, rest, sizeof(t));
-                replace_first(t, "-r", ""); replace_first(t, "-rf", "");
-                SETM("rmdir /s /q"); if(strlen(t)){ strncat(mapped," ", sizeof(mapped)-strlen(mapped)-1); strncat(mapped,t, sizeof(mapped)-strlen(mapped)-1);} return strdup(mapped);
-            } else {
-                SETM("del"); APPREST(); return strdup(mapped);
+// Repeated lines through the translation cache against a fresh translation
+// each time, for working sets that fit the cache and one that does not.
+static int bench_cache(long iters){
+    if(iters <= 0) iters = 1000000;
+    static const size_t sets[] = { 100, 1000, 20000 };
+    struct arena arena = { NULL };
+    char (*lines)[96] = malloc(sizeof(*lines) * sets[ARRAY_LEN(sets)-1]);
+    if(!lines) return 1;
+    volatile size_t sink = 0;
+    printf("cache: %ld translations per working set\n", iters);
+    for(size_t si=0; si<ARRAY_LEN(sets); si++){
+        size_t n = sets[si];
+        for(size_t i=0;i<n;i++)
+            snprintf(lines[i], sizeof(lines[i]), "%s  \"file %zu.txt\"",
+                     bench_windows_corpus[i % ARRAY_LEN(bench_windows_corpus)], i);
+        double t[2];
+        for(int cached=0; cached<2; cached++){
+            tcache_clear();
+            double t0 = now_sec();
+            for(long it=0; it<iters; it++){
+                const char *l = lines[(size_t)it % n];
+                struct sbuf out = { NULL, 0, 0, &arena };
+                if(cached) translate_cached(l, strlen(l), 1, 0, &out, 0);
+                else translate_pipeline_into(l, strlen(l), 1, 0, &out, 0);
+                sink += out.len;
+                arena_reset(&arena);
             }
+            t[cached] = (now_sec() - t0) * 1e9 / iters;
         }
-        if(strcmp(first_lc,"touch")==0){
-            // type nul > file
-            if(strlen(rest)){
-                char t[MAX_LINE]; strncpy(t, rest, sizeof(t));
-                trim(t);
-                SETM("type nul >"); strncat(mapped, " ", sizeof(mapped)-strlen(mapped)-1); strncat(mapped, t, sizeof(mapped)-strlen(mapped)-1); return strdup(mapped);
-            } else { return strdup("rem touch: missing filename"); }
-        }
-        if(strcmp(first_lc,"cp")==0){ SETM("copy"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"mv")==0){ SETM("move"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"cat")==0){ SETM("type"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"less")==0 || strcmp(first_lc,"more")==0){ SETM("more"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"head")==0){
-            // head -n N file -> powershell Get-Content file -TotalCount N
-            char sec[MAX_TOK]; split_first(rest, sec, sec); // not perfect
-            char *nptr = strstr(rest, "-n");
-            if(nptr){
-                int N;
-                if(sscanf(nptr, "-n %d", &N)==1){
-                    char file[MAX_LINE]; // attempt to extract file (last token)
-                    // simple heuristic: last whitespace separated token
-                    char temp[MAX_LINE]; strncpy(temp, rest, sizeof(temp));
-                    trim(temp);
-                    char *last = strrchr(temp, ' ');
-                    if(last) strcpy(file, last+1); else strcpy(file, temp);
-                    snprintf(mapped, sizeof(mapped), "powershell -Command \"Get-Content %s -TotalCount %d\"", file, N);
-                    return strdup(mapped);
-                }
-            }
-            // fallback: more +N not reliable; use head via PowerShell reading first lines
-            if(strlen(rest)){ snprintf(mapped,sizeof(mapped),"powershell -Command \"Get-Content %s -TotalCount 10\"", rest); return strdup(mapped); }
-            SETM("more"); return strdup(mapped);
+        unsigned long total = tcache.hits + tcache.misses;
+        printf("  %6zu distinct lines: uncached %6.0f ns  cached %6.0f ns  (%.1fx, %.1f%% hits)\n",
+               n, t[0], t[1], t[0] / t[1], total ? 100.0 * tcache.hits / total : 0.0);
+    }
+    tcache_clear();
+    arena_free(&arena);
+    free(lines);
+    (void)sink;
+    return 0;
+}
+
+// !prefix and !?substr? expansion cost as the history grows.
+static int bench_histexp(long iters){
+    if(iters <= 0) iters = 100000;
+    static const size_t sizes[] = { 1000, 10000, 100000, 1000000 };
+    static const char *queries[] = { "!git", "!make -j", "!?status?", "!?@h?", "!cc:$" };
+    // bash leaves these alone; so must we
+    static const char *inert[] = { "ls [!a]*", "echo ${!HO*}", "kill $!;" };
+    volatile size_t sink = 0;
+    for(size_t q=0;q<ARRAY_LEN(inert);q++){
+        int print_only;
+        char *out = expand_bang(inert[q], 0, &print_only);
+        int same = out && strcmp(out, inert[q]) == 0;
+        free(out);
+        if(!same){ fprintf(stderr, "histexp: %s: expanded\n", inert[q]); return 1; }
+    }
+    printf("histexp: %ld expansions per query and size\n", iters);
+    for(size_t si=0; si<ARRAY_LEN(sizes); si++){
+        free_history();
+        if(hist_init(sizes[si]) != 0) return 1;
+        char line[64];
+        for(size_t i=0;i<sizes[si];i++){
+            // the queried commands sit near the oldest end, the worst case for a scan
+            if(i == 3) snprintf(line, sizeof(line), "git status");
+            else if(i == 5) snprintf(line, sizeof(line), "make -j8 all");
+            else if(i == 7) snprintf(line, sizeof(line), "cc -O2 -o app%zu app.c", i);
+            else if(i == 9) snprintf(line, sizeof(line), "ssh me@host");
+            else snprintf(line, sizeof(line), "tool%zu --flag value%zu", i, i * 7);
+            hist_push(line, strlen(line));
         }
-        if(strcmp(first_lc,"tail")==0){
-            // tail -f -> powershell Get-Content -Wait; tail -n -> Get-Content -Tail
-            if(strstr(rest,"-f") || strstr(rest,"-F")){
-                // extract filename
-                char temp[MAX_LINE]; strncpy(temp, rest, sizeof(temp));
-                replace_first(temp, "-f", ""); replace_first(temp, "-F", "");
-                trim(temp);
-                snprintf(mapped,sizeof(mapped),"powershell -Command \"Get-Content %s -Wait\"", temp);
-                return strdup(mapped);
-            }
-            char *nptr = strstr(rest, "-n");
-            if(nptr){
-                int N;
-                if(sscanf(nptr, "-n %d", &N)==1){
-                    char temp[MAX_LINE]; strncpy(temp, rest, sizeof(temp));
-                    // remove -n ... to get filename
-                    char *fn = NULL;
-                    char *tok = strtok(temp, " ");
-                    while(tok){ fn = tok; tok = strtok(NULL," "); }
-                    if(fn){ snprintf(mapped,sizeof(mapped),"powershell -Command \"Get-Content %s -Tail %d\"", fn, N); return strdup(mapped); }
-                }
+        printf("  %8zu entries:", sizes[si]);
+        for(size_t q=0;q<ARRAY_LEN(queries);q++){
+            int print_only;
+            free(expand_bang(queries[q], 0, &print_only)); // builds the lazy indexes
+            double t0 = now_sec();
+            for(long it=0; it<iters; it++){
+                char *out = expand_bang(queries[q], 0, &print_only);
+                if(!out) return 1;
+                sink += strlen(out);
+                free(out);
             }
-            SETM("powershell -Command \"Get-Content "); APPREST(); strncat(mapped, " -Tail 10\"", sizeof(mapped)-strlen(mapped)-1); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"chmod")==0){ SETM("rem chmod not supported on Windows; use icacls or powershell Set-Acl"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"chown")==0){ SETM("rem chown not supported on Windows; use icacls"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"whoami")==0){ SETM("whoami"); return strdup(mapped); }
-        if(strcmp(first_lc,"uname")==0){ SETM("systeminfo"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"hostname")==0){ SETM("hostname"); return strdup(mapped); }
-        if(strcmp(first_lc,"date")==0){ SETM("date /t"); return strdup(mapped); }
-        if(strcmp(first_lc,"uptime")==0){ SETM("net statistics workstation"); return strdup(mapped); }
-        if(strcmp(first_lc,"df")==0){
-            // df -h -> wmic logicaldisk get size,freespace,caption (legacy)
-            SETM("wmic logicaldisk get caption,freespace,size"); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"du")==0){
-            // du -sh dir -> powershell Get-ChildItem dir -Recurse | Measure-Object -Property Length -Sum
-            char target[MAX_LINE]; strncpy(target, rest, sizeof(target)); trim(target);
-            if(strlen(target)){
-                snprintf(mapped,sizeof(mapped),"powershell -Command \"(Get-ChildItem -Recurse %s | Measure-Object -Property Length -Sum).Sum\"", target);
-                return strdup(mapped);
-            } else { SETM("rem du needs directory"); return strdup(mapped); }
+            printf("  %s %6.0f ns", queries[q], (now_sec() - t0) * 1e9 / iters);
         }
-        if(strcmp(first_lc,"free")==0){ SETM("systeminfo | findstr /C:\"Total Physical Memory\" /C:\"Available\""); return strdup(mapped); }
-        if(strcmp(first_lc,"top")==0 || strcmp(first_lc,"htop")==0){
-            SETM("tasklist"); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"ps")==0){
-            if(strstr(rest,"aux")){ SETM("tasklist"); return strdup(mapped); }
-            SETM("tasklist"); APPREST(); return strdup(mapped);
+        printf("\n");
+    }
+    free_history();
+    (void)sink;
+    return 0;
+}
+
+#if !HOST_IS_WINDOWS
+// In-process cat/head/tail/ls against spawning the same command line, with
+// stdout sent to /dev/null.
+static int bench_native(long n){
+    if(n <= 0) n = 1000;
+    char dir[] = "/tmp/custard-bench-nativeXXXXXX";
+    if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+    char path[MAX_LINE];
+    snprintf(path, sizeof(path), "%s/log.txt", dir);
+    FILE *f = fopen(path, "w");
+    if(!f){ perror(path); return 1; }
+    for(int i=0;i<5000;i++) fprintf(f, "%05d some log line with a bit of text in it\n", i);
+    fclose(f);
+    for(int i=0;i<100;i++){
+        snprintf(path, sizeof(path), "%s/file%03d.dat", dir, i);
+        if((f = fopen(path, "w"))) fclose(f);
+    }
+    char cmds[4][MAX_LINE];
+    snprintf(cmds[0], MAX_LINE, "cat %s/log.txt", dir);
+    snprintf(cmds[1], MAX_LINE, "head -n 10 %s/log.txt", dir);
+    snprintf(cmds[2], MAX_LINE, "tail -n 10 %s/log.txt", dir);
+    snprintf(cmds[3], MAX_LINE, "ls -l %s", dir);
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO), null_fd = open("/dev/null", O_WRONLY);
+    if(saved < 0 || null_fd < 0){ perror("dup"); return 1; }
+    double t[4][2];
+    int bad = 0;
+    for(int c=0;c<4;c++){
+        dup2(null_fd, STDOUT_FILENO);
+        for(int native=0; native<2; native++){
+            long reps = native ? n * 20 : n;
+            double t0 = now_sec();
+            for(long i=0;i<reps;i++)
+                if((native ? native_run(cmds[c], 0) : run_command(cmds[c])) != 0) bad = 1;
+            t[c][native] = (now_sec() - t0) * 1e6 / reps;
         }
-        if(strcmp(first_lc,"kill")==0){
-            // kill -9 pid -> taskkill /PID pid /F
-            if(strstr(rest,"-9")){
-                char t[MAX_LINE]; strncpy(t, rest, sizeof(t));
-                replace_first(t,"-9","");
-                trim(t);
-                snprintf(mapped,sizeof(mapped),"taskkill /PID %s /F", t);
-                return strdup(mapped);
-            } else {
-                char t[MAX_LINE]; strncpy(t, rest, sizeof(t)); trim(t);
-                snprintf(mapped,sizeof(mapped),"taskkill /PID %s", t);
-                return strdup(mapped);
+        dup2(saved, STDOUT_FILENO);
+    }
+    close(null_fd); close(saved);
+    printf("native: %ld spawned runs per command (20x that in-process)\n", n);
+    static const char *names[] = { "cat 5000 lines", "head -n 10", "tail -n 10", "ls -l 101 entries" };
+    for(int c=0;c<4;c++)
+        printf("  %-18s spawn %8.1f us   native %7.2f us   (%.0fx)\n", names[c], t[c][0], t[c][1], t[c][0] / t[c][1]);
+    if(bad) printf("  (some commands failed)\n");
+    for(int i=0;i<100;i++){ snprintf(path, sizeof(path), "%s/file%03d.dat", dir, i); remove(path); }
+    snprintf(path, sizeof(path), "%s/log.txt", dir);
+    remove(path);
+    rmdir(dir);
+    return 0;
+}
+#endif
+
+#if !HOST_IS_WINDOWS
+// n files under dir, 1000 per directory in 32 groups, some with data and
+// every 100th hard-linked.
+static int bench_make_tree(const char *dir, long n){
+    mkdir(dir, 0755);
+    int root = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(root < 0){ perror(dir); return 1; }
+    char name[64];
+    long made = 0;
+    for(long d=0; made<n; d++){
+        snprintf(name, sizeof(name), "g%02ld", d % 32);
+        mkdirat(root, name, 0755);
+        snprintf(name, sizeof(name), "g%02ld/d%ld", d % 32, d);
+        if(mkdirat(root, name, 0755) != 0){ perror(name); return 1; }
+        int dfd = openat(root, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        for(int f=0; f<1000 && made<n; f++, made++){
+            snprintf(name, sizeof(name), "f%d", f);
+            int fd = openat(dfd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            if(fd < 0){ perror(name); return 1; }
+            if(f % 10 == 0 && write(fd, name, strlen(name)) < 0){}
+            close(fd);
+            if(f % 100 == 1){
+                char link[64];
+                snprintf(link, sizeof(link), "l%d", f);
+                linkat(dfd, name, dfd, link, 0);
             }
         }
-        if(strcmp(first_lc,"jobs")==0 || strcmp(first_lc,"fg")==0 || strcmp(first_lc,"bg")==0){
-            SETM("rem job control not supported on Windows; use powershell background jobs or task manager"); APPREST(); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"ping")==0){ SETM("ping"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"curl")==0){ SETM("curl"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"wget")==0){
-            SETM("curl -O"); APPREST(); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"ifconfig")==0 || (strcmp(first_lc,"ip")==0 && strstr(rest,"addr"))){
-            SETM("ipconfig /all"); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"netstat")==0){
-            // netstat -tulnp -> netstat -ano
-            SETM("netstat -ano"); APPREST(); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"ssh")==0){ SETM("ssh"); APPREST(); return strdup(mapped); } // Windows 10+ may have ssh
-        if(strcmp(first_lc,"scp")==0){ SETM("scp"); APPREST(); return strdup(mapped); } // requires installed scp
-        // package managers: apt/dnf/pacman -> not supported
-        if(strcmp(first_lc,"sudo")==0){
-            // remove sudo on Windows; try to run via powershell start-process -Verb runAs for elevation is complex; we'll strip it
-            char t[MAX_LINE]; strncpy(t, rest, sizeof(t)); trim(t);
-            if(strlen(t)) return strdup(t);
-            else return strdup("rem sudo with no command");
-        }
-        if(strcmp(first_lc,"apt")==0 || strcmp(first_lc,"dnf")==0 || strcmp(first_lc,"pacman")==0){
-            SETM("rem Package manager commands are not supported on Windows; consider using WSL or equivalent"); APPREST(); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"adduser")==0 || strcmp(first_lc,"passwd")==0 || strcmp(first_lc,"su")==0){
-            SETM("rem User management must be done via Control Panel or net user on Windows"); APPREST(); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"who")==0 || strcmp(first_lc,"id")==0 || strcmp(first_lc,"groups")==0){
-            SETM("whoami"); APPREST(); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"tar")==0){
-            // many forms: tar -czvf file.tar.gz dir/ -> use tar if Windows has tar.exe or use powershell Compress-Archive
-            if(strstr(rest,"-czvf") || strstr(rest,"-czf")){
-                // find archive name and dir
-                // fallback to using tar if available
-                SETM("tar"); APPREST(); return strdup(mapped);
-            }
-            SETM("tar"); APPREST(); return strdup(mapped);
+        close(dfd);
+    }
+    close(root);
+    return 0;
+}
+
+// du -sh over a generated tree of n files, natively and through the host's du.
+static int bench_du(long n){
+    if(n <= 0) n = 1000000;
+    char dir[] = "/tmp/custard-bench-duXXXXXX";
+    if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+    printf("du: generating %ld files under %s ...\n", n, dir);
+    fflush(stdout);
+    if(bench_make_tree(dir, n) != 0) return 1;
+    char cmd[MAX_LINE], out_path[MAX_LINE];
+    snprintf(cmd, sizeof(cmd), "du -sh %s", dir);
+    snprintf(out_path, sizeof(out_path), "%s.out", dir);
+    printf("du: %d cores\n", cpu_count());
+    fflush(stdout);
+    for(int round=0; round<2; round++){
+        for(int native=1; native>=0; native--){
+            fflush(stdout);
+            int saved = dup(STDOUT_FILENO), o = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            dup2(o, STDOUT_FILENO);
+            double t0 = now_sec();
+            int rc = native ? native_run(cmd, 0) : run_command(cmd);
+            double dt = now_sec() - t0;
+            dup2(saved, STDOUT_FILENO);
+            close(saved); close(o);
+            char result[64] = "";
+            FILE *f = fopen(out_path, "r");
+            if(f){ if(fscanf(f, "%63s", result) != 1) result[0] = 0; fclose(f); }
+            printf("  %-9s %8.3f s  %9.0f files/s  -> %s%s\n", native ? "native" : "host du",
+                   dt, n / dt, result, rc ? "  (failed!)" : "");
         }
-        if(strcmp(first_lc,"zip")==0 || strcmp(first_lc,"unzip")==0){
-            // Windows: use powershell Compress-Archive or Expand-Archive
-            if(strcmp(first_lc,"zip")==0){
-                SETM("powershell -Command \"Compress-Archive -Path"); if(strlen(rest)){ strncat(mapped, " ", sizeof(mapped)-strlen(mapped)-1); strncat(mapped, rest, sizeof(mapped)-strlen(mapped)-1); } strncat(mapped, "\"", sizeof(mapped)-strlen(mapped)-1); return strdup(mapped);
-            } else {
-                SETM("powershell -Command \"Expand-Archive -Path"); if(strlen(rest)){ strncat(mapped, " ", sizeof(mapped)-strlen(mapped)-1); strncat(mapped, rest, sizeof(mapped)-strlen(mapped)-1); } strncat(mapped, "\"", sizeof(mapped)-strlen(mapped)-1); return strdup(mapped);
-            }
+    }
+    remove(out_path);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    return run_command(cmd) != 0;
+}
+
+// rm -rf of a generated tree of n files, natively and through the host's rm;
+// the tree is rebuilt before every run.
+static int bench_rm(long n){
+    if(n <= 0) n = 200000;
+    char dir[] = "/tmp/custard-bench-rmXXXXXX", tree[64], cmd[MAX_LINE];
+    if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+    snprintf(tree, sizeof(tree), "%s/t", dir);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", tree);
+    printf("rm: %ld files per run, %d cores\n", n, cpu_count());
+    int bad = 0;
+    for(int round=0; round<2; round++){
+        for(int native=1; native>=0; native--){
+            if(bench_make_tree(tree, n) != 0){ bad = 1; break; }
+            sync();
+            fflush(stdout);
+            double t0 = now_sec();
+            int rc = native ? native_run(cmd, 0) : run_command(cmd);
+            double dt = now_sec() - t0;
+            struct stat st;
+            if(lstat(tree, &st) == 0) rc = 1;
+            printf("  %-9s %8.3f s  %9.0f files/s%s\n", native ? "native" : "host rm", dt, n / dt, rc ? "  (failed!)" : "");
+            bad |= rc != 0;
         }
-        if(strcmp(first_lc,"history")==0){ SETM("rem history shown by this terminal"); return strdup(mapped); }
-        if(strcmp(first_lc,"clear")==0){ SETM("cls"); return strdup(mapped); }
-        if(strcmp(first_lc,"!!")==0){ // handled outside
-            return strdup("!!");
+    }
+    rmdir(dir);
+    return bad;
+}
+
+// cp -r of a build-output-like tree (n small files plus 16 x 8 MiB
+// artifacts), natively and through the host's cp.
+static int bench_cp(long n){
+    if(n <= 0) n = 100000;
+    char dir[] = "/tmp/custard-bench-cpXXXXXX", src[64], dst[64], cmd[MAX_LINE];
+    if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+    snprintf(src, sizeof(src), "%s/src", dir);
+    snprintf(dst, sizeof(dst), "%s/dst", dir);
+    if(bench_make_tree(src, n) != 0) return 1;
+    char *blob = malloc(8 << 20);
+    if(!blob) return 1;
+    for(size_t i=0;i<(8u << 20);i++) blob[i] = (char)(i * 2654435761u >> 13);
+    for(int i=0;i<16;i++){
+        char path[96];
+        snprintf(path, sizeof(path), "%s/artifact%d.bin", src, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0 || write_all(fd, blob, 8u << 20) != 0){ perror(path); return 1; }
+        close(fd);
+    }
+    free(blob);
+    printf("cp: %ld files + 16 x 8 MiB, %d cores\n", n, cpu_count());
+    int bad = 0;
+    for(int round=0; round<2; round++){
+        for(int native=1; native>=0; native--){
+            snprintf(cmd, sizeof(cmd), "rm -rf %s", dst);
+            run_command(cmd);
+            sync();
+            snprintf(cmd, sizeof(cmd), "cp -r %s %s", src, dst);
+            fflush(stdout);
+            double t0 = now_sec();
+            int rc = native ? native_run(cmd, 0) : run_command(cmd);
+            double dt = now_sec() - t0;
+            printf("  %-9s %8.3f s  %9.0f files/s%s\n", native ? "native" : "host cp", dt, (n + 16) / dt, rc ? "  (failed!)" : "");
+            bad |= rc != 0;
         }
-        if(first_lc[0]=='!'){ // !n handled outside
-            return strdup(input);
+    }
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    return run_command(cmd) != 0 || bad;
+}
+#endif
+
+#ifdef __linux__
+// CPU cost of following 32 busy logs: the native follow loop against the
+// host's tail -F, each in a child with output to a file, while the parent
+// appends n lines per log in small writes.
+static int bench_follow(long n){
+    if(n <= 0) n = 20000;
+    enum { NLOGS = 32 };
+    char dir[] = "/tmp/custard-bench-followXXXXXX";
+    if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+    char paths[NLOGS][MAX_LINE], out_path[MAX_LINE], cmd[MAX_LINE * 2];
+    snprintf(out_path, sizeof(out_path), "%s/out", dir);
+    int len = snprintf(cmd, sizeof(cmd), "tail -n 0 -F");
+    char host_cmd[MAX_LINE * 2 + 8];
+    for(int i=0;i<NLOGS;i++){
+        snprintf(paths[i], MAX_LINE, "%s/log%02d", dir, i);
+        len += snprintf(cmd + len, sizeof(cmd) - (size_t)len, " %s", paths[i]);
+    }
+    static const char line[] = "2026-10-15 12:00:00 INFO request served in 12ms status=200\n";
+    printf("follow: %d logs x %ld appended lines\n", NLOGS, n);
+    for(int native=1; native>=0; native--){
+        int fds[NLOGS];
+        for(int i=0;i<NLOGS;i++) fds[i] = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        struct rusage before, after;
+        getrusage(RUSAGE_CHILDREN, &before);
+        pid_t pid = fork();
+        if(pid == 0){
+            int o = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            dup2(o, STDOUT_FILENO);
+            dup2(o, STDERR_FILENO);
+            if(native) _exit(native_run(cmd, 0) < 0 ? 127 : 0);
+            snprintf(host_cmd, sizeof(host_cmd), "exec %s", cmd);
+            execl("/bin/sh", "sh", "-c", host_cmd, (char *)NULL);
+            _exit(127);
         }
+        usleep(200000); // let the follower set up its watches
+        double t0 = now_sec();
+        for(long k=0;k<n;k++)
+            for(int i=0;i<NLOGS;i++) if(write(fds[i], line, sizeof(line) - 1) < 0){}
+        double dt = now_sec() - t0;
+        usleep(300000);
+        kill(pid, native ? SIGINT : SIGTERM);
+        int st;
+        waitpid(pid, &st, 0);
+        getrusage(RUSAGE_CHILDREN, &after);
+        double cpu = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_stime.tv_sec - before.ru_stime.tv_sec)
+                   + ((after.ru_utime.tv_usec - before.ru_utime.tv_usec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec)) / 1e6;
+        struct stat ost;
+        long long got = stat(out_path, &ost) == 0 ? (long long)ost.st_size : 0, want = (long long)n * NLOGS * (sizeof(line) - 1);
+        printf("  %-12s %7.3f s CPU for %.1f MB appended in %.2f s  (%.2f us per write)%s\n", native ? "native" : "host tail -F",
+               cpu, want / 1e6, dt, cpu * 1e6 / ((double)n * NLOGS), got < want ? "  (output incomplete!)" : "");
+        for(int i=0;i<NLOGS;i++) close(fds[i]);
+    }
+    for(int i=0;i<NLOGS;i++) remove(paths[i]);
+    remove(out_path);
+    rmdir(dir);
+    return 0;
+}
+#endif
 
-        // default fallback: try to run via bash on Windows if available (WSL) else run raw
-        // We'll attempt to run original in PowerShell by wrapping: bash -lc "input"
-        // But since host_is_windows, we will try to run via bash -c if WSL present:
-        char trybash[MAX_LINE*2];
-        snprintf(trybash, sizeof(trybash), "bash -lc \"%s\"", input);
-        return strdup(trybash);
+#if !HOST_IS_WINDOWS
+// Commands per second through system() versus the direct spawn engine.
+static int bench_exec(long n){
+    if(n <= 0) n = 500;
+    static const char *cmds[] = { "env true", "env true | env true | env true" };
+    printf("exec: %ld runs per command\n", n);
+    for(size_t c=0; c<ARRAY_LEN(cmds); c++){
+        double t0 = now_sec();
+        for(long i=0;i<n;i++) if(system(cmds[c]) == -1){ perror("system"); return 1; }
+        double t_sys = now_sec() - t0;
+        t0 = now_sec();
+        for(long i=0;i<n;i++) if(run_command(cmds[c]) != 0){ fprintf(stderr, "run_command failed\n"); return 1; }
+        double t_spawn = now_sec() - t0;
+        printf("  %-20s system() %8.0f cmds/s   spawn engine %8.0f cmds/s   (%.2fx)\n",
+               cmds[c], n / t_sys, n / t_spawn, t_sys / t_spawn);
+    }
+    return 0;
+}
+#endif
+
+#if !HOST_IS_WINDOWS
+// Streaming throughput: n MiB through pipelines whose middle stages the engine
+// runs in-process (splice/tee), against the same line under /bin/sh.
+static int bench_pipe(long n){
+    if(n <= 0) n = 4096;
+    static const char *fmts[] = {
+        "head -c %ld /dev/zero | cat | cat | wc -c > /dev/null",
+        "head -c %ld /dev/zero | tee /dev/null | cat > /dev/null",
+    };
+    printf("pipe: %ld MiB per pipeline\n", n);
+    for(size_t c=0; c<ARRAY_LEN(fmts); c++){
+        char cmd[256];
+        snprintf(cmd, sizeof(cmd), fmts[c], n << 20);
+        double t0 = now_sec();
+        if(system(cmd) != 0){ fprintf(stderr, "system failed\n"); return 1; }
+        double t_sys = now_sec() - t0;
+        t0 = now_sec();
+        if(run_command(cmd) != 0){ fprintf(stderr, "run_command failed\n"); return 1; }
+        double t_eng = now_sec() - t0;
+        printf("  %s\n    /bin/sh %8.0f MiB/s   engine %8.0f MiB/s   (%.2fx)\n",
+               cmd, n / t_sys, n / t_eng, t_sys / t_eng);
     }
+    return 0;
+}
 
-    // Windows -> Linux mappings
-    if(source_is_windows && !host_is_windows){
-        if(strcmp(first_lc,"dir")==0){
-            // map flags /a etc roughly
-            SETM("ls"); APPREST(); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"type")==0){ SETM("cat"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"copy")==0){ SETM("cp"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"move")==0){ SETM("mv"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"del")==0 || strcmp(first_lc,"erase")==0){ SETM("rm"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"rmdir")==0){ SETM("rm -r"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"mkdir")==0){ SETM("mkdir"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"cls")==0){ SETM("clear"); return strdup(mapped); }
-        if(strcmp(first_lc,"whoami")==0){ SETM("whoami"); return strdup(mapped); }
-        if(strcmp(first_lc,"systeminfo")==0){ SETM("uname -a"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"hostname")==0){ SETM("hostname"); return strdup(mapped); }
-        if(strcmp(first_lc,"date")==0){ SETM("date"); return strdup(mapped); }
-        if(strcmp(first_lc,"netstat")==0){ SETM("netstat -tulnp"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"tasklist")==0){ SETM("ps aux"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"taskkill")==0){
-            // taskkill /PID pid /F -> kill -9 pid
-            char t[MAX_LINE]; strncpy(t, rest, sizeof(t)); trim(t);
-            // try to find PID
-            char pid[MAX_TOK] = {0};
-            if(strstr(t,"/PID")){
-                char *p = strstr(t,"/PID")+4;
-                while(*p && isspace((unsigned char)*p)) p++;
-                int i=0;
-                while(*p && !isspace((unsigned char)*p) && i<MAX_TOK-1) pid[i++]=*p++;
-                pid[i]=0;
-                snprintf(mapped,sizeof(mapped),"kill -9 %s", pid); return strdup(mapped);
-            } else {
-                SETM("rem cannot map taskkill: check args"); APPREST(); return strdup(mapped);
-            }
-        }
-        if(strcmp(first_lc,"ipconfig")==0){ SETM("ifconfig"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"ping")==0){ SETM("ping"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"curl")==0){ SETM("curl"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"ssh")==0){ SETM("ssh"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"scp")==0){ SETM("scp"); APPREST(); return strdup(mapped); }
-        if(strcmp(first_lc,"powershell")==0){ // pass through but remove 'powershell -Command'
-            SETM(rest); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"wmic")==0){
-            SETM("df -h"); APPREST(); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"cls")==0){ SETM("clear"); return strdup(mapped); }
-        if(strcmp(first_lc,"tar")==0 || strcmp(first_lc,"Compress-Archive")==0){
-            SETM("tar"); APPREST(); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"rem")==0){
-            // comment - do nothing
-            SETM("true"); return strdup(mapped);
-        }
-        if(strcmp(first_lc,"history")==0){ SETM("history"); return strdup(mapped); } // history is handled in this terminal
-        if(strcmp(first_lc,"start")==0){
-            SETM("xdg-open"); APPREST(); return strdup(mapped);
+// md5sum over n 2 MiB files fanned out by xargs: the host's xargs serially and
+// with -P (which needs -n to split the list), and ours with -P 0 alone.
+static int bench_xargs(long n){
+    if(n <= 0) n = 256;
+    char dir[] = "/tmp/custard-bench-xargsXXXXXX", cmd[MAX_LINE];
+    if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+    size_t size = 2u << 20;
+    char *blob = malloc(size);
+    if(!blob) return 1;
+    for(long i=0;i<n;i++){
+        for(size_t k=0;k<size;k++) blob[k] = (char)((k + (size_t)i) * 2654435761u >> 13);
+        char path[96];
+        snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0 || write_all(fd, blob, size) != 0){ perror(path); return 1; }
+        close(fd);
+    }
+    free(blob);
+    int cores = cpu_count(), bad = 0;
+    printf("xargs: md5sum over %ld files (%ld MiB), %d cores\n", n, n * 2, cores);
+    for(int round=0; round<2; round++){
+        for(int mode=0; mode<3; mode++){
+            if(mode == 0) snprintf(cmd, sizeof(cmd), "find %s -type f | xargs md5sum > /dev/null", dir);
+            else if(mode == 1) snprintf(cmd, sizeof(cmd), "find %s -type f | xargs -P %d -n 8 md5sum > /dev/null", dir, cores);
+            else snprintf(cmd, sizeof(cmd), "find %s -type f | xargs -P 0 md5sum > /dev/null", dir);
+            fflush(stdout);
+            double t0 = now_sec();
+            int rc = mode < 2 ? system(cmd) : run_command(cmd);
+            double dt = now_sec() - t0;
+            printf("  %-26s %8.3f s  %7.0f MiB/s%s\n", mode == 0 ? "host xargs" : mode == 1 ? "host xargs -P -n 8" : "custard xargs -P 0",
+                   dt, n * 2 / dt, rc ? "  (failed!)" : "");
+            bad |= rc != 0;
         }
-        // fallback: return original
-        return strdup(input);
     }
-
-    // default fallback
-    return strdup(input);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    return run_command(cmd) != 0 || bad;
 }
 
-// Expand !! and !n using history; returns malloc'd string
-static char *expand_bang(const char *cmd){
-    if(strcmp(cmd,"!!")==0){
-        if(hist_count==0) return strdup("");
-        return strdup(history[hist_count-1]);
+// cmd for over n small files. The naive translation starts a shell per
+// iteration; the loop here spawns the body directly (sort) or runs it in-process
+// (type) with no process at all.
+static int bench_for(long n){
+    if(n <= 0) n = 10000;
+    char dir[] = "/tmp/custard-bench-forXXXXXX", cmd[MAX_LINE];
+    if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+    for(long i=0;i<n;i++){
+        char path[96], text[32];
+        snprintf(path, sizeof(path), "%s/f%05ld.log", dir, i);
+        int len = snprintf(text, sizeof(text), "line %ld\n", i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0 || write_all(fd, text, (size_t)len) != 0){ perror(path); return 1; }
+        close(fd);
     }
-    if(cmd[0]=='!' && isdigit((unsigned char)cmd[1])){
-        int n = atoi(cmd+1);
-        if(n <= 0 || n > hist_count) return strdup("");
-        return strdup(history[n-1]);
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC), saved = dup(STDOUT_FILENO), bad = 0;
+    if(devnull < 0 || saved < 0){ perror("/dev/null"); return 1; }
+    printf("for: %ld files\n", n);
+    for(int mode=0; mode<3; mode++){
+        if(mode == 0) snprintf(cmd, sizeof(cmd), "for f in %s/*.log; do sh -c 'cat \"$1\"' sh \"$f\"; done", dir);
+        else snprintf(cmd, sizeof(cmd), "for %%f in (%s/*.log) do %s %%f", dir, mode == 1 ? "sort" : "type");
+        fflush(stdout);
+        dup2(devnull, STDOUT_FILENO);
+        double t0 = now_sec();
+        int rc = mode == 0 ? system(cmd) : cmdfor_run(cmd);
+        double dt = now_sec() - t0;
+        dup2(saved, STDOUT_FILENO);
+        printf("  %-34s %8.3f s  %9.0f iterations/s%s\n",
+               mode == 0 ? "host sh, one shell per iteration" : mode == 1 ? "for ... do sort %f (spawned)" : "for ... do type %f (in-process)",
+               dt, n / dt, rc ? "  (failed!)" : "");
+        bad |= rc != 0;
     }
-    return strdup(cmd);
+    close(devnull);
+    close(saved);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    return run_command(cmd) != 0 || bad;
 }
 
-// New function: handle built-in commands that can appear in a pipeline
-static int handle_builtin_pipeline(const char *cmd) {
-    char first[MAX_TOK], rest[MAX_LINE];
-    split_first(cmd, first, rest);
-    char first_lc[MAX_TOK]; lc_copy(first, first_lc);
+// The fallback provider against the loopback mock: n unknown commands asked
+// cold, the same n answered from the cache, then a mock slower than the
+// timeout. The prompt's share is the time spent starting requests and
+// printing answers; it should stay in microseconds however slow the provider.
+static int bench_fallback(long n){
+    if(n <= 0) n = 200;
+    int port = 0, lfd = fb_mock_listen(&port);
+    pthread_t mock;
+    if(lfd < 0 || pthread_create(&mock, NULL, fb_mock_serve, (void *)(intptr_t)lfd) != 0){ perror("fallback mock"); return 1; }
+    pthread_detach(mock);
+    static char url[64], cache[] = "/tmp/custard-bench-fallbackXXXXXX";
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/suggest", port);
+    int cfd = mkstemp(cache);
+    if(cfd < 0){ perror("mkstemp"); return 1; }
+    close(cfd);
+    fb.cache_path = cache;
+    if(fb_configure(url, 500) != 0 || fb_init(0) != 0) return 1;
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC), saved = dup(STDOUT_FILENO), bad = 0;
+    if(devnull < 0 || saved < 0){ perror("/dev/null"); return 1; }
+    printf("fallback: %ld unknown commands against a loopback mock, timeout %d ms\n", n, fb.timeout_ms);
+    for(int phase=0; phase<3; phase++){
+        long count = phase == 2 ? 3 : n;
+        fb_mock_delay_ms = phase == 2 ? 2 * fb.timeout_ms : 0;
+        fb.requests = fb.answers = fb.hits = fb.timeouts = fb.failures = fb.skipped = fb.prompt_n = 0;
+        fb.lat_total = fb.lat_max = fb.prompt_total = fb.prompt_max = 0;
+        fflush(stdout);
+        dup2(devnull, STDOUT_FILENO);
+        double t0 = now_sec();
+        for(long i=0;i<count;i++){
+            char line[64];
+            snprintf(line, sizeof(line), "frobnicate%ld --all", phase == 2 ? n + i : i);
+            fb_request(line, line, 0);
+            while(fb.busy){
+                struct pollfd p = { fb.wake[0], POLLIN, 0 };
+                poll(&p, 1, -1);
+                fb_collect(0);
+            }
+        }
+        double dt = now_sec() - t0;
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        long asked = fb.answers + fb.timeouts + fb.failures;
+        printf("  %-8s %4ld answers %4ld cache hits %3ld timeouts  provider avg %7.2f ms max %7.2f ms  prompt avg %6.3f ms max %6.3f ms  (%.2f s)\n",
+               phase == 0 ? "cold" : phase == 1 ? "cached" : "slow", fb.answers, fb.hits, fb.timeouts,
+               asked ? fb.lat_total * 1e3 / asked : 0.0, fb.lat_max * 1e3,
+               fb.prompt_n ? fb.prompt_total * 1e3 / fb.prompt_n : 0.0, fb.prompt_max * 1e3, dt);
+        bad |= phase == 0 ? fb.answers != n : phase == 1 ? fb.hits != n : fb.timeouts != count;
+    }
+    close(devnull);
+    close(saved);
+    unlink(cache);
+    if(bad) fprintf(stderr, "fallback: unexpected answer/hit/timeout counts\n");
+    return bad;
+}
 
-    if(strcmp(first_lc,"help")==0){
-        printf("Universal Terminal — Help\n");
-        printf("-------------------------\n");
-        printf("Built-in commands:\n");
-        printf("  exit, quit       : Exit the terminal\n");
-        printf("  history          : Show last 100 commands\n");
-        printf("  clear            : Clear the screen\n");
-        printf("  !!               : Repeat last command\n");
-        printf("  !<num>           : Repeat command number <num> from history\n");
-        printf("  help             : Show this help message\n");
-        printf("\nCommand translation:\n");
-        printf("  You can type commands in your chosen dialect (Windows CMD or Linux Bash)\n");
-        printf("  Common commands like ls, dir, cp, move, rm, del, cat, etc., are mapped to the host OS\n");
-        printf("  Piped commands (using |) are supported and translated\n");
-        return 1; // indicates it was handled
+// The did-you-mean index: building it over PATH, n typo queries against a
+// linear scan of every word, then the cost of following PATH changes (a new
+// directory, one more file in it, the directory gone) next to a full rebuild.
+static int bench_spell(long n){
+    if(n <= 0) n = 20000;
+    double t0 = now_sec();
+    spell_refresh();
+    double t_build = now_sec() - t0;
+    printf("spell: %u words from %zu PATH directories, built in %.2f ms\n", spell.live, spell.ndirs, t_build * 1e3);
+    if(!spell.live) return 1;
+    // typos: known words with one edit (swap, drop, or change a letter)
+    char (*q)[SPELL_MAX_WORD + 1] = malloc((size_t)n * sizeof(*q));
+    if(!q) return 1;
+    unsigned seed = 12345;
+    for(long i=0;i<n;i++){
+        const char *w;
+        do{ seed = seed * 1103515245u + 12345u; w = spell.pool.p + spell.node[(seed >> 8) % spell.nnodes].word; } while(strlen(w) < 3);
+        size_t len = strlen(w), at = (seed >> 4) % (len - 1);
+        memcpy(q[i], w, len + 1);
+        if(i % 3 == 0){ char c = q[i][at]; q[i][at] = q[i][at+1]; q[i][at+1] = c; }
+        else if(i % 3 == 1) memmove(q[i] + at, q[i] + at + 1, len - at);
+        else q[i][at] = q[i][at] == 'x' ? 'y' : 'x';
     }
-    if(strcmp(first_lc,"exit")==0 || strcmp(first_lc,"quit")==0){
-        exit(0);
+    long found = 0, lin_found = 0, missed = 0;
+    t0 = now_sec();
+    for(long i=0;i<n;i++){
+        const char *best[SPELL_SUGGEST];
+        int known, len = (int)strlen(q[i]);
+        found += spell_suggest(q[i], (size_t)len, 0, best, &known) > 0 || known;
     }
-    if(strcmp(first_lc,"history")==0){
-        print_history();
-        return 1;
+    double t_tree = now_sec() - t0;
+    t0 = now_sec();
+    for(long i=0;i<n;i++){
+        size_t len = strlen(q[i]);
+        int r = spell_radius(len), hit = 0;
+        struct spell_pat pt;
+        spell_pattern(&pt, q[i], len);
+        for(uint32_t k=0;k<spell.nnodes;k++){
+            const struct spell_node *nd = &spell.node[k];
+            hit |= nd->refs && (nd->dialects & 1) && spell_dist(&pt, spell_folded(nd), nd->len) <= r;
+        }
+        lin_found += hit;
     }
-    if(strcmp(first_lc,"clear")==0){
-        if(HOST_IS_WINDOWS) system("cls"); else system("clear");
-        return 1;
+    double t_lin = now_sec() - t0;
+    missed = lin_found - found;
+    free(q);
+    printf("  %ld typo queries: BK-tree %7.2f us/query   linear scan %8.2f us/query   answered %ld/%ld%s\n",
+           n, t_tree * 1e6 / n, t_lin * 1e6 / n, found, n, missed > 0 ? "  (tree missed some!)" : "");
+
+    char dir[] = "/tmp/custard-bench-spellXXXXXX", path[MAX_LINE];
+    if(!mkdtemp(dir)){ perror("mkdtemp"); return 1; }
+    for(int i=0;i<=200;i++){
+        snprintf(path, sizeof(path), "%s/%s%03d", dir, i == 200 ? "frobnicate" : "tool", i);
+        int fd = i < 200 ? open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0755) : -2;
+        if(fd == -1){ perror(path); return 1; }
+        if(fd >= 0) close(fd);
     }
+    const char *old = getenv("PATH");
+    char *saved = strdup(old ? old : "");
+    snprintf(path, sizeof(path), "%s:%s", dir, saved);
+    setenv("PATH", path, 1);
+    t0 = now_sec();
+    spell_refresh();
+    double t_add = now_sec() - t0;
+    t0 = now_sec();
+    spell_refresh();
+    double t_same = now_sec() - t0;
+    struct timespec pause = { 0, 20000000 }; // let the directory mtime move on coarse clocks
+    nanosleep(&pause, NULL);
+    snprintf(path, sizeof(path), "%s/frobnicate", dir);
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+    if(fd >= 0) close(fd);
+    t0 = now_sec();
+    spell_refresh();
+    double t_file = now_sec() - t0;
+    const char *best[SPELL_SUGGEST];
+    int known, k = spell_search("frobincate", 10, 0, 2, best, SPELL_SUGGEST, &known);
+    int ok = k > 0 && strcmp(best[0], "frobnicate") == 0;
+    setenv("PATH", saved, 1);
+    t0 = now_sec();
+    spell_refresh();
+    double t_del = now_sec() - t0;
+    k = spell_search("frobincate", 10, 0, 2, best, SPELL_SUGGEST, &known);
+    ok = ok && (k == 0 || strcmp(best[0], "frobnicate") != 0);
+    t0 = now_sec();
+    spell_rebuild();
+    double t_full = now_sec() - t0;
+    printf("  PATH +dir (200 files) %7.3f ms   unchanged %7.3f ms   +1 file %7.3f ms   -dir %7.3f ms   full rebuild %7.2f ms%s\n",
+           t_add * 1e3, t_same * 1e3, t_file * 1e3, t_del * 1e3, t_full * 1e3, ok ? "" : "  (new file not tracked!)");
+    free(saved);
+    snprintf(path, sizeof(path), "rm -rf %s", dir);
+    return run_command(path) != 0 || !ok;
+}
 
-    return 0; // not a handled built-in
+// Background jobs: n short jobs started with `&` while finished ones are reaped
+// from the SIGCHLD signalfd between launches, as the prompt does. Fails unless
+// every job is reaped and no child is left over.
+static int bench_jobs(long n){
+    if(n <= 0) n = 500;
+    static const char *cmds[] = { "true &", "sleep 0.05 &" };
+    job_init(0);
+    printf("jobs: %ld background jobs per command\n", n);
+    for(size_t c=0; c<ARRAY_LEN(cmds); c++){
+        int peak = 0;
+        double t0 = now_sec();
+        for(long i=0;i<n;i++){
+            if(run_command(cmds[c]) != 0){ fprintf(stderr, "run_command failed\n"); return 1; }
+            job_reap();
+            job_notify(1);
+            if(njobs > peak) peak = njobs;
+        }
+        double t_launch = now_sec() - t0;
+        job_wait(NULL);
+        job_notify(1);
+        double t_all = now_sec() - t0;
+        int ws;
+        if(njobs || waitpid(-1, &ws, WNOHANG) != -1){
+            fprintf(stderr, "jobs: %d jobs left unreaped\n", njobs);
+            return 1;
+        }
+        printf("  %-14s launch %8.0f jobs/s   all reaped after %7.1f ms   (peak %d in the table)\n",
+               cmds[c], n / t_launch, t_all * 1e3, peak);
+    }
+    return 0;
 }
 
-// New function: handle multiple commands separated by |
-static char *translate_pipeline(const char *line, int source_is_windows, int host_is_windows) {
-    char buf[MAX_LINE * 2];
-    buf[0] = 0;
+// Per-command latency: system(), the spawn engine and the persistent coprocess.
+static int bench_coproc(long n){
+    if(n <= 0) n = 500;
+    static const char *cmds[] = { "env true", "cd ." };
+    if(coproc_start() != 0) return 1;
+    printf("coproc: %ld runs per command\n", n);
+    for(size_t c=0; c<ARRAY_LEN(cmds); c++){
+        double t0 = now_sec();
+        for(long i=0;i<n;i++) if(system(cmds[c]) == -1){ perror("system"); return 1; }
+        double t_sys = now_sec() - t0;
+        t0 = now_sec();
+        for(long i=0;i<n;i++) run_command(cmds[c]);
+        double t_spawn = now_sec() - t0;
+        t0 = now_sec();
+        for(long i=0;i<n;i++) if(coproc_run(cmds[c]) != 0){ fprintf(stderr, "coproc_run failed\n"); return 1; }
+        double t_co = now_sec() - t0;
+        printf("  %-10s system() %8.1f us   spawn engine %8.1f us   coprocess %8.1f us\n",
+               cmds[c], t_sys * 1e6 / n, t_spawn * 1e6 / n, t_co * 1e6 / n);
+    }
+    coproc_stop();
+    return 0;
+}
+#endif
 
-    char *copy = strdup(line);
-    if (!copy) return strdup("");
+static int run_bench(const char *name, long n){
+    if(strcmp(name,"dispatch")==0) return bench_dispatch(n);
+    if(strcmp(name,"rules")==0) return bench_rules(n);
+    if(strcmp(name,"histexp")==0) return bench_histexp(n);
+    if(strcmp(name,"translate")==0) return bench_translate(n);
+    if(strcmp(name,"batch")==0) return bench_batch(n);
+    if(strcmp(name,"translate-only")==0) return bench_translate_only(n);
+    if(strcmp(name,"cache")==0) return bench_cache(n);
+#if !HOST_IS_WINDOWS
+    if(strcmp(name,"exec")==0) return bench_exec(n);
+    if(strcmp(name,"pipe")==0) return bench_pipe(n);
+    if(strcmp(name,"jobs")==0) return bench_jobs(n);
+    if(strcmp(name,"xargs")==0) return bench_xargs(n);
+    if(strcmp(name,"for")==0) return bench_for(n);
+    if(strcmp(name,"fallback")==0) return bench_fallback(n);
+    if(strcmp(name,"spell")==0) return bench_spell(n);
+    if(strcmp(name,"native")==0) return bench_native(n);
+    if(strcmp(name,"du")==0) return bench_du(n);
+    if(strcmp(name,"rm")==0) return bench_rm(n);
+    if(strcmp(name,"cp")==0) return bench_cp(n);
+    if(strcmp(name,"coproc")==0) return bench_coproc(n);
+#endif
+#ifdef __linux__
+    if(strcmp(name,"follow")==0) return bench_follow(n);
+#endif
+    fprintf(stderr, "Unknown benchmark '%s'. Available: dispatch, rules, translate, cache, batch, translate-only, histexp, exec, pipe, jobs, xargs, for, fallback, spell, native, du, rm, cp, follow, coproc\n", name);
+    return 2;
+}
 
-    char *saveptr = NULL;
-    char *token;
-    int first = 1;
+static void usage(void){
+    fprintf(stderr, "usage: custard [--rules FILE] [--coproc] [--histsize N] [--histfile FILE] [--dialect cmd|bash]\n"
+                    "               [--fallback http://HOST[:PORT]/PATH|exec:PROGRAM] [--fallback-timeout MS]\n"
+                    "               [--batch [--input FILE] [--quiet]] [--bench NAME [N]]\n"
+                    "       custard --fallback-mock [PORT [DELAY_MS]]\n"
+                    "       custard --translate-only [--dialect cmd|bash] [--jobs N] [--out DIR] [--quiet] FILE...\n");
+}
 
-    token = STRTOK(copy, "|", &saveptr);
-    while (token) {
-        trim(token);
-        if (strlen(token) > 0) {
-            if(handle_builtin_pipeline(token)) {
-                // skip adding to mapped buffer, already handled
-                token = STRTOK(NULL, "|", &saveptr);
-                continue;
-            }
-            char *mapped = map_command(token, source_is_windows, host_is_windows);
-            if (mapped) {
-                if (!first) strncat(buf, " | ", sizeof(buf) - strlen(buf) - 1);
-                strncat(buf, mapped, sizeof(buf) - strlen(buf) - 1);
-                free(mapped);
-                first = 0;
-            }
+int main(int argc, char **argv){
+    const char *rules_path = NULL;
+    int use_coproc = 0;
+    size_t hist_cap = hist_default_cap();
+    const char *histfile_path = NULL;
+    int batch = 0, quiet = 0, dialect = -1; // dialect: 1 cmd, 0 bash, -1 ask
+    const char *input_path = NULL;
+    int translate_only = 0, jobs = 0;
+    const char *out_dir = NULL;
+    const char *fallback = getenv("CUSTARD_FALLBACK");
+    int fallback_ms = getenv("CUSTARD_FALLBACK_TIMEOUT") ? atoi(getenv("CUSTARD_FALLBACK_TIMEOUT")) : 0;
+#if !HOST_IS_WINDOWS
+    if(argc > 1 && strcmp(argv[1],"--xargs")==0) return xargs_main(argc - 2, argv + 2);
+    if(argc > 1 && strcmp(argv[1],"--fallback-mock")==0) return fb_mock_main(argc - 2, argv + 2);
+#ifdef __linux__
+    self_exe = "/proc/self/exe";
+#else
+    static char self_path[4096];
+    if(strchr(argv[0], '/') && realpath(argv[0], self_path)) self_exe = self_path;
+#endif
+#endif
+    char **files = calloc((size_t)argc, sizeof(*files));
+    size_t nfiles = 0;
+    init_dispatch_tables();
+    for(int i=1;i<argc;i++){
+        if(strcmp(argv[i],"--bench")==0 && i+1 < argc){ free(files); return run_bench(argv[i+1], i+2 < argc ? atol(argv[i+2]) : 0); }
+        else if(strcmp(argv[i],"--rules")==0 && i+1 < argc) rules_path = argv[++i];
+        else if(strcmp(argv[i],"--coproc")==0) use_coproc = 1;
+        else if(strcmp(argv[i],"--histsize")==0 && i+1 < argc) hist_cap = strtoul(argv[++i], NULL, 10);
+        else if(strcmp(argv[i],"--histfile")==0 && i+1 < argc) histfile_path = argv[++i];
+        else if(strcmp(argv[i],"--batch")==0) batch = 1;
+        else if(strcmp(argv[i],"--input")==0 && i+1 < argc) input_path = argv[++i];
+        else if(strcmp(argv[i],"--translate-only")==0) translate_only = 1;
+        else if(strcmp(argv[i],"--jobs")==0 && i+1 < argc) jobs = atoi(argv[++i]);
+        else if(strcmp(argv[i],"--out")==0 && i+1 < argc) out_dir = argv[++i];
+        else if(strcmp(argv[i],"--quiet")==0 || strcmp(argv[i],"-q")==0) quiet = 1;
+        else if(strcmp(argv[i],"--fallback")==0 && i+1 < argc) fallback = argv[++i];
+        else if(strcmp(argv[i],"--fallback-timeout")==0 && i+1 < argc) fallback_ms = atoi(argv[++i]);
+        else if(strcmp(argv[i],"--dialect")==0 && i+1 < argc){
+            i++;
+            if(strcmp(argv[i],"cmd")==0 || strcmp(argv[i],"windows")==0) dialect = 1;
+            else if(strcmp(argv[i],"bash")==0 || strcmp(argv[i],"linux")==0) dialect = 0;
+            else { free(files); usage(); return 2; }
         }
-        token = STRTOK(NULL, "|", &saveptr);
+        else if(argv[i][0] != '-' && files) files[nfiles++] = argv[i];
+        else { free(files); usage(); return 2; }
     }
+    if(nfiles && !translate_only){ free(files); usage(); return 2; }
 
-    free(copy);
-    return strdup(buf);
-}
+    if(translate_only){
+        if(!nfiles){ free(files); usage(); return 2; }
+        if(out_dir && tr_make_out_dir(out_dir) != 0){ free(files); return 1; }
+        init_rules(rules_path, 1);
+        long lines = 0;
+        double t0 = now_sec();
+        long failed = translate_files(files, nfiles, dialect, out_dir, jobs, &lines);
+        if(!quiet)
+            fprintf(stderr, "custard: translated %zu file(s), %ld line(s) in %.2fs\n",
+                    nfiles - (size_t)failed, lines, now_sec() - t0);
+        if(failed) fprintf(stderr, "custard: %ld file(s) failed\n", failed);
+        free(files);
+        return failed ? 1 : 0;
+    }
+    free(files);
 
+    if(batch){
+        if(dialect < 0 && input_path){ // .bat/.cmd scripts are cmd, anything else needs --dialect
+            const char *ext = strrchr(input_path, '.');
+            if(ext && (view_ieq(ext, strlen(ext), ".bat") || view_ieq(ext, strlen(ext), ".cmd"))) dialect = 1;
+        }
+        if(dialect < 0){ fprintf(stderr, "custard: --batch needs --dialect cmd|bash\n"); return 2; }
+        init_rules(rules_path, 1);
+        return run_batch(input_path, dialect, quiet);
+    }
 
-int main(){
     printf("Universal Terminal — Full mapping\n");
     printf("--------------------------------\n");
 #if HOST_IS_WINDOWS
@@ -479,8 +8966,22 @@ int main(){
 #else
     printf("Host detected: Unix-like (Linux/macOS) (compile-time)\n");
 #endif
+    if(hist_init(hist_cap) != 0){ fprintf(stderr, "Cannot allocate history of %zu entries.\n", hist_cap); return 1; }
+#if !HOST_IS_WINDOWS
+    init_histfile(histfile_path);
+#else
+    (void)histfile_path;
+#endif
+    init_rules(rules_path, 0);
+#if !HOST_IS_WINDOWS
+    if(use_coproc && coproc_start()==0) printf("Coprocess mode: commands run in one persistent host shell\n");
+    if(fb_configure(fallback, fallback_ms) != 0) return 2;
+#else
+    if(use_coproc) printf("coproc mode is not available on Windows hosts.\n");
+    (void)fallback; (void)fallback_ms;
+#endif
 
-   int source_is_windows = -1; // invalid initial value
+   int source_is_windows = dialect; // -1 (ask) unless --dialect was given
     char choice[16];
 
     while (source_is_windows == -1) {
@@ -508,11 +9009,21 @@ int main(){
     printf("Type commands in the chosen dialect. Type 'exit' to quit. 'history' shows recent commands.\n");
 
     char line[MAX_LINE];
+#if !HOST_IS_WINDOWS
+    job_init(1);
+    if(fb.prov) fb_init(1);
+#endif
     while(1){
-        if(source_is_windows) printf("cmd> ");
-        else printf("bash> ");
-        if(!fgets(line, sizeof(line), stdin)){
+#if !HOST_IS_WINDOWS
+        job_reap();
+        job_notify(0);
+        fb_collect(0);
+#endif
+        if(!read_line(source_is_windows ? "cmd> " : "bash> ", line, sizeof(line))){
             printf("\n");
+#if !HOST_IS_WINDOWS
+            if(job_exit()) continue;
+#endif
             break;
         }
         trim(line);
@@ -527,6 +9038,14 @@ int main(){
             printf("  clear            : Clear the screen\n");
             printf("  !!               : Repeat last command\n");
             printf("  !<num>           : Repeat command number <num> from history\n");
+            printf("  !str !?str? !$   : Bash history expansion (also !*, !-n, ^old^new, :s/a/b/, :p)\n");
+            printf("  Ctrl-R           : Reverse-search history as you type\n");
+            printf("  coproc on|off    : Run commands in one persistent host shell\n");
+            printf("  cache [clear]    : Show translation cache hit/miss counters (or empty it)\n");
+            printf("  fallback         : Show suggestion provider counters (answers, cache hits, latency)\n");
+            printf("  pipestatus       : Show the exit status of each stage of the last pipeline\n");
+            printf("  cmd &, jobs, fg, bg, wait, kill %%n : Job control (Ctrl-Z stops the foreground job)\n");
+            printf("  for [/d|/l|/f] %%v in (...) do ... : cmd loops run in-process, no shell per iteration\n");
             printf("  help             : Show this help message\n");
             printf("\nCommand translation:\n");
             printf("  You can type commands in your chosen dialect (Windows CMD or Linux Bash)\n");
@@ -546,48 +9065,109 @@ int main(){
             continue;
         }
         if(strcmp(line,"CTRL + Z")==0 || strcmp(line,"CTRL+Z")==0){
-            printf("[Note] Ctrl-Z suspends a process in UNIX; job control not fully supported across OS translations.\n");
+            printf("[Note] Ctrl-Z stops the job running in the foreground; 'jobs', 'fg' and 'bg' manage it. Type 'exit' to quit.\n");
             continue;
         }
 
         // Expand history references
-       if(line[0]=='!'){
-            char *expanded = expand_bang(line);
-            if(expanded && strlen(expanded)){
+        if(source_is_windows ? line[0]=='!' : strchr(line,'!') || line[0]=='^'){
+            int print_only = 0;
+            char *expanded = expand_bang(line, source_is_windows, &print_only);
+            if(!expanded) continue;
+            if(strcmp(expanded, line) != 0){
                 printf("[Expanded] %s\n", expanded);
-                strncpy(line, expanded, sizeof(line)-1);
-                line[sizeof(line)-1]=0;
-            } else {
-                printf("No such history entry.\n");
-                free(expanded);
-                continue;
+                snprintf(line, sizeof(line), "%s", expanded);
             }
             free(expanded);
+            trim(line);
+            if(!*line) continue;
+            if(print_only){ // :p shows the result and records it without running it
+                add_history(line);
+                continue;
+            }
         }
 
 
         // handle builtins: exit, history, clear, etc
-        char cmd_copy[MAX_LINE]; strncpy(cmd_copy, line, sizeof(cmd_copy));
-        char first[MAX_TOK], rest[MAX_LINE];
-        split_first(cmd_copy, first, rest);
-        char first_lc[MAX_TOK]; lc_copy(first, first_lc);
+        struct tok bt[4];
+        size_t nbt = tokenize(line, strlen(line), source_is_windows, bt, ARRAY_LEN(bt)), first_n, arg_n = 0;
+        const char *first = tok_word(line, &bt[0], &first_n);
+        const char *arg = nbt == 2 ? tok_word(line, &bt[1], &arg_n) : "";
 
-        if(strcmp(first_lc,"exit")==0 || strcmp(first_lc,"quit")==0) break;
-        if(strcmp(first_lc,"history")==0){
+        if(view_ieq(first, first_n, "exit") || view_ieq(first, first_n, "quit")){
+#if !HOST_IS_WINDOWS
+            if(job_exit()) continue;
+#endif
+            break;
+        }
+        if(view_ieq(first, first_n, "history")){
             print_history();
             add_history(line);
             continue;
         }
-        if(strcmp(first_lc,"clear")==0){
+        if(view_ieq(first, first_n, "clear")){
             if(HOST_IS_WINDOWS) system("cls"); else system("clear");
             add_history(line);
             continue;
         }
+        if(view_ieq(first, first_n, "cache")){
+            if(view_ieq(arg, arg_n, "clear")){ tcache_clear(); printf("translation cache cleared\n"); }
+            else tcache_stats();
+            add_history(line);
+            continue;
+        }
+        if(view_ieq(first, first_n, "pipestatus")){
+#if HOST_IS_WINDOWS
+            printf("pipestatus is not available on Windows hosts.\n");
+#else
+            if(!pipe_nstatus) printf("no pipeline has run yet\n");
+            for(int i=0;i<pipe_nstatus;i++) printf("%s%d", i ? " " : "", pipe_status[i]);
+            if(pipe_nstatus) printf("\n");
+#endif
+            add_history(line);
+            continue;
+        }
+        if(view_ieq(first, first_n, "fallback")){
+#if HOST_IS_WINDOWS
+            printf("the fallback provider is not available on Windows hosts.\n");
+#else
+            fb_stats();
+#endif
+            add_history(line);
+            continue;
+        }
+        if(view_ieq(first, first_n, "coproc")){
+#if HOST_IS_WINDOWS
+            printf("coproc mode is not available on Windows hosts.\n");
+            (void)arg;
+#else
+            if(view_ieq(arg, arg_n, "on")){ if(coproc_start()==0) printf("coproc: on (pid %d)\n", (int)coproc.pid); }
+            else if(view_ieq(arg, arg_n, "off")){ coproc_stop(); printf("coproc: off\n"); }
+            else printf("coproc: %s  (usage: coproc on|off)\n", coproc_active() ? "on" : "off");
+#endif
+            add_history(line);
+            continue;
+        }
+
+#if !HOST_IS_WINDOWS
+        if(job_builtin(line, source_is_windows) >= 0){
+            add_history(line);
+            continue;
+        }
+#endif
 
         // add to history before expansion of !!? Add after expansion done. We already expanded !n earlier.
 
         add_history(line);
 
+#if !HOST_IS_WINDOWS
+        // cat/head/tail/ls (bash) and type/dir (cmd) on plain files run in-process,
+        // and cmd for loops iterate here; with the coprocess on, its shell owns the
+        // working directory
+        if(!coproc_active() && source_is_windows && cmdfor_run(line) != -1) continue;
+        if(!coproc_active() && native_run(line, source_is_windows) != -1) continue;
+#endif
+
         // Translate
         char *translated = translate_pipeline(line, source_is_windows, HOST_IS_WINDOWS);
         if(!translated){
@@ -614,42 +9194,26 @@ int main(){
             printf("[Translated ->] %s\n", translated);
 
             #if HOST_IS_WINDOWS
-                    if (strchr(translated, '|') != NULL) {
-                        // Split into separate commands if pipe is found
-                        char copy[MAX_LINE * 3];
-                        strncpy(copy, translated, sizeof(copy));
-                        copy[sizeof(copy)-1] = '\0';
-
-                        char *token = strtok(copy, "|");
-                        while (token != NULL) {
-                            // Trim leading spaces
-                            while (*token == ' ') token++;
-
-                            char cmdline[MAX_LINE * 3];
-                            snprintf(cmdline, sizeof(cmdline), "cmd /C \"%s\"", token);
-                            printf("[Running ->] %s\n", cmdline);
-
-                            int rc = system(cmdline);
-                            if (rc == -1) {
-                                printf("Failed to run command on host shell.\n");
-                            }
-
-                            token = strtok(NULL, "|");
-                        }
-                    } else {
-                        char cmdline[MAX_LINE * 3];
-                        snprintf(cmdline, sizeof(cmdline), "cmd /C \"%s\"", translated);
-                        int rc = system(cmdline);
-                        if (rc == -1) {
-                            printf("Failed to run command on host shell.\n");
-                        }
-                    }
+                // the whole line goes to one cmd, which runs its pipes, lists and redirections;
+                // /S strips exactly the outer quotes, whatever quotes are inside
+                char cmdline[MAX_LINE * 3];
+                snprintf(cmdline, sizeof(cmdline), "cmd /S /C \"%s\"", translated);
+                int rc = system(cmdline);
+                if(rc == -1){
+                    printf("Failed to run command on host shell.\n");
+                }
             #else
-                // Linux/Unix: /bin/sh already understands pipes
-                int rc = system(translated);
+                // Linux/Unix: spawn directly (or via the coprocess); /bin/sh only for syntax we don't handle
+                int rc = exec_host(translated);
                 if (rc == -1) {
                     printf("Failed to run command on host shell.\n");
                 }
+                // not found: offer close commands at once, then ask the fallback provider
+                // without waiting for it
+                if(rc == 127){
+                    spell_hint(line, source_is_windows);
+                    fb_request(line, translated, source_is_windows);
+                }
             #endif
 
         }
@@ -658,8 +9222,14 @@ int main(){
         // free(translated);
     }
 
+#if !HOST_IS_WINDOWS
+    coproc_stop();
+    hist_file_close();
+#endif
+
     // cleanup history
-    for(int i=0;i<hist_count;i++) free(history[i]);
+    free_history();
+    tcache_clear();
 
     printf("Goodbye.\n");
     return 0;